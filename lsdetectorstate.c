@@ -37,6 +37,13 @@ void detector_state_push_queue(char *dummy_event) {
   pthread_mutex_unlock( &detector_state_queue_mutex);
 }
 
+/** Our timer went off: have the worker take another look
+ *  Called directly from the timer thread.
+ */
+static void detector_state_timer_cb( char *event, struct timespec *due, unsigned long int overruns) {
+  detector_state_push_queue( event);
+}
+
 //
 // Redis onSet function.
 //
@@ -183,7 +190,6 @@ void *detector_state_worker(void *dummy) {
   detector_state_redis = lsredis_get_obj("detector.state_machine");
 
   lsredis_set_onSet( detector_state_redis, detector_state_push_queue);
-  lsevents_add_listener( "^DETECTOR_STATE_MACHINE$", detector_state_push_queue);
 
 
   while( 1) {
@@ -204,7 +210,7 @@ void *detector_state_worker(void *dummy) {
     pthread_cond_signal(&detector_state_cond);
     pthread_mutex_unlock(&detector_state_mutex);
 
-    lstimer_set_timer( "DETECTOR_STATE_MACHINE", 1, newTimeout, 0);
+    lstimer_set_timer_cb( "DETECTOR_STATE_MACHINE", 1, newTimeout, 0, detector_state_timer_cb);
   }
   return NULL;
 }
@@ -7,20 +7,86 @@
  */
 
 
-#define LSEVENTS_QUEUE_LENGTH 1024
+#define LSEVENTS_QUEUE_LENGTH 1024		//!< entries in each event queue.  Must be a power of 2
+
+#define LSEVENTS_ID_CHUNK      256		//!< event ids are stored in chunks of this many names
+#define LSEVENTS_MAX_ID_CHUNKS 1024		//!< so we can have LSEVENTS_ID_CHUNK * LSEVENTS_MAX_ID_CHUNKS different events
 
 /** Storage definition for the events.
- *  Just a string for now.  Perhaps one day
- *  we'll succumb to the temptation to add an argument
- *  or two.
  */
 typedef struct lsevents_queue_struct {
-  char *evp;				//!< name of the event
+  unsigned long seq;			//!< slot sequence number: tells senders and the worker whose turn it is
+  unsigned long ticket;			//!< global send order so the worker can merge the two queues
+  int id;				//!< interned id of the event (see lsevents_intern)
+  unsigned long gen;			//!< callback list generation the sender marked coalescing listeners with, 0 for none
+  lsevents_payload_t pl;		//!< what the sender had to say about it
 } lsevents_queue_t;
 
-static lsevents_queue_t lsevents_queue[LSEVENTS_QUEUE_LENGTH];		//!< simple list of events
-static unsigned int lsevents_queue_on  = 0;				//!< next queue location to write
-static unsigned int lsevents_queue_off = 0;				//!< next queue location to read
+/** Bounded lock free queue (after Vyukov).  Any number of threads
+ *  may put entries on and take them off; each slot's seq says
+ *  whether it is ready to be written (seq == on) or read (seq == off + 1).
+ */
+typedef struct lsevents_ring_struct {
+  lsevents_queue_t q[LSEVENTS_QUEUE_LENGTH];	//!< the entries
+  unsigned long on;				//!< next queue location to write
+  unsigned long off;				//!< next queue location to read
+} lsevents_ring_t;
+
+static lsevents_ring_t lsevents_critical_queue;		//!< events that must be delivered: senders wait when this is full
+static lsevents_ring_t lsevents_coalesce_queue;		//!< events that can be lost: the oldest is dropped when this is full
+static unsigned long lsevents_ticket = 0;		//!< next send order ticket
+
+#define LSEVENTS_TRACE_MAGIC "LSEVTRC1"	//!< first 8 bytes of an event trace file
+
+/** Event trace record.  A name record ('N') is written the first time
+ *  an id shows up in a trace and is followed by len bytes of name.
+ *  Event records ('E') follow.  Native byte order: traces are
+ *  replayed on the kind of machine that made them.
+ */
+typedef struct lsevents_trace_rec_struct {
+  int32_t type;					//!< 'N' or 'E'
+  int32_t id;					//!< event id when recorded
+  int32_t len;					//!< name length ('N' records)
+  int32_t tid;					//!< sending thread
+  int32_t motor;				//!< index in lspmac_motors of the payload's motor, -1 for none
+  int32_t pad;					//!< keep the rest aligned
+  int64_t sec;					//!< payload timestamp
+  int64_t nsec;					//!< payload timestamp
+  double  position;				//!< payload position
+  int64_t ival[2];				//!< payload integers
+  double  dval[2];				//!< payload doubles
+} lsevents_trace_rec_t;
+
+static pthread_mutex_t lsevents_trace_mutex;	//!< protects the trace file
+static FILE *lsevents_trace_fp = NULL;		//!< the trace we are writing, NULL when not tracing
+static unsigned char *lsevents_trace_named = NULL;	//!< flags ids whose name is in the trace
+static int lsevents_trace_nnamed = 0;		//!< size of lsevents_trace_named
+
+static __thread int lsevents_tid = 0;		//!< our thread id, for the payload
+
+static sem_t lsevents_queue_sem;			//!< posted once per event sent
+static unsigned long lsevents_dropped   = 0;		//!< coalescable events dropped to make room
+static unsigned long lsevents_overflows = 0;		//!< times a critical sender found the queue full
+static int lsevents_full_waiters        = 0;		//!< critical senders waiting for room
+
+/** A critical event that found the queue full when sent by a thread
+ *  that must not wait for room (see lsevents_never_wait).  These go
+ *  on a list of their own that the worker treats as a third queue.
+ */
+typedef struct lsevents_overflow_struct {
+  struct lsevents_overflow_struct *next;	//!< the next newer entry
+  unsigned long ticket;				//!< global send order
+  int id;					//!< interned id of the event
+  unsigned long gen;				//!< callback list generation (see lsevents_queue_t)
+  lsevents_payload_t pl;			//!< what the sender had to say about it
+} lsevents_overflow_t;
+
+static pthread_mutex_t lsevents_overflow_mutex;		//!< protects the overflow list
+static lsevents_overflow_t *lsevents_overflow_head = NULL;	//!< oldest overflow entry
+static lsevents_overflow_t *lsevents_overflow_tail = NULL;	//!< newest overflow entry
+static int lsevents_overflow_n         = 0;		//!< entries on the overflow list
+static int lsevents_overflow_max       = 0;		//!< most entries the overflow list has held
+static __thread int lsevents_nowait    = 0;		//!< set in threads that must never wait for room
 
 //
 // Store a list of event n_events names in a hash table
@@ -30,76 +96,1216 @@ static int lsevents_max_events = 1024;
 static int lsevents_n_events   =    0;
 static struct hsearch_data lsevents_event_name_ht;
 
-/** Linked list of event listeners.
+#define LSEVENTS_HIST_BINS 24		//!< callback time histogram: bin 0 is under 1 usec, bin n is 2^(n-1) to 2^n usecs
+
+/** Execution time statistics for a callback routine.  These are kept
+ *  by routine rather than by listener so they survive listeners that
+ *  come and go (lspg's abort listener, for example).  Never freed.
+ */
+typedef struct lsevents_cb_stats_struct {
+  struct lsevents_cb_stats_struct *next;	//!< next in our list
+  uintptr_t cb;					//!< the routine (either kind of callback)
+  char *raw_regexp;				//!< the first pattern it was registered with, to help identify it
+  unsigned long calls;				//!< number of times called
+  unsigned long total_nsecs;			//!< total time spent in the routine
+  unsigned long max_nsecs;			//!< longest call
+  unsigned long reported_max_nsecs;		//!< max_nsecs when lsevents_callback_report_slow last mentioned us
+  unsigned long hist[LSEVENTS_HIST_BINS];	//!< histogram of call times
+  struct lsevents_coalesce_struct **cells;	//!< coalescing callbacks: LSEVENTS_MAX_ID_CHUNKS chunks of cells indexed by event id
+} lsevents_cb_stats_t;
+
+/** Coalescing state of one event for one coalescing callback routine
+ */
+typedef struct lsevents_coalesce_struct {
+  int queued;					//!< an instance on the event queue will call the routine
+  int pending;					//!< an instance is queued for the routine's worker
+  int suppressed;				//!< instances dropped since the routine was last called
+} lsevents_coalesce_t;
+
+static lsevents_cb_stats_t *lsevents_cb_stats = NULL;	//!< all our callback statistics (protected by lsevents_listener_mutex)
+
+/** Linked list of event listeners.
+ */
+typedef struct lsevents_listener_struct {
+  struct lsevents_listener_struct *next;	//!< Next listener
+  char *raw_regexp;				//!< the original string sent to us
+  regex_t re;					//!< regular expression representing listened for events
+  void (*cb)( char *);				//!< call back function
+  void (*ccb)( char *, int);			//!< or coalescing call back function (see lsevents_add_coalescing_listener)
+  void (*pcb)( char *, lsevents_payload_t *);	//!< or payload call back function (see lsevents_add_payload_listener)
+  lsevents_cb_stats_t *stats;			//!< time spent in cb
+  unsigned long seq;				//!< order added: callbacks are called oldest first
+  int shard;					//!< worker that runs our callback (see lsevents_set_workers)
+  int kind;					//!< LSEVENTS_MATCH_EXACT, LSEVENTS_MATCH_PREFIX, or LSEVENTS_MATCH_REGEX
+  char *prefix;					//!< literal text every matching event starts with (the whole event for EXACT)
+} lsevents_listener_t;
+
+static lsevents_listener_t *lsevents_listeners_p = NULL;	//!< Pointer to the first item in the link list of listeners
+static unsigned long lsevents_listener_seq = 0;			//!< next listener seq
+
+#define LSEVENTS_MATCH_EXACT  0		//!< pattern is ^literal$: a string compare does it
+#define LSEVENTS_MATCH_PREFIX 1		//!< pattern is ^literal...: only events starting with literal need regexec
+#define LSEVENTS_MATCH_REGEX  2		//!< anything else: regexec every event
+
+/** A growable list of listeners
+ */
+typedef struct lsevents_lvec_struct {
+  int n;					//!< number in use
+  int max;					//!< number allocated
+  lsevents_listener_t **l;			//!< the listeners
+} lsevents_lvec_t;
+
+/** Prefix trie of the literal part of the listener patterns.  All
+ *  the listeners that might match an event are found in one walk down
+ *  the event name instead of running every listener's regexec.
+ */
+typedef struct lsevents_trie_struct {
+  struct lsevents_trie_struct *child;		//!< our first child
+  struct lsevents_trie_struct *sibling;		//!< next child of our parent
+  char c;					//!< the character leading here from our parent
+  lsevents_lvec_t lv;				//!< listeners whose literal prefix ends here
+} lsevents_trie_t;
+
+#define LSEVENTS_MAX_WORKERS 16		//!< most callback worker threads we'll run
+
+/** A callback waiting for a worker
+ */
+typedef struct lsevents_shard_entry_struct {
+  void (*cb)( char *);				//!< the routine to call
+  void (*ccb)( char *, int);			//!< or the coalescing routine to call
+  void (*pcb)( char *, lsevents_payload_t *);	//!< or the payload routine to call
+  lsevents_coalesce_t *cell;			//!< coalescing state for ccb
+  lsevents_payload_t pl;			//!< payload for pcb
+  lsevents_cb_stats_t *stats;			//!< where to record how long it took
+  char *event;					//!< interned event name (never freed)
+} lsevents_shard_entry_t;
+
+/** A callback worker thread and its queue.  Each callback routine
+ *  always runs on the same worker so it sees its events in order.
+ */
+typedef struct lsevents_shard_struct {
+  pthread_t       thread;			//!< our thread
+  pthread_mutex_t mutex;			//!< protects the queue
+  pthread_cond_t  cond;				//!< wakes our thread
+  lsevents_shard_entry_t *q;			//!< the queue: grows instead of making the dispatcher wait
+  unsigned long size;				//!< entries allocated in q (a power of 2)
+  unsigned long on;				//!< next queue location to write
+  unsigned long off;				//!< next queue location to read
+  unsigned long max_depth;			//!< deepest the queue has been
+  unsigned long dispatched;			//!< callbacks run
+} lsevents_shard_t;
+
+static lsevents_shard_t lsevents_shards[LSEVENTS_MAX_WORKERS];	//!< our callback workers
+static int lsevents_nworkers = 0;				//!< number of callback workers, 0 to run callbacks on the dispatch thread
+
+static lsevents_trie_t lsevents_trie_root;	//!< trie of listener prefixes (protected by lsevents_listener_mutex)
+static lsevents_lvec_t lsevents_regex_only;	//!< listeners with no literal prefix
+
+/** The listeners for an event.  Once published a list is never
+ *  modified: adding or removing a listener publishes a new list and
+ *  retires the old one so the worker can read it without a lock.
+ */
+typedef struct lsevents_callbacks_struct {
+  int n;					//!< number of listeners
+  lsevents_listener_t *l[];			//!< the listeners in the order they are called
+} lsevents_callbacks_t;
+
+/** Things no longer published that the worker might still be looking at.
+ */
+typedef struct lsevents_retired_struct {
+  struct lsevents_retired_struct *next;		//!< next in our list
+  unsigned long gp;				//!< grace period that must pass before we free p
+  void *p;					//!< the retired item
+  void (*free_fn)( void *);			//!< how to free it
+} lsevents_retired_t;
+
+static lsevents_retired_t *lsevents_retired = NULL;	//!< retired items (protected by lsevents_listener_mutex)
+static unsigned long lsevents_gp            = 0;	//!< grace period counter, bumped for each retired item
+static unsigned long lsevents_worker_qs     = 0;	//!< grace period the worker last saw while holding no lists
+static int lsevents_mark_readers            = 0;	//!< senders looking at a callback list to mark it (see lsevents_coalesce_mark)
+
+/** linked list of all the event names
+ *  used to regenerate the hash table
+ */
+typedef struct lsevents_event_names_struct {
+  struct lsevents_event_names_struct *next;
+  char *event;					// event string
+  int id;					// our interned id
+  int cbl_valid;				// cbl has been matched against the listeners
+  int policy;					// LSEVENTS_CRITICAL or LSEVENTS_COALESCE
+  int has_ccb;					// cbl has a coalescing listener
+  unsigned long cbl_gen;			// bumped twice each time cbl is replaced: odd while it's changing
+  lsevents_callbacks_t *cbl;			// callback list, NULL if there are no listeners
+} lsevents_event_names_t;
+static lsevents_event_names_t *lsevents_event_names = NULL;
+
+//
+// Event names indexed by id.  The chunks never move once allocated
+// so an id handed out by lsevents_intern can be looked up without
+// holding any lock.
+//
+static lsevents_event_names_t **lsevents_ids[LSEVENTS_MAX_ID_CHUNKS];
+
+
+
+static pthread_t       lsevents_thread;			//!< thread to run the event queue
+static pthread_mutex_t lsevents_listener_mutex;		//!< mutex to protect the listener linked list
+static pthread_mutex_t lsevents_names_mutex;		//!< mutex to protect the event name hash table, list, and ids
+static pthread_mutex_t lsevents_queue_mutex;		//!< only used by critical senders waiting for room
+static pthread_cond_t  lsevents_queue_cond;		//!< condition to pause critical senders when the queue is full
+
+/** Find the name entry for an interned event id
+ *  \param id value returned by lsevents_intern
+ *  \returns NULL if there is no such id
+ */
+static lsevents_event_names_t *lsevents_id_lookup( int id) {
+  lsevents_event_names_t **chunk;
+
+  if( id < 0 || id >= LSEVENTS_ID_CHUNK * LSEVENTS_MAX_ID_CHUNKS)
+    return NULL;
+
+  chunk = lsevents_ids[id / LSEVENTS_ID_CHUNK];
+  if( chunk == NULL)
+    return NULL;
+
+  return chunk[id % LSEVENTS_ID_CHUNK];
+}
+
+/** Name of an interned event
+ *  \param id value returned by lsevents_intern
+ *  \returns the event name or NULL if there is no such id.  Do not free or modify.
+ */
+char *lsevents_id_name( int id) {
+  lsevents_event_names_t *enp;
+
+  enp = lsevents_id_lookup( id);
+  return enp == NULL ? NULL : enp->event;
+}
+
+/** Put an entry on a queue
+ *  \returns 1 on success, 0 if the queue is full
+ */
+static int lsevents_ring_push( lsevents_ring_t *r, int id, unsigned long ticket, unsigned long gen, lsevents_payload_t *pl) {
+  lsevents_queue_t *qp;
+  unsigned long pos, seq;
+  long dif;
+
+  pos = __atomic_load_n( &r->on, __ATOMIC_RELAXED);
+  while( 1) {
+    qp  = &r->q[pos % LSEVENTS_QUEUE_LENGTH];
+    seq = __atomic_load_n( &qp->seq, __ATOMIC_ACQUIRE);
+    dif = (long)seq - (long)pos;
+    if( dif == 0) {
+      if( __atomic_compare_exchange_n( &r->on, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if( dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n( &r->on, __ATOMIC_RELAXED);
+    }
+  }
+  qp->id     = id;
+  qp->ticket = ticket;
+  qp->gen    = gen;
+  qp->pl     = *pl;
+  __atomic_store_n( &qp->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/** Take the oldest entry off a queue
+ *  \returns 1 on success, 0 if the queue is empty
+ */
+static int lsevents_ring_pop( lsevents_ring_t *r, int *id, unsigned long *gen, lsevents_payload_t *pl) {
+  lsevents_queue_t *qp;
+  unsigned long pos, seq;
+  long dif;
+
+  pos = __atomic_load_n( &r->off, __ATOMIC_RELAXED);
+  while( 1) {
+    qp  = &r->q[pos % LSEVENTS_QUEUE_LENGTH];
+    seq = __atomic_load_n( &qp->seq, __ATOMIC_ACQUIRE);
+    dif = (long)seq - (long)(pos + 1);
+    if( dif == 0) {
+      if( __atomic_compare_exchange_n( &r->off, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if( dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n( &r->off, __ATOMIC_RELAXED);
+    }
+  }
+  *id  = qp->id;
+  *gen = qp->gen;
+  *pl  = qp->pl;
+  __atomic_store_n( &qp->seq, pos + LSEVENTS_QUEUE_LENGTH, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/** Ticket of the oldest entry on a queue
+ *  \returns 1 if there is an entry, 0 if the queue is empty
+ */
+static int lsevents_ring_peek( lsevents_ring_t *r, unsigned long *ticket) {
+  lsevents_queue_t *qp;
+  unsigned long pos;
+
+  pos = __atomic_load_n( &r->off, __ATOMIC_RELAXED);
+  qp  = &r->q[pos % LSEVENTS_QUEUE_LENGTH];
+  if( __atomic_load_n( &qp->seq, __ATOMIC_ACQUIRE) != pos + 1)
+    return 0;
+
+  *ticket = qp->ticket;
+  return 1;
+}
+
+static void lsevents_ring_init( lsevents_ring_t *r) {
+  unsigned long i;
+
+  for( i=0; i<LSEVENTS_QUEUE_LENGTH; i++)
+    r->q[i].seq = i;
+  r->on  = 0;
+  r->off = 0;
+}
+
+/** Set how an event is to be queued
+ *  \param id     value returned by lsevents_intern
+ *  \param policy LSEVENTS_CRITICAL (the default): the sender waits if the queue is full.
+ *                LSEVENTS_COALESCE: the oldest coalescable event is dropped if the queue is full.
+ *                Only use this for events where a later instance makes up for a lost one.
+ */
+void lsevents_set_policy( int id, int policy) {
+  lsevents_event_names_t *enp;
+
+  enp = lsevents_id_lookup( id);
+  if( enp != NULL)
+    __atomic_store_n( &enp->policy, policy, __ATOMIC_RELAXED);
+}
+
+/** Report the queue statistics
+ *  \param dropped   Returns the number of coalescable events dropped to make room.  May be NULL.
+ *  \param overflows Returns the number of times a critical sender found the queue full.  May be NULL.
+ */
+void lsevents_queue_stats( unsigned long *dropped, unsigned long *overflows) {
+  if( dropped != NULL)
+    *dropped = __atomic_load_n( &lsevents_dropped, __ATOMIC_RELAXED);
+  if( overflows != NULL)
+    *overflows = __atomic_load_n( &lsevents_overflows, __ATOMIC_RELAXED);
+}
+
+/** Log the queue statistics when they have changed since we were last called
+ */
+void lsevents_queue_report() {
+  static unsigned long last_dropped = 0, last_overflows = 0;
+  unsigned long dropped, overflows;
+  int omax;
+
+  lsevents_queue_stats( &dropped, &overflows);
+  if( dropped == last_dropped && overflows == last_overflows)
+    return;
+
+  pthread_mutex_lock( &lsevents_overflow_mutex);
+  omax = lsevents_overflow_max;
+  pthread_mutex_unlock( &lsevents_overflow_mutex);
+
+  lslogging_log_message( "lsevents_queue_report: %lu coalescable events dropped (%lu new), critical queue full %lu times (%lu new), overflow list high water %d",
+			 dropped, dropped - last_dropped, overflows, overflows - last_overflows, omax);
+  last_dropped   = dropped;
+  last_overflows = overflows;
+}
+
+/** Critical events sent from the calling thread never wait for room
+ *  on the queue: when it is full they go on an overflow list instead.
+ *  For threads that must keep running (the dispatch thread itself and
+ *  the pmac status thread).
+ */
+void lsevents_never_wait() {
+  lsevents_nowait = 1;
+}
+
+/** Put a critical event on the overflow list
+ */
+static void lsevents_overflow_push( int id, unsigned long ticket, unsigned long gen, lsevents_payload_t *pl) {
+  lsevents_overflow_t *op;
+
+  op = calloc( 1, sizeof( lsevents_overflow_t));
+  if( op == NULL) {
+    lslogging_log_message( "lsevents_overflow_push: out of memory");
+    exit( -1);
+  }
+  op->id     = id;
+  op->ticket = ticket;
+  op->gen    = gen;
+  op->pl     = *pl;
+
+  pthread_mutex_lock( &lsevents_overflow_mutex);
+  if( lsevents_overflow_tail == NULL)
+    lsevents_overflow_head = op;
+  else
+    lsevents_overflow_tail->next = op;
+  lsevents_overflow_tail = op;
+  __atomic_add_fetch( &lsevents_overflow_n, 1, __ATOMIC_SEQ_CST);
+  if( lsevents_overflow_n > lsevents_overflow_max)
+    lsevents_overflow_max = lsevents_overflow_n;
+  pthread_mutex_unlock( &lsevents_overflow_mutex);
+}
+
+/** Coalescing state of an event for a coalescing callback routine
+ *  Senders and the dispatch thread may race to allocate the storage;
+ *  the loser frees its copy.
+ */
+static lsevents_coalesce_t *lsevents_coalesce_cell( lsevents_cb_stats_t *sp, int id) {
+  lsevents_coalesce_t **cells, **new_cells;
+  lsevents_coalesce_t *chunk, *new_chunk;
+
+  cells = __atomic_load_n( &sp->cells, __ATOMIC_ACQUIRE);
+  if( cells == NULL) {
+    new_cells = calloc( LSEVENTS_MAX_ID_CHUNKS, sizeof( lsevents_coalesce_t *));
+    if( new_cells == NULL) {
+      lslogging_log_message( "lsevents_coalesce_cell: out of memory");
+      exit( -1);
+    }
+    if( __atomic_compare_exchange_n( &sp->cells, &cells, new_cells, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      cells = new_cells;
+    else
+      free( new_cells);
+  }
+
+  chunk = __atomic_load_n( &cells[id / LSEVENTS_ID_CHUNK], __ATOMIC_ACQUIRE);
+  if( chunk == NULL) {
+    new_chunk = calloc( LSEVENTS_ID_CHUNK, sizeof( lsevents_coalesce_t));
+    if( new_chunk == NULL) {
+      lslogging_log_message( "lsevents_coalesce_cell: out of memory");
+      exit( -1);
+    }
+    if( __atomic_compare_exchange_n( &cells[id / LSEVENTS_ID_CHUNK], &chunk, new_chunk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      chunk = new_chunk;
+    else
+      free( new_chunk);
+  }
+  return &chunk[id % LSEVENTS_ID_CHUNK];
+}
+
+/** Mark an event as on its way to its coalescing listeners.  A
+ *  listener that already has an instance on the way counts this one
+ *  as suppressed instead.  Like the worker we read the published
+ *  callback list without a lock: lsevents_reclaim leaves retired
+ *  lists alone while any sender is in here.
+ *  \param gen returns the callback list generation the marks go with, 0 if nothing was marked
+ *  \returns 1 if every listener already has an instance on the way and the event need not be queued
+ */
+static int lsevents_coalesce_mark( lsevents_event_names_t *enp, unsigned long *gen) {
+  lsevents_callbacks_t *cbl;
+  lsevents_coalesce_t *cell;
+  unsigned long gen1, gen2;
+  int needed;
+  int i;
+
+  *gen   = 0;
+  needed = 1;
+
+  __atomic_add_fetch( &lsevents_mark_readers, 1, __ATOMIC_SEQ_CST);
+  gen1 = __atomic_load_n( &enp->cbl_gen, __ATOMIC_SEQ_CST);
+  cbl  = __atomic_load_n( &enp->cbl, __ATOMIC_SEQ_CST);
+  if( (gen1 & 1) == 0 && __atomic_load_n( &enp->cbl_valid, __ATOMIC_ACQUIRE) && cbl != NULL) {
+    needed = 0;
+    for( i=0; i<cbl->n; i++) {
+      if( cbl->l[i]->ccb == NULL) {
+	needed = 1;
+	continue;
+      }
+      cell = lsevents_coalesce_cell( cbl->l[i]->stats, enp->id);
+      if( __atomic_exchange_n( &cell->queued, 1, __ATOMIC_SEQ_CST))
+	__atomic_fetch_add( &cell->suppressed, 1, __ATOMIC_SEQ_CST);
+      else
+	needed = 1;
+    }
+    gen2 = __atomic_load_n( &enp->cbl_gen, __ATOMIC_SEQ_CST);
+
+    //
+    // The list changed under us: queue the event unmarked so that
+    // every listener on the new list gets called
+    //
+    if( gen2 != gen1)
+      needed = 1;
+    else
+      *gen = gen1;
+  }
+  __atomic_sub_fetch( &lsevents_mark_readers, 1, __ATOMIC_SEQ_CST);
+
+  return !needed;
+}
+
+/** Queue an event with a payload by its interned id.
+ *  No formatting, hashing, locking, or memory allocation is done
+ *  here so this is the one to use for events sent at status frame
+ *  rates.  Only a critical event sent to a full queue waits, and not
+ *  even then from a thread that called lsevents_never_wait.
+ * \param id the value returned by lsevents_intern
+ * \param plp what to tell payload listeners (copied).  NULL for none.  A zero timestamp is replaced with now.
+ */
+void lsevents_send_event_id_payload( int id, lsevents_payload_t *plp) {
+  static const char *id_s = FILEID "lsevents_send_event_id_payload";
+  lsevents_event_names_t *enp;
+  unsigned long ticket, gen, dummy_gen;
+  struct timespec then;
+  int dummy;
+  lsevents_payload_t pl, dummy_pl;
+
+  enp = lsevents_id_lookup( id);
+  if( enp == NULL) {
+    lslogging_log_message( "%s: unknown event id %d", id_s, id);
+    return;
+  }
+
+  if( plp == NULL)
+    memset( &pl, 0, sizeof( pl));
+  else
+    pl = *plp;
+
+  if( pl.ts.tv_sec == 0 && pl.ts.tv_nsec == 0)
+    clock_gettime( CLOCK_REALTIME, &pl.ts);
+
+  if( lsevents_tid == 0)
+    lsevents_tid = syscall( SYS_gettid);
+  pl.tid = lsevents_tid;
+
+  //
+  // Coalescing listeners that already have an instance on the way
+  // don't need this one.  If nobody else does either we needn't
+  // queue it, which keeps a fast sender from filling the queue.
+  // Traces want every event.
+  //
+  gen = 0;
+  if( __atomic_load_n( &enp->has_ccb, __ATOMIC_ACQUIRE) && __atomic_load_n( &enp->policy, __ATOMIC_RELAXED) == LSEVENTS_CRITICAL) {
+    if( lsevents_coalesce_mark( enp, &gen) && __atomic_load_n( &lsevents_trace_fp, __ATOMIC_ACQUIRE) == NULL)
+      return;
+  }
+
+  ticket = __atomic_fetch_add( &lsevents_ticket, 1, __ATOMIC_RELAXED);
+
+  if( __atomic_load_n( &enp->policy, __ATOMIC_RELAXED) == LSEVENTS_COALESCE) {
+    //
+    // Make room by throwing away the oldest coalescable event.
+    // These are never marked: an instance we throw away must not be
+    // one a coalescing listener is counting on.
+    //
+    while( !lsevents_ring_push( &lsevents_coalesce_queue, id, ticket, 0, &pl)) {
+      if( lsevents_ring_pop( &lsevents_coalesce_queue, &dummy, &dummy_gen, &dummy_pl))
+	__atomic_fetch_add( &lsevents_dropped, 1, __ATOMIC_RELAXED);
+    }
+    sem_post( &lsevents_queue_sem);
+    return;
+  }
+
+  //
+  // Once we've started using the overflow list we keep using it
+  // until it's empty so that our events stay in order.
+  //
+  if( lsevents_nowait && __atomic_load_n( &lsevents_overflow_n, __ATOMIC_SEQ_CST) > 0) {
+    lsevents_overflow_push( id, ticket, gen, &pl);
+    sem_post( &lsevents_queue_sem);
+    return;
+  }
+
+  if( !lsevents_ring_push( &lsevents_critical_queue, id, ticket, gen, &pl)) {
+    __atomic_fetch_add( &lsevents_overflows, 1, __ATOMIC_RELAXED);
+
+    //
+    // Our own callbacks sending critical events to a full queue would
+    // wait forever, and the status thread must not wait at all.
+    //
+    if( lsevents_nowait) {
+      lsevents_overflow_push( id, ticket, gen, &pl);
+      sem_post( &lsevents_queue_sem);
+      return;
+    }
+
+    //
+    // Slow path: wait for the worker to make room.  The timeout
+    // covers a wakeup that slips in between our push and the wait.
+    //
+    pthread_mutex_lock( &lsevents_queue_mutex);
+    __atomic_fetch_add( &lsevents_full_waiters, 1, __ATOMIC_SEQ_CST);
+    while( !lsevents_ring_push( &lsevents_critical_queue, id, ticket, gen, &pl)) {
+      clock_gettime( CLOCK_REALTIME, &then);
+      then.tv_nsec += 10000000;
+      if( then.tv_nsec >= 1000000000) {
+	then.tv_sec++;
+	then.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait( &lsevents_queue_cond, &lsevents_queue_mutex, &then);
+    }
+    __atomic_fetch_sub( &lsevents_full_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock( &lsevents_queue_mutex);
+  }
+  sem_post( &lsevents_queue_sem);
+}
+
+/** Queue an event by its interned id.
+ * \param id the value returned by lsevents_intern
+ */
+void lsevents_send_event_id( int id) {
+  lsevents_send_event_id_payload( id, NULL);
+}
+
+/** Call the callback routines for the given event.
+ *  Compatibility layer over lsevents_intern and lsevents_send_event_id.
+ * \param fmt a printf style formating string
+ * \param ... list of arguments specified by the format string
+ */
+void lsevents_send_event( char *fmt, ...) {
+  char event[LSEVENTS_EVENT_LENGTH];
+  va_list arg_ptr;
+  int id;
+
+  va_start( arg_ptr, fmt);
+  vsnprintf( event, sizeof(event)-1, fmt, arg_ptr);
+  event[sizeof(event)-1]=0;
+  va_end( arg_ptr);
+
+  id = lsevents_intern( "%s", event);
+  if( id >= 0)
+    lsevents_send_event_id( id);
+}
+
+/** Send an event with a payload
+ * \param plp what to tell payload listeners (copied)
+ * \param fmt a printf style formating string
+ * \param ... list of arguments specified by the format string
+ */
+void lsevents_send_event_payload( lsevents_payload_t *plp, char *fmt, ...) {
+  char event[LSEVENTS_EVENT_LENGTH];
+  va_list arg_ptr;
+  int id;
+
+  va_start( arg_ptr, fmt);
+  vsnprintf( event, sizeof(event)-1, fmt, arg_ptr);
+  event[sizeof(event)-1]=0;
+  va_end( arg_ptr);
+
+  id = lsevents_intern( "%s", event);
+  if( id >= 0)
+    lsevents_send_event_id_payload( id, plp);
+}
+
+
+/** Hand an item no longer reachable from a published list over to be
+ *  freed once the worker is known not to be using it.
+ *  Call with lsevents_listener_mutex locked.
+ */
+static void lsevents_retire( void *p, void (*free_fn)( void *)) {
+  lsevents_retired_t *rp;
+
+  if( p == NULL)
+    return;
+
+  rp = calloc( 1, sizeof( lsevents_retired_t));
+  if( rp == NULL) {
+    lslogging_log_message( "lsevents_retire: out of memory");
+    exit( -1);
+  }
+  rp->p       = p;
+  rp->free_fn = free_fn;
+  rp->gp      = __atomic_add_fetch( &lsevents_gp, 1, __ATOMIC_SEQ_CST);
+  rp->next    = lsevents_retired;
+  lsevents_retired = rp;
+}
+
+/** Free retired items the worker has finished with
+ *  Call with lsevents_listener_mutex locked.
+ */
+static void lsevents_reclaim() {
+  lsevents_retired_t *rp, *last, *next;
+  unsigned long qs;
+
+  //
+  // A sender marking coalescing listeners might hold any of them.
+  // One that starts after this can only find the published lists.
+  //
+  if( __atomic_load_n( &lsevents_mark_readers, __ATOMIC_SEQ_CST) != 0)
+    return;
+
+  qs = __atomic_load_n( &lsevents_worker_qs, __ATOMIC_SEQ_CST);
+
+  last = NULL;
+  for( rp = lsevents_retired; rp != NULL; rp = next) {
+    next = rp->next;
+    if( (long)(qs - rp->gp) >= 0) {
+      if( last == NULL)
+	lsevents_retired = next;
+      else
+	last->next = next;
+      rp->free_fn( rp->p);
+      free( rp);
+    } else {
+      last = rp;
+    }
+  }
+}
+
+/** Make a new callback list from an old one
+ *  \param old    the current list (may be NULL)
+ *  \param add    listener to add at the end (may be NULL)
+ *  \param remove listener to leave out (may be NULL)
+ *  \returns the new list, NULL if it would be empty
+ */
+static lsevents_callbacks_t *lsevents_cbl_copy( lsevents_callbacks_t *old, lsevents_listener_t *add, lsevents_listener_t *remove) {
+  lsevents_callbacks_t *rtn;
+  int i, n;
+
+  n = (old == NULL ? 0 : old->n) + (add == NULL ? 0 : 1);
+  if( n == 0)
+    return NULL;
+
+  rtn = calloc( 1, sizeof( lsevents_callbacks_t) + n * sizeof( lsevents_listener_t *));
+  if( rtn == NULL) {
+    lslogging_log_message( "lsevents_cbl_copy: out of memory");
+    exit( -1);
+  }
+
+  rtn->n = 0;
+  for( i=0; old != NULL && i<old->n; i++) {
+    if( old->l[i] != remove)
+      rtn->l[rtn->n++] = old->l[i];
+  }
+  if( add != NULL)
+    rtn->l[rtn->n++] = add;
+
+  if( rtn->n == 0) {
+    free( rtn);
+    return NULL;
+  }
+  return rtn;
+}
+
+static void lsevents_listener_free( void *p) {
+  lsevents_listener_t *lp;
+
+  lp = p;
+  regfree( &lp->re);
+  free( lp->raw_regexp);
+  free( lp->prefix);
+  free( lp);
+}
+
+static void lsevents_lvec_add( lsevents_lvec_t *lv, lsevents_listener_t *lp) {
+  if( lv->n == lv->max) {
+    lv->max = lv->max == 0 ? 8 : 2 * lv->max;
+    lv->l   = realloc( lv->l, lv->max * sizeof( lsevents_listener_t *));
+    if( lv->l == NULL) {
+      lslogging_log_message( "lsevents_lvec_add: out of memory");
+      exit( -1);
+    }
+  }
+  lv->l[lv->n++] = lp;
+}
+
+static void lsevents_lvec_remove( lsevents_lvec_t *lv, lsevents_listener_t *lp) {
+  int i;
+
+  for( i=0; i<lv->n; i++) {
+    if( lv->l[i] == lp) {
+      memmove( &lv->l[i], &lv->l[i+1], (lv->n - i - 1) * sizeof( lsevents_listener_t *));
+      lv->n--;
+      return;
+    }
+  }
+}
+
+/** Work out what literal text a pattern's matches must start with
+ *  and whether that text is all there is to it.
+ *  Sets lp->kind and lp->prefix.
+ */
+static void lsevents_classify( lsevents_listener_t *lp) {
+  char *rp;
+  int depth, n;
+
+  lp->kind   = LSEVENTS_MATCH_REGEX;
+  lp->prefix = NULL;
+
+  rp = lp->raw_regexp;
+  if( *rp != '^')
+    return;
+
+  //
+  // A top level alternation could match anything
+  //
+  depth = 0;
+  for( rp = lp->raw_regexp; *rp; rp++) {
+    if( *rp == '\\' && rp[1] != 0)
+      rp++;
+    else if( *rp == '(')
+      depth++;
+    else if( *rp == ')')
+      depth--;
+    else if( *rp == '|' && depth == 0)
+      return;
+  }
+
+  //
+  // Literal characters after the ^
+  //
+  rp = lp->raw_regexp + 1;
+  n  = strcspn( rp, ".[]()*+?{}|\\^$");
+
+  if( rp[n] == '$' && rp[n+1] == 0) {
+    lp->kind   = LSEVENTS_MATCH_EXACT;
+    lp->prefix = strndup( rp, n);
+    return;
+  }
+
+  //
+  // The last literal is optional if a *, ?, or {} follows it
+  //
+  if( n > 0 && (rp[n] == '*' || rp[n] == '?' || rp[n] == '{'))
+    n--;
+
+  if( n == 0)
+    return;
+
+  lp->kind   = LSEVENTS_MATCH_PREFIX;
+  lp->prefix = strndup( rp, n);
+}
+
+/** Put a listener into the matcher
+ *  Call with lsevents_listener_mutex locked.
+ */
+static void lsevents_matcher_add( lsevents_listener_t *lp) {
+  lsevents_trie_t *node, *child;
+  char *cp;
+
+  if( lp->kind == LSEVENTS_MATCH_REGEX) {
+    lsevents_lvec_add( &lsevents_regex_only, lp);
+    return;
+  }
+
+  node = &lsevents_trie_root;
+  for( cp = lp->prefix; *cp; cp++) {
+    for( child = node->child; child != NULL; child = child->sibling) {
+      if( child->c == *cp)
+	break;
+    }
+    if( child == NULL) {
+      child = calloc( 1, sizeof( lsevents_trie_t));
+      if( child == NULL) {
+	lslogging_log_message( "lsevents_matcher_add: out of memory");
+	exit( -1);
+      }
+      child->c       = *cp;
+      child->sibling = node->child;
+      node->child    = child;
+    }
+    node = child;
+  }
+  lsevents_lvec_add( &node->lv, lp);
+}
+
+/** Take a listener out of the matcher.  Empty trie nodes are left
+ *  in place: the same patterns tend to come back.
+ *  Call with lsevents_listener_mutex locked.
+ */
+static void lsevents_matcher_remove( lsevents_listener_t *lp) {
+  lsevents_trie_t *node, *child;
+  char *cp;
+
+  if( lp->kind == LSEVENTS_MATCH_REGEX) {
+    lsevents_lvec_remove( &lsevents_regex_only, lp);
+    return;
+  }
+
+  node = &lsevents_trie_root;
+  for( cp = lp->prefix; *cp && node != NULL; cp++) {
+    for( child = node->child; child != NULL; child = child->sibling) {
+      if( child->c == *cp)
+	break;
+    }
+    node = child;
+  }
+  if( node != NULL)
+    lsevents_lvec_remove( &node->lv, lp);
+}
+
+/** Add the listeners in lv that match event to out
+ */
+static void lsevents_match_lvec( lsevents_lvec_t *lv, char *event, int at_end, lsevents_lvec_t *out) {
+  lsevents_listener_t *lp;
+  int i;
+
+  for( i=0; i<lv->n; i++) {
+    lp = lv->l[i];
+    if( lp->kind == LSEVENTS_MATCH_EXACT) {
+      if( at_end)
+	lsevents_lvec_add( out, lp);
+    } else if( regexec( &lp->re, event, 0, NULL, 0) == 0) {
+      lsevents_lvec_add( out, lp);
+    }
+  }
+}
+
+/** Find all the listeners for an event in one pass
+ *  \param event the event name
+ *  \param out   matching listeners are put here, oldest first
+ *  Call with lsevents_listener_mutex locked.
+ */
+static void lsevents_match( char *event, lsevents_lvec_t *out) {
+  lsevents_trie_t *node;
+  lsevents_listener_t *lp;
+  char *cp;
+  int i, j;
+
+  out->n = 0;
+
+  node = &lsevents_trie_root;
+  for( cp = event; *cp; cp++) {
+    for( node = node->child; node != NULL; node = node->sibling) {
+      if( node->c == *cp)
+	break;
+    }
+    if( node == NULL)
+      break;
+    lsevents_match_lvec( &node->lv, event, cp[1] == 0, out);
+  }
+
+  lsevents_match_lvec( &lsevents_regex_only, event, 0, out);
+
+  //
+  // Sort by age (insertion sort: these lists are short)
+  //
+  for( i=1; i<out->n; i++) {
+    lp = out->l[i];
+    for( j=i; j>0 && out->l[j-1]->seq > lp->seq; j--)
+      out->l[j] = out->l[j-1];
+    out->l[j] = lp;
+  }
+}
+
+/** Does this listener want this event?
+ */
+static int lsevents_listener_matches( lsevents_listener_t *lp, char *event) {
+  switch( lp->kind) {
+  case LSEVENTS_MATCH_EXACT:
+    return strcmp( lp->prefix, event) == 0;
+
+  case LSEVENTS_MATCH_PREFIX:
+    if( strncmp( lp->prefix, event, strlen( lp->prefix)) != 0)
+      return 0;
+    break;
+  }
+  return regexec( &lp->re, event, 0, NULL, 0) == 0;
+}
+
+/** Count the listeners for an event.  Used to compare the matcher
+ *  against plain regexec over all listeners.
+ *  \param event   the event name
+ *  \param use_re  1 to regexec every listener, 0 to use the matcher
+ */
+int lsevents_match_count( char *event, int use_re) {
+  static lsevents_lvec_t out;
+  lsevents_listener_t *lp;
+  int rtn;
+
+  pthread_mutex_lock( &lsevents_listener_mutex);
+  if( use_re) {
+    rtn = 0;
+    for( lp = lsevents_listeners_p; lp != NULL; lp = lp->next) {
+      if( regexec( &lp->re, event, 0, NULL, 0) == 0)
+	rtn++;
+    }
+  } else {
+    lsevents_match( event, &out);
+    rtn = out.n;
+  }
+  pthread_mutex_unlock( &lsevents_listener_mutex);
+  return rtn;
+}
+
+/** Find an existing event name
+ *  \returns NULL if we have not heard of it
+ */
+static lsevents_event_names_t *lsevents_name_find( char *event) {
+  ENTRY entry_in, *entry_outp;
+  lsevents_event_names_t *rtn;
+
+  entry_in.key  = event;
+  entry_in.data = NULL;
+
+  pthread_mutex_lock( &lsevents_names_mutex);
+  rtn = NULL;
+  if( hsearch_r( entry_in, FIND, &entry_outp, &lsevents_event_name_ht) != 0)
+    rtn = entry_outp->data;
+  pthread_mutex_unlock( &lsevents_names_mutex);
+
+  return rtn;
+}
+
+/** Replace the callback list for a name.  The generation is odd
+ *  while we're at it so the dispatch thread can tell when the list it
+ *  loaded might not be the one an event was marked with.
+ *  Call with lsevents_listener_mutex locked.
+ */
+static void lsevents_cbl_publish( lsevents_event_names_t *enp, lsevents_callbacks_t *cbl) {
+  int has_ccb;
+  int i;
+
+  //
+  // Senders mark coalescing routines' cells: have them ready
+  //
+  has_ccb = 0;
+  for( i=0; cbl != NULL && i<cbl->n; i++) {
+    if( cbl->l[i]->ccb != NULL) {
+      has_ccb = 1;
+      lsevents_coalesce_cell( cbl->l[i]->stats, enp->id);
+    }
+  }
+
+  __atomic_add_fetch( &enp->cbl_gen, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n( &enp->cbl, cbl, __ATOMIC_SEQ_CST);
+  __atomic_store_n( &enp->has_ccb, has_ccb, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch( &enp->cbl_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Publish a new callback list for a name with lp added or removed
+ *  Call with lsevents_listener_mutex and lsevents_names_mutex locked.
+ */
+static void lsevents_cbl_update( lsevents_event_names_t *enp, lsevents_listener_t *add, lsevents_listener_t *remove) {
+  lsevents_callbacks_t *old_cbl;
+  int i;
+
+  if( !enp->cbl_valid)
+    return;
+
+  old_cbl = enp->cbl;
+  if( remove != NULL) {
+    for( i=0; old_cbl != NULL && i<old_cbl->n; i++) {
+      if( old_cbl->l[i] == remove)
+	break;
+    }
+    if( old_cbl == NULL || i == old_cbl->n)
+      return;
+  }
+
+  //
+  // A routine coming back may have been marked for an instance it
+  // never saw
+  //
+  if( add != NULL && add->ccb != NULL)
+    __atomic_store_n( &lsevents_coalesce_cell( add->stats, enp->id)->queued, 0, __ATOMIC_SEQ_CST);
+
+  lsevents_cbl_publish( enp, lsevents_cbl_copy( old_cbl, add, remove));
+  lsevents_retire( old_cbl, free);
+}
+
+/** Find (or start) the statistics for a callback routine
+ *  Call with lsevents_listener_mutex locked.
+ */
+static lsevents_cb_stats_t *lsevents_cb_stats_find( uintptr_t cb, char *raw_regexp) {
+  lsevents_cb_stats_t *sp;
+
+  for( sp = lsevents_cb_stats; sp != NULL; sp = sp->next) {
+    if( sp->cb == cb)
+      return sp;
+  }
+
+  sp = calloc( 1, sizeof( lsevents_cb_stats_t));
+  if( sp == NULL) {
+    lslogging_log_message( "lsevents_cb_stats_find: out of memory");
+    exit( -1);
+  }
+  sp->cb         = cb;
+  sp->raw_regexp = strdup( raw_regexp);
+  sp->next       = lsevents_cb_stats;
+  lsevents_cb_stats = sp;
+
+  return sp;
+}
+
+/** Account for one call of a callback
+ */
+static void lsevents_cb_stats_add( lsevents_cb_stats_t *sp, unsigned long nsecs) {
+  unsigned long usecs, max;
+  int bin;
+
+  usecs = nsecs / 1000;
+  for( bin=0; usecs != 0 && bin < LSEVENTS_HIST_BINS-1; bin++)
+    usecs >>= 1;
+
+  __atomic_fetch_add( &sp->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add( &sp->total_nsecs, nsecs, __ATOMIC_RELAXED);
+  __atomic_fetch_add( &sp->hist[bin], 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n( &sp->max_nsecs, __ATOMIC_RELAXED);
+  while( nsecs > max && !__atomic_compare_exchange_n( &sp->max_nsecs, &max, nsecs, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** Run a callback and account for the time it took
+ */
+static void lsevents_call( lsevents_shard_entry_t *ep) {
+  struct timespec t1, t2;
+  int suppressed;
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  if( ep->cb != NULL) {
+    ep->cb( ep->event);
+  } else if( ep->pcb != NULL) {
+    ep->pcb( ep->event, &ep->pl);
+  } else {
+    suppressed = 0;
+    if( ep->cell != NULL) {
+      //
+      // Anything sent from here on needs a new call
+      //
+      __atomic_store_n( &ep->cell->pending, 0, __ATOMIC_SEQ_CST);
+      suppressed = __atomic_exchange_n( &ep->cell->suppressed, 0, __ATOMIC_SEQ_CST);
+    }
+    ep->ccb( ep->event, suppressed);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  lsevents_cb_stats_add( ep->stats, (t2.tv_sec - t1.tv_sec) * 1000000000UL + t2.tv_nsec - t1.tv_nsec);
+}
+
+/** Which worker runs a callback routine
+ */
+static int lsevents_shard_of( uintptr_t cb) {
+  uint64_t h;
+
+  if( lsevents_nworkers <= 0)
+    return 0;
+
+  h = (uint64_t)cb * 0x9E3779B97F4A7C15ULL;
+  return (int)((h >> 32) % lsevents_nworkers);
+}
+
+/** Queue a callback for its worker
  */
-typedef struct lsevents_listener_struct {
-  struct lsevents_listener_struct *next;	//!< Next listener
-  char *raw_regexp;				//!< the original string sent to us
-  regex_t re;					//!< regular expression representing listened for events
-  void (*cb)( char *);				//!< call back function
-} lsevents_listener_t;
+static void lsevents_shard_push( lsevents_shard_t *sh, lsevents_shard_entry_t *ep) {
+  lsevents_shard_entry_t *newq;
+  unsigned long depth, i;
 
-static lsevents_listener_t *lsevents_listeners_p = NULL;	//!< Pointer to the first item in the link list of listeners
+  pthread_mutex_lock( &sh->mutex);
 
-/** lsevents linked list of callbacks for each event
- */
-typedef struct lsevents_callbacks_struct {
-  struct lsevents_callbacks_struct *next;
-  void (*cb)( char *);
-} lsevents_callbacks_t;
+  depth = sh->on - sh->off;
+  if( depth == sh->size) {
+    newq = calloc( 2 * sh->size, sizeof( lsevents_shard_entry_t));
+    if( newq == NULL) {
+      lslogging_log_message( "lsevents_shard_push: out of memory");
+      exit( -1);
+    }
+    for( i=0; i<depth; i++)
+      newq[i] = sh->q[(sh->off + i) % sh->size];
+    free( sh->q);
+    sh->q    = newq;
+    sh->size = 2 * sh->size;
+    sh->off  = 0;
+    sh->on   = depth;
+  }
 
+  sh->q[(sh->on++) % sh->size] = *ep;
+  if( ++depth > sh->max_depth)
+    sh->max_depth = depth;
 
-/** linked list of all the event names
- *  used to regenerate the hash table
+  pthread_cond_signal( &sh->cond);
+  pthread_mutex_unlock( &sh->mutex);
+}
+
+/** A callback worker
+ *  \param arg our lsevents_shard_t
  */
-typedef struct lsevents_event_names_struct {
-  struct lsevents_event_names_struct *next;
-  char *event;					// event string
-  lsevents_callbacks_t *cbl;			// callback list
-} lsevents_event_names_t;
-static lsevents_event_names_t *lsevents_event_names = NULL;
+static void *lsevents_shard_worker( void *arg) {
+  lsevents_shard_t *sh;
+  lsevents_shard_entry_t e;
 
+  sh = arg;
+  while( 1) {
+    pthread_mutex_lock( &sh->mutex);
+    while( sh->off == sh->on)
+      pthread_cond_wait( &sh->cond, &sh->mutex);
+    e = sh->q[(sh->off++) % sh->size];
+    pthread_mutex_unlock( &sh->mutex);
 
+    lsevents_call( &e);
 
-static pthread_t       lsevents_thread;			//!< thread to run the event queue
-static pthread_mutex_t lsevents_listener_mutex;		//!< mutex to protect the listener linked list
-static pthread_mutex_t lsevents_queue_mutex;		//!< mutex to protect the event queue
-static pthread_cond_t  lsevents_queue_cond;		//!< condition to pause the queue if needed
+    pthread_mutex_lock( &sh->mutex);
+    sh->dispatched++;
+    pthread_mutex_unlock( &sh->mutex);
+  }
+  return NULL;
+}
 
-/** Call the callback routines for the given event.
- * \param fmt a printf style formating string
- * \param ... list of arguments specified by the format string
+/** Run callbacks on several threads instead of on the dispatch thread.
+ *  Each callback routine is assigned to one worker so the events it
+ *  receives stay in order; different routines may run at the same
+ *  time.  Call before lsevents_init.
+ *  \param n number of workers, 0 (the default) to run callbacks on the dispatch thread
  */
-void lsevents_send_event( char *fmt, ...) {
-  char event[LSEVENTS_EVENT_LENGTH];
-  va_list arg_ptr;
+void lsevents_set_workers( int n) {
+  if( n < 0)
+    n = 0;
+  if( n > LSEVENTS_MAX_WORKERS)
+    n = LSEVENTS_MAX_WORKERS;
+  lsevents_nworkers = n;
+}
 
-  va_start( arg_ptr, fmt);
-  vsnprintf( event, sizeof(event)-1, fmt, arg_ptr);
-  event[sizeof(event)-1]=0;
-  va_end( arg_ptr);
+/** Log the execution time statistics of every callback that has been called
+ */
+void lsevents_callback_report() {
+  lsevents_cb_stats_t *sp;
+  char hist[LSEVENTS_HIST_BINS * 24];
+  int i, n;
+  unsigned long calls;
 
-  pthread_mutex_lock( &lsevents_queue_mutex);
+  pthread_mutex_lock( &lsevents_listener_mutex);
+  for( sp = lsevents_cb_stats; sp != NULL; sp = sp->next) {
+    calls = __atomic_load_n( &sp->calls, __ATOMIC_RELAXED);
+    if( calls == 0)
+      continue;
 
-  // maybe wait for room on the queue
-  while( (lsevents_queue_on + 1) % LSEVENTS_QUEUE_LENGTH == lsevents_queue_off % LSEVENTS_QUEUE_LENGTH)
-    pthread_cond_wait( &lsevents_queue_cond, &lsevents_queue_mutex);
-  
-  lsevents_queue[(lsevents_queue_on++) % LSEVENTS_QUEUE_LENGTH].evp = strdup(event);
+    hist[0] = 0;
+    n = 0;
+    for( i=0; i<LSEVENTS_HIST_BINS; i++) {
+      if( sp->hist[i] != 0)
+	n += snprintf( hist + n, sizeof( hist) - n, " <%luus:%lu", 1UL << i, sp->hist[i]);
+    }
 
-  pthread_cond_signal(  &lsevents_queue_cond);
-  pthread_mutex_unlock( &lsevents_queue_mutex);
+    lslogging_log_message( "lsevents_callback_report: '%s' %p calls %lu  mean %.1f us  max %.1f us %s",
+			   sp->raw_regexp, (void *)sp->cb, calls, sp->total_nsecs / 1000.0 / calls, sp->max_nsecs / 1000.0, hist);
+  }
+  pthread_mutex_unlock( &lsevents_listener_mutex);
+
+  for( i=0; i<lsevents_nworkers; i++) {
+    pthread_mutex_lock( &lsevents_shards[i].mutex);
+    lslogging_log_message( "lsevents_callback_report: worker %d  depth %lu  max depth %lu  dispatched %lu",
+			   i, lsevents_shards[i].on - lsevents_shards[i].off, lsevents_shards[i].max_depth, lsevents_shards[i].dispatched);
+    pthread_mutex_unlock( &lsevents_shards[i].mutex);
+  }
 }
 
+/** Log the callbacks that have set a new record above usecs since
+ *  the last time we were called.  Quiet enough to call every minute.
+ */
+void lsevents_callback_report_slow(
+				   unsigned long usecs		/**< [in] only mention calls that took longer than this */
+				   ) {
+  lsevents_cb_stats_t *sp;
+  unsigned long calls, max;
 
-/** Add a callback routine to listen for a specific event
- *  \param raw_regexp String value of regular expression to listen to
- *  \param cb the routine to call
+  pthread_mutex_lock( &lsevents_listener_mutex);
+  for( sp = lsevents_cb_stats; sp != NULL; sp = sp->next) {
+    calls = __atomic_load_n( &sp->calls, __ATOMIC_RELAXED);
+    max   = __atomic_load_n( &sp->max_nsecs, __ATOMIC_RELAXED);
+    if( calls == 0 || max <= usecs * 1000 || max <= sp->reported_max_nsecs)
+      continue;
+
+    lslogging_log_message( "lsevents_callback_report_slow: '%s' %p took %.1f us  calls %lu  mean %.1f us",
+			   sp->raw_regexp, (void *)sp->cb, max / 1000.0, calls, __atomic_load_n( &sp->total_nsecs, __ATOMIC_RELAXED) / 1000.0 / calls);
+    sp->reported_max_nsecs = max;
+  }
+  pthread_mutex_unlock( &lsevents_listener_mutex);
+}
+
+/** Add a listener with either kind of callback routine
  */
-void lsevents_add_listener( char *raw_regexp, void (*cb)(char *)) {
+static void lsevents_add_listener_cb( char *raw_regexp, void (*cb)(char *), void (*ccb)( char *, int), void (*pcb)( char *, lsevents_payload_t *)) {
   lsevents_listener_t    *new;
   lsevents_event_names_t *enp;
-  lsevents_callbacks_t   *cbp;
   int err;
   char *errbuf;
   int nerrbuf;
@@ -126,34 +1332,80 @@ void lsevents_add_listener( char *raw_regexp, void (*cb)(char *)) {
 
   new->raw_regexp = strdup( raw_regexp);
   new->cb   = cb;
+  new->ccb  = ccb;
+  new->pcb  = pcb;
+  lsevents_classify( new);
 
   pthread_mutex_lock( &lsevents_listener_mutex);
+  new->stats = lsevents_cb_stats_find( cb != NULL ? (uintptr_t)cb : (ccb != NULL ? (uintptr_t)ccb : (uintptr_t)pcb), raw_regexp);
+  new->seq   = lsevents_listener_seq++;
+  new->shard = lsevents_shard_of( new->stats->cb);
   new->next = lsevents_listeners_p;
   lsevents_listeners_p = new;
+  lsevents_matcher_add( new);
 
-  for( enp = lsevents_event_names; enp != NULL; enp = enp->next) {
-    if( regexec( &new->re, enp->event, 0, NULL, 0) == 0) {
-      cbp       = calloc( 1, sizeof( lsevents_callbacks_t));
-      cbp->cb   = cb;
-      cbp->next = enp->cbl;
-      enp->cbl  = cbp;
+  //
+  // Names whose callback lists have not been built yet will pick
+  // up our new listener when they are.
+  //
+  pthread_mutex_lock( &lsevents_names_mutex);
+  if( new->kind == LSEVENTS_MATCH_EXACT) {
+    enp = lsevents_name_find( new->prefix);
+    if( enp != NULL)
+      lsevents_cbl_update( enp, new, NULL);
+  } else {
+    for( enp = lsevents_event_names; enp != NULL; enp = enp->next) {
+      if( enp->cbl_valid && lsevents_listener_matches( new, enp->event))
+	lsevents_cbl_update( enp, new, NULL);
     }
   }
-  
+  pthread_mutex_unlock( &lsevents_names_mutex);
 
+  lsevents_reclaim();
   pthread_mutex_unlock( &lsevents_listener_mutex);
 
 }
 
-/** Remove a listener previously added with lsevents_add_listener
- *  \param event The name of the event (possibly a regular expression string)
- *  \param cb The callback routine to remove
+/** Add a callback routine to listen for a specific event
+ *  \param raw_regexp String value of regular expression to listen to
+ *  \param cb the routine to call
  */
-void lsevents_remove_listener (char *event, void (*cb)(char *)) {
+void lsevents_add_listener( char *raw_regexp, void (*cb)(char *)) {
+  lsevents_add_listener_cb( raw_regexp, cb, NULL, NULL);
+}
+
+/** Add a callback routine that only cares about the latest instance
+ *  of an event.  An instance sent while an earlier one is still on
+ *  the way to us (on the event queue or waiting for our worker, see
+ *  lsevents_set_workers) is dropped and counted instead: we are
+ *  always called at least once after any instance is sent, just not
+ *  once per instance.  When every listener to a critical event
+ *  coalesces, dropped instances are not queued at all.  Nothing is
+ *  dropped before an event's first delivery, and instances of
+ *  LSEVENTS_COALESCE events are only dropped at the worker.
+ *  \param raw_regexp String value of regular expression to listen to
+ *  \param cb the routine to call with the event and the number of instances suppressed since the last call
+ */
+void lsevents_add_coalescing_listener( char *raw_regexp, void (*cb)(char *, int)) {
+  lsevents_add_listener_cb( raw_regexp, NULL, cb, NULL);
+}
+
+/** Add a callback routine that wants the payload sent with the event
+ *  (see lsevents_send_event_id_payload).  Events sent without one
+ *  arrive with only the timestamp set.
+ *  \param raw_regexp String value of regular expression to listen to
+ *  \param cb the routine to call with the event and its payload.  The payload is only good for the duration of the call.
+ */
+void lsevents_add_payload_listener( char *raw_regexp, void (*cb)(char *, lsevents_payload_t *)) {
+  lsevents_add_listener_cb( raw_regexp, NULL, NULL, cb);
+}
+
+/** Remove a listener with either kind of callback routine
+ */
+static void lsevents_remove_listener_cb( char *event, void (*cb)(char *), void (*ccb)( char *, int), void (*pcb)( char *, lsevents_payload_t *)) {
   
   lsevents_listener_t *last, *current;
   lsevents_event_names_t *enp;
-  lsevents_callbacks_t   *cbp, *last_cbp;
 
   //
   // Find the listener to remove
@@ -164,7 +1416,7 @@ void lsevents_remove_listener (char *event, void (*cb)(char *)) {
   do {
     last = NULL;
     for( current = lsevents_listeners_p; current != NULL; current = current->next) {
-      if( strcmp( current->raw_regexp, event) == 0 && current->cb == cb) {
+      if( strcmp( current->raw_regexp, event) == 0 && current->cb == cb && current->ccb == ccb && current->pcb == pcb) {
 	if( last == NULL) {
 	  lsevents_listeners_p = current->next;
 	} else {
@@ -180,49 +1432,70 @@ void lsevents_remove_listener (char *event, void (*cb)(char *)) {
       break;
     }
 
+    lsevents_matcher_remove( current);
+
     //
     // Remove callback from lists of event names
     //
-    for( enp = lsevents_event_names; enp != NULL; enp = enp->next) {
-      if( regexec( &current->re, enp->event, 0, NULL, 0) == 0) {
-	last_cbp = NULL;
-	for( cbp = enp->cbl; cbp != NULL; cbp = cbp->next) {
-	  if( cbp->cb == cb) {
-	    if( last_cbp == NULL)
-	      enp->cbl = NULL;
-	    else
-	      last_cbp->next = cbp->next;
-	    free( cbp);
-	    break;
-	  }
-	}
-      }
+    pthread_mutex_lock( &lsevents_names_mutex);
+    if( current->kind == LSEVENTS_MATCH_EXACT) {
+      enp = lsevents_name_find( current->prefix);
+      if( enp != NULL)
+	lsevents_cbl_update( enp, NULL, current);
+    } else {
+      for( enp = lsevents_event_names; enp != NULL; enp = enp->next)
+	lsevents_cbl_update( enp, NULL, current);
     }
+    pthread_mutex_unlock( &lsevents_names_mutex);
+
+    //
+    // Now remove it (once the worker is done with it)
+    //
+    lsevents_retire( current, lsevents_listener_free);
   } while(0);
 
+  lsevents_reclaim();
   pthread_mutex_unlock( &lsevents_listener_mutex);
+}
 
-  //
-  // Now remove it
-  //
-  if( current->raw_regexp != NULL) {
-    free( current->raw_regexp);
-  }
-  free(current);
+/** Remove a listener previously added with lsevents_add_listener
+ *  \param event The name of the event (possibly a regular expression string)
+ *  \param cb The callback routine to remove
+ */
+void lsevents_remove_listener (char *event, void (*cb)(char *)) {
+  lsevents_remove_listener_cb( event, cb, NULL, NULL);
+}
+
+/** Remove a listener previously added with lsevents_add_coalescing_listener
+ *  \param event The name of the event (possibly a regular expression string)
+ *  \param cb The callback routine to remove
+ */
+void lsevents_remove_coalescing_listener( char *event, void (*cb)(char *, int)) {
+  lsevents_remove_listener_cb( event, NULL, cb, NULL);
+}
+
+/** Remove a listener previously added with lsevents_add_payload_listener
+ *  \param event The name of the event (possibly a regular expression string)
+ *  \param cb The callback routine to remove
+ */
+void lsevents_remove_payload_listener( char *event, void (*cb)(char *, lsevents_payload_t *)) {
+  lsevents_remove_listener_cb( event, NULL, NULL, cb);
 }
 
 
-/** Add a new event name and find matching callbacks as a returned linked list
+/** Find an event name, adding it if it is new.
  *
+ *  Matching the new name against the listeners is left for the
+ *  worker (see lsevents_callbacks) so that senders never wait on the
+ *  listener mutex.
  */
-lsevents_callbacks_t *lsevents_register_event( char *event) {
-  static const char *id = FILEID "lsevents_regitster_event";
+static lsevents_event_names_t *lsevents_intern_name( char *event) {
+  static const char *id = FILEID "lsevents_intern_name";
   ENTRY entry_in, *entry_outp;
   int err;
-  lsevents_callbacks_t *new_cb;
   lsevents_event_names_t *new_event_name, *enp;
-  lsevents_listener_t *p;
-  lsevents_callbacks_t *rtn;
+  lsevents_event_names_t **chunk;
+  lsevents_event_names_t *rtn;
 
   rtn = NULL;
 
@@ -232,7 +1505,7 @@ lsevents_callbacks_t *lsevents_register_event( char *event) {
   entry_in.key  = event;
   entry_in.data = NULL;
 
-  pthread_mutex_lock( &lsevents_listener_mutex);
+  pthread_mutex_lock( &lsevents_names_mutex);
 
   do {
     err = hsearch_r( entry_in, FIND, &entry_outp, &lsevents_event_name_ht);
@@ -240,8 +1513,7 @@ lsevents_callbacks_t *lsevents_register_event( char *event) {
       //
       // Success, we found the entry
       //
-      enp = entry_outp->data;
-      rtn = enp->cbl;
+      rtn = entry_outp->data;
       break;
     }
 
@@ -256,33 +1528,41 @@ lsevents_callbacks_t *lsevents_register_event( char *event) {
     //
     // Not Found
     //
-    // Create new event name item
-    new_event_name = calloc( 1, sizeof( lsevents_event_names_t));
-    new_event_name->event = strdup( event);
-    new_event_name->cbl   = NULL;
-    
-    //
-    // Find matching callbacks
-    //
-    //  A previously defined callback might want to trigger on our
-    //  event.
-    //
-    for( p = lsevents_listeners_p; p != NULL; p = p->next) {
-      if( regexec( &p->re, event, 0, NULL, 0) == 0) {
-	new_cb = calloc( 1, sizeof( lsevents_callbacks_t));
-	new_cb->cb = p->cb;
-	new_cb->next = new_event_name->cbl;
-	new_event_name->cbl = new_cb;
+    if( lsevents_n_events >= LSEVENTS_ID_CHUNK * LSEVENTS_MAX_ID_CHUNKS) {
+      lslogging_log_message( "%s: too many events, cannot add '%s'", id, event);
+      break;
+    }
+
+    chunk = lsevents_ids[lsevents_n_events / LSEVENTS_ID_CHUNK];
+    if( chunk == NULL) {
+      chunk = calloc( LSEVENTS_ID_CHUNK, sizeof( lsevents_event_names_t *));
+      if( chunk == NULL) {
+	lslogging_log_message( "%s: out of memory", id);
+	exit( -1);
       }
+      lsevents_ids[lsevents_n_events / LSEVENTS_ID_CHUNK] = chunk;
     }
 
-    rtn = new_event_name->cbl;
+    // Create new event name item
+    new_event_name = calloc( 1, sizeof( lsevents_event_names_t));
+    if( new_event_name == NULL) {
+      lslogging_log_message( "%s: out of memory", id);
+      exit( -1);
+    }
+    new_event_name->event     = strdup( event);
+    new_event_name->id        = lsevents_n_events;
+    new_event_name->cbl_valid = 0;
+    new_event_name->cbl       = NULL;
+    
+    rtn = new_event_name;
     
     //
-    // Add the new event to our linked list
+    // Add the new event to our linked list and id table
     //
     new_event_name->next  = lsevents_event_names;
     lsevents_event_names  = new_event_name;
+    chunk[new_event_name->id % LSEVENTS_ID_CHUNK] = new_event_name;
+    lsevents_n_events++;
 
     //
     // Also add the new event to our hash table
@@ -293,7 +1573,7 @@ lsevents_callbacks_t *lsevents_register_event( char *event) {
     if( err == 0) {
       //
       // Something bad happend but we can still return a valid
-      // callback list.  We just can't use the hash table to find it
+      // name.  We just can't use the hash table to find it
       // again later.  But getting here is probably really bad.
       //
       lslogging_log_message( "%s: Could not add event name: hsearch_r returned %d: %s", id, errno, strerror( errno));
@@ -304,7 +1584,7 @@ lsevents_callbacks_t *lsevents_register_event( char *event) {
     // Rebuild the hash table if we are getting too big for our
     // britches
     //
-    if( ++lsevents_n_events  >= lsevents_max_events) {
+    if( lsevents_n_events  >= lsevents_max_events) {
       hdestroy_r( &lsevents_event_name_ht);
       lsevents_max_events *= 2;
       hcreate_r( lsevents_max_events * 2, &lsevents_event_name_ht);
@@ -316,13 +1596,73 @@ lsevents_callbacks_t *lsevents_register_event( char *event) {
     }
   } while (0);
 
-  pthread_mutex_unlock( &lsevents_listener_mutex);
+  pthread_mutex_unlock( &lsevents_names_mutex);
   return rtn;
 }  
 
+/** Map an event name to a stable integer id.
+ *  Call once (at init time, say) and then use lsevents_send_event_id.
+ * \param fmt a printf style formating string
+ * \param ... list of arguments specified by the format string
+ * \returns the id or -1 on error
+ */
+int lsevents_intern( char *fmt, ...) {
+  char event[LSEVENTS_EVENT_LENGTH];
+  va_list arg_ptr;
+  lsevents_event_names_t *enp;
+
+  va_start( arg_ptr, fmt);
+  vsnprintf( event, sizeof(event)-1, fmt, arg_ptr);
+  event[sizeof(event)-1]=0;
+  va_end( arg_ptr);
+
+  enp = lsevents_intern_name( event);
+  return enp == NULL ? -1 : enp->id;
+}
+
+/** Callbacks listening to an event.
+ *  The list is built from the listeners the first time it is needed.
+ *  Must be called with lsevents_listener_mutex locked.
+ */
+static lsevents_callbacks_t *lsevents_callbacks( lsevents_event_names_t *enp) {
+  static lsevents_lvec_t matches;
+  lsevents_callbacks_t *cbl;
+
+  if( enp->cbl_valid)
+    return enp->cbl;
+
+  //
+  // Find matching callbacks
+  //
+  //  A previously defined callback might want to trigger on our
+  //  event.  Listeners are called oldest first.
+  //
+  lsevents_match( enp->event, &matches);
+
+  cbl = NULL;
+  if( matches.n > 0) {
+    cbl = calloc( 1, sizeof( lsevents_callbacks_t) + matches.n * sizeof( lsevents_listener_t *));
+    if( cbl == NULL) {
+      lslogging_log_message( "lsevents_callbacks: out of memory");
+      exit( -1);
+    }
+    cbl->n = matches.n;
+    memcpy( cbl->l, matches.l, matches.n * sizeof( lsevents_listener_t *));
+  }
+
+  //
+  // add_listener and remove_listener look at cbl_valid with the names mutex locked
+  //
+  pthread_mutex_lock( &lsevents_names_mutex);
+  lsevents_cbl_publish( enp, cbl);
+  __atomic_store_n( &enp->cbl_valid, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock( &lsevents_names_mutex);
+
+  return cbl;
+}
 
 void lsevents_preregister_event( char *fmt, ...) {
-  char  s[128];
+  char  s[LSEVENTS_EVENT_LENGTH];
   va_list arg_ptr;
 
   va_start( arg_ptr, fmt);
@@ -330,10 +1670,226 @@ void lsevents_preregister_event( char *fmt, ...) {
   s[sizeof(s)-1] = 0;
   va_end( arg_ptr);
 
-  lsevents_register_event( s);
+  lsevents_intern_name( s);
+}
+
+
+
+/** Record events as they are dispatched
+ *  \param path file to write the trace to (truncated)
+ *  \returns 0 on success
+ */
+int lsevents_trace_start( char *path) {
+  static const char *id = FILEID "lsevents_trace_start";
+  FILE *fp;
+
+  fp = fopen( path, "w");
+  if( fp == NULL) {
+    lslogging_log_message( "%s: could not open %s: %s", id, path, strerror( errno));
+    return 1;
+  }
+  fwrite( LSEVENTS_TRACE_MAGIC, 1, 8, fp);
+
+  pthread_mutex_lock( &lsevents_trace_mutex);
+  if( lsevents_trace_fp != NULL)
+    fclose( lsevents_trace_fp);
+  if( lsevents_trace_named != NULL)
+    memset( lsevents_trace_named, 0, lsevents_trace_nnamed);
+  __atomic_store_n( &lsevents_trace_fp, fp, __ATOMIC_RELEASE);
+  pthread_mutex_unlock( &lsevents_trace_mutex);
+
+  lslogging_log_message( "%s: tracing events to %s", id, path);
+  return 0;
+}
+
+/** Stop recording events
+ */
+void lsevents_trace_stop() {
+  pthread_mutex_lock( &lsevents_trace_mutex);
+  if( lsevents_trace_fp != NULL) {
+    fclose( lsevents_trace_fp);
+    __atomic_store_n( &lsevents_trace_fp, NULL, __ATOMIC_RELEASE);
+    lslogging_log_message( "lsevents_trace_stop: done tracing events");
+  }
+  pthread_mutex_unlock( &lsevents_trace_mutex);
+}
+
+/** Write one event to the trace
+ *  Only called from the dispatch thread.
+ */
+static void lsevents_trace_write( lsevents_event_names_t *enp, lsevents_payload_t *pl) {
+  lsevents_trace_rec_t rec;
+
+  pthread_mutex_lock( &lsevents_trace_mutex);
+  if( lsevents_trace_fp == NULL) {
+    pthread_mutex_unlock( &lsevents_trace_mutex);
+    return;
+  }
+
+  memset( &rec, 0, sizeof( rec));
+
+  if( enp->id >= lsevents_trace_nnamed) {
+    int n;
+
+    n = 2 * (enp->id + 1);
+    lsevents_trace_named = realloc( lsevents_trace_named, n);
+    if( lsevents_trace_named == NULL) {
+      lslogging_log_message( "lsevents_trace_write: out of memory");
+      exit( -1);
+    }
+    memset( lsevents_trace_named + lsevents_trace_nnamed, 0, n - lsevents_trace_nnamed);
+    lsevents_trace_nnamed = n;
+  }
+
+  if( !lsevents_trace_named[enp->id]) {
+    rec.type = 'N';
+    rec.id   = enp->id;
+    rec.len  = strlen( enp->event);
+    fwrite( &rec, sizeof( rec), 1, lsevents_trace_fp);
+    fwrite( enp->event, 1, rec.len, lsevents_trace_fp);
+    lsevents_trace_named[enp->id] = 1;
+  }
+
+  rec.type     = 'E';
+  rec.id       = enp->id;
+  rec.len      = 0;
+  rec.tid      = pl->tid;
+  rec.motor    = pl->mp == NULL ? -1 : pl->mp - lspmac_motors;
+  rec.sec      = pl->ts.tv_sec;
+  rec.nsec     = pl->ts.tv_nsec;
+  rec.position = pl->position;
+  rec.ival[0]  = pl->ival[0];
+  rec.ival[1]  = pl->ival[1];
+  rec.dval[0]  = pl->dval[0];
+  rec.dval[1]  = pl->dval[1];
+  fwrite( &rec, sizeof( rec), 1, lsevents_trace_fp);
+
+  pthread_mutex_unlock( &lsevents_trace_mutex);
 }
 
+/** Send the events in a trace again.  Everything listening gets
+ *  them, so only do this on a system that is not running a beamline.
+ *  \param path  trace file made by lsevents_trace_start
+ *  \param speed 1.0 for the original timing, 10.0 for ten times faster, 0 for as fast as possible
+ *  \param only  regular expression: only replay the events it matches.  NULL for all of them.
+ *  \returns number of events sent or -1 on error
+ */
+long lsevents_trace_replay( char *path, double speed, char *only) {
+  static const char *id = FILEID "lsevents_trace_replay";
+  FILE *fp;
+  char magic[8];
+  char event[LSEVENTS_EVENT_LENGTH];
+  lsevents_trace_rec_t rec;
+  lsevents_payload_t pl;
+  int *ids;
+  int nids, n;
+  long rtn;
+  double t0_trace, t0_now, t_trace, wait_secs;
+  struct timespec now, then;
+  regex_t re;
+
+  if( only != NULL && regcomp( &re, only, REG_EXTENDED | REG_NOSUB) != 0) {
+    lslogging_log_message( "%s: bad regular expression '%s'", id, only);
+    return -1;
+  }
+
+  fp = fopen( path, "r");
+  if( fp == NULL) {
+    lslogging_log_message( "%s: could not open %s: %s", id, path, strerror( errno));
+    if( only != NULL)
+      regfree( &re);
+    return -1;
+  }
+  if( fread( magic, 1, 8, fp) != 8 || memcmp( magic, LSEVENTS_TRACE_MAGIC, 8) != 0) {
+    lslogging_log_message( "%s: %s is not an event trace", id, path);
+    fclose( fp);
+    if( only != NULL)
+      regfree( &re);
+    return -1;
+  }
+
+  ids      = NULL;
+  nids     = 0;
+  rtn      = 0;
+  t0_trace = 0.0;
+  t0_now   = 0.0;
+
+  while( fread( &rec, sizeof( rec), 1, fp) == 1) {
+    if( rec.id < 0) {
+      rtn = -1;
+      break;
+    }
+    if( rec.id >= nids) {
+      n   = 2 * (rec.id + 1);
+      ids = realloc( ids, n * sizeof( int));
+      if( ids == NULL) {
+	lslogging_log_message( "%s: out of memory", id);
+	exit( -1);
+      }
+      memset( ids + nids, -1, (n - nids) * sizeof( int));
+      nids = n;
+    }
+
+    if( rec.type == 'N') {
+      if( rec.len < 0 || rec.len >= (int)sizeof( event) || fread( event, 1, rec.len, fp) != (size_t)rec.len) {
+	rtn = -1;
+	break;
+      }
+      event[rec.len] = 0;
+      //
+      // Events we are skipping get id -2
+      //
+      ids[rec.id] = (only == NULL || regexec( &re, event, 0, NULL, 0) == 0) ? lsevents_intern( "%s", event) : -2;
+      continue;
+    }
+
+    if( rec.type != 'E' || ids[rec.id] == -1) {
+      rtn = -1;
+      break;
+    }
+
+    if( ids[rec.id] < 0)
+      continue;
+
+    //
+    // Keep the original spacing, scaled
+    //
+    t_trace = rec.sec + rec.nsec / 1.e9;
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    if( rtn == 0) {
+      t0_trace = t_trace;
+      t0_now   = now.tv_sec + now.tv_nsec / 1.e9;
+    } else if( speed > 0.0) {
+      wait_secs = t0_now + (t_trace - t0_trace) / speed - (now.tv_sec + now.tv_nsec / 1.e9);
+      if( wait_secs > 0.0) {
+	then.tv_sec  = wait_secs;
+	then.tv_nsec = (wait_secs - then.tv_sec) * 1.e9;
+	nanosleep( &then, NULL);
+      }
+    }
+
+    memset( &pl, 0, sizeof( pl));
+    pl.ts.tv_sec  = rec.sec;
+    pl.ts.tv_nsec = rec.nsec;
+    pl.mp         = (rec.motor >= 0 && rec.motor < lspmac_nmotors) ? &lspmac_motors[rec.motor] : NULL;
+    pl.position   = rec.position;
+    pl.ival[0]    = rec.ival[0];
+    pl.ival[1]    = rec.ival[1];
+    pl.dval[0]    = rec.dval[0];
+    pl.dval[1]    = rec.dval[1];
+    lsevents_send_event_id_payload( ids[rec.id], &pl);
+    rtn++;
+  }
+
+  if( rtn < 0)
+    lslogging_log_message( "%s: %s is corrupt", id, path);
 
+  free( ids);
+  fclose( fp);
+  if( only != NULL)
+    regfree( &re);
+  return rtn;
+}
 
 /** Our worker
  *  \param dummy Unused but needed by pthreads to be happy
@@ -342,38 +1898,161 @@ void *lsevents_worker(
 		     void *dummy
 		     ) {
   
-  char *event;
-  lsevents_callbacks_t *cbi;
+  int id;
+  int i;
+  lsevents_event_names_t *enp;
+  lsevents_callbacks_t *cbl;
+  lsevents_listener_t *lp;
+  lsevents_shard_entry_t e;
+  lsevents_payload_t pl;
+
+  unsigned long critical_ticket, coalesce_ticket, overflow_ticket;
+  unsigned long gen, gen1, gen2;
+  int have_critical, have_coalesce, have_overflow;
+  int marked;
+  lsevents_overflow_t *op;
+
+  lsevents_never_wait();
 
   while( 1) {
-    pthread_mutex_lock( &lsevents_queue_mutex);
+    //
+    // We hold no callback lists between events: anything retired
+    // before now may be freed.
+    //
+    __atomic_store_n( &lsevents_worker_qs, __atomic_load_n( &lsevents_gp, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    if( __atomic_load_n( &lsevents_retired, __ATOMIC_RELAXED) != NULL && pthread_mutex_trylock( &lsevents_listener_mutex) == 0) {
+      lsevents_reclaim();
+      pthread_mutex_unlock( &lsevents_listener_mutex);
+    }
 
     //
     // wait for someone to send an event
     //
-    while( lsevents_queue_off == lsevents_queue_on)
-      pthread_cond_wait( &lsevents_queue_cond, &lsevents_queue_mutex);
+    if( sem_wait( &lsevents_queue_sem) != 0)
+      continue;
+
+    //
+    // Get our event: the oldest of the queue heads.  Dropped
+    // coalescable events leave extra posts on the semaphore so we
+    // might find nothing.
+    //
+    have_critical = lsevents_ring_peek( &lsevents_critical_queue, &critical_ticket);
+    have_coalesce = lsevents_ring_peek( &lsevents_coalesce_queue, &coalesce_ticket);
+
+    have_overflow = 0;
+    if( __atomic_load_n( &lsevents_overflow_n, __ATOMIC_SEQ_CST) > 0) {
+      pthread_mutex_lock( &lsevents_overflow_mutex);
+      if( lsevents_overflow_head != NULL) {
+	have_overflow   = 1;
+	overflow_ticket = lsevents_overflow_head->ticket;
+      }
+      pthread_mutex_unlock( &lsevents_overflow_mutex);
+    }
+
+    if( have_overflow &&
+	(!have_critical || (long)(overflow_ticket - critical_ticket) < 0) &&
+	(!have_coalesce || (long)(overflow_ticket - coalesce_ticket) < 0)) {
+      //
+      // Only we take entries off the list so the head is still ours
+      //
+      pthread_mutex_lock( &lsevents_overflow_mutex);
+      op = lsevents_overflow_head;
+      lsevents_overflow_head = op->next;
+      if( lsevents_overflow_head == NULL)
+	lsevents_overflow_tail = NULL;
+      __atomic_sub_fetch( &lsevents_overflow_n, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock( &lsevents_overflow_mutex);
+
+      id  = op->id;
+      gen = op->gen;
+      pl  = op->pl;
+      free( op);
+    } else if( have_critical && (!have_coalesce || (long)(critical_ticket - coalesce_ticket) < 0)) {
+      if( !lsevents_ring_pop( &lsevents_critical_queue, &id, &gen, &pl))
+	continue;
+      //
+      // let the send event process know there is room on the queue again
+      //
+      if( __atomic_load_n( &lsevents_full_waiters, __ATOMIC_SEQ_CST) > 0) {
+	pthread_mutex_lock( &lsevents_queue_mutex);
+	pthread_cond_broadcast( &lsevents_queue_cond);
+	pthread_mutex_unlock( &lsevents_queue_mutex);
+      }
+    } else if( have_coalesce) {
+      if( !lsevents_ring_pop( &lsevents_coalesce_queue, &id, &gen, &pl))
+	continue;
+    } else {
+      continue;
+    }
+
+    enp = lsevents_id_lookup( id);
+    if( enp == NULL)
+      continue;
+
+    if( __atomic_load_n( &lsevents_trace_fp, __ATOMIC_ACQUIRE) != NULL)
+      lsevents_trace_write( enp, &pl);
 
     //
-    // Get our event name
+    // Get our callback list.  Only the first event of a given name
+    // needs the listener mutex.
     //
-    event = lsevents_queue[(lsevents_queue_off++) % LSEVENTS_QUEUE_LENGTH].evp;
+    gen1 = __atomic_load_n( &enp->cbl_gen, __ATOMIC_SEQ_CST);
+    if( __atomic_load_n( &enp->cbl_valid, __ATOMIC_ACQUIRE)) {
+      cbl = __atomic_load_n( &enp->cbl, __ATOMIC_SEQ_CST);
+    } else {
+      pthread_mutex_lock( &lsevents_listener_mutex);
+      cbl = lsevents_callbacks( enp);
+      pthread_mutex_unlock( &lsevents_listener_mutex);
+    }
+    gen2 = __atomic_load_n( &enp->cbl_gen, __ATOMIC_SEQ_CST);
 
     //
-    // let the send event process know there is room on the queue again
+    // The sender's marks only count if they went with this list
     //
-    pthread_cond_signal(  &lsevents_queue_cond);
-    pthread_mutex_unlock( &lsevents_queue_mutex);
+    marked = gen != 0 && gen == gen1 && gen == gen2;
 
-    // call our callbacks
+    // call our callbacks, or hand them to their workers.  The
+    // workers only get things that are never freed so the listener
+    // may go away before its callback runs.
     //
-    pthread_mutex_lock( &lsevents_listener_mutex);
-    for( cbi = lsevents_register_event( event); cbi != NULL; cbi = cbi->next) {
-      cbi->cb( event);
-    }
-    pthread_mutex_unlock( &lsevents_listener_mutex);
+    for( i=0; cbl != NULL && i<cbl->n; i++) {
+      lp = cbl->l[i];
+      e.cb    = lp->cb;
+      e.ccb   = lp->ccb;
+      e.pcb   = lp->pcb;
+      e.pl    = pl;
+      e.cell  = NULL;
+      e.stats = lp->stats;
+      e.event = enp->event;
+
+      if( lp->ccb != NULL) {
+	//
+	// The sender marked this routine as having an instance on the
+	// way.  If the mark is gone an earlier instance's call took
+	// care of ours; anything sent from here on needs a new one.
+	//
+	e.cell = lsevents_coalesce_cell( lp->stats, enp->id);
+	if( !__atomic_exchange_n( &e.cell->queued, 0, __ATOMIC_SEQ_CST) && marked)
+	  continue;
+      }
 
-    free( event);
+      if( lsevents_nworkers == 0) {
+	lsevents_call( &e);
+	continue;
+      }
+
+      if( lp->ccb != NULL) {
+	//
+	// Already waiting for this routine's worker?  Then that call
+	// stands in for this one.
+	//
+	if( __atomic_exchange_n( &e.cell->pending, 1, __ATOMIC_SEQ_CST)) {
+	  __atomic_fetch_add( &e.cell->suppressed, 1, __ATOMIC_SEQ_CST);
+	  continue;
+	}
+      }
+      lsevents_shard_push( &lsevents_shards[lp->shard], &e);
+    }
   }
   return NULL;
 }
@@ -382,6 +2061,7 @@ void *lsevents_worker(
  */
 void lsevents_init() {
   pthread_mutexattr_t mutex_initializer;
+  int i;
 
   // Use recursive mutexs
   //
@@ -389,8 +2069,26 @@ void lsevents_init() {
   pthread_mutexattr_settype( &mutex_initializer, PTHREAD_MUTEX_RECURSIVE);
 
   pthread_mutex_init( &lsevents_queue_mutex,    &mutex_initializer);
+  pthread_mutex_init( &lsevents_overflow_mutex, &mutex_initializer);
   pthread_cond_init(  &lsevents_queue_cond,     NULL);
   pthread_mutex_init( &lsevents_listener_mutex, &mutex_initializer);
+  pthread_mutex_init( &lsevents_names_mutex,    &mutex_initializer);
+  pthread_mutex_init( &lsevents_trace_mutex,    &mutex_initializer);
+
+  lsevents_ring_init( &lsevents_critical_queue);
+  lsevents_ring_init( &lsevents_coalesce_queue);
+  sem_init( &lsevents_queue_sem, 0, 0);
+
+  for( i=0; i<lsevents_nworkers; i++) {
+    pthread_mutex_init( &lsevents_shards[i].mutex, &mutex_initializer);
+    pthread_cond_init(  &lsevents_shards[i].cond,  NULL);
+    lsevents_shards[i].size = LSEVENTS_QUEUE_LENGTH;
+    lsevents_shards[i].q    = calloc( lsevents_shards[i].size, sizeof( lsevents_shard_entry_t));
+    if( lsevents_shards[i].q == NULL) {
+      lslogging_log_message( "lsevents_init: out of memory");
+      exit( -1);
+    }
+  }
 
   hcreate_r( 2*lsevents_max_events, &lsevents_event_name_ht);
 }
@@ -398,6 +2096,11 @@ void lsevents_init() {
 /** Start up the thread and get out of the way.
  */
 pthread_t *lsevents_run() {
+  int i;
+
+  for( i=0; i<lsevents_nworkers; i++)
+    pthread_create( &lsevents_shards[i].thread, NULL, lsevents_shard_worker, &lsevents_shards[i]);
+
   pthread_create( &lsevents_thread, NULL, lsevents_worker, NULL);
   return &lsevents_thread;
 }
@@ -2302,6 +2302,11 @@ static void lspg_unset_current_preset_moving_cb( char *event) {
 }
 
 
+static lsredis_family_t lspg_zoom_scalex  = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.ScaleX");	//!< cam.zoom.%d.ScaleX handles
+static lsredis_family_t lspg_zoom_scaley  = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.ScaleY");	//!< cam.zoom.%d.ScaleY handles
+static lsredis_family_t lspg_zoom_centerx = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.CenterX");	//!< cam.zoom.%d.CenterX handles
+static lsredis_family_t lspg_zoom_centery = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.CenterY");	//!< cam.zoom.%d.CenterY handles
+
 /** Fix up xscale, yscale, CenterX, and CenterY  when zoom changes
  */
 static void lspg_set_scale_cb( char *event) {
@@ -2317,16 +2322,16 @@ static void lspg_set_scale_cb( char *event) {
 
   mag = floor(( lspmac_getPosition( zoom) + 0.5));
   
-  px  = lsredis_get_obj( "cam.zoom.%d.ScaleX", mag);
+  px  = lsredis_family_get( &lspg_zoom_scalex, mag);
   sx = lsredis_getstr( px);
 
-  py  = lsredis_get_obj( "cam.zoom.%d.ScaleY", mag);
+  py  = lsredis_family_get( &lspg_zoom_scaley, mag);
   sy = lsredis_getstr( py);
 
-  px  = lsredis_get_obj( "cam.zoom.%d.CenterX", mag);
+  px  = lsredis_family_get( &lspg_zoom_centerx, mag);
   cx = lsredis_getstr( px);
 
-  py  = lsredis_get_obj( "cam.zoom.%d.CenterY", mag);
+  py  = lsredis_family_get( &lspg_zoom_centery, mag);
   cy = lsredis_getstr( py);
 
   // lspg_query_push( NULL, NULL, "EXECUTE kvupdate( '{cam.xScale,%s,cam.yScale,%s,cam.CenterX,%s,cam.CenterY,%s}')", sx, sy, cx, cy);
@@ -63,9 +63,14 @@ void lspmac_get_ascii( char *);                 //!< Forward declarateion
 static int lspmac_running = 1;                  //!< exit worker thread when zero
 int lspmac_shutter_state;                       //!< State of the shutter, used to detect changes
 int lspmac_shutter_has_opened_globally;         //!< Indicates that the shutter had opened, perhaps briefly even if the state did not change
+static int lspmac_shutter_last_omega_cnts = 0;  //!< omega counts at the previous status frame, used to place shutter edges
+static int lspmac_shutter_cycles = 0;           //!< number of fast shutter open/close cycles we've seen
+static double lspmac_shutter_open_cnts  = 0.0;  //!< estimated omega counts when the fast shutter last opened
+static double lspmac_shutter_close_cnts = 0.0;  //!< estimated omega counts when the fast shutter last closed
 pthread_mutex_t lspmac_moving_mutex;            //!< Coordinate moving motors between threads
 pthread_cond_t  lspmac_moving_cond;             //!< Wait for motor(s) to finish moving condition
 int lspmac_moving_flags;                        //!< Flag used to implement motor moving condition
+static int lspmac_coordsys_stopped_ev[17];	//!< interned "Coordsys %d Stopped" events, indexed by coordinate system
 
 static double lspmac_saved_analPosition=0;      //!< the analizer is the home motor we cannot home. Use the last known position in case we have to home it
 static double lspmac_saved_phiPosition=0;       //!< the phi has no home switch.  Use the last known position in case we have to home it.
@@ -75,6 +80,12 @@ static uint16_t lspmac_control_char = 0;        //!< The control character we've
 static pthread_mutex_t lspmac_ascii_mutex;      //!< Keep too many processes from sending commands at once
 static int lspmac_ascii_busy = 0;               //!< flag for condition to wait for
 
+static pthread_mutex_t lspmac_query_mutex;      //!< Only one variable query at a time
+static pthread_cond_t  lspmac_query_cond;       //!< Signal the response to a query (used with lspmac_ascii_mutex)
+static char lspmac_query_cmd[32];               //!< The query we are waiting on, empty when none
+static char lspmac_query_response[256];         //!< The response to our query
+static int  lspmac_query_state = 0;             //!< 0 waiting, 1 answered, -1 refused
+
 static int omega_zero_search = 0;               //!< Indicate we'd really like to know when omega crosses zero
 static double omega_zero_velocity = 0;          //!< rate (cnts/sec) that omega was traveling when it crossed zero
 struct timespec omega_zero_time;                //!< Time we believe that omega crossed zero
@@ -91,9 +102,12 @@ static int getmvars = 0;                        //!< flag set at initialization
 
 lspmac_bi_t lspmac_bis[32];                     //!< array of binary inputs
 int lspmac_nbis = 0;                            //!< number of active binary inputs
+lspmac_bi_group_t lspmac_bi_groups[32];         //!< binary inputs grouped by status word
+int lspmac_nbi_groups = 0;                      //!< number of status words with binary inputs
 
 #define LSPMAC_MAX_MOTORS 48
 lspmac_motor_t lspmac_motors[LSPMAC_MAX_MOTORS];//!< All our motors
+lspmac_motor_hot_t lspmac_motor_hot[LSPMAC_MAX_MOTORS]; //!< Per frame state of our motors, same order as lspmac_motors
 int lspmac_nmotors = 0;                         //!< The number of motors we manage
 struct hsearch_data motors_ht;                  //!< A hash table to find motors by name
 
@@ -1178,25 +1192,25 @@ void lspmac_bo_read(
 
   pos = (*(mp->read_ptr) & mp->read_mask) == 0 ? 0 : 1;
 
-  changed = pos != mp->position;
-  mp->position = pos;
+  changed = pos != mp->hot->position;
+  mp->hot->position = pos;
 
   if( changed) {
-    mp->motion_seen  = 1;
-    mp->not_done     = 0;
+    mp->hot->motion_seen  = 1;
+    mp->hot->not_done     = 0;
     mp->command_sent = 1;
     pthread_cond_signal( &(mp->cond));
-    lsevents_send_event( "%s Moving", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
     lsevents_send_event( "%s %d", mp->name, pos);
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_in_position);
   }
 
-  if( mp->reported_position != mp->position) {
-    fmt = lsredis_getstr(mp->redis_fmt);
-    lsredis_setstr( mp->redis_position, fmt, mp->position);
-    lsredis_setstr( mp->status_str, "%s", mp->position ? "On" : "Off");
-    free(fmt);
-    mp->reported_position = mp->position;
+  if( mp->hot->reported_position != mp->hot->position) {
+    fmt = lsredis_borrow( mp->redis_fmt);
+    lsredis_setstr( mp->redis_position, fmt, mp->hot->position);
+    lsredis_setstr( mp->status_str, "%s", mp->hot->position ? "On" : "Off");
+    lsredis_release( fmt);
+    mp->hot->reported_position = mp->hot->position;
   }
 
   pthread_mutex_unlock( &(mp->mutex));
@@ -1211,26 +1225,26 @@ void lspmac_dac_read(
   char *fmt;
 
   pthread_mutex_lock( &(mp->mutex));
-  mp->actual_pos_cnts = *mp->actual_pos_cnts_p;
+  mp->hot->actual_pos_cnts = *mp->hot->actual_pos_cnts_p;
   u2c = lsredis_getd( mp->u2c);
 
   if( mp->nlut >0 && mp->lut != NULL) {
     if( u2c == 0.0)
       u2c = 1.0;
-    mp->position = lspmac_rlut( mp->nlut, mp->lut, mp->actual_pos_cnts/u2c);
+    mp->hot->position = lspmac_rlut( mp->nlut, mp->lut, mp->hot->actual_pos_cnts/u2c);
   } else {
     if( u2c != 0.0) {
-      mp->position = mp->actual_pos_cnts / u2c;
+      mp->hot->position = mp->hot->actual_pos_cnts / u2c;
     } else {
-      mp->position = mp->actual_pos_cnts;
+      mp->hot->position = mp->hot->actual_pos_cnts;
     }
   }
 
-  if( fabs(mp->reported_position - mp->position) >= lsredis_getd(mp->update_resolution)) {
-    fmt = lsredis_getstr(mp->redis_fmt);
-    lsredis_setstr( mp->redis_position, fmt, mp->position);
-    free(fmt);
-    mp->reported_position = mp->position;
+  if( fabs(mp->hot->reported_position - mp->hot->position) >= lsredis_getd(mp->update_resolution)) {
+    fmt = lsredis_borrow( mp->redis_fmt);
+    lsredis_setstr( mp->redis_position, fmt, mp->hot->position);
+    lsredis_release( fmt);
+    mp->hot->reported_position = mp->hot->position;
   }
 
   pthread_mutex_unlock( &(mp->mutex));
@@ -1258,27 +1272,47 @@ void lspmac_shutter_read(
   if( md2_status.fs_has_opened_globally && !lspmac_shutter_has_opened_globally && !md2_status.fs_is_open) {
     //
     // Here the shutter opened and closed again before we got the memo
-    // Treat it as a shutter closed event
+    // Treat it as a shutter closed event.  It's still a cycle but we
+    // can't say where either edge was.
     //
+    lspmac_shutter_open_cnts  = NAN;
+    lspmac_shutter_close_cnts = NAN;
+    lspmac_shutter_cycles++;
     pthread_cond_signal( &mp->cond);
   }
   lspmac_shutter_has_opened_globally = md2_status.fs_has_opened_globally;
 
   if( lspmac_shutter_state !=  md2_status.fs_is_open) {
+    double omega_cnts;
+
+    //
+    // The edge happened sometime between the last status frame and
+    // this one.  Call it half way for the shutter timing measurement.
+    //
+    omega_cnts = (lspmac_shutter_last_omega_cnts + *omega->hot->actual_pos_cnts_p) / 2.0;
+    if( md2_status.fs_is_open) {
+      lspmac_shutter_open_cnts  = omega_cnts;
+    } else {
+      lspmac_shutter_close_cnts = omega_cnts;
+      lspmac_shutter_cycles++;
+    }
+
     lspmac_shutter_state = md2_status.fs_is_open;
-    mp->motion_seen = 1;
-    mp->not_done    = 0;
+    mp->hot->motion_seen = 1;
+    mp->hot->not_done    = 0;
 
     pthread_cond_signal( &(mp->cond));
   }
 
+  lspmac_shutter_last_omega_cnts = *omega->hot->actual_pos_cnts_p;
+
   sb_open        = lspmac_getBIPosition(sb_shutter_open);
   sb_not_enabled = lspmac_getBIPosition(sb_shutter_not_enabled);
 
   pthread_mutex_lock( &ncurses_mutex);
   if (sb_not_enabled) {
     mvwprintw( term_status2, 1, 1, "Shutter Disabled");
-    mp->position = 0;
+    mp->hot->position = 0;
 
     if( md2_status.fs_is_open) {
       // Shutter is logically open but is disabled by the shutter box.
@@ -1290,25 +1324,25 @@ void lspmac_shutter_read(
   } else {
     if( sb_open) {
       mvwprintw( term_status2, 1, 1, "Shutter Open    ");
-      mp->position = 1;
+      mp->hot->position = 1;
     } else {
       mvwprintw( term_status2, 1, 1, "Shutter Closed  ");
-      mp->position = 0;
+      mp->hot->position = 0;
     }
   }
   pthread_mutex_unlock( &ncurses_mutex);
 
-  if( fshut->reported_position != fshut->position) {
-    mp->motion_seen = 1;
-    mp->not_done    = 0;
-    fmt = lsredis_getstr( fshut->redis_fmt);
-    lsredis_setstr( fshut->redis_position, fmt, fshut->position);
+  if( fshut->hot->reported_position != fshut->hot->position) {
+    mp->hot->motion_seen = 1;
+    mp->hot->not_done    = 0;
+    fmt = lsredis_borrow( fshut->redis_fmt);
+    lsredis_setstr( fshut->redis_position, fmt, fshut->hot->position);
+    lsredis_release( fmt);
     if (sb_not_enabled) {
       lsredis_setstr( fshut->status_str, "Disabled");
     } else {
-      lsredis_setstr( fshut->status_str, "%s", fshut->reported_position == 0 ? "Open" : "Closed");
-      free(fmt);
-      fshut->reported_position = fshut->position;
+      lsredis_setstr( fshut->status_str, "%s", fshut->hot->reported_position == 0 ? "Open" : "Closed");
+      fshut->hot->reported_position = fshut->hot->position;
       pthread_cond_signal( &(mp->cond));
     }
   }
@@ -1322,6 +1356,62 @@ void lspmac_shutter_read(
   }
 }
 
+/** Number of fast shutter open/close cycles seen so far.
+ *  Pass the result to lspmac_shutter_cycle_wait to wait for the next one.
+ */
+int lspmac_shutter_cycles_get() {
+  int rtn;
+
+  pthread_mutex_lock( &(fshut->mutex));
+  rtn = lspmac_shutter_cycles;
+  pthread_mutex_unlock( &(fshut->mutex));
+  return rtn;
+}
+
+/** Wait for the fast shutter to finish an open/close cycle and
+ *  report where omega was (in counts) when it opened and closed.
+ *  The edges are only known to within one status frame; we
+ *  report the mid point.  Both are NAN when the whole cycle fell
+ *  between two status frames.
+ *
+ *  \returns 0 on success, 1 on timeout
+ */
+int lspmac_shutter_cycle_wait(
+			      int cycles,		/**< [in]  Value of lspmac_shutter_cycles_get() before the shutter was opened */
+			      double timeout_secs,	/**< [in]  Give up after this many seconds                                    */
+			      double *open_cnts,	/**< [out] Omega counts when the shutter opened                               */
+			      double *close_cnts	/**< [out] Omega counts when the shutter closed                               */
+			      ) {
+  struct timespec timeout;
+  double isecs, fsecs;
+  int err;
+
+  clock_gettime( CLOCK_REALTIME, &timeout);
+  fsecs = modf( timeout_secs, &isecs);
+  timeout.tv_sec  += (long)floor( isecs);
+  timeout.tv_nsec += (long)floor( fsecs * 1.e9);
+  timeout.tv_sec  += timeout.tv_nsec / 1000000000;
+  timeout.tv_nsec %= 1000000000;
+
+  err = 0;
+  pthread_mutex_lock( &(fshut->mutex));
+  while( err == 0 && lspmac_shutter_cycles == cycles)
+    err = pthread_cond_timedwait( &(fshut->cond), &(fshut->mutex), &timeout);
+
+  if( err == ETIMEDOUT) {
+    pthread_mutex_unlock( &(fshut->mutex));
+    return 1;
+  }
+
+  if( open_cnts != NULL)
+    *open_cnts  = lspmac_shutter_open_cnts;
+  if( close_cnts != NULL)
+    *close_cnts = lspmac_shutter_close_cnts;
+  pthread_mutex_unlock( &(fshut->mutex));
+
+  return 0;
+}
+
 /** Home the motor.
  */
 void lspmac_home1_queue(
@@ -1388,7 +1478,7 @@ void lspmac_home1_queue(
         //
         // we are homing or ( not in position       while     in open loop)
         //
-        if( m2->homing || (((m2->status2 & 0x01)==0) && ((m2->status1 & 0x040000) != 0)))
+        if( m2->homing || (((m2->hot->status2 & 0x01)==0) && ((m2->hot->status1 & 0x040000) != 0)))
           nogo = 1;
         pthread_mutex_unlock( &(m2->mutex));
       }
@@ -1400,8 +1490,8 @@ void lspmac_home1_queue(
   }
   mp->homing   = 1;
   lslogging_log_message( "%s homing = %d", mp->name, mp->homing);
-  mp->not_done = 1;     // set up waiting for cond
-  mp->motion_seen = 0;
+  mp->hot->not_done = 1;     // set up waiting for cond
+  mp->hot->motion_seen = 0;
   // This opens the control loop.
   // The status routine should notice this and the fact that
   // the homing flag is set and call on the home2 routine
@@ -1412,7 +1502,7 @@ void lspmac_home1_queue(
   // before the open loop command is dequeued and acted on.
   //
 
-  if( active && (~(mp->status1) & 0x040000)) {
+  if( active && (~(mp->hot->status1) & 0x040000)) {
     lspmac_SockSendDPline( mp->name, "#%d$*", motor_num);
   }
 
@@ -1427,7 +1517,7 @@ void lspmac_home1_queue(
     // We only got here cause someone called us directly, not becuase we figured out
     // on our own that a motor needed to be homed.
     mp->homing = 0;
-    lsevents_send_event( "%s Homed", mp->name);
+    lsevents_send_event_id( mp->ev_homed);
   }
 }
 
@@ -1479,7 +1569,7 @@ void lspmac_home2_queue(
 double lspmac_getPosition( lspmac_motor_t *mp) {
   double rtn;
   pthread_mutex_lock( &(mp->mutex));
-  rtn = mp->position;
+  rtn = mp->hot->position;
   pthread_mutex_unlock( &(mp->mutex));
   return rtn;
 }
@@ -1496,6 +1586,8 @@ void lspmac_pmacmotor_read(
   int motor_num;
   char *fmt;
   int status_changed;
+  int inpos_changed;
+  lsevents_payload_t pl;
 
 
   if( lsredis_getb( mp->active) != 1)
@@ -1510,9 +1602,9 @@ void lspmac_pmacmotor_read(
   // Only omega has been observed to change by 0x10000 on its own
   // with no real motion.
   //
-  if( mp->status2 & 1 && mp->status2 == *mp->status2_p && abs( mp->actual_pos_cnts - *mp->actual_pos_cnts_p) > 256) {
+  if( mp->hot->status2 & 1 && mp->hot->status2 == *mp->hot->status2_p && abs( mp->hot->actual_pos_cnts - *mp->hot->actual_pos_cnts_p) > 256) {
     //    lslogging_log_message( "Instantaneous change: %s old status1: %0x, new status1: %0x, old status2: %0x, new status2: %0x, old cnts: %0x, new cnts: %0x",
-    //                             mp->name, mp->status1, *mp->status1_p, mp->status2, *mp->status2_p, mp->actual_pos_cnts, *mp->actual_pos_cnts_p);
+    //                             mp->name, mp->hot->status1, *mp->hot->status1_p, mp->hot->status2, *mp->hot->status2_p, mp->hot->actual_pos_cnts, *mp->hot->actual_pos_cnts_p);
 
     //
     // At this point we'll just log the event and return
@@ -1522,7 +1614,7 @@ void lspmac_pmacmotor_read(
     // wrong.  Homing (or moving) the motor should fix this.  There is a non-zero probably that it can happen
     // two or more times in a row after moving.
     //
-    // TODO: account for the case where mp->actual_pos_cnts is the bad value.
+    // TODO: account for the case where mp->hot->actual_pos_cnts is the bad value.
     //
     // TODO: Is this a problem when the motor is moving?  Can we detect it?
     //
@@ -1533,11 +1625,9 @@ void lspmac_pmacmotor_read(
     return;
   }
 
-  // Send an event if inPosition has changed
+  // Send an event if inPosition has changed (once we know where we are)
   //
-  if( (mp->status2 & 0x000001) != (*mp->status2_p & 0x000001)) {
-    lsevents_send_event( "%s %s", mp->name, (*mp->status2_p & 0x000001) ? "In Position" : "Moving");
-  }
+  inpos_changed = (mp->hot->status2 & 0x000001) != (*mp->hot->status2_p & 0x000001);
 
   // Get some values we might need later
   //
@@ -1548,12 +1638,12 @@ void lspmac_pmacmotor_read(
   //
   // maybe look for omega zero crossing
   //
-  if( motor_num == 1 && omega_zero_search && *mp->actual_pos_cnts_p >=0 && mp->actual_pos_cnts < 0) {
+  if( motor_num == 1 && omega_zero_search && *mp->hot->actual_pos_cnts_p >=0 && mp->hot->actual_pos_cnts < 0) {
     int secs, nsecs;
 
     if( omega_zero_velocity > 0.0) {
-      secs = *mp->actual_pos_cnts_p / omega_zero_velocity;
-      nsecs = (*mp->actual_pos_cnts_p / omega_zero_velocity - secs) * 1000000000;
+      secs = *mp->hot->actual_pos_cnts_p / omega_zero_velocity;
+      nsecs = (*mp->hot->actual_pos_cnts_p / omega_zero_velocity - secs) * 1000000000;
 
 
       omega_zero_time.tv_sec = lspmac_status_time.tv_sec  - secs;
@@ -1564,9 +1654,13 @@ void lspmac_pmacmotor_read(
       }
       omega_zero_time.tv_nsec -= nsecs;
 
-      lsevents_send_event( "omega crossed zero");
+      memset( &pl, 0, sizeof( pl));
+      pl.ts       = omega_zero_time;
+      pl.mp       = mp;
+      pl.position = 0.0;
+      lsevents_send_event_payload( &pl, "omega crossed zero");
       lslogging_log_message("lspmac_pmacmotor_read: omega zero secs %d  nsecs %d ozt.tv_sec %ld  ozt.tv_nsec  %ld, motor cnts %d",
-                            secs, nsecs, omega_zero_time.tv_sec, omega_zero_time.tv_nsec, *mp->actual_pos_cnts_p);
+                            secs, nsecs, omega_zero_time.tv_sec, omega_zero_time.tv_nsec, *mp->hot->actual_pos_cnts_p);
     }
     omega_zero_search = 0;
   }
@@ -1574,22 +1668,44 @@ void lspmac_pmacmotor_read(
   // Make local copies so we can inspect them in other threads
   // without having to grab the status mutex
   //
-  if( mp->status1 != *mp->status1_p || mp->status2 != *mp->status2_p) {
-    mp->status1 = *mp->status1_p;
-    mp->status2 = *mp->status2_p;
+  if( mp->hot->status1 != *mp->hot->status1_p || mp->hot->status2 != *mp->hot->status2_p) {
+    mp->hot->status1 = *mp->hot->status1_p;
+    mp->hot->status2 = *mp->hot->status2_p;
     status_changed = 1;
   } else {
     status_changed = 0;
   }
-  mp->actual_pos_cnts = *mp->actual_pos_cnts_p;
+  mp->hot->actual_pos_cnts = *mp->hot->actual_pos_cnts_p;
+
+  if( mp->nlut >0 && mp->lut != NULL) {
+    mp->hot->position = lspmac_rlut( mp->nlut, mp->lut, mp->hot->actual_pos_cnts);
+  } else {
+    if( u2c != 0.0) {
+      mp->hot->position = ((mp->hot->actual_pos_cnts / u2c) - neutral_pos);
+    } else {
+      mp->hot->position = mp->hot->actual_pos_cnts;
+    }
+  }
+
+  //
+  // Listeners hear about the change before anyone waiting on our
+  // condition wakes up
+  //
+  if( inpos_changed) {
+    memset( &pl, 0, sizeof( pl));
+    pl.ts       = lspmac_status_time;
+    pl.mp       = mp;
+    pl.position = mp->hot->position;
+    lsevents_send_event_id_payload( (mp->hot->status2 & 0x000001) ? mp->ev_in_position : mp->ev_moving, &pl);
+  }
 
   // See if the motor is moving
   //
   //                move timer                  homing
   //                  123456                    123456
-  if( mp->status1 & 0x020000 || mp->status1 & 0x000400) {
-    if( mp->motion_seen == 0) {
-      mp->motion_seen = 1;
+  if( mp->hot->status1 & 0x020000 || mp->hot->status1 & 0x000400) {
+    if( mp->hot->motion_seen == 0) {
+      mp->hot->motion_seen = 1;
       pthread_cond_signal( &(mp->cond));
     }
   }
@@ -1599,11 +1715,11 @@ void lspmac_pmacmotor_read(
   // case here:
   //
   //  motion not seen      motor not moving
-  if( !mp->motion_seen && (mp->status1 & 0x020000) == 0) {
+  if( !mp->hot->motion_seen && (mp->hot->status1 & 0x020000) == 0) {
     int in_position_band;
     in_position_band = lsredis_getl(   mp->in_position_band);
-    if( abs( mp->requested_pos_cnts - mp->actual_pos_cnts) * 16 < in_position_band) {
-      mp->motion_seen = 1;
+    if( abs( mp->requested_pos_cnts - mp->hot->actual_pos_cnts) * 16 < in_position_band) {
+      mp->hot->motion_seen = 1;
       pthread_cond_signal( &(mp->cond));
     }
   }
@@ -1611,67 +1727,57 @@ void lspmac_pmacmotor_read(
   //
   // See if we are done moving, ie, in position
   //
-  if( mp->status2 & 0x000001) {
-    if( mp->not_done) {
-      mp->not_done = 0;
+  if( mp->hot->status2 & 0x000001) {
+    if( mp->hot->not_done) {
+      mp->hot->not_done = 0;
       pthread_cond_signal( &(mp->cond));
     }
-  } else if( mp->not_done == 0) {
-    mp->not_done = 1;
+  } else if( mp->hot->not_done == 0) {
+    mp->hot->not_done = 1;
   }
 
   pthread_mutex_lock( &ncurses_mutex);
   mvwprintw( mp->win, 2, 1, "%*s", LS_DISPLAY_WINDOW_WIDTH-2, " ");
-  mvwprintw( mp->win, 2, 1, "%*d cts", LS_DISPLAY_WINDOW_WIDTH-6, mp->actual_pos_cnts);
+  mvwprintw( mp->win, 2, 1, "%*d cts", LS_DISPLAY_WINDOW_WIDTH-6, mp->hot->actual_pos_cnts);
   mvwprintw( mp->win, 3, 1, "%*s", LS_DISPLAY_WINDOW_WIDTH-2, " ");
   pthread_mutex_unlock( &ncurses_mutex);
 
-  if( mp->nlut >0 && mp->lut != NULL) {
-    mp->position = lspmac_rlut( mp->nlut, mp->lut, mp->actual_pos_cnts);
-  } else {
-    if( u2c != 0.0) {
-      mp->position = ((mp->actual_pos_cnts / u2c) - neutral_pos);
-    } else {
-      mp->position = mp->actual_pos_cnts;
-    }
+  if( status_changed || fabs(mp->hot->reported_position - mp->hot->position) >= lsredis_getd(mp->update_resolution)) {
+    fmt = lsredis_borrow( mp->redis_fmt);
+    lsredis_setstr( mp->redis_position, fmt, mp->hot->position);
+    lsredis_release( fmt);
+    mp->hot->reported_position = mp->hot->position;
   }
 
-  if( status_changed || fabs(mp->reported_position - mp->position) >= lsredis_getd(mp->update_resolution)) {
-    fmt = lsredis_getstr(mp->redis_fmt);
-    lsredis_setstr( mp->redis_position, fmt, mp->position);
-    free(fmt);
-    mp->reported_position = mp->position;
-  }
-
-  fmt = lsredis_getstr( mp->printf_fmt);
-  snprintf( s, sizeof(s)-1, fmt, 8, mp->position);
+  fmt = lsredis_borrow( mp->printf_fmt);
+  snprintf( s, sizeof(s)-1, fmt, 8, mp->hot->position);
   s[sizeof(s)-1] = 0;
-  free( fmt);
+  lsredis_release( fmt);
 
   //
   // indicate limit problems
   //
-  lsredis_setstr( mp->pos_limit_hit, mp->status1 & 0x200000 ? "1" : "0");
-  lsredis_setstr( mp->neg_limit_hit, mp->status1 & 0x400000 ? "1" : "0");
+  lsredis_setstr( mp->pos_limit_hit, mp->hot->status1 & 0x200000 ? "1" : "0");
+  lsredis_setstr( mp->neg_limit_hit, mp->hot->status1 & 0x400000 ? "1" : "0");
 
   // set flag if we are not homed
   homing1 = 0;
   //                        ~(homed flag)
-  if( mp->homing == 0  && (~mp->status2 & 0x000400) != 0) {
+  if( mp->homing == 0  && (~mp->hot->status2 & 0x000400) != 0) {
     homing1 = 1;
   }
 
   // set flag if we are homing and in open loop
   homing2 = 0;
   //                         open loop
-  if( mp->homing == 1 && (mp->status1 & 0x040000) != 0) {
+  if( mp->homing == 1 && (mp->hot->status1 & 0x040000) != 0) {
     homing2 = 1;
   }
   // maybe reset homing flag
   //                        homed flag                       in position flag
-  if( (mp->homing == 2) && ((mp->status2 & 0x000400) != 0) && ((mp->status2 & 0x000001) != 0)) {
+  if( (mp->homing == 2) && ((mp->hot->status2 & 0x000400) != 0) && ((mp->hot->status2 & 0x000001) != 0)) {
     mp->homing = 0;
-    lsevents_send_event( "%s Homed", mp->name);
+    lsevents_send_event_id( mp->ev_homed);
     lslogging_log_message( "%s homing = %d", mp->name, mp->homing);
   }
 
@@ -1680,36 +1786,36 @@ void lspmac_pmacmotor_read(
   mvwprintw( mp->win, 3, 1, "%*s", LS_DISPLAY_WINDOW_WIDTH-6, s);
 
   if( status_changed) {
-    mvwprintw( mp->win, 4, 1, "%*x", LS_DISPLAY_WINDOW_WIDTH-2, mp->status1);
-    mvwprintw( mp->win, 5, 1, "%*x", LS_DISPLAY_WINDOW_WIDTH-2, mp->status2);
+    mvwprintw( mp->win, 4, 1, "%*x", LS_DISPLAY_WINDOW_WIDTH-2, mp->hot->status1);
+    mvwprintw( mp->win, 5, 1, "%*x", LS_DISPLAY_WINDOW_WIDTH-2, mp->hot->status2);
     sp = "";
-    if( mp->status2 & 0x000002)
+    if( mp->hot->status2 & 0x000002)
       sp = "Following Warning";
-    else if( mp->status2 & 0x000004)
+    else if( mp->hot->status2 & 0x000004)
       sp = "Following Error";
-    else if( mp->status2 & 0x000020)
+    else if( mp->hot->status2 & 0x000020)
       sp = "I2T Amp Fault";
-    else if( mp->status2 & 0x000008)
+    else if( mp->hot->status2 & 0x000008)
       sp = "Amp. Fault";
-    else if( mp->status2 & 0x000800)
+    else if( mp->hot->status2 & 0x000800)
       sp = "Stopped on Limit";
-    else if( mp->status1 & 0x040000)
+    else if( mp->hot->status1 & 0x040000)
       sp = "Open Loop";
-    else if( ~(mp->status1) & 0x080000)
+    else if( ~(mp->hot->status1) & 0x080000)
       sp = "Motor Disabled";
-    else if( mp->status1 & 0x000400)
+    else if( mp->hot->status1 & 0x000400)
       sp = "Homing";
-    else if( (mp->status1 & 0x600000) == 0x600000)
+    else if( (mp->hot->status1 & 0x600000) == 0x600000)
       sp = "Both Limits Tripped";
-    else if( mp->status1 & 0x200000)
+    else if( mp->hot->status1 & 0x200000)
       sp = "Positive Limit";
-    else if( mp->status1 & 0x400000)
+    else if( mp->hot->status1 & 0x400000)
       sp = "Negative Limit";
-    else if( ~(mp->status2) & 0x000400)
+    else if( ~(mp->hot->status2) & 0x000400)
       sp = "Not Homed";
-    else if( mp->status1 & 0x020000)
+    else if( mp->hot->status1 & 0x020000)
       sp = "Moving";
-    else if( mp->status2 & 0x000001)
+    else if( mp->hot->status2 & 0x000001)
       sp = "In Position";
 
     mvwprintw( mp->win, 6, 1, "%*s", LS_DISPLAY_WINDOW_WIDTH-2, sp);
@@ -1741,6 +1847,67 @@ int lspmac_getBIPosition( lspmac_bi_t *bip) {
   return rtn;
 }
 
+/** Run the read routines of our motors after a status update.
+ *  The motors are visited in the order of the hot array.
+ */
+void lspmac_read_motors() {
+  int i;
+
+  for( i=0; i<lspmac_nmotors; i++) {
+    lspmac_motor_hot[i].mp->read( lspmac_motor_hot[i].mp);
+  }
+}
+
+/** Update a binary input whose bit(s) changed in the status buffer
+ *  and send its events.  Called from the status callback only for
+ *  inputs whose group xor showed a change (or on the first frame).
+ */
+void lspmac_bi_update(
+		      lspmac_bi_t *bp		/**< [in] The binary input to update */
+		      ) {
+  int newValue = 0;
+
+  pthread_mutex_lock( &(bp->mutex));
+
+  bp->position = (*(bp->ptr) & bp->mask) == 0 ? 0 : 1;
+
+  if( bp->first_time) {
+    newValue       = 1;
+    bp->first_time = 0;
+    if( bp->position==1 && bp->changeEventOn_id >= 0) {
+      lsevents_send_event_id( bp->changeEventOn_id);
+      if( bp->onStatus != NULL)
+	lsredis_setstr( bp->status_str, bp->onStatus);
+    }
+    if( bp->position==0 && bp->changeEventOff_id >= 0) {
+      lsevents_send_event_id( bp->changeEventOff_id);
+      if( bp->offStatus != NULL)
+	lsredis_setstr( bp->status_str, bp->offStatus);
+    }
+  } else {
+    if( bp->position != bp->previous) {
+      if( bp->position==1 && bp->changeEventOn_id >= 0) {
+	newValue = 1;
+	lsevents_send_event_id( bp->changeEventOn_id);
+	if( bp->onStatus != NULL)
+	  lsredis_setstr( bp->status_str, bp->onStatus);
+      }
+      if(bp->position==0 && bp->changeEventOff_id >= 0) {
+	newValue = 1;
+	lsevents_send_event_id( bp->changeEventOff_id);
+	if( bp->offStatus != NULL)
+	  lsredis_setstr( bp->status_str, bp->offStatus);
+      }
+    }
+  }
+  bp->previous = bp->position;
+
+  if( newValue)
+    pthread_cond_signal( &(bp->cond));
+
+  pthread_mutex_unlock( &(bp->mutex));
+}
+
 /** Service routing for status upate
  *  This updates positions and status information.
  */
@@ -1757,6 +1924,7 @@ void lspmac_get_status_cb(
 
   int i;
   lspmac_bi_t    *bp;
+  lspmac_bi_group_t *gp;
 
   clock_gettime( CLOCK_REALTIME, &lspmac_status_time);
 
@@ -1787,7 +1955,7 @@ void lspmac_get_status_cb(
     for( i=1; i<=16; i++, mask <<= 1) {
       if( ((lspmac_moving_flags & mask) != 0) && ((md2_status.moving_flags & mask) == 0)) {
         // Falling edge: send event
-        lsevents_send_event( "Coordsys %d Stopped", i);
+        lsevents_send_event_id( lspmac_coordsys_stopped_ev[i]);
       }
     }
     lspmac_moving_flags = md2_status.moving_flags;
@@ -1796,60 +1964,57 @@ void lspmac_get_status_cb(
   pthread_mutex_unlock( &lspmac_moving_mutex);
 
   //
-  // Read the motor positions
+  // Everything this frame writes to redis goes out together
   //
-  for( i=0; i<lspmac_nmotors; i++) {
-    lspmac_motors[i].read(&(lspmac_motors[i]));
-  }
+  lsredis_batch_begin();
 
   //
-  // Read the binary inputs and perhaps send an event
+  // Read the motor positions
   //
-  for( i=0; i<lspmac_nbis; i++) {
-    int newValue = 0;
-    bp = &(lspmac_bis[i]);
+  lspmac_read_motors();
 
-    pthread_mutex_lock( &(bp->mutex));
+  //
+  // Read the binary inputs and perhaps send an event.
+  //
+  // The inputs are grouped by status word so a single xor tells us
+  // whether anything in the word changed.  Only the bits that did
+  // change are visited.
+  //
+  for( i=0; i<lspmac_nbi_groups; i++) {
+    unsigned int changed, seen;
+    lspmac_bi_link_t *lp;
+    int current, b;
 
-    bp->position = (*(bp->ptr) & bp->mask) == 0 ? 0 : 1;
+    gp = &(lspmac_bi_groups[i]);
 
-    if( bp->first_time) {
-      newValue       = 1;
-      bp->first_time = 0;
-      if( bp->position==1 && bp->changeEventOn != NULL && bp->changeEventOn[0] != 0) {
-          lsevents_send_event( bp->changeEventOn);
-          if( bp->onStatus != NULL)
-            lsredis_setstr( bp->status_str, bp->onStatus);
-      }
-      if( bp->position==0 && bp->changeEventOff != NULL && bp->changeEventOff[0] != 0) {
-          lsevents_send_event( bp->changeEventOff);
-          if( bp->offStatus != NULL)
-            lsredis_setstr( bp->status_str, bp->offStatus);
-      }
+    current = *(gp->ptr) & gp->mask;
+    if( gp->first_time) {
+      changed        = gp->mask;
+      gp->first_time = 0;
     } else {
-      if( bp->position != bp->previous) {
-        if( bp->position==1 && bp->changeEventOn != NULL && bp->changeEventOn[0] != 0) {
-          newValue = 1;
-          lsevents_send_event( bp->changeEventOn);
-          if( bp->onStatus != NULL)
-            lsredis_setstr( bp->status_str, bp->onStatus);
-        }
-        if(bp->position==0 && bp->changeEventOff != NULL && bp->changeEventOff[0] != 0) {
-          newValue = 1;
-          lsevents_send_event( bp->changeEventOff);
-          if( bp->offStatus != NULL)
-            lsredis_setstr( bp->status_str, bp->offStatus);
-        }
-      }
+      changed = current ^ gp->previous;
     }
-    bp->previous = bp->position;
-
-    if( newValue)
-      pthread_cond_signal( &(bp->cond));
+    gp->previous = current;
 
-    pthread_mutex_unlock( &(bp->mutex));
+    //
+    // An input that uses more than one changed bit is only
+    // updated for the lowest of them
+    //
+    seen = 0;
+    while( changed) {
+      b = __builtin_ctz( changed);
+      for( lp = gp->bits[b]; lp != NULL; lp = lp->next) {
+	bp = lp->bp;
+	if( (bp->mask & seen) == 0)
+	  lspmac_bi_update( bp);
+      }
+      seen    |= 1u << b;
+      changed &= changed - 1;
+    }
   }
 
+  lsredis_batch_end();
+
   pthread_mutex_lock( &ncurses_mutex);
 
   // acc11c_1   INPUTS
@@ -1966,9 +2131,9 @@ void lspmac_get_status_cb(
   } else {
     mvwprintw( term_status,  3, 1, "%*s", -(LS_DISPLAY_WINDOW_WIDTH-2), "Backlight Down");
   }
-  mvwprintw( term_status, 4, 1, "Front: %*u", LS_DISPLAY_WINDOW_WIDTH-2-8, (int)flight->position);
-  mvwprintw( term_status, 5, 1, "Back: %*u", LS_DISPLAY_WINDOW_WIDTH-2-7,  (int)blight->position);
-  mvwprintw( term_status, 6, 1, "Piezo: %*u", LS_DISPLAY_WINDOW_WIDTH-2-8, (int)fscint->position);
+  mvwprintw( term_status, 4, 1, "Front: %*u", LS_DISPLAY_WINDOW_WIDTH-2-8, (int)flight->hot->position);
+  mvwprintw( term_status, 5, 1, "Back: %*u", LS_DISPLAY_WINDOW_WIDTH-2-7,  (int)blight->hot->position);
+  mvwprintw( term_status, 6, 1, "Piezo: %*u", LS_DISPLAY_WINDOW_WIDTH-2-8, (int)fscint->hot->position);
   wnoutrefresh( term_status);
 
   wnoutrefresh( term_input);
@@ -2058,6 +2223,9 @@ void lspmac_get_ascii_cb( pmac_cmd_queue_t *cmd, int nreceived, char *buff) {
       // Requeue it;
       if( errcode == 1) {
         lspmac_dpascii_off--;
+      } else if( lspmac_query_cmd[0] != 0 && strcmp( lspmac_ascii_buffers.command_str, lspmac_query_cmd) == 0) {
+        lspmac_query_state = -1;
+        pthread_cond_signal( &lspmac_query_cond);
       }
     } else {
       //
@@ -2084,6 +2252,16 @@ void lspmac_get_ascii_cb( pmac_cmd_queue_t *cmd, int nreceived, char *buff) {
         else
           lslogging_log_message( "lspmac_get_ascii_cb: '%s'   responded", lspmac_ascii_buffers.command_str);
 
+        //
+        // Someone may be waiting for this answer
+        //
+        if( lspmac_query_cmd[0] != 0 && lspmac_query_state == 0 && strcmp( lspmac_ascii_buffers.command_str, lspmac_query_cmd) == 0) {
+          strncpy( lspmac_query_response, lspmac_ascii_buffers.response_str, sizeof( lspmac_query_response) - 1);
+          lspmac_query_response[sizeof( lspmac_query_response) - 1] = 0;
+          lspmac_query_state = 1;
+          pthread_cond_signal( &lspmac_query_cond);
+        }
+
         //
         // 5.  "If Bits 0 – 7 of the Host-Input Control Word had
         // contained the value $0D (13 decimal, “CR”), this was not the
@@ -2158,6 +2336,57 @@ void lspmac_SockSendDPline( char *event, char *fmt, ...) {
   pthread_mutex_unlock( &lspmac_ascii_mutex);
 }
 
+/** Ask the pmac for the value of a variable
+ *  The answer comes back through the dpram ascii interface so this
+ *  must not be called from the pmac worker thread.
+ *
+ *  \returns 0 on success, 1 on timeout or when the pmac refused the query
+ */
+int lspmac_get_variable(
+			char *var,		/**< [in]  Variable name, ie "P179"    */
+			double timeout_secs,	/**< [in]  Give up after this long     */
+			double *value		/**< [out] The variable's value        */
+			) {
+  static const char *id = FILEID "lspmac_get_variable";
+  struct timespec timeout;
+  double isecs, fsecs;
+  int err;
+
+  pthread_mutex_lock( &lspmac_query_mutex);
+
+  pthread_mutex_lock( &lspmac_ascii_mutex);
+  snprintf( lspmac_query_cmd, sizeof( lspmac_query_cmd), "%s", var);
+  lspmac_query_response[0] = 0;
+  lspmac_query_state       = 0;
+  pthread_mutex_unlock( &lspmac_ascii_mutex);
+
+  lspmac_SockSendDPline( NULL, "%s", lspmac_query_cmd);
+
+  clock_gettime( CLOCK_REALTIME, &timeout);
+  fsecs = modf( timeout_secs, &isecs);
+  timeout.tv_sec  += (long)floor( isecs);
+  timeout.tv_nsec += (long)floor( fsecs * 1.e9);
+  timeout.tv_sec  += timeout.tv_nsec / 1000000000;
+  timeout.tv_nsec %= 1000000000;
+
+  err = 0;
+  pthread_mutex_lock( &lspmac_ascii_mutex);
+  while( err == 0 && lspmac_query_state == 0)
+    err = pthread_cond_timedwait( &lspmac_query_cond, &lspmac_ascii_mutex, &timeout);
+
+  if( lspmac_query_state != 1 || sscanf( lspmac_query_response, "%lf", value) != 1) {
+    lslogging_log_message( "%s: no good answer for %s: '%s'", id, var, lspmac_query_response);
+    err = 1;
+  } else {
+    err = 0;
+  }
+  lspmac_query_cmd[0] = 0;
+  pthread_mutex_unlock( &lspmac_ascii_mutex);
+
+  pthread_mutex_unlock( &lspmac_query_mutex);
+  return err;
+}
+
 void lspmac_request_control_response_cb( char *event) {
   static char s[32];
   int i;
@@ -2451,6 +2680,11 @@ void* lspmac_worker(void *unused) {
   static int old_state = LS_PMAC_STATE_DETACHED;
   int pollrtn = 0;
 
+  //
+  // The status callback runs here: it must not wait for room on the event queue
+  //
+  lsevents_never_wait();
+
   old_state = ls_pmac_state;
   while( lspmac_running) {
     lspmac_next_state();
@@ -2521,44 +2755,44 @@ int lspmac_movedac_queue(
     //
     // fake the move
     //
-    mp->not_done     = 1;
-    mp->motion_seen  = 0;
+    mp->hot->not_done     = 1;
+    mp->hot->motion_seen  = 0;
     mp->command_sent = 1;
 
     // fake the read: This allows everyone to read the newly set
     // position before the pmac state is read
 
-    mp->actual_pos_cnts = mp->requested_pos_cnts;
+    mp->hot->actual_pos_cnts = mp->requested_pos_cnts;
     if( mp->nlut >0 && mp->lut != NULL) {
       if( u2c == 0.0)
 	u2c = 1.0;
-      mp->position = lspmac_rlut( mp->nlut, mp->lut, mp->actual_pos_cnts/u2c);
+      mp->hot->position = lspmac_rlut( mp->nlut, mp->lut, mp->hot->actual_pos_cnts/u2c);
     } else {
       if (u2c != 0.0) {
-	mp->position = mp->actual_pos_cnts / u2c;
+	mp->hot->position = mp->hot->actual_pos_cnts / u2c;
       } else {
-	mp->position = mp->actual_pos_cnts;
+	mp->hot->position = mp->hot->actual_pos_cnts;
       }
     }
 
-    fmt = lsredis_getstr(mp->redis_fmt);
-    lsredis_setstr( mp->redis_position, fmt, mp->position);
-    free(fmt);
-    mp->reported_position = mp->position;
+    fmt = lsredis_borrow( mp->redis_fmt);
+    lsredis_setstr( mp->redis_position, fmt, mp->hot->position);
+    lsredis_release( fmt);
+    mp->hot->reported_position = mp->hot->position;
 
     pthread_mutex_unlock( &mp->mutex);
 
-    lsevents_send_event( "%s Moving", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
     lspmac_SockSendDPline( mp->name, "%s=%d", mp->dac_mvar, mp->requested_pos_cnts);
 
     pthread_mutex_lock( &mp->mutex);
 
-    mp->not_done     = 0;
-    mp->motion_seen  = 1;
+    mp->hot->not_done     = 0;
+    mp->hot->motion_seen  = 1;
     mp->command_sent = 1;
     pthread_cond_signal(  &mp->cond);
     pthread_mutex_unlock( &(mp->mutex));
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_in_position);
   }
 
   pthread_mutex_unlock( &(mp->mutex));
@@ -2586,31 +2820,31 @@ int lspmac_movezoom_queue(
   if( mp->nlut > 0 && mp->lut != NULL) {
     mp->requested_pos_cnts = lspmac_lut( mp->nlut, mp->lut, requested_position);
 
-    if( abs( mp->requested_pos_cnts - mp->actual_pos_cnts) * 16 <= in_position_band) {
+    if( abs( mp->requested_pos_cnts - mp->hot->actual_pos_cnts) * 16 <= in_position_band) {
       lslogging_log_message( "lspmac_movezoom_queue: Faking move");
       //
       // fake the move
       //
-      mp->not_done     = 1;
-      mp->motion_seen  = 0;
+      mp->hot->not_done     = 1;
+      mp->hot->motion_seen  = 0;
       mp->command_sent = 1;
       pthread_mutex_unlock( &(mp->mutex));
-      lsevents_send_event( "%s Moving", mp->name);
+      lsevents_send_event_id( mp->ev_moving);
 
       //
       // Perhaps give someone else a chance to process the move
       //
       pthread_mutex_lock( &(mp->mutex));
-      mp->not_done     = 0;
-      mp->motion_seen  = 1;
+      mp->hot->not_done     = 0;
+      mp->hot->motion_seen  = 1;
       mp->command_sent = 1;
       pthread_mutex_unlock( &(mp->mutex));
-      lsevents_send_event( "%s In Position", mp->name);
+      lsevents_send_event_id( mp->ev_in_position);
       return 0;
     }
 
-    mp->not_done     = 1;
-    mp->motion_seen  = 0;
+    mp->hot->not_done     = 1;
+    mp->hot->motion_seen  = 0;
     mp->command_sent = 0;
 
     lspmac_SockSendDPline( mp->name, "#%d j=%d", motor_num, mp->requested_pos_cnts);
@@ -2674,8 +2908,8 @@ int lspmac_moveabs_fshut_queue(
   pthread_mutex_lock( &(mp->mutex));
 
   mp->requested_position = requested_position;
-  mp->not_done    = 1;
-  mp->motion_seen = 0;
+  mp->hot->not_done    = 1;
+  mp->hot->motion_seen = 0;
   mp->requested_pos_cnts = requested_position;
   if( requested_position != 0) {
     //
@@ -2705,22 +2939,22 @@ int lspmac_moveabs_bo_queue(
   mp->requested_position = requested_position == 0.0 ? 0.0 : 1.0;
   mp->requested_pos_cnts = requested_position == 0.0 ? 0 : 1;
 
-  if( mp->requested_position == mp->position) {
+  if( mp->requested_position == mp->hot->position) {
     //
     // No real move requested
     //
-    mp->not_done     = 0;
-    mp->motion_seen  = 1;
+    mp->hot->not_done     = 0;
+    mp->hot->motion_seen  = 1;
     mp->command_sent = 1;
-    lsevents_send_event( "%s Moving", mp->name);
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
+    lsevents_send_event_id( mp->ev_in_position);
 
   } else {
     //
     // Go ahead and send the request
     //
-    mp->not_done     = 1;
-    mp->motion_seen  = 0;
+    mp->hot->not_done     = 1;
+    mp->hot->motion_seen  = 0;
     mp->command_sent = 0;
     lspmac_SockSendDPline( mp->name, mp->write_fmt, mp->requested_pos_cnts);
   }
@@ -2773,8 +3007,8 @@ void lspmac_moveabs_timed_queue(
     return;
   }
 
-  mp->not_done    = 1;          //!< Flags needed for wait routine
-  mp->motion_seen = 0;
+  mp->hot->not_done    = 1;          //!< Flags needed for wait routine
+  mp->hot->motion_seen = 0;
 
   mp->requested_position = start + delta;
   mp->requested_pos_cnts = u2c * (mp->requested_position + neutral_pos);
@@ -2794,36 +3028,36 @@ void lspmac_moveabs_timed_queue(
  */
 int lspmac_moveabs_frontlight_oo_queue( lspmac_motor_t *mp, double pos) {
   pthread_mutex_lock( &(mp->mutex));
-  *mp->actual_pos_cnts_p = pos;
-  mp->position           = pos;
-  mp->not_done           = 1;
-  mp->motion_seen        = 0;
+  *mp->hot->actual_pos_cnts_p = pos;
+  mp->hot->position           = pos;
+  mp->hot->not_done           = 1;
+  mp->hot->motion_seen        = 0;
   mp->command_sent       = 1;
   pthread_mutex_unlock( &(mp->mutex));
 
-  lsevents_send_event( "%s Moving", mp->name);
+  lsevents_send_event_id( mp->ev_moving);
   if( pos == 0.0) {
     flight->moveAbs( flight, 0.0);
   } else {
     flight->moveAbs( flight, lspmac_getPosition( zoom));
   }
   pthread_mutex_lock( &mp->mutex);
-  mp->not_done     = 0;
-  mp->motion_seen  = 1;
+  mp->hot->not_done     = 0;
+  mp->hot->motion_seen  = 1;
   mp->command_sent = 1;
   pthread_cond_signal(  &mp->cond);
   pthread_mutex_unlock( &mp->mutex);
-  lsevents_send_event( "%s In Position", mp->name);
+  lsevents_send_event_id( mp->ev_in_position);
   return 0;
 }
 
 int lspmac_moveabs_flight_factor_queue( lspmac_motor_t *mp, double pos) {
   if( pos >= 50 && pos <= 150) {
     pthread_mutex_lock( &mp->mutex);
-    *mp->actual_pos_cnts_p = pos;
-    mp->position           = pos;
-    mp->not_done           = 1;
-    mp->motion_seen        = 0;
+    *mp->hot->actual_pos_cnts_p = pos;
+    mp->hot->position           = pos;
+    mp->hot->not_done           = 1;
+    mp->hot->motion_seen        = 0;
     mp->command_sent       = 1;
     pthread_mutex_unlock( &mp->mutex);
 
@@ -2832,15 +3066,15 @@ int lspmac_moveabs_flight_factor_queue( lspmac_motor_t *mp, double pos) {
     pthread_mutex_unlock( &flight->mutex);
 
     flight->moveAbs( flight, lspmac_getPosition( zoom));
-    lsevents_send_event( "%s Moving", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
 
     pthread_mutex_lock( &mp->mutex);
-    mp->not_done     = 0;
-    mp->motion_seen  = 1;
+    mp->hot->not_done     = 0;
+    mp->hot->motion_seen  = 1;
     mp->command_sent = 1;
     pthread_cond_signal(  &mp->cond);
     pthread_mutex_unlock( &mp->mutex);
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_in_position);
 
     return 0;
   }
@@ -2850,10 +3084,10 @@ int lspmac_moveabs_flight_factor_queue( lspmac_motor_t *mp, double pos) {
 int lspmac_moveabs_blight_factor_queue( lspmac_motor_t *mp, double pos) {
   if( pos >= 50 && pos <= 150) {
     pthread_mutex_lock( &mp->mutex);
-    *mp->actual_pos_cnts_p = pos;
-    mp->position           = pos;
-    mp->not_done           = 1;
-    mp->motion_seen        = 0;
+    *mp->hot->actual_pos_cnts_p = pos;
+    mp->hot->position           = pos;
+    mp->hot->not_done           = 1;
+    mp->hot->motion_seen        = 0;
     mp->command_sent       = 1;
     pthread_mutex_unlock( &mp->mutex);
 
@@ -2862,15 +3096,15 @@ int lspmac_moveabs_blight_factor_queue( lspmac_motor_t *mp, double pos) {
     pthread_mutex_unlock( &blight->mutex);
 
     blight->moveAbs( blight, lspmac_getPosition( zoom));
-    lsevents_send_event( "%s Moving", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
 
     pthread_mutex_lock( &mp->mutex);
-    mp->not_done     = 0;
-    mp->motion_seen  = 1;
+    mp->hot->not_done     = 0;
+    mp->hot->motion_seen  = 1;
     mp->command_sent = 1;
     pthread_cond_signal(  &mp->cond);
     pthread_mutex_unlock( &(mp->mutex));
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_in_position);
   }
 
   return 0;
@@ -2892,13 +3126,13 @@ void lspmac_flight_factor_read( lspmac_motor_t *mp) {
   // flight_factor u2c should always be 1.  Add code here if this is
   // no longer the case
   //
-  mp->position        = pos;
-  mp->actual_pos_cnts = pos;
-  if (fabs(mp->reported_position - mp->position) >= lsredis_getd(mp->update_resolution)) {
-    fmt = lsredis_getstr(mp->redis_fmt);
-    lsredis_setstr( mp->redis_position, fmt, mp->position);
-    free(fmt);
-    mp->reported_position = mp->position;
+  mp->hot->position        = pos;
+  mp->hot->actual_pos_cnts = pos;
+  if (fabs(mp->hot->reported_position - mp->hot->position) >= lsredis_getd(mp->update_resolution)) {
+    fmt = lsredis_borrow( mp->redis_fmt);
+    lsredis_setstr( mp->redis_position, fmt, mp->hot->position);
+    lsredis_release( fmt);
+    mp->hot->reported_position = mp->hot->position;
   }
 
   pthread_mutex_unlock( &mp->mutex);
@@ -2920,13 +3154,13 @@ void lspmac_blight_factor_read( lspmac_motor_t *mp) {
   // blight_factor u2c should always be 1.  Add code here if this is
   // no longer the case
   //
-  mp->position        = pos;
-  mp->actual_pos_cnts = pos;
-  if (fabs(mp->reported_position - mp->position) >= lsredis_getd(mp->update_resolution)) {
-    fmt = lsredis_getstr(mp->redis_fmt);
-    lsredis_setstr( mp->redis_position, fmt, mp->position);
-    free(fmt);
-    mp->reported_position = mp->position;
+  mp->hot->position        = pos;
+  mp->hot->actual_pos_cnts = pos;
+  if (fabs(mp->hot->reported_position - mp->hot->position) >= lsredis_getd(mp->update_resolution)) {
+    fmt = lsredis_borrow( mp->redis_fmt);
+    lsredis_setstr( mp->redis_position, fmt, mp->hot->position);
+    lsredis_release( fmt);
+    mp->hot->reported_position = mp->hot->position;
   }
 
   pthread_mutex_unlock( &mp->mutex);
@@ -3531,30 +3765,30 @@ int lspmac_move_or_jog_abs_queue(
     }
     requested_pos_cnts = mp->requested_pos_cnts;
 
-    mp->not_done     = 1;
-    mp->motion_seen  = 0;
+    mp->hot->not_done     = 1;
+    mp->hot->motion_seen  = 0;
     mp->command_sent = 0;
 
-    lsevents_send_event( "%s Moving", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
 
-    mp->not_done     = 0;
-    mp->motion_seen  = 1;
+    mp->hot->not_done     = 0;
+    mp->hot->motion_seen  = 1;
     mp->command_sent = 1;
 
-    mp->position = requested_position;
-    mp->actual_pos_cnts = requested_pos_cnts;
+    mp->hot->position = requested_position;
+    mp->hot->actual_pos_cnts = requested_pos_cnts;
 
     pthread_mutex_unlock( &(mp->mutex));
 
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_in_position);
     return 0;
 
   }
 
-  if( (neg_limit_hit && (requested_position < mp->position)) || (pos_limit_hit && (requested_position > mp->position))) {
+  if( (neg_limit_hit && (requested_position < mp->hot->position)) || (pos_limit_hit && (requested_position > mp->hot->position))) {
     pthread_mutex_unlock( &(mp->mutex));
     lslogging_log_message( "lspmac_move_or_jog_abs_queue: %s Moving wrong way on limit: requested position=%f  current position=%f  low limit=%d high limit=%d",
-                           mp->name, requested_position, mp->position, neg_limit_hit, pos_limit_hit);
+                           mp->name, requested_position, mp->hot->position, neg_limit_hit, pos_limit_hit);
     lsevents_send_event( "%s Move Aborted", mp->name);
     return 2;
   }
@@ -3570,28 +3804,28 @@ int lspmac_move_or_jog_abs_queue(
   //
   // Bluff if we are already there
   //
-  if( (abs( requested_pos_cnts - mp->actual_pos_cnts) * 16 < in_position_band)) {
+  if( (abs( requested_pos_cnts - mp->hot->actual_pos_cnts) * 16 < in_position_band)) {
     //
     // Lie and say we moved even though we didn't.  Who will know? We are within the deadband or not active.
     //
-    mp->not_done     = 1;
-    mp->motion_seen  = 0;
+    mp->hot->not_done     = 1;
+    mp->hot->motion_seen  = 0;
     mp->command_sent = 0;
 
-    lsevents_send_event( "%s Moving", mp->name);
+    lsevents_send_event_id( mp->ev_moving);
 
-    mp->not_done     = 0;
-    mp->motion_seen  = 1;
+    mp->hot->not_done     = 0;
+    mp->hot->motion_seen  = 1;
     mp->command_sent = 1;
 
     pthread_mutex_unlock( &(mp->mutex));
 
-    lsevents_send_event( "%s In Position", mp->name);
+    lsevents_send_event_id( mp->ev_in_position);
     return 0;
   }
 
-  mp->not_done     = 1;
-  mp->motion_seen  = 0;
+  mp->hot->not_done     = 1;
+  mp->hot->motion_seen  = 0;
   mp->command_sent = 0;
 
   if( use_jog || axis == NULL || *axis == 0) {
@@ -3799,7 +4033,7 @@ int lspmac_moveabs_wait( lspmac_motor_t *mp, double timeout_secs) {
 
   err = 0;
   pthread_mutex_lock( &(mp->mutex));
-  while( err == 0 && mp->motion_seen == 0)
+  while( err == 0 && mp->hot->motion_seen == 0)
     err = pthread_cond_timedwait( &(mp->cond), &(mp->mutex), &timeout);
 
   if( err != 0) {
@@ -3807,7 +4041,7 @@ int lspmac_moveabs_wait( lspmac_motor_t *mp, double timeout_secs) {
       lslogging_log_message( "lspmac_moveabs_wait: unexpected error from timedwait: %d  tv_sec %ld   tv_nsec %ld", err, timeout.tv_sec, timeout.tv_nsec);
     }
     pthread_mutex_unlock( &(mp->mutex));
-    lslogging_log_message( "lspmac_moveabs_wait: timed out waiting for motion to be seen. Motor %s  motion_seen %d   not_done  %d", mp->name, mp->motion_seen, mp->not_done);
+    lslogging_log_message( "lspmac_moveabs_wait: timed out waiting for motion to be seen. Motor %s  motion_seen %d   not_done  %d", mp->name, mp->hot->motion_seen, mp->hot->not_done);
     return 1;
   }
 
@@ -3815,7 +4049,7 @@ int lspmac_moveabs_wait( lspmac_motor_t *mp, double timeout_secs) {
   // wait for the motion that we know has started to finish
   //
   err = 0;
-  while( err == 0 && mp->not_done)
+  while( err == 0 && mp->hot->not_done)
     err = pthread_cond_timedwait( &(mp->cond), &(mp->mutex), &timeout);
 
   if( err != 0) {
@@ -3846,6 +4080,10 @@ void _lspmac_motor_init( lspmac_motor_t *d, char *name) {
 
   lspmac_nmotors++;
 
+  d->hot = &(lspmac_motor_hot[d - lspmac_motors]);
+  memset( d->hot, 0, sizeof( *d->hot));
+  d->hot->mp          = d;
+
   pthread_mutex_init( &(d->mutex), &mutex_initializer);
   pthread_cond_init(  &(d->cond), NULL);
 
@@ -3876,22 +4114,29 @@ void _lspmac_motor_init( lspmac_motor_t *d, char *name) {
   d->u2c                 = lsredis_get_obj( "%s.u2c",               d->name);
   d->unit                = lsredis_get_obj( "%s.unit",              d->name);
   d->update_resolution   = lsredis_get_obj( "%s.update_resolution", d->name);
+  d->presets_length      = lsredis_get_obj( "%s.presets.length",   d->name);
+  lsredis_family_init( &d->preset_names,     "%s.presets.%%d.name",     d->name);
+  lsredis_family_init( &d->preset_positions, "%s.presets.%%d.position", d->name);
   d->lut                 = NULL;
   d->nlut                = 0;
   d->homing              = 0;
   d->dac_mvar            = NULL;
-  d->actual_pos_cnts_p   = NULL;
-  d->status1_p           = NULL;
-  d->status2_p           = NULL;
+  d->hot->actual_pos_cnts_p   = NULL;
+  d->hot->status1_p           = NULL;
+  d->hot->status2_p           = NULL;
   d->win                 = NULL;
   d->read                = NULL;
-  d->reported_position   = INFINITY;
+  d->hot->reported_position   = INFINITY;
   d->reported_pg_position= INFINITY;
 
+  d->ev_moving           = lsevents_intern( "%s Moving",      d->name);
+  d->ev_in_position      = lsevents_intern( "%s In Position", d->name);
+  d->ev_homed            = lsevents_intern( "%s Homed",       d->name);
+
   lsevents_preregister_event( "%s queued", d->name);
   lsevents_preregister_event( "%s command accepted", d->name);
 
-  lsredis_load_presets( d->name);
+  lsredis_load_presets( d);
 }
 
 /** Initialize a pmac stepper or servo motor
@@ -3914,9 +4159,9 @@ lspmac_motor_t *lspmac_motor_init(
   d->moveAbs             = moveAbs;
   d->jogAbs              = jogAbs;
   d->read                = lspmac_pmacmotor_read;
-  d->actual_pos_cnts_p   = posp;
-  d->status1_p           = stat1p;
-  d->status2_p           = stat2p;
+  d->hot->actual_pos_cnts_p   = posp;
+  d->hot->status1_p           = stat1p;
+  d->hot->status2_p           = stat2p;
 
   d->win = newwin( LS_DISPLAY_WINDOW_HEIGHT, LS_DISPLAY_WINDOW_WIDTH, wy*LS_DISPLAY_WINDOW_HEIGHT, wx*LS_DISPLAY_WINDOW_WIDTH);
 
@@ -3927,9 +4172,6 @@ lspmac_motor_t *lspmac_motor_init(
   pthread_mutex_unlock( &ncurses_mutex);
 
   lsevents_preregister_event( "%s Homing",       d->name);
-  lsevents_preregister_event( "%s Homed",        d->name);
-  lsevents_preregister_event( "%s Moving",       d->name);
-  lsevents_preregister_event( "%s In Position",  d->name);
   lsevents_preregister_event( "%s Move Aborted", d->name);
 
   return d;
@@ -3995,7 +4237,7 @@ lspmac_motor_t *lspmac_dac_init(
   d->moveAbs           = moveAbs;
   d->jogAbs            = moveAbs;
   d->read              = lspmac_dac_read;
-  d->actual_pos_cnts_p = posp;
+  d->hot->actual_pos_cnts_p = posp;
   d->dac_mvar          = strdup(mvar);
 
   return d;
@@ -4020,12 +4262,61 @@ lspmac_motor_t *lspmac_soft_motor_init(lspmac_motor_t *d, char *name,
   d->moveAbs      = moveAbs;
   d->jogAbs       = moveAbs;
   d->read         = reader;
-  d->actual_pos_cnts_p = calloc( sizeof(int), 1);
-  *d->actual_pos_cnts_p = 0;
+  d->hot->actual_pos_cnts_p = calloc( sizeof(int), 1);
+  *d->hot->actual_pos_cnts_p = 0;
 
   return d;
 }
 
+/** Add a binary input to the group for its status word, creating the group if needed
+ */
+void lspmac_bi_group_add(
+			 lspmac_bi_t *d		/**< [in] The binary input to add */
+			 ) {
+  static const char *id = FILEID "lspmac_bi_group_add";
+  lspmac_bi_group_t *gp;
+  lspmac_bi_link_t *lp;
+  unsigned int m;
+  int i;
+
+  gp = NULL;
+  for( i=0; i<lspmac_nbi_groups; i++) {
+    if( lspmac_bi_groups[i].ptr == d->ptr) {
+      gp = &(lspmac_bi_groups[i]);
+      break;
+    }
+  }
+
+  if( gp == NULL) {
+    if( lspmac_nbi_groups >= sizeof( lspmac_bi_groups)/sizeof( lspmac_bi_groups[0])) {
+      lslogging_log_message( "%s: too many binary input groups, cannot add %s", id, d->name);
+      exit( -1);
+    }
+    gp = &(lspmac_bi_groups[lspmac_nbi_groups++]);
+    memset( gp, 0, sizeof( *gp));
+    gp->ptr        = d->ptr;
+    gp->first_time = 1;
+  }
+
+  gp->mask |= d->mask;
+
+  //
+  // Inputs may share bits: each bit keeps a list of everyone using it
+  //
+  for( i=0, m=1; i<32; i++, m <<= 1) {
+    if( d->mask & m) {
+      lp = calloc( 1, sizeof( *lp));
+      if( lp == NULL) {
+	lslogging_log_message( "%s: out of memory", id);
+	exit( -1);
+      }
+      lp->bp      = d;
+      lp->next    = gp->bits[i];
+      gp->bits[i] = lp;
+    }
+  }
+}
+
 /** Initialize binary input
  */
 lspmac_bi_t *lspmac_bi_init(lspmac_bi_t *d, char *name, int *ptr, int mask,
@@ -4050,11 +4341,16 @@ lspmac_bi_t *lspmac_bi_init(lspmac_bi_t *d, char *name, int *ptr, int mask,
   d->first_time     = 1;
   d->status_str     = lsredis_get_obj( "%s.status_str", d->name);
 
-  if( d->changeEventOn != NULL)
-    lsevents_preregister_event( "%s", d->changeEventOn);
+  lspmac_bi_group_add( d);
+
+  d->changeEventOn_id  = -1;
+  d->changeEventOff_id = -1;
+
+  if( d->changeEventOn != NULL && d->changeEventOn[0] != 0)
+    d->changeEventOn_id = lsevents_intern( "%s", d->changeEventOn);
 
-  if( d->changeEventOff != NULL)
-    lsevents_preregister_event( "%s", d->changeEventOff);
+  if( d->changeEventOff != NULL && d->changeEventOff[0] != 0)
+    d->changeEventOff_id = lsevents_intern( "%s", d->changeEventOff);
 
   return d;
 }
@@ -4214,6 +4510,8 @@ void lspmac_init(
     pthread_cond_init(  &lspmac_moving_cond, NULL);
 
     pthread_mutex_init( &lspmac_ascii_mutex, &mutex_initializer);
+    pthread_mutex_init( &lspmac_query_mutex, &mutex_initializer);
+    pthread_cond_init(  &lspmac_query_cond, NULL);
 
     pthread_mutex_init( &lspmac_ascii_buffers_mutex, &mutex_initializer);
 
@@ -4226,7 +4524,7 @@ void lspmac_init(
     lsevents_preregister_event( "Reset command accepted");
 
     for( i=1; i<=16; i++) {
-      lsevents_preregister_event( "Coordsys %d Stopped", i);
+      lspmac_coordsys_stopped_ev[i] = lsevents_intern( "Coordsys %d Stopped", i);
     }
     first_time = 0;
   }
@@ -4261,7 +4559,7 @@ void lspmac_cryoSwitchChanged_cb( char *event) {
   int pos;
 
   pthread_mutex_lock( &(cryo->mutex));
-  pos = cryo->position;
+  pos = cryo->hot->position;
   pthread_mutex_unlock( &(cryo->mutex));
 
   if( first_time) {
@@ -4281,7 +4579,7 @@ void lspmac_scint_maybe_turn_on_dryer_cb( char *event) {
   int err;
 
   pthread_mutex_lock( &(scint->mutex));
-  pos = scint->position;
+  pos = scint->hot->position;
   pthread_mutex_unlock( &(scint->mutex));
 
   if( pos > 20.0) {
@@ -4559,7 +4857,7 @@ void lspmac_scint_maybe_return_sample_cb( char *event) {
       break;
     }
     pthread_mutex_lock( &astage[i]->mutex);
-    not_done = astage[i]->not_done;
+    not_done = astage[i]->hot->not_done;
     pthread_mutex_unlock( &astage[i]->mutex);
 
     // When we go from beamlocation back to centering then md2cmds
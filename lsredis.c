@@ -31,13 +31,45 @@
  * (this last value is used to support the now deprecated px.kvs table in the LS-CAT postgresql server).
  * We assume that all publishers that we are listening to ONLY publish key names that have changed.
  *
+ * At startup we walk the keys with SCAN and fetch their values in batches, a single EVAL per
+ * SCAN reply, so that requests for individual objects (from motor initialization, say) are not
+ * stuck behind the entire key space.  There is one SCAN for each top level alternative of the RE
+ * in our configuration, matching the literal text the alternative starts with (anywhere in the key
+ * unless the alternative is anchored with ^), so "redis\.kvseq|stns\.2\.(.+)" walks the keys
+ * with MATCH *redis.kvseq* and MATCH *stns.2.*.  An alternative that does not start with literal
+ * text means a SCAN of every key.
+ *
  * When someone else changes a value we invalidate our internal copy and issue a "HGET key VALUE" command.  Other threads
  * that request the value of our lsredis_obj_t will pause until the new value has been received and processed.
  *
+ * A publisher may also send the value, saving that round trip, on a channel of its own:
+<pre>
+    PUBLISH VALUES.publisher {"key": "stns.2.omega.position", "value": "12.345", "ts": 1700000000.123456}
+    PUBLISH publisher stns.2.omega.position
+</pre>
+ * where ts (optional) is when the value was written, in seconds since the epoch.  The publisher channel still
+ * carries just the key so subscribers that don't know about VALUES.* are unaffected.  The value must be published
+ * before the key: we take the value as it comes and then skip the fetch that publisher's key would otherwise cause.
+ * Setting PUSH to 1 in our configuration hash makes us publish our own changes this way too.  The time from a
+ * publisher's write to the value being visible here (and, for key-only publications, the time our HGET took)
+ * is reported once a minute and by lsredis_sync_stats.
+ *
+ * Each object carries a generation number that goes up with every pushed value, local write and fetch we ask for.
+ * A fetch reply is only used if no newer push or fetch has happened since it was requested, so a slow HGET
+ * can't overwrite a value pushed after it was sent.
+ *
  * When a value changes locally this module changes it in redis as shown above.  At this point we refuse
  * other publishers attempt to change the value until we've seen all of our PUBLISH messages.  That is, we ignore
  * changes that in redis happened before our change.
  *
+ * Writes made between lsredis_batch_begin() and lsredis_batch_end() on the same thread (a status frame,
+ * for example) are held and sent as one MULTI with an HSET and PUBLISH per changed key.
+ *
+ * The server is found at LS_REDIS_HOSTNAME and LS_REDIS_PORT (default 127.0.0.1:6379).  When a connection
+ * drops we try again with an exponential backoff.  Local writes made while the write connection is down
+ * are queued.  Once all three connections are back we re-issue the PSUBSCRIBE, refetch every object in
+ * batches and replay the queued writes.
+ *
  * You'll need an lsredis_obj_t to do anything with redis in the pgpmac project:
  * <pre>
  * lsredis_obj_t *lsredis_get_obj( char *fmt, ...)  where fmt is a printf style formatting string to interpret the rest of the arguments (if any)
@@ -50,11 +82,15 @@
  *  void lsredis_setstr( lsredis_obj_t *p, char *fmt, ...)  where fmt is a printf style formatting string to interpret the rest of the arguments (if any)
  * </pre>
  *
- * When a new value is seen we immediately parse it and make it available through the following functions:
+ * When a new value is seen we keep the string.  The first time it is asked for as some other type it is parsed
+ * and the result is kept until the value changes again.  The value is available through the following functions:
  * <pre>
  *
  *   char    *lsredis_getstr( lsredis_obj_t *p)            Returns a copy of the VALUE field.  Use "free" on the retured value when done using it.
  *
+ *   char    *lsredis_borrow( lsredis_obj_t *p)            Returns the VALUE field itself, without copying.  Do not change it.  It stays good,
+ *                                                whatever happens to the object, until you give it back with lsredis_release.
+ *
  *   double   lsredis_getd( lsredis_obj_t *p)              Returns a double.  If the value was not a number it returns 0.
  *
  *   long int lsredis_getl( lsredis_obj_t *p)              Returns a long int.  If the value was not a number it returns 0.
@@ -77,38 +113,284 @@ int lsredis_running = 0;
 static pthread_mutexattr_t mutex_initializer;
 
 
-static lsredis_obj_t *lsredis_objs = NULL;
-static struct hsearch_data lsredis_htab;
+static lsredis_map_t lsredis_objs;		//!< all our objects, by full redis key
 
 static redisAsyncContext *subac;
 static redisAsyncContext *roac;
 static redisAsyncContext *wrac;
 
+static char *lsredis_host = "127.0.0.1";	//!< our redis server, LS_REDIS_HOSTNAME overrides
+static int   lsredis_port = 6379;		//!< our redis server's port, LS_REDIS_PORT overrides
+static char *lsredis_config_host = NULL;	//!< lower case host name whose config hash we read
+
+//! The publishers whose messages we follow
+#define LSREDIS_PSUBSCRIBE "PSUBSCRIBE REDIS_PV_CONNECTOR REDIS_PG_CONNECTOR REDIS_NODE_CONNECTOR mk_pgpmac_redis UI* MD2-* DETECTOR-21-ID-* VALUES.*"
+
+//! Publishers send values (as opposed to keys) on this prefix followed by their name
+#define LSREDIS_VALUES_PREFIX "VALUES."
+
+#define LSREDIS_BACKOFF_MIN_MS   100	//!< first wait before reconnecting
+#define LSREDIS_BACKOFF_MAX_MS 30000	//!< longest wait before reconnecting
+
+static int lsredis_push_values = 0;		//!< 1 to send values along with our publications (PUSH in our configuration)
+
+static unsigned long int lsredis_n_pushed = 0;	//!< values that arrived with their publication and carried a write time
+static double lsredis_push_sum_secs = 0.0;	//!< total time from their write to their arrival
+static double lsredis_push_max_secs = 0.0;	//!< longest time from a write to its arrival
+static unsigned long int lsredis_n_fetched = 0;	//!< values we had to fetch after a publication
+static double lsredis_fetch_sum_secs = 0.0;	//!< total time from publication to the fetched value arriving
+static double lsredis_fetch_max_secs = 0.0;	//!< longest time from publication to fetched value
+
 static char *lsredis_publisher = NULL;
 static regex_t lsredis_key_select_regex;
 static char *lsredis_head = NULL;
+static char *lsredis_key_select = NULL;		//!< the RE lsredis_key_select_regex was compiled from
 static pthread_mutex_t lsredis_config_mutex;
 static pthread_cond_t  lsredis_config_cond;
 
+#define LSREDIS_SCAN_COUNT 1000	//!< keys to ask for in each SCAN
+
+static struct timespec lsredis_load_start;	//!< when we started the startup SCAN
+static int lsredis_load_batches = 0;		//!< SCAN replies processed so far
+static int lsredis_load_keys    = 0;		//!< keys the SCAN returned so far
+static int lsredis_load_objs    = 0;		//!< new objects the SCAN created so far
+static int lsredis_load_pending = 0;		//!< batches whose values have not come back yet
+static int lsredis_load_scans   = 0;		//!< SCANs whose cursors have not come back to 0
+static int lsredis_load_scanned = 0;		//!< 1 once every SCAN cursor has come back to 0
+static int lsredis_load_lost    = 0;		//!< 1 if a SCAN failed or the connection dropped before it finished
+
+static int lsredis_resync_needed  = 0;		//!< a connection has failed since we last resynchronized
+static int lsredis_resync_pending = 0;		//!< resync batches whose values have not come back yet
+static int lsredis_resync_objs    = 0;		//!< objects being refetched by the current resync
+static int lsredis_resync_writes  = 0;		//!< queued writes replayed by the current resync
+static struct timespec lsredis_resync_start;	//!< when the current resync started
+
+static int lsredis_n_reconnects       = 0;	//!< connections that have come back after failing
+static int lsredis_n_resyncs          = 0;	//!< completed resyncs
+static double lsredis_resync_last_secs = 0.0;	//!< how long the last resync took
+static double lsredis_resync_max_secs  = 0.0;	//!< how long the longest resync took
+
+static void lsredis_resync_done();
+void lsredis_reconnect_cb( char *event, struct timespec *due, unsigned long int overruns);
+
+static lsredis_obj_t **lsredis_unsent = NULL;	//!< objects written while the write connection was down
+static int lsredis_unsent_n    = 0;		//!< number of objects in lsredis_unsent
+static int lsredis_unsent_size = 0;		//!< allocated length of lsredis_unsent
+
+/** A batch of objects whose values we've asked for with one command
+ */
+typedef struct lsredis_batch_struct {
+  int resync;					//!< 1 if part of a resync, 0 if part of the startup load
+  int n;					//!< number of objects
+  int next;					//!< falling back to HGET: the object the next reply is for
+  unsigned int *gen;				//!< each object's generation when we asked for it
+  lsredis_obj_t *p[];				//!< the objects, in the order they were requested
+} lsredis_batch_t;
+
+/** A single HGET in flight
+ */
+typedef struct lsredis_fetch_struct {
+  lsredis_obj_t *p;				//!< the object we asked for
+  unsigned int gen;				//!< its generation when we asked
+} lsredis_fetch_t;
+
+#define LSREDIS_DERIVED_D 0x01	//!< dvalue and lvalue are good
+#define LSREDIS_DERIVED_A 0x02	//!< avalue is good
+#define LSREDIS_DERIVED_B 0x04	//!< bvalue is good
+#define LSREDIS_DERIVED_C 0x08	//!< cvalue is good
+
+/** Reference counted value buffer
+ *  An object's value lives in one of these so that a reader can borrow
+ *  the string without copying it.  The object holds one reference and
+ *  each borrower another; the buffer is only changed in place when the
+ *  object holds the only reference.
+ */
+typedef struct lsredis_value_struct {
+  int refs;					//!< object + borrowers
+  char str[];					//!< the value
+} lsredis_value_t;
+
+//! Find the buffer holding a value string
+#define LSREDIS_VALUE_OF( s) ((lsredis_value_t *)((s) - offsetof( lsredis_value_t, str)))
+
+static unsigned long int lsredis_n_sets         = 0;	//!< times an object's value has been set
+static unsigned long int lsredis_n_parses       = 0;	//!< times an object's value has been parsed into another type
+static unsigned long int lsredis_n_array_parses = 0;	//!< times an object's value has been parsed into an array (these allocate)
+
+static unsigned long int lsredis_n_writes     = 0;	//!< values we've written to redis
+static unsigned long int lsredis_n_write_cmds = 0;	//!< commands it took to write them
+static unsigned long int lsredis_n_suppressed = 0;	//!< writes not sent because the value had not changed
+
+static __thread int lsredis_batch_depth       = 0;	//!< nesting level of lsredis_batch_begin on this thread
+static __thread lsredis_obj_t **lsredis_batch = NULL;	//!< objects written on this thread waiting for lsredis_batch_end
+static __thread int lsredis_batch_n           = 0;	//!< number of objects in lsredis_batch
+static __thread int lsredis_batch_size        = 0;	//!< allocated length of lsredis_batch
+
 static struct pollfd subfd;
 static struct pollfd rofd;
 static struct pollfd wrfd;
 
-typedef struct lsredis_preset_list_struct {
-  struct lsredis_preset_list_struct *next;	// next in the list or null if none
-  char *key;					// our key (motor name concatenated with the preset name)
-  int index;					// our index in the motor's preset array
-  lsredis_obj_t *name;				// object containing the name
-  lsredis_obj_t *position;			// object containing the position
-} lsredis_preset_list_t;
+/** One of our connections to the redis server
+ */
+typedef struct lsredis_conn_struct {
+  char *name;					//!< used in log messages and as the name of our reconnect timer
+  redisAsyncContext **acp;			//!< subac, roac, or wrac.  NULL while we are disconnected
+  struct pollfd *pfd;				//!< the poll entry for the connection
+  int backoff_ms;				//!< wait this long before the next attempt
+  int lost;					//!< 1 after the connection failed, 0 once it is back
+} lsredis_conn_t;
+
+static lsredis_conn_t lsredis_conns[] = {
+  { "lsredis_reconnect_sub", &subac, &subfd, LSREDIS_BACKOFF_MIN_MS, 0},
+  { "lsredis_reconnect_ro",  &roac,  &rofd,  LSREDIS_BACKOFF_MIN_MS, 0},
+  { "lsredis_reconnect_wr",  &wrac,  &wrfd,  LSREDIS_BACKOFF_MIN_MS, 0}
+};
+
+#define LSREDIS_NCONNS (int)(sizeof( lsredis_conns)/sizeof( lsredis_conns[0]))
+
+/** Hash a key (64 bit FNV-1a)
+ */
+static uint64_t lsredis_map_hash( const char *key) {
+  uint64_t h;
+
+  for( h = 14695981039346656037ULL; *key; key++) {
+    h ^= (unsigned char)*key;
+    h *= 1099511628211ULL;
+  }
+  return h == 0 ? 1 : h;	// 0 marks an empty slot
+}
+
+/** Set up an empty map
+ *  \param m    The map
+ *  \param size Initial number of slots, rounded up to a power of 2
+ */
+void lsredis_map_init( lsredis_map_t *m, int size) {
+  static const char *id = "lsredis_map_init";
+
+  for( m->size = 16; m->size < size; m->size *= 2);
+  m->n = 0;
+  m->e = calloc( m->size, sizeof( lsredis_map_entry_t));
+  if( m->e == NULL) {
+    lslogging_log_message( "%s: out of memory", id);
+    exit( -1);
+  }
+}
+
+/** Free the map's slots (but not the keys or data)
+ */
+void lsredis_map_free( lsredis_map_t *m) {
+  free( m->e);
+  m->e    = NULL;
+  m->size = 0;
+  m->n    = 0;
+}
+
+/** Find the slot holding key or the empty slot where it would go
+ */
+static lsredis_map_entry_t *lsredis_map_slot( lsredis_map_t *m, const char *key, uint64_t h) {
+  lsredis_map_entry_t *e;
+  int i;
+
+  for( i = h & (m->size - 1);; i = (i+1) & (m->size - 1)) {
+    e = &m->e[i];
+    if( e->hash == 0 || (e->hash == h && strcmp( e->key, key) == 0))
+      return e;
+  }
+}
+
+/** Look up a key
+ *  \returns the data or NULL if the key is not there
+ */
+void *lsredis_map_find( lsredis_map_t *m, const char *key) {
+  return lsredis_map_slot( m, key, lsredis_map_hash( key))->data;
+}
+
+/** Add a key
+ *  The key is not copied: it must stay around until it is removed.
+ *  The map doubles in size when it gets half full.
+ *  \returns 0 on success, -1 if the key was already there
+ */
+int lsredis_map_insert( lsredis_map_t *m, char *key, void *data) {
+  static const char *id = "lsredis_map_insert";
+  lsredis_map_entry_t *e, *olde;
+  uint64_t h;
+  int i, oldsize;
+
+  h = lsredis_map_hash( key);
+  e = lsredis_map_slot( m, key, h);
+  if( e->hash != 0)
+    return -1;
+
+  if( 2 * (m->n + 1) > m->size) {
+    olde    = m->e;
+    oldsize = m->size;
+    m->size *= 2;
+    m->e = calloc( m->size, sizeof( lsredis_map_entry_t));
+    if( m->e == NULL) {
+      lslogging_log_message( "%s: out of memory", id);
+      exit( -1);
+    }
+    for( i=0; i<oldsize; i++) {
+      if( olde[i].hash != 0)
+	*lsredis_map_slot( m, olde[i].key, olde[i].hash) = olde[i];
+    }
+    free( olde);
+    e = lsredis_map_slot( m, key, h);
+  }
+
+  e->hash = h;
+  e->key  = key;
+  e->data = data;
+  m->n++;
+  return 0;
+}
+
+/** Take a key out of the map
+ *  Later entries in the probe sequence are shifted back so that no
+ *  tombstones are needed.
+ *  \returns the data that was stored with the key or NULL if it was not there
+ */
+void *lsredis_map_remove( lsredis_map_t *m, const char *key) {
+  lsredis_map_entry_t *e;
+  void *rtn;
+  int i, j, home;
+
+  e = lsredis_map_slot( m, key, lsredis_map_hash( key));
+  if( e->hash == 0)
+    return NULL;
+  rtn = e->data;
 
-static lsredis_preset_list_t *lsredis_preset_list = NULL;	// our list of presets
+  i = e - m->e;
+  j = i;
+  while( 1) {
+    j = (j+1) & (m->size - 1);
+    if( m->e[j].hash == 0)
+      break;
+    home = m->e[j].hash & (m->size - 1);
+    //
+    // Move j back to i unless its home slot lies cyclically in (i, j]
+    //
+    if( i <= j ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    m->e[i] = m->e[j];
+    i = j;
+  }
+  memset( &m->e[i], 0, sizeof( lsredis_map_entry_t));
+  m->n--;
+  return rtn;
+}
 
-static struct hsearch_data lsredis_preset_ht;			// hash table to find list items
+/** Call fn for every key in the map
+ *  fn must not add or remove keys.
+ */
+void lsredis_map_foreach( lsredis_map_t *m, void (*fn)( char *, void *, void *), void *arg) {
+  int i;
 
-static int lsredis_preset_n = 0;				// number of entries in the hash table
-static int lsredis_preset_max_n = 1024;				// size of the hash table
-static pthread_mutex_t lsredis_preset_list_mutex;
+  for( i=0; i<m->size; i++) {
+    if( m->e[i].hash != 0)
+      fn( m->e[i].key, m->e[i].data, arg);
+  }
+}
 
 /** Log the reply
  */
@@ -171,37 +453,50 @@ void lsredis_set_onSet( lsredis_obj_t *p, void (*cb)()) {
   pthread_mutex_unlock( &p->mutex);
 }
 
-/** set_value and setstr helper funciton
- *  p->mutex must be locked before calling
+/** Like lsredis_set_onSet but the callback is passed arg
+ *  The callback runs with the object's mutex locked.
  */
-void _lsredis_set_value( lsredis_obj_t *p, char *v) {
+void lsredis_set_onChange( lsredis_obj_t *p, void (*cb)( void *), void *arg) {
+  if( p == NULL)
+    return;
 
-  if( strlen(v) >= (unsigned int) p->value_length) {
-    if( p->value != NULL)
-      free( p->value);
-    p->value_length = strlen(v) + 256;
-    p->value = calloc( p->value_length, sizeof( char));
-    if( p->value == NULL) {
-      lslogging_log_message( "_lsredis_set_value: out of memory");
-      exit( -1);
-    }
-  }
-  strncpy( p->value, v, p->value_length - 1);
-  p->value[p->value_length-1] = 0;
-  p->dvalue = strtod( p->value, NULL);
-  p->lvalue = p->dvalue;
+  pthread_mutex_lock( &p->mutex);
+  p->onChange   = cb;
+  p->change_arg = arg;
+  pthread_mutex_unlock( &p->mutex);
+}
+
+/** Compute the requested representations of the value if we have not already
+ *  p->mutex must be locked and p->value valid before calling
+ */
+static void _lsredis_derive( lsredis_obj_t *p, unsigned char want) {
+  int i;
+
+  want &= ~p->derived;
+  if( want == 0)
+    return;
 
-  if( p->avalue != NULL) {
-    int i;
-    for( i=0; (p->avalue)[i] != NULL; i++)
-      free( (p->avalue)[i]);
-    free( p->avalue);
-    p->avalue = NULL;
+  lsredis_n_parses++;
+
+  if( want & LSREDIS_DERIVED_D) {
+    p->dvalue = strtod( p->value, NULL);
+    p->lvalue = p->dvalue;
   }
 
-  p->avalue = lspg_array2ptrs( p->value);
+  if( want & LSREDIS_DERIVED_A) {
+    if( p->avalue != NULL) {
+      for( i=0; (p->avalue)[i] != NULL; i++)
+	free( (p->avalue)[i]);
+      free( p->avalue);
+      p->avalue = NULL;
+    }
+
+    lsredis_n_array_parses++;
+    p->avalue = lspg_array2ptrs( p->value);
+  }
 
-  switch( *(p->value)) {
+  if( want & LSREDIS_DERIVED_B) {
+    switch( *(p->value)) {
       case 'T':
       case 't':
       case 'Y':
@@ -221,14 +516,72 @@ void _lsredis_set_value( lsredis_obj_t *p, char *v) {
       default:
 	p->bvalue = -1;		// nil is -1 here in our world
     }
+  }
+
+  if( want & LSREDIS_DERIVED_C)
+    p->cvalue = *(p->value);
+
+  p->derived |= want;
+}
+
+/** Forget which publisher last pushed us a value
+ *  p->mutex must be locked before calling
+ */
+static void lsredis_clear_pushed( lsredis_obj_t *p) {
+  free( p->pushed_by);
+  p->pushed_by = NULL;
+}
+
+/** set_value and setstr helper funciton
+ *  p->mutex must be locked before calling
+ *
+ *  Only the string is kept here: the other representations are
+ *  computed by _lsredis_derive when someone asks for them.
+ */
+void _lsredis_set_value( lsredis_obj_t *p, char *v) {
+  lsredis_value_t *vb;
+
+  //
+  // Get a new buffer if the old one is too small or someone has
+  // borrowed it.
+  //
+  if( p->value == NULL || strlen(v) >= (unsigned int) p->value_length || LSREDIS_VALUE_OF( p->value)->refs > 1) {
+    if( p->value != NULL)
+      lsredis_release( p->value);
+    p->value_length = strlen(v) + 256;
+    vb = calloc( 1, sizeof( lsredis_value_t) + p->value_length);
+    if( vb == NULL) {
+      lslogging_log_message( "_lsredis_set_value: out of memory");
+      exit( -1);
+    }
+    vb->refs = 1;
+    p->value = vb->str;
+  }
+  strncpy( p->value, v, p->value_length - 1);
+  p->value[p->value_length-1] = 0;
 
-  p->cvalue = *(p->value);
+  lsredis_n_sets++;
+  p->derived = 0;
 
   p->valid = 1;				//!< We can consider this value valid
   p->creating = 0;			//!< At this point the key is considered created
 
   if( p->onSet)
     p->onSet();
+
+  if( p->onChange)
+    p->onChange( p->change_arg);
+}
+
+/** How much parsing are we doing?
+ *  \param sets          Returns the number of times a value has been set
+ *  \param parses        Returns the number of times a value has been converted to another type
+ *  \param array_parses  Returns the number of those conversions that were to string arrays
+ */
+void lsredis_parse_stats( unsigned long int *sets, unsigned long int *parses, unsigned long int *array_parses) {
+  *sets         = lsredis_n_sets;
+  *parses       = lsredis_n_parses;
+  *array_parses = lsredis_n_array_parses;
 }
 
 /** Set the value of a redis object and make it valid.  Called by mgetCB to set the value as it is in redis
@@ -313,6 +666,145 @@ char *lsredis_getstr( lsredis_obj_t *p) {
   return rtn;
 }
 
+/** Use the current value without copying it
+ *  The string must not be changed and must be returned with lsredis_release.
+ */
+char *lsredis_borrow( lsredis_obj_t *p) {
+  char *rtn;
+
+  pthread_mutex_lock( &p->mutex);
+  while( p->valid == 0)
+    pthread_cond_wait( &p->cond, &p->mutex);
+
+  rtn = p->value;
+  __sync_add_and_fetch( &LSREDIS_VALUE_OF( rtn)->refs, 1);
+  pthread_mutex_unlock( &p->mutex);
+  return rtn;
+}
+
+/** Give back a value from lsredis_borrow
+ */
+void lsredis_release( char *v) {
+  lsredis_value_t *vb;
+
+  if( v == NULL)
+    return;
+
+  vb = LSREDIS_VALUE_OF( v);
+  if( __sync_sub_and_fetch( &vb->refs, 1) == 0)
+    free( vb);
+}
+
+
+/** Tell everyone that a value has changed
+ *  Normally we just publish the key and subscribers fetch the value.
+ *  With PUSH configured the value and the time we wrote it go out first on our values channel.
+ *  Must be called with lsredis_mutex locked and wrac connected
+ *
+ *  \returns the number of commands sent
+ */
+static int lsredis_publish( char *key, char *v) {
+  struct timespec now;
+  json_t *msg;
+  char *s;
+
+  s = NULL;
+  if( lsredis_push_values && v != NULL) {
+    clock_gettime( CLOCK_REALTIME, &now);
+    msg = json_object();
+    if( json_object_set_new( msg, "key",   json_string( key)) == 0 &&
+	json_object_set_new( msg, "value", json_string( v))   == 0 &&
+	json_object_set_new( msg, "ts",    json_real( now.tv_sec + now.tv_nsec / 1.e9)) == 0) {
+      s = json_dumps( msg, JSON_COMPACT);
+    }
+    json_decref( msg);
+  }
+
+  //
+  // Values jansson won't take (not UTF-8, say) are left for subscribers to fetch
+  //
+  if( s != NULL) {
+    redisAsyncCommand( wrac, NULL, NULL, "PUBLISH %s%s %s", LSREDIS_VALUES_PREFIX, lsredis_publisher, s);
+    free( s);
+  }
+
+  redisAsyncCommand( wrac, NULL, NULL, "PUBLISH %s %s", lsredis_publisher, key);
+  return s == NULL ? 1 : 2;
+}
+
+/** Send the current values of some objects as a single transaction
+ *  Must be called with lsredis_mutex locked and wrac connected
+ */
+static void lsredis_send_values( lsredis_obj_t **objs, int n) {
+  lsredis_obj_t *p;
+  char *argv[4];
+  int i;
+
+  redisAsyncCommand( wrac, NULL, NULL, "MULTI");
+  argv[0] = "HSET";
+  argv[2] = "VALUE";
+  for( i=0; i<n; i++) {
+    p = objs[i];
+    pthread_mutex_lock( &p->mutex);
+    argv[1] = p->key;
+    argv[3] = p->value;
+    redisAsyncCommandArgv( wrac, NULL, NULL, 4, (const char **)argv, NULL);
+    lsredis_n_write_cmds += 1 + lsredis_publish( p->key, p->value);
+    p->batched = 0;
+    p->unsent  = 0;
+    pthread_mutex_unlock( &p->mutex);
+  }
+  redisAsyncCommand( wrac, NULL, NULL, "EXEC");
+
+  lsredis_n_writes     += n;
+  lsredis_n_write_cmds += 2;
+}
+
+/** Remember to write an object once the write connection is back
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_queue_unsent( lsredis_obj_t *p) {
+  static const char *id = "lsredis_queue_unsent";
+
+  pthread_mutex_lock( &p->mutex);
+  if( !p->unsent) {
+    p->unsent = 1;
+    if( lsredis_unsent_n == lsredis_unsent_size) {
+      lsredis_unsent_size = lsredis_unsent_size == 0 ? 64 : 2 * lsredis_unsent_size;
+      lsredis_unsent = realloc( lsredis_unsent, lsredis_unsent_size * sizeof( lsredis_obj_t *));
+      if( lsredis_unsent == NULL) {
+	lslogging_log_message( "%s: out of memory", id);
+	exit( -1);
+      }
+    }
+    lsredis_unsent[lsredis_unsent_n++] = p;
+  }
+  pthread_mutex_unlock( &p->mutex);
+}
+
+/** Write everything queued while the write connection was down
+ *  Objects that have since gone out with a batch are skipped.
+ *  Must be called with lsredis_mutex locked and wrac connected
+ */
+static int lsredis_replay_unsent() {
+  lsredis_obj_t *p;
+  int i, n;
+
+  n = 0;
+  for( i=0; i<lsredis_unsent_n; i++) {
+    p = lsredis_unsent[i];
+    pthread_mutex_lock( &p->mutex);
+    if( p->unsent)
+      lsredis_unsent[n++] = p;
+    pthread_mutex_unlock( &p->mutex);
+  }
+
+  if( n > 0)
+    lsredis_send_values( lsredis_unsent, n);
+
+  lsredis_unsent_n = 0;
+  return n;
+}
 
 /** Set the value and update redis.
  *  Note that lsredis_set_value sets the value based on redis
@@ -322,29 +814,59 @@ char *lsredis_getstr( lsredis_obj_t *p) {
  *
  * redisAsyncCommandArgv used instead of redisAsyncCommand 'cause it's easier (and possible)
  * to deal with strings that would otherwise cause hiredis to emit a bad command, like those containing spaces.
+ *
+ * Between lsredis_batch_begin and lsredis_batch_end the write to
+ * redis is put off until lsredis_batch_end.
+ *
+ * Unless force is set, nothing is written when the value has not changed.
  */
-void lsredis_setstr( lsredis_obj_t *p, char *fmt, ...) {
-  va_list arg_ptr;
-  char v[512];
+static void _lsredis_setstr( lsredis_obj_t *p, char *v, int force) {
+  static const char *id = "lsredis_setstr";
   char *argv[4];
 
-  va_start( arg_ptr, fmt);
-  vsnprintf( v, sizeof(v)-1, fmt, arg_ptr);
-  v[sizeof(v)-1] = 0;
-  va_end( arg_ptr);
-  
   pthread_mutex_lock( &p->mutex);
 
   //
   // Don't send an update if a good value has not changed
   //
-  if( p->creating == 0 && p->valid && strcmp( v, p->value) == 0) {
+  if( !force && p->creating == 0 && p->valid && strcmp( v, p->value) == 0) {
     // nothing to do
+    __sync_fetch_and_add( &lsredis_n_suppressed, 1);
+    pthread_mutex_unlock( &p->mutex);
+    return;
+  }
+
+  if( lsredis_batch_depth > 0) {
+    //
+    // Take the value now, tell redis later.  If the object is already
+    // waiting to be written (by us or by another thread's batch) the
+    // latest value is what will be sent.
+    //
+    if( !p->batched) {
+      p->batched = 1;
+      p->wait_for_me++;
+      lsredis_clear_pushed( p);
+      p->gen++;
+      if( lsredis_batch_n == lsredis_batch_size) {
+	lsredis_batch_size = lsredis_batch_size == 0 ? 64 : 2 * lsredis_batch_size;
+	lsredis_batch = realloc( lsredis_batch, lsredis_batch_size * sizeof( lsredis_obj_t *));
+	if( lsredis_batch == NULL) {
+	  lslogging_log_message( "%s: out of memory", id);
+	  exit( -1);
+	}
+      }
+      lsredis_batch[lsredis_batch_n++] = p;
+    }
+    _lsredis_set_value( p, v);
+    pthread_cond_signal( &p->cond);
     pthread_mutex_unlock( &p->mutex);
     return;
   }
 
   p->wait_for_me++;			//!< up the count of times we need to see ourselves published before we start listening to others again
+  p->sending++;				//!< so a resync before we get lsredis_mutex still counts us
+  lsredis_clear_pushed( p);		//!< whatever key comes next is ignored or is someone else's new value
+  p->gen++;				//!< replies to fetches already in flight are older than this
   pthread_mutex_unlock( &p->mutex);	//!< Unlock to prevent deadlock in case the service routine needs to set our value
 
 
@@ -358,11 +880,23 @@ void lsredis_setstr( lsredis_obj_t *p, char *fmt, ...) {
   while( lsredis_running == 0)
     pthread_cond_wait( &lsredis_cond, &lsredis_mutex);
 
-  redisAsyncCommand( wrac, NULL, NULL, "MULTI");
-  redisAsyncCommandArgv( wrac, NULL, NULL, 4, (const char **)argv, NULL);
+  if( wrac == NULL) {
+    //
+    // The value goes out when the connection comes back
+    //
+    lsredis_queue_unsent( p);
+  } else {
+    redisAsyncCommand( wrac, NULL, NULL, "MULTI");
+    redisAsyncCommandArgv( wrac, NULL, NULL, 4, (const char **)argv, NULL);
 
-  redisAsyncCommand( wrac, NULL, NULL, "PUBLISH %s %s", lsredis_publisher, p->key);
-  redisAsyncCommand( wrac, NULL, NULL, "EXEC");
+    lsredis_n_write_cmds += 3 + lsredis_publish( p->key, v);
+    redisAsyncCommand( wrac, NULL, NULL, "EXEC");
+    lsredis_n_writes++;
+  }
+
+  pthread_mutex_lock( &p->mutex);
+  p->sending--;
+  pthread_mutex_unlock( &p->mutex);
   pthread_mutex_unlock( &lsredis_mutex);
 
   // Assume redis will take exactly the value we sent it
@@ -374,33 +908,111 @@ void lsredis_setstr( lsredis_obj_t *p, char *fmt, ...) {
   pthread_mutex_unlock( &p->mutex);
 }
 
+/** Set the value and update redis, unless it has not changed
+ */
+void lsredis_setstr( lsredis_obj_t *p, char *fmt, ...) {
+  va_list arg_ptr;
+  char v[512];
 
-double lsredis_get_or_set_d( lsredis_obj_t *p, double val, int prec) {
-  long int rtn;
-  int err;
-  struct timespec timeout;
-
-  clock_gettime( CLOCK_REALTIME, &timeout);
-  timeout.tv_sec += 2;
+  va_start( arg_ptr, fmt);
+  vsnprintf( v, sizeof(v)-1, fmt, arg_ptr);
+  v[sizeof(v)-1] = 0;
+  va_end( arg_ptr);
 
-  pthread_mutex_lock( &p->mutex);
-  err = 0;
-  while( err == 0 && p->valid == 0)
-    err = pthread_cond_timedwait( &p->cond, &p->mutex, &timeout);
+  _lsredis_setstr( p, v, 0);
+}
 
-  if( err == ETIMEDOUT) {
-    rtn = val;
-    pthread_mutex_unlock( &p->mutex);
-    lsredis_setstr( p, "%.*f", prec, val);
-  } else {
-    rtn = p->lvalue;
-    pthread_mutex_unlock( &p->mutex);
-  }
-  
-  return rtn;
-}  
+/** Set the value and update redis even if it has not changed.
+ *  For values whose subscribers need to see each write, like status messages.
+ */
+void lsredis_setstr_force( lsredis_obj_t *p, char *fmt, ...) {
+  va_list arg_ptr;
+  char v[512];
 
-double lsredis_getd( lsredis_obj_t *p) {
+  va_start( arg_ptr, fmt);
+  vsnprintf( v, sizeof(v)-1, fmt, arg_ptr);
+  v[sizeof(v)-1] = 0;
+  va_end( arg_ptr);
+
+  _lsredis_setstr( p, v, 1);
+}
+
+/** Hold this thread's redis writes until lsredis_batch_end
+ *  Calls may be nested: the writes go out at the outermost end.
+ */
+void lsredis_batch_begin() {
+  lsredis_batch_depth++;
+}
+
+/** Send the writes held since lsredis_batch_begin as a single transaction
+ */
+void lsredis_batch_end() {
+  lsredis_obj_t *p;
+  int i;
+
+  if( lsredis_batch_depth <= 0 || --lsredis_batch_depth > 0 || lsredis_batch_n == 0)
+    return;
+
+  pthread_mutex_lock( &lsredis_mutex);
+  while( lsredis_running == 0)
+    pthread_cond_wait( &lsredis_cond, &lsredis_mutex);
+
+  if( wrac == NULL) {
+    for( i=0; i<lsredis_batch_n; i++) {
+      p = lsredis_batch[i];
+      pthread_mutex_lock( &p->mutex);
+      p->batched = 0;
+      pthread_mutex_unlock( &p->mutex);
+      lsredis_queue_unsent( p);
+    }
+  } else {
+    lsredis_send_values( lsredis_batch, lsredis_batch_n);
+  }
+  pthread_mutex_unlock( &lsredis_mutex);
+
+  lsredis_batch_n = 0;
+}
+
+/** How many values have we written and how many commands did it take?
+ *  Unbatched each write takes 4 (MULTI, HSET, PUBLISH, EXEC).
+ *  Also how many writes were dropped because nothing changed.
+ */
+void lsredis_write_stats( unsigned long int *writes, unsigned long int *commands, unsigned long int *suppressed) {
+  pthread_mutex_lock( &lsredis_mutex);
+  *writes     = lsredis_n_writes;
+  *commands   = lsredis_n_write_cmds;
+  *suppressed = lsredis_n_suppressed;
+  pthread_mutex_unlock( &lsredis_mutex);
+}
+
+
+double lsredis_get_or_set_d( lsredis_obj_t *p, double val, int prec) {
+  long int rtn;
+  int err;
+  struct timespec timeout;
+
+  clock_gettime( CLOCK_REALTIME, &timeout);
+  timeout.tv_sec += 2;
+
+  pthread_mutex_lock( &p->mutex);
+  err = 0;
+  while( err == 0 && p->valid == 0)
+    err = pthread_cond_timedwait( &p->cond, &p->mutex, &timeout);
+
+  if( err == ETIMEDOUT) {
+    rtn = val;
+    pthread_mutex_unlock( &p->mutex);
+    lsredis_setstr( p, "%.*f", prec, val);
+  } else {
+    _lsredis_derive( p, LSREDIS_DERIVED_D);
+    rtn = p->lvalue;
+    pthread_mutex_unlock( &p->mutex);
+  }
+  
+  return rtn;
+}  
+
+double lsredis_getd( lsredis_obj_t *p) {
   double rtn;
 
   pthread_mutex_lock( &p->mutex);
@@ -413,6 +1025,7 @@ double lsredis_getd( lsredis_obj_t *p) {
   while( p->valid == 0)
     pthread_cond_wait( &p->cond, &p->mutex);
 
+  _lsredis_derive( p, LSREDIS_DERIVED_D);
   rtn = p->dvalue;
   pthread_mutex_unlock( &p->mutex);
   
@@ -432,6 +1045,7 @@ long int lsredis_getl( lsredis_obj_t *p) {
   while( p->valid == 0)
     pthread_cond_wait( &p->cond, &p->mutex);
 
+  _lsredis_derive( p, LSREDIS_DERIVED_D);
   rtn = p->lvalue;
   pthread_mutex_unlock( &p->mutex);
   
@@ -457,6 +1071,7 @@ long int lsredis_get_or_set_l( lsredis_obj_t *p, long int val) {
     pthread_mutex_unlock( &p->mutex);
     lsredis_setstr( p, "%ld", val);
   } else {
+    _lsredis_derive( p, LSREDIS_DERIVED_D);
     rtn = p->lvalue;
     pthread_mutex_unlock( &p->mutex);
   }
@@ -477,6 +1092,7 @@ char **lsredis_get_string_array( lsredis_obj_t *p) {
   while( p->valid == 0)
     pthread_cond_wait( &p->cond, &p->mutex);
 
+  _lsredis_derive( p, LSREDIS_DERIVED_A);
   rtn = p->avalue;
   pthread_mutex_unlock( &p->mutex);
   
@@ -495,6 +1111,7 @@ int lsredis_getb( lsredis_obj_t *p) {
   while( p->valid == 0)
     pthread_cond_wait( &p->cond, &p->mutex);
 
+  _lsredis_derive( p, LSREDIS_DERIVED_B);
   rtn = p->bvalue;
   pthread_mutex_unlock( &p->mutex);
   
@@ -513,18 +1130,31 @@ char lsredis_getc( lsredis_obj_t *p) {
   while( p->valid == 0)
     pthread_cond_wait( &p->cond, &p->mutex);
 
+  _lsredis_derive( p, LSREDIS_DERIVED_C);
   rtn = p->cvalue;
   pthread_mutex_unlock( &p->mutex);
   
   return rtn;
 }  
 
-void lsredis_hgetCB( redisAsyncContext *ac, void *reply, void *privdata) {
-  redisReply *r;
-  lsredis_obj_t *p;
+/** Deal with the reply to an HGET key VALUE (or the equivalent element of a batch)
+ *
+ *  \param p   the object we asked for
+ *  \param gen its generation when we asked: a newer push or fetch makes this reply stale
+ *  \param r   the reply
+ */
+static void lsredis_hget_reply( lsredis_obj_t *p, unsigned int gen, redisReply *r) {
+  struct timespec now;
+  double secs;
 
-  r = reply;
-  p =  privdata;
+  if( p == NULL)
+    return;
+
+  pthread_mutex_lock( &p->mutex);
+  if( p->gen != gen) {
+    pthread_mutex_unlock( &p->mutex);
+    return;
+  }
 
   //lslogging_log_message( "hgetCB: %s %s", p == NULL ? "<NULL>" : p->key, r->type == REDIS_REPLY_STRING ? r->str : "Non-string value.  Why?");
 
@@ -533,28 +1163,123 @@ void lsredis_hgetCB( redisAsyncContext *ac, void *reply, void *privdata) {
   // Just set it to an empty string so at least other apps will have the same behaviour as us
   // TODO: figure out a better way to deal with missing key/values
   //
-  if( p != NULL && r->type == REDIS_REPLY_NIL) {
+  if( r->type == REDIS_REPLY_NIL) {
     //
     // Show that we are creating this new key
     // if the next request is a read we'll create an empty string value and return it
     // if the next request is a write then we'll create that value and return it
     //
-    pthread_mutex_lock( &p->mutex);
     p->creating = 1;
+    p->fetch_start.tv_sec = 0;
     pthread_mutex_unlock( &p->mutex);
     return;
   }
 
-  if( p != NULL && r->type == REDIS_REPLY_STRING && r->str != NULL) {
-    pthread_mutex_lock( &p->mutex);
-
+  if( r->type == REDIS_REPLY_STRING && r->str != NULL) {
     _lsredis_set_value( p, r->str);
 
+    //
+    // How long since the publication sent us to get this?
+    //
+    if( p->fetch_start.tv_sec != 0) {
+      clock_gettime( CLOCK_MONOTONIC, &now);
+      secs = (now.tv_sec - p->fetch_start.tv_sec) + (now.tv_nsec - p->fetch_start.tv_nsec) / 1.e9;
+      p->fetch_start.tv_sec = 0;
+      lsredis_n_fetched++;
+      lsredis_fetch_sum_secs += secs;
+      if( secs > lsredis_fetch_max_secs)
+	lsredis_fetch_max_secs = secs;
+    }
+
     pthread_cond_signal( &p->cond);
-    pthread_mutex_unlock( &p->mutex);
   }
+  pthread_mutex_unlock( &p->mutex);
+}
+
+void lsredis_hgetCB( redisAsyncContext *ac, void *reply, void *privdata) {
+  lsredis_fetch_t *f;
+
+  f = privdata;
+  if( reply != NULL)
+    lsredis_hget_reply( f->p, f->gen, reply);
+  free( f);
+}
+
+/** Ask for an object's value
+ *  Must be called with lsredis_mutex locked and roac connected
+ */
+static void lsredis_fetch( lsredis_obj_t *p) {
+  lsredis_fetch_t *f;
+
+  f = calloc( 1, sizeof( lsredis_fetch_t));
+  if( f == NULL) {
+    lslogging_log_message( "lsredis_fetch: out of memory");
+    exit( -1);
+  }
+  f->p = p;
+
+  pthread_mutex_lock( &p->mutex);
+  f->gen = ++p->gen;
+  pthread_mutex_unlock( &p->mutex);
+
+  if( redisAsyncCommand( roac, lsredis_hgetCB, f, "HGET %s VALUE", p->key) != REDIS_OK)
+    free( f);
 }
 
+/** Find an existing object
+ *  Must be called with lsredis_mutex locked
+ */
+static lsredis_obj_t *_lsredis_find_obj( char *key) {
+  return lsredis_map_find( &lsredis_objs, key);
+}
+
+
+/** Make a new object, without asking redis for its value
+ * Must be called with lsredis_mutex locked
+ */
+static lsredis_obj_t *_lsredis_new_obj( char *key) {
+  lsredis_obj_t *p;
+  regmatch_t pmatch[2];
+  int err;
+
+  p = calloc( 1, sizeof( lsredis_obj_t));
+  if( p == NULL) {
+    lslogging_log_message( "_lsredis_get_obj: Out of memory");
+    exit( -1);
+  }
+
+  // The regex is a "filter-in" criteria. If it doesn't exist, we treat it
+  // as "no-match" and what we plan to do as "no-go".
+  err = lsredis_key_select_regex.re_nsub > 0 ?
+    regexec(&lsredis_key_select_regex, key, 2, pmatch, 0) : REG_NOMATCH;
+  if (err == 0 && pmatch[1].rm_so != -1) {
+    p->events_name = strndup( key+pmatch[1].rm_so, pmatch[1].rm_eo - pmatch[1].rm_so);
+  } else {
+    p->events_name = strdup( key);
+  }
+  if( p->events_name == NULL) {
+    lslogging_log_message( "_lsredis_get_obj: Out of memory (events_name)");
+    exit( -1);
+  }
+
+  pthread_mutex_init( &p->mutex, &mutex_initializer);
+  pthread_cond_init(  &p->cond, NULL);
+  p->value = NULL;
+  p->valid = 0;
+  // lsevents_send_event( "%s Invalid", p->events_name);
+  p->wait_for_me = 0;
+  p->key = strdup( key);
+  p->hits = 0;
+  p->onSet = NULL;
+  p->onChange = NULL;
+  p->change_arg = NULL;
+
+  if( lsredis_map_insert( &lsredis_objs, p->key, p) != 0) {
+    lslogging_log_message( "_lsredis_get_obj: key '%s' is already in the object table", p->key);
+  }
+
+  return p;
+}
 
 /** Maybe add a new object
  *  Used internally for this module
@@ -562,15 +1287,8 @@ void lsredis_hgetCB( redisAsyncContext *ac, void *reply, void *privdata) {
  */
 lsredis_obj_t *_lsredis_get_obj( char *key) {
   lsredis_obj_t *p;
-  regmatch_t pmatch[2];
-  int err;
-  ENTRY htab_input, *htab_output;
 
   // Dispense with obviously bad keys straight away
-  // unless p->valid == 0 in which case we call HGET first
-  //
-  // TODO: review logic: is there ever a time when valid is zero for a preexisting p and HGET has not been called?
-  //       If not then we should just return p without checking for validity.
   //
   if( key == NULL || *key == 0 || strchr( key, ' ') != NULL) {
     lslogging_log_message( "_lsredis_get_obj: bad key '%s'", key == NULL ? "<NULL>" : key);
@@ -579,72 +1297,18 @@ lsredis_obj_t *_lsredis_get_obj( char *key) {
 
   // If the key is already there then just return it
   //
-
-  htab_input.key  = key;
-  htab_input.data = NULL;
-  errno = 0;
-  err = hsearch_r( htab_input, FIND, &htab_output, &lsredis_htab);
-
-  if( err == 0)
-    p = NULL;
-  else
-    p = htab_output->data;
-
-
-  if( p != NULL) {
+  p = _lsredis_find_obj( key);
+  if( p != NULL)
     return p;
-  } else {
-    // make a new one.
-    p = calloc( 1, sizeof( lsredis_obj_t));
-    if( p == NULL) {
-      lslogging_log_message( "_lsredis_get_obj: Out of memory");
-      exit( -1);
-    }
 
-    // The regex is a "filter-in" criteria. If it doesn't exist, we treat it
-    // as "no-match" and what we plan to do as "no-go".
-    err = lsredis_key_select_regex.re_nsub > 0 ?
-      regexec(&lsredis_key_select_regex, key, 2, pmatch, 0) : REG_NOMATCH;
-    if (err == 0 && pmatch[1].rm_so != -1) {
-      p->events_name = strndup( key+pmatch[1].rm_so, pmatch[1].rm_eo - pmatch[1].rm_so);
-    } else {
-      p->events_name = strdup( key);
-    }
-    if( p->events_name == NULL) {
-      lslogging_log_message( "_lsredis_get_obj: Out of memory (events_name)");
-      exit( -1);
-    }
-
-    pthread_mutex_init( &p->mutex, &mutex_initializer);
-    pthread_cond_init(  &p->cond, NULL);
-    p->value = NULL;
-    p->valid = 0;
-    // lsevents_send_event( "%s Invalid", p->events_name);
-    p->wait_for_me = 0;
-    p->key = strdup( key);
-    p->hits = 0;
-    p->onSet = NULL;
-
-    htab_input.key  = p->key;
-    htab_input.data = p;
-
-    errno = 0;
-    err = hsearch_r( htab_input, ENTER, &htab_output, &lsredis_htab);
-    if( err == 0) {
-      lslogging_log_message( "_lsredis_get_obj: hsearch error on enter.  errno=%d: %s", errno, strerror(errno));
-    }
+  p = _lsredis_new_obj( key);
 
-    //
-    // Shouldn't need the linked list unless we need to rebuild the hash table when, for example, we run out of room.
-    // TODO: resize hash table when needed.
-    //
-    p->next = lsredis_objs;
-    lsredis_objs = p;
-  }
   //
   // We arrive here with the valid flag lowered.  Go ahead and request the latest value.
+  // Without a connection the value comes with the resync once we reconnect.
   //
-  redisAsyncCommand( roac, lsredis_hgetCB, p, "HGET %s VALUE", key);
+  if( roac != NULL)
+    lsredis_fetch( p);
 
   return p;
 }
@@ -690,13 +1354,117 @@ lsredis_obj_t *lsredis_get_obj( char *fmt, ...) {
   return rtn;
 }
 
-/** call back in case a redis server becomes disconnected
- *  TODO: reconnect
+/** Resolve a redis object once and remember it
+ *  Objects are never freed once created so the pointer stored in
+ *  *cache stays good for the life of the program.  Callers keep a
+ *  static lsredis_obj_t * around and hand us its address: the first
+ *  call formats and hashes the key, every later call just returns
+ *  the cached pointer.
+ *
+ *  \param cache  where to keep the handle (initialize to NULL)
+ *  \param fmt    printf style format of the key (without the head)
  */
-void redisDisconnectCB(const redisAsyncContext *ac, int status) {
-  if( status != REDIS_OK) {
-    lslogging_log_message( "lsredis: Disconnected with status %d", status);
+lsredis_obj_t *lsredis_handle( lsredis_obj_t **cache, char *fmt, ...) {
+  lsredis_obj_t *rtn;
+  va_list arg_ptr;
+  char k[512];
+
+  rtn = *cache;
+  if( rtn != NULL)
+    return rtn;
+
+  va_start( arg_ptr, fmt);
+  vsnprintf( k, sizeof(k)-1, fmt, arg_ptr);
+  k[sizeof(k)-1] = 0;
+  va_end( arg_ptr);
+
+  rtn = lsredis_get_obj( "%s", k);
+
+  //
+  // Two threads racing here both get the same object so there is
+  // nothing to protect.
+  //
+  *cache = rtn;
+  return rtn;
+}
+
+/** Set up a family of handles whose keys differ only by an index
+ *  The format arguments are expanded right away to build the
+ *  family's template, which must then contain exactly one %d for the
+ *  index.  Use "%%d" to get it through this first expansion, as in
+ *
+ *  lsredis_family_init( &mp->preset_names, "%s.presets.%%d.name", mp->name);
+ *
+ *  Families with constant templates can instead be declared with
+ *  LSREDIS_FAMILY_INITIALIZER and need no call here.
+ *
+ *  \param f   the family to initialize
+ *  \param fmt printf style format of the template
+ */
+void lsredis_family_init( lsredis_family_t *f, char *fmt, ...) {
+  static const char *id = "lsredis_family_init";
+  va_list arg_ptr;
+  char k[512];
+
+  va_start( arg_ptr, fmt);
+  vsnprintf( k, sizeof(k)-1, fmt, arg_ptr);
+  k[sizeof(k)-1] = 0;
+  va_end( arg_ptr);
+
+  pthread_mutex_init( &f->mutex, NULL);
+  f->n   = 0;
+  f->h   = NULL;
+  f->fmt = strdup( k);
+  if( f->fmt == NULL) {
+    lslogging_log_message( "%s: Out of memory", id);
+    exit( -1);
+  }
+}
+
+/** Return the handle for index i of a family
+ *  The handle array grows as needed and each entry is resolved the
+ *  first time it is asked for.  After that this is an array lookup.
+ *
+ *  \param f the family
+ *  \param i the index to substitute into the family's template
+ */
+lsredis_obj_t *lsredis_family_get( lsredis_family_t *f, int i) {
+  static const char *id = "lsredis_family_get";
+  lsredis_obj_t *rtn;
+  lsredis_obj_t **new_h;
+  int new_n;
+
+  //
+  // Nothing sensible to cache for a negative index but the caller
+  // still deserves an object.
+  //
+  if( i < 0)
+    return lsredis_get_obj( f->fmt, i);
+
+  pthread_mutex_lock( &f->mutex);
+  if( i >= f->n) {
+    new_n = f->n == 0 ? 16 : f->n;
+    while( new_n <= i)
+      new_n *= 2;
+
+    new_h = realloc( f->h, new_n * sizeof( *new_h));
+    if( new_h == NULL) {
+      lslogging_log_message( "%s: Out of memory", id);
+      exit( -1);
+    }
+    memset( new_h + f->n, 0, (new_n - f->n) * sizeof( *new_h));
+    f->h = new_h;
+    f->n = new_n;
+  }
+
+  rtn = f->h[i];
+  if( rtn == NULL) {
+    rtn = lsredis_get_obj( f->fmt, i);
+    f->h[i] = rtn;
   }
+  pthread_mutex_unlock( &f->mutex);
+
+  return rtn;
 }
 
 /** hook to mange read events
@@ -763,18 +1531,127 @@ void lsredis_cleanup( void *data) {
 }
 
 
+/** Act on a publication
+ *  Either take the value that came with it or ask for the new value.
+ *  Must be called with lsredis_mutex locked
+ *
+ *  \param publisher who published
+ *  \param k         the key that changed
+ *  \param v         the new value (from the publisher's values channel) or NULL for a key only publication
+ *  \param ts        when the publisher wrote the value (seconds since the epoch), 0 if unknown
+ */
+static void lsredis_sub_message( char *publisher, char *k, char *v, double ts) {
+  lsredis_obj_t *p;
+  struct timespec now;
+  double secs;
+
+  //
+  // see if we care
+  //
+  if( lsredis_key_select_regex.re_nsub == 0 ||
+      regexec(&lsredis_key_select_regex, k, 0, NULL, 0) != 0) {
+    return;
+  }
+
+  //
+  // We should know about this one
+  //
+  p = _lsredis_find_obj( k);
+
+  if( p == NULL && v == NULL) {
+    _lsredis_get_obj( k);
+    return;
+  }
+
+  if( p == NULL)
+    p = _lsredis_new_obj( k);
+
+  // Look who's talk'n
+  pthread_mutex_lock( &p->mutex);
+  if( p->wait_for_me) {
+    //
+    // see if we are done waiting
+    //
+    if( strcmp( publisher, lsredis_publisher)==0)
+      p->wait_for_me--;
+
+    pthread_mutex_unlock( &p->mutex);
+    //
+    // Didn't get a new value, either we set it last or we are still waiting for redis to report
+    // our publication
+    //
+    return;
+  }
+
+  if( v != NULL) {
+    //
+    // The value came with the publication.  Nothing more to ask for,
+    // neither now nor when the key arrives on the publisher channel.
+    // Any fetch still in flight is older than this.
+    //
+    _lsredis_set_value( p, v);
+    p->gen++;
+    if( p->pushed_by == NULL || strcmp( p->pushed_by, publisher) != 0) {
+      lsredis_clear_pushed( p);
+      p->pushed_by = strdup( publisher);
+    }
+    pthread_cond_signal( &p->cond);
+    pthread_mutex_unlock( &p->mutex);
+
+    if( ts > 0.0) {
+      clock_gettime( CLOCK_REALTIME, &now);
+      secs = now.tv_sec + now.tv_nsec / 1.e9 - ts;
+      lsredis_n_pushed++;
+      lsredis_push_sum_secs += secs;
+      if( secs > lsredis_push_max_secs)
+	lsredis_push_max_secs = secs;
+    }
+    return;
+  }
+
+  if( p->pushed_by != NULL && strcmp( p->pushed_by, publisher) == 0) {
+    //
+    // The key that goes with the value this publisher just pushed.
+    // Someone else's key is news.
+    //
+    lsredis_clear_pushed( p);
+    pthread_mutex_unlock( &p->mutex);
+    return;
+  }
+
+  // Here we know our value is out of date
+  //
+  p->valid = 0;
+  clock_gettime( CLOCK_MONOTONIC, &p->fetch_start);
+  //lsevents_send_event( "%s Invalid", p->events_name);
+  pthread_mutex_unlock( &p->mutex);
+
+  //
+  // We shouldn't get here if wait_for_me is zero and we are the publisher.
+  // If somehow we did (ie we did an hset without incrementing wait_for_me or if we published too many times), it shouldn't hurt to get the value again.
+  // 
+
+  if( roac != NULL)
+    lsredis_fetch( p);
+}
+
 /** Use the publication to request the new value
+ *  (or to set it, when it came on a values channel)
  */
 void lsredis_subCB( redisAsyncContext *ac, void *reply, void *privdata) {
   redisReply *r;
-  lsredis_obj_t *p;
-  char *k;
-  char *publisher;
-  ENTRY htab_input, *htab_output;
-  int err;
+  json_t *msg, *kj, *vj, *tj;
+  json_error_t jerr;
+  char *publisher, *k, *v;
+  double ts;
 
   r = (redisReply *)reply;
 
+  // Connection lost.  We'll subscribe again when we resync.
+  //
+  if( r == NULL)
+    return;
+
   // Ignore our psubscribe reply
   //
   if( r->type == REDIS_REPLY_ARRAY && r->elements == 3 && r->element[0]->type == REDIS_REPLY_STRING && strcmp( r->element[0]->str, "psubscribe")==0)
@@ -799,208 +1676,662 @@ void lsredis_subCB( redisAsyncContext *ac, void *reply, void *privdata) {
 
   if( k == NULL || *k == 0)
     return;
-  
+
   //
-  // see if we care
+  // A publication with the value in it
   //
-  if (lsredis_key_select_regex.re_nsub > 0 &&
-      regexec(&lsredis_key_select_regex, k, 0, NULL, 0) == 0) {
+  publisher = r->element[2]->str;
+  msg = NULL;
+  v   = NULL;
+  ts  = 0.0;
+  if( strncmp( publisher, LSREDIS_VALUES_PREFIX, strlen( LSREDIS_VALUES_PREFIX)) == 0) {
+    publisher += strlen( LSREDIS_VALUES_PREFIX);
+
     //
-    // We should know about this one
+    // Our own values are for everyone else: we'll see the key on our publisher channel
     //
-    
-    htab_input.key  = k;
-    htab_input.data = NULL;
+    if( lsredis_publisher != NULL && strcmp( publisher, lsredis_publisher) == 0)
+      return;
 
-    errno = 0;
-    err = hsearch_r( htab_input, FIND, &htab_output, &lsredis_htab);
-    if( err == 0 && errno == ESRCH)
-      p = NULL;
-    else
-      p = htab_output->data;
-      
+    msg = json_loads( k, JSON_DECODE_INT_AS_REAL, &jerr);
+    kj  = msg == NULL ? NULL : json_object_get( msg, "key");
+    if( kj == NULL || json_typeof( kj) != JSON_STRING || *json_string_value( kj) == 0) {
+      lslogging_log_message( "lsredis_subCB: could not understand publication '%s'", k);
+      if( msg != NULL)
+	json_decref( msg);
+      return;
+    }
+    k = (char *)json_string_value( kj);
 
-    if( p == NULL) {
-      _lsredis_get_obj( k);
-    } else {
-      // Look who's talk'n
-      publisher = r->element[2]->str;
+    vj = json_object_get( msg, "value");
+    if( vj == NULL || json_typeof( vj) != JSON_STRING) {
+      lslogging_log_message( "lsredis_subCB: no value in publication '%s'", r->element[3]->str);
+      json_decref( msg);
+      return;
+    }
+    v = (char *)json_string_value( vj);
 
-      pthread_mutex_lock( &p->mutex);
-      if( p->wait_for_me) {
-	//
-	// see if we are done waiting
-	//
-	if( strcmp( publisher, lsredis_publisher)==0)
-	  p->wait_for_me--;
-
-	pthread_mutex_unlock( &p->mutex);
-	//
-	// Didn't get a new value, either we set it last or we are still waiting for redis to report
-	// our publication
-	//
-	return;
+    tj = json_object_get( msg, "ts");
+    if( tj != NULL && json_typeof( tj) == JSON_REAL)
+      ts = json_real_value( tj);
+  }
+
+  lsredis_sub_message( publisher, k, v, ts);
+
+  if( msg != NULL)
+    json_decref( msg);
+}
+
+
+/** All the values for a batch are in (or lost with the connection)
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_batch_done( lsredis_batch_t *b) {
+  static const char *id = "lsredis_batch_done";
+  struct timespec now;
+
+  free( b->gen);
+  if( b->resync) {
+    free( b);
+    if( --lsredis_resync_pending == 0)
+      lsredis_resync_done();
+    return;
+  }
+  free( b);
+
+  lsredis_load_pending--;
+  if( lsredis_load_scanned && lsredis_load_pending == 0) {
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    lslogging_log_message( "%s: loaded %d objects from %d keys in %d batches in %.3f seconds", id,
+			   lsredis_load_objs, lsredis_load_keys, lsredis_load_batches,
+			   (now.tv_sec - lsredis_load_start.tv_sec) + (now.tv_nsec - lsredis_load_start.tv_nsec)/1.e9);
+  }
+}
+
+/** One of a batch's values, fetched the slow way, has arrived.
+ *  Replies come back in the order we asked for them.
+ */
+static void lsredis_batch_hgetCB( redisAsyncContext *ac, void *reply, void *privdata) {
+  lsredis_batch_t *b;
+
+  b = privdata;
+  if( reply != NULL)
+    lsredis_hget_reply( b->p[b->next], b->gen[b->next], reply);
+
+  if( ++b->next == b->n)
+    lsredis_batch_done( b);
+}
+
+/** Values for a batch of objects have arrived
+ */
+static void lsredis_batchCB( redisAsyncContext *ac, void *reply, void *privdata) {
+  static const char *id = "lsredis_batchCB";
+  lsredis_batch_t *b;
+  redisReply *r;
+  int i, n;
+
+  r = reply;
+  b = privdata;
+
+  if( r == NULL) {
+    //
+    // Connection lost.  These objects will be refetched when we resync.
+    //
+  } else if( r->type == REDIS_REPLY_ARRAY && r->elements == b->n) {
+    for( i=0; i<b->n; i++)
+      lsredis_hget_reply( b->p[i], b->gen[i], r->element[i]);
+  } else {
+    //
+    // Perhaps scripting is turned off.  Do it the slow way.  The
+    // batch isn't done until the last HGET comes back.
+    //
+    if( r->type == REDIS_REPLY_ERROR)
+      lslogging_log_message( "%s: batch request failed (%s), falling back to HGET", id, r->str);
+    n = 0;
+    for( i=0; i<b->n; i++) {
+      if( roac != NULL && redisAsyncCommand( roac, lsredis_batch_hgetCB, b, "HGET %s VALUE", b->p[i]->key) == REDIS_OK) {
+	b->p[n] = b->p[i];
+	pthread_mutex_lock( &b->p[n]->mutex);
+	b->gen[n] = ++b->p[n]->gen;
+	pthread_mutex_unlock( &b->p[n]->mutex);
+	n++;
       }
+    }
+    b->n    = n;
+    b->next = 0;
+    if( n > 0)
+      return;
+  }
 
-      // Here we know our value is out of date
-      //
-      p->valid = 0;
-      //lsevents_send_event( "%s Invalid", p->events_name);
-      pthread_mutex_unlock( &p->mutex);
+  lsredis_batch_done( b);
+}
 
-      //
-      // We shouldn't get here if wait_for_me is zero and we are the publisher.
-      // If somehow we did (ie we did an hset without incrementing wait_for_me or if we published too many times), it shouldn't hurt to get the value again.
-      // 
+/** Ask for the values of a bunch of objects with a single command
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_batch_get( lsredis_batch_t *b) {
+  static const char *script = "local r = {} for i, k in ipairs( KEYS) do r[i] = redis.call( 'HGET', k, 'VALUE') end return r";
+  const char **argv;
+  char nkeys[16];
+  int i;
+
+  argv = calloc( b->n + 3, sizeof( char *));
+  if( argv == NULL) {
+    lslogging_log_message( "lsredis_batch_get: out of memory");
+    exit( -1);
+  }
+
+  b->gen = calloc( b->n, sizeof( unsigned int));
+  if( b->gen == NULL) {
+    lslogging_log_message( "lsredis_batch_get: out of memory");
+    exit( -1);
+  }
+
+  snprintf( nkeys, sizeof( nkeys), "%d", b->n);
+  argv[0] = "EVAL";
+  argv[1] = script;
+  argv[2] = nkeys;
+  for( i=0; i<b->n; i++) {
+    argv[i+3] = b->p[i]->key;
+    pthread_mutex_lock( &b->p[i]->mutex);
+    b->gen[i] = ++b->p[i]->gen;
+    pthread_mutex_unlock( &b->p[i]->mutex);
+  }
+
+  if( roac == NULL || redisAsyncCommandArgv( roac, lsredis_batchCB, b, b->n + 3, argv, NULL) != REDIS_OK) {
+    //
+    // No connection: the resync after we reconnect takes care of these
+    //
+    free( b->gen);
+    free( b);
+  } else if( b->resync) {
+    lsredis_resync_pending++;
+  } else {
+    lsredis_load_pending++;
+  }
+  free( argv);
+}
 
-      redisAsyncCommand( roac, lsredis_hgetCB, p, "HGET %s VALUE", k);
+/** Make the SCAN MATCH pattern for everything under our head
+ */
+static char *lsredis_scan_pattern() {
+  char *rtn, *sp, *hp;
+
+  rtn = calloc( 2 * strlen( lsredis_head) + 3, sizeof( char));
+  if( rtn == NULL) {
+    lslogging_log_message( "lsredis_scan_pattern: out of memory");
+    exit( -1);
+  }
+
+  for( sp = rtn, hp = lsredis_head; *hp; hp++) {
+    if( strchr( "*?[]\\", *hp) != NULL)
+      *sp++ = '\\';
+    *sp++ = *hp;
+  }
+  strcpy( sp, ".*");
+  return rtn;
+}
+
+/** Make a SCAN MATCH pattern for one alternative of our RE: the
+ *  literal text it starts with, with a * after it, and before it too
+ *  unless it's anchored.
+ *  \param re the alternative
+ *  \param n  its length
+ *  \returns "*" when there is no literal text.  Free it when done.
+ */
+static char *lsredis_scan_glob( char *re, int n) {
+  char *rtn, *sp;
+  int i, nlit;
+  char c;
+
+  rtn = calloc( 2 * n + 3, sizeof( char));
+  if( rtn == NULL) {
+    lslogging_log_message( "lsredis_scan_glob: out of memory");
+    exit( -1);
+  }
+
+  sp   = rtn;
+  nlit = 0;
+  i    = 0;
+  if( n > 0 && re[0] == '^')
+    i++;
+  else
+    *sp++ = '*';
+
+  for( ; i<n; i++) {
+    c = re[i];
+    if( c == '\\' && i+1 < n && ispunct( (unsigned char)re[i+1]))
+      c = re[++i];
+    else if( strchr( ".[]()*+?{}|^$\\", c) != NULL)
+      break;
+
+    //
+    // A character that may be left out ends the literal text
+    //
+    if( i+1 < n && strchr( "*?{", re[i+1]) != NULL)
+      break;
+
+    if( strchr( "*?[]\\", c) != NULL)
+      *sp++ = '\\';
+    *sp++ = c;
+    nlit++;
+  }
+
+  if( nlit == 0)
+    strcpy( rtn, "*");
+  else
+    *sp = '*';
+  return rtn;
+}
+
+/** Sift through the keys to find ones we like.  Add them to our list
+ *  of followed objects, ask for their values, and ask for the next
+ *  bunch of keys.
+ */
+void lsredis_scanCB( redisAsyncContext *ac, void *reply, void *privdata) {
+  static const char *id = "lsredis_scanCB";
+  redisReply *r, *keys;
+  lsredis_batch_t *b;
+  lsredis_obj_t *p;
+  char *k;
+  int i;
+
+  r = reply;
+  if( r == NULL || r->type != REDIS_REPLY_ARRAY || r->elements != 2 ||
+      r->element[0]->type != REDIS_REPLY_STRING || r->element[1]->type != REDIS_REPLY_ARRAY) {
+    if( r != NULL) {
+      lslogging_log_message( "%s: unexpected SCAN reply", id);
+      lsredis_debugCB( ac, reply, privdata);
+    }
+    //
+    // Connection lost or the SCAN failed.  Start over when we resync.
+    //
+    lsredis_load_lost = 1;
+    lsredis_load_scans--;
+    free( privdata);
+    return;
+  }
+  keys = r->element[1];
+
+  b = calloc( 1, sizeof( lsredis_batch_t) + keys->elements * sizeof( lsredis_obj_t *));
+  if( b == NULL) {
+    lslogging_log_message( "%s: out of memory", id);
+    exit( -1);
+  }
+
+  for( i=0; i<(int)keys->elements; i++) {
+    if( keys->element[i]->type != REDIS_REPLY_STRING) {
+      lslogging_log_message( "%s: exepected string...", id);
+      lsredis_debugCB( ac, keys->element[i], privdata);
+      continue;
+    }
+    k = keys->element[i]->str;
+
+    // Add the key if it matches our regex filter-in criteria.
+    // If there's no regex, don't cache anything.
+    if( lsredis_key_select_regex.re_nsub == 0 || regexec( &lsredis_key_select_regex, k, 0, NULL, 0) != 0)
+      continue;
+    if( *k == 0 || strchr( k, ' ') != NULL || _lsredis_find_obj( k) != NULL)
+      continue;
+
+    p = _lsredis_new_obj( k);
+    b->p[b->n++] = p;
+  }
+
+  lsredis_load_batches++;
+  lsredis_load_keys += keys->elements;
+  lsredis_load_objs += b->n;
+
+  if( b->n > 0)
+    lsredis_batch_get( b);
+  else
+    free( b);
+
+  if( strcmp( r->element[0]->str, "0") == 0) {
+    free( privdata);
+    if( --lsredis_load_scans > 0)
+      return;
+    lsredis_load_scanned = 1;
+    if( lsredis_load_pending == 0)
+      lslogging_log_message( "%s: loaded %d objects from %d keys in %d batches", id, lsredis_load_objs, lsredis_load_keys, lsredis_load_batches);
+    return;
+  }
+
+  if( lsredis_load_batches % 10 == 0)
+    lslogging_log_message( "%s: %d keys scanned, %d objects so far", id, lsredis_load_keys, lsredis_load_objs);
+
+  redisAsyncCommand( roac, lsredis_scanCB, privdata, "SCAN %s MATCH %s COUNT %d", r->element[0]->str, (char *)privdata, LSREDIS_SCAN_COUNT);
+}
+
+/** Start the SCANs that load the keys our RE selects.  Each SCAN
+ *  owns its pattern (the privdata of lsredis_scanCB).  With no RE we
+ *  fall back to everything under our head.
+ */
+static void lsredis_scan_start() {
+  char **globs;
+  char *re;
+  int depth, bracket, start, nglobs;
+  int i, j;
+
+  globs  = NULL;
+  nglobs = 0;
+
+  re = lsredis_key_select;
+  if( re == NULL) {
+    globs = calloc( 1, sizeof( char *));
+    if( globs == NULL) {
+      lslogging_log_message( "lsredis_scan_start: out of memory");
+      exit( -1);
+    }
+    globs[nglobs++] = lsredis_scan_pattern();
+  } else {
+    globs = calloc( strlen( re) + 1, sizeof( char *));
+    if( globs == NULL) {
+      lslogging_log_message( "lsredis_scan_start: out of memory");
+      exit( -1);
+    }
+
+    //
+    // Split on the | that are not inside parentheses or brackets
+    //
+    depth   = 0;
+    bracket = 0;
+    start   = 0;
+    for( i=0; ; i++) {
+      if( re[i] == 0 || (re[i] == '|' && depth == 0 && !bracket)) {
+	globs[nglobs++] = lsredis_scan_glob( re + start, i - start);
+	if( re[i] == 0)
+	  break;
+	start = i + 1;
+	continue;
+      }
+
+      if( bracket) {
+	// A ] right after the [ (or [^) is part of the list
+	if( re[i] == ']' && i > bracket)
+	  bracket = 0;
+	continue;
+      }
+
+      if( re[i] == '\\' && re[i+1] != 0) {
+	i++;
+      } else if( re[i] == '[') {
+	bracket = re[i+1] == '^' ? i+2 : i+1;
+      } else if( re[i] == '(') {
+	depth++;
+      } else if( re[i] == ')' && depth > 0) {
+	depth--;
+      }
+    }
+
+    //
+    // No point walking the key space more than once for the same
+    // thing, or at all if we have to walk all of it anyway
+    //
+    for( i=0; i<nglobs; i++) {
+      if( strcmp( globs[i], "*") == 0) {
+	for( j=0; j<nglobs; j++) {
+	  if( j != i)
+	    free( globs[j]);
+	}
+	globs[0] = globs[i];
+	nglobs   = 1;
+	break;
+      }
+    }
+    for( i=1; i<nglobs; i++) {
+      for( j=0; j<i; j++) {
+	if( strcmp( globs[i], globs[j]) == 0)
+	  break;
+      }
+      if( j < i) {
+	free( globs[i]);
+	globs[i--] = globs[--nglobs];
+      }
+    }
+  }
+
+  //
+  // Other SCANs may still be going if only one of them failed
+  //
+  lsredis_load_scanned = 0;
+  for( i=0; i<nglobs; i++) {
+    lslogging_log_message( "lsredis_scan_start: SCAN MATCH %s", globs[i]);
+    if( redisAsyncCommand( roac, lsredis_scanCB, globs[i], "SCAN 0 MATCH %s COUNT %d", globs[i], LSREDIS_SCAN_COUNT) != REDIS_OK) {
+      lsredis_load_lost = 1;
+      free( globs[i]);
+      continue;
     }
+    lsredis_load_scans++;
   }
+  free( globs);
 }
 
+/** A preset's name or position has changed
+ *  Called with the object's mutex locked so we only raise flags here:
+ *  the table catches up the next time someone looks something up.
+ */
+static void lsredis_preset_changed( void *arg) {
+  lsredis_preset_t *pp;
+
+  pp = arg;
+  pp->dirty = 1;
+  __sync_fetch_and_add( &pp->table->changes, 1);
+}
+
+/** The number of presets has changed
+ *  Called with the object's mutex locked, see lsredis_preset_changed
+ */
+static void lsredis_presets_length_changed( void *arg) {
+  lsredis_presets_t *t;
+
+  t = arg;
+  t->length_dirty = 1;
+  __sync_fetch_and_add( &t->changes, 1);
+}
+
+/** Put a preset's name into the name map
+ *  When names are duplicated the lowest index wins.
+ *  Must be called with the table mutex locked
+ */
+static void lsredis_presets_name( lsredis_presets_t *t, lsredis_preset_t *pp) {
+  intptr_t other;
+
+  if( pp->name == NULL)
+    return;
+
+  other = (intptr_t)lsredis_map_find( &t->names, pp->name);
+  if( other != 0 && other - 1 < pp->index)
+    return;
 
-void lsredis_maybe_add_key(char *k) {
-  // Add the key if it matches our regex filter-in criteria.
-  // If there's no regex, don't cache anything.
-  if (lsredis_key_select_regex.re_nsub > 0 &&
-      regexec(&lsredis_key_select_regex, k, 0, NULL, 0) == 0) {
-    if (strstr(k, "state_machine")) {
-      lslogging_log_message("lsredis_maybe_add_key adding key %s", k);
-    }
-    _lsredis_get_obj(k);
-  }
+  if( other != 0)
+    lsredis_map_remove( &t->names, pp->name);
+  lsredis_map_insert( &t->names, pp->name, (void *)(intptr_t)(pp->index + 1));
 }
 
-/** Sift through the keys to find ones we like.  Add them to our list of followed objects
+/** Take a preset's name out of the name map
+ *  If another preset has the same name it takes over the entry.
+ *  Must be called with the table mutex locked
  */
-void lsredis_keysCB( redisAsyncContext *ac, void *reply, void *privdata) {
-  redisReply *r;
+static void lsredis_presets_unname( lsredis_presets_t *t, lsredis_preset_t *pp) {
+  char *name;
   int i;
-  
-  r = reply;
-  if( r->type != REDIS_REPLY_ARRAY) {
-    lslogging_log_message( "lsredis_keysCB: exepected array...");
-    lsredis_debugCB( ac, reply, privdata);
+
+  name = pp->name;
+  if( name == NULL)
     return;
-  }
-  
-  for( i=0; i< (int)r->elements; i++) {
-    if( r->element[i]->type != REDIS_REPLY_STRING) {
-      lslogging_log_message( "lsredis_keysCB: exepected string...");
-      lsredis_debugCB( ac, r->element[i], privdata);
-    } else {
-      lsredis_maybe_add_key( r->element[i]->str);
+  pp->name = NULL;
+
+  if( (intptr_t)lsredis_map_find( &t->names, name) == pp->index + 1) {
+    lsredis_map_remove( &t->names, name);
+    for( i=0; i<t->n; i++) {
+      if( t->slots[i]->name != NULL && strcmp( t->slots[i]->name, name) == 0) {
+	lsredis_map_insert( &t->names, t->slots[i]->name, (void *)(intptr_t)(i + 1));
+	break;
+      }
     }
   }
+  free( name);
 }
 
-/** update the presets hash table for the named motor
+/** Bring a motor's preset table up to date
+ *  Only presets whose redis objects have changed since last time are
+ *  reread.  When nothing has changed this is one comparison.
+ *  Must be called with the table mutex locked
  */
-void lsredis_load_presets( char *motor_name) {
-  lsredis_obj_t *p;
-  lsredis_preset_list_t *pl;
-  int plength;
-  char *preset_name;
-  int i;
-  int key_length;
-  ENTRY entry_in, *entry_outp;
-
-  p = lsredis_get_obj( "%s.presets.length", motor_name);
-  plength = lsredis_get_or_set_l( p, 0);
-  if( plength <= 0)
+static void lsredis_presets_refresh( lspmac_motor_t *mp) {
+  static const char *id = "lsredis_presets_refresh";
+  lsredis_presets_t *t;
+  lsredis_preset_t *pp;
+  unsigned long int changes;
+  int i, j, k, n, old_n, resort;
+  char *v;
+
+  t = &mp->presets;
+  changes = __sync_fetch_and_add( &t->changes, 0);
+  if( changes == t->seen)
     return;
+  //
+  // Anything that changes from here on gets picked up next time
+  //
+  t->seen = changes;
+  resort  = 0;
+
+  if( __sync_lock_test_and_set( &t->length_dirty, 0)) {
+    n = lsredis_get_or_set_l( mp->presets_length, 0);
+    if( n < 0)
+      n = 0;
+
+    if( n > t->nslots) {
+      t->slots       = realloc( t->slots,       n * sizeof( lsredis_preset_t *));
+      t->by_position = realloc( t->by_position, n * sizeof( int));
+      if( t->slots == NULL || t->by_position == NULL) {
+	lslogging_log_message( "%s: out of memory", id);
+	exit( -1);
+      }
+      for( i=t->nslots; i<n; i++) {
+	pp = calloc( 1, sizeof( lsredis_preset_t));
+	if( pp == NULL) {
+	  lslogging_log_message( "%s: out of memory", id);
+	  exit( -1);
+	}
+	pp->table      = t;
+	pp->index      = i;
+	pp->name_p     = lsredis_family_get( &mp->preset_names,     i);
+	pp->position_p = lsredis_family_get( &mp->preset_positions, i);
+	t->slots[i]    = pp;
+	lsredis_set_onChange( pp->name_p,     lsredis_preset_changed, pp);
+	lsredis_set_onChange( pp->position_p, lsredis_preset_changed, pp);
+      }
+      t->nslots = n;
+    }
 
-  pthread_mutex_lock( &lsredis_preset_list_mutex);
-
-  for( i=0; i<plength; i++) {
-    pl = calloc( 1, sizeof( lsredis_preset_list_t));
-    pl->name      = lsredis_get_obj( "%s.presets.%d.name",     motor_name, i);
-    pl->position  = lsredis_get_obj( "%s.presets.%d.position", motor_name, i);
-    pl->index     = i;
-    
-    preset_name   = lsredis_getstr( pl->name);
-    key_length    = strlen( motor_name) + strlen( preset_name) + 1;
-    pl->key       = calloc( key_length, 1);
-
-    pl->next            = lsredis_preset_list;
-    lsredis_preset_list = pl;
+    old_n = t->n;
+    t->n  = n;
+    for( i=n; i<old_n; i++)
+      lsredis_presets_unname( t, t->slots[i]);
+    for( i=old_n; i<n; i++)
+      t->slots[i]->dirty = 1;
 
-    snprintf( pl->key, key_length, "%s%s", motor_name, preset_name);
+    for( i=0; i<n; i++)
+      t->by_position[i] = i;
+    resort = 1;
+  }
 
-    entry_in.key  = pl->key;
-    entry_in.data = pl;
-    hsearch_r( entry_in, ENTER, &entry_outp, &lsredis_preset_ht);
-    if( entry_outp->data != pl) {
-      //
-      // The key was already there or we couldn't add it
-      //
-      if( entry_outp->data == NULL)
-	lslogging_log_message( "lsredis_load_presets: could not add preset '%s' for motor '%s'", preset_name, motor_name);
+  for( i=0; i<t->n; i++) {
+    pp = t->slots[i];
+    if( !__sync_lock_test_and_set( &pp->dirty, 0))
+      continue;
 
-      free( pl->key);
-      free( pl);
-    } else {
-      //
-      // We've successfully added the new key
-      //
-      lsredis_preset_n++;
-      //
-      // Resize the hash table if we are starting to fill it up
-      // Generally we prefer a sparse table
-      //
-      if( lsredis_preset_n >= lsredis_preset_max_n) {
-	lslogging_log_message( "lsredis_load_presets: increasing preset hash table size.  max now %d", lsredis_preset_max_n);
-	hdestroy_r( &lsredis_preset_ht);
-	memset(&lsredis_preset_ht, 0, sizeof(lsredis_preset_ht));
-	lsredis_preset_max_n *= 2;
-	hcreate_r( 2 * lsredis_preset_max_n, &lsredis_preset_ht);
-	for( pl = lsredis_preset_list; pl != NULL; pl = pl->next) {
-	  entry_in.key  = pl->key;
-	  entry_in.data = pl;
-	  hsearch_r( entry_in, ENTER, &entry_outp, &lsredis_preset_ht);
+    v = lsredis_borrow( pp->name_p);
+    if( pp->name == NULL || strcmp( pp->name, v) != 0) {
+      lsredis_presets_unname( t, pp);
+      if( *v) {
+	pp->name = strdup( v);
+	if( pp->name == NULL) {
+	  lslogging_log_message( "%s: out of memory", id);
+	  exit( -1);
 	}
-	lslogging_log_message( "lsredis_load_presets: done increasing preset hash table size.", lsredis_preset_max_n);
+	lsredis_presets_name( t, pp);
       }
     }
-    free( preset_name);
+    lsredis_release( v);
+
+    pp->position = lsredis_getd( pp->position_p);
+    resort = 1;
+  }
+
+  if( resort) {
+    //
+    // Insertion sort: there are only a few presets and usually only
+    // one of them has moved.
+    //
+    for( i=1; i<t->n; i++) {
+      k = t->by_position[i];
+      for( j=i; j>0 && t->slots[t->by_position[j-1]]->position > t->slots[k]->position; j--)
+	t->by_position[j] = t->by_position[j-1];
+      t->by_position[j] = k;
+    }
   }
-  pthread_mutex_unlock( &lsredis_preset_list_mutex);
+}
+
+/** Set up the preset table for a motor
+ *  Called once, when the motor is initialized.  From then on the
+ *  table follows <motor>.presets.* on its own.
+ */
+void lsredis_load_presets( lspmac_motor_t *mp) {
+  lsredis_presets_t *t;
+
+  t = &mp->presets;
+  pthread_mutex_init( &t->mutex, &mutex_initializer);
+  t->changes      = 1;
+  t->seen         = 0;
+  t->length_dirty = 1;
+  t->n            = 0;
+  t->nslots       = 0;
+  t->slots        = NULL;
+  t->by_position  = NULL;
+  lsredis_map_init( &t->names, 16);
+
+  lsredis_set_onChange( mp->presets_length, lsredis_presets_length_changed, t);
+
+  pthread_mutex_lock( &t->mutex);
+  lsredis_presets_refresh( mp);
+  pthread_mutex_unlock( &t->mutex);
+}
+
+/** Return the index of a motor's preset or -1 if there is no such preset
+ *  Must be called with the table mutex locked
+ */
+static int lsredis_presets_find( lspmac_motor_t *mp, char *preset_name) {
+  lsredis_presets_refresh( mp);
+  return (int)(intptr_t)lsredis_map_find( &mp->presets.names, preset_name) - 1;
 }
 
 /** Get the value of the given preset and return it in dval
  *  Returns 0 on error, non-zero on success;
  */
 int lsredis_find_preset( char *motor_name, char *preset_name, double *dval) {
-  char s[512];
-  int err;
-  ENTRY entry_in, *entry_outp;
-  lsredis_preset_list_t *pl;
-
-  snprintf( s, sizeof( s)-1, "%s%s", motor_name, preset_name);
-  s[sizeof(s)-1] = 0;
+  lspmac_motor_t *mp;
+  int i;
 
-  entry_in.key  = s;
-  entry_in.data = NULL;
-  err = hsearch_r( entry_in, FIND, &entry_outp, &lsredis_preset_ht);
+  mp = lspmac_find_motor_by_name( motor_name);
+  if( mp == NULL) {
+    lslogging_log_message( "lsredis_find_preset: no motor named '%s' to look for preset '%s'", motor_name, preset_name);
+    *dval = 0.0;
+    return 0;
+  }
 
-  if( err == 0) {
-    // not found (or some other problem that means we don't have an answer
-    //
-    // Maybe someone added a new preset and we don't know about it yet
-    //
-    lsredis_load_presets( motor_name);
-    err = hsearch_r( entry_in, FIND, &entry_outp, &lsredis_preset_ht);
-    if( err == 0) {
-      //
-      // Guess not.  Give up.  We tried
-      //
-      lslogging_log_message( "lsredis_find_preset: no preset named '%s' for motor '%s' found", preset_name, motor_name);
-      *dval = 0.0;
-      return 0;
-    }
+  pthread_mutex_lock( &mp->presets.mutex);
+  i = lsredis_presets_find( mp, preset_name);
+  if( i < 0) {
+    pthread_mutex_unlock( &mp->presets.mutex);
+    lslogging_log_message( "lsredis_find_preset: no preset named '%s' for motor '%s' found", preset_name, motor_name);
+    *dval = 0.0;
+    return 0;
   }
-  pl = entry_outp->data;
-  *dval = lsredis_getd( pl->position);
+  *dval = mp->presets.slots[i]->position;
+  pthread_mutex_unlock( &mp->presets.mutex);
   return 1;
 }
 
@@ -1010,14 +2341,12 @@ int lsredis_find_preset( char *motor_name, char *preset_name, double *dval) {
  */
 void lsredis_set_preset( char *motor_name, char *preset_name, double dval) {
   static const char *id = "lsredis_set_preset";
-  char s[512];
   int plength;
   int err;
+  int i;
   double min_pos, max_pos, neutral_pos;
   lspmac_motor_t *mp;
-  ENTRY entry_in, *entry_outp;
-  lsredis_obj_t *p1, *p2, *presets_length_p;
-  lsredis_preset_list_t *pl;
+  lsredis_obj_t *p1, *p2;
   struct timespec timeout;
 
   if (preset_name[0] == 0) {
@@ -1031,44 +2360,38 @@ void lsredis_set_preset( char *motor_name, char *preset_name, double dval) {
   }
 
   mp = lspmac_find_motor_by_name( motor_name);
-  if( mp) {
-    neutral_pos = lsredis_getd( mp->neutral_pos);
-    min_pos     = lsredis_getd( mp->min_pos) - neutral_pos;
-    max_pos     = lsredis_getd( mp->max_pos) - neutral_pos;
-    if( dval < min_pos || dval > max_pos) {
-      lslogging_log_message( "Cannot set preset '%s' for motor '%s' to %.3f  min pos: %.3f   max pos: %.3f\n", preset_name, motor_name, dval, min_pos, max_pos);
-      lsredis_sendStatusReport( 1, "Point out of range. Try again");
-      return;
-    }
+  if( mp == NULL) {
+    lslogging_log_message( "%s: no motor named '%s' to set preset '%s'", id, motor_name, preset_name);
+    return;
   }
 
-  snprintf( s, sizeof( s)-1, "%s%s", motor_name, preset_name);
-  s[sizeof(s)-1] = 0;
+  neutral_pos = lsredis_getd( mp->neutral_pos);
+  min_pos     = lsredis_getd( mp->min_pos) - neutral_pos;
+  max_pos     = lsredis_getd( mp->max_pos) - neutral_pos;
+  if( dval < min_pos || dval > max_pos) {
+    lslogging_log_message( "Cannot set preset '%s' for motor '%s' to %.3f  min pos: %.3f   max pos: %.3f\n", preset_name, motor_name, dval, min_pos, max_pos);
+    lsredis_sendStatusReport( 1, "Point out of range. Try again");
+    return;
+  }
 
-  entry_in.key  = s;
-  entry_in.data = NULL;
-  pthread_mutex_lock( &lsredis_preset_list_mutex);
-  err = hsearch_r( entry_in, FIND, &entry_outp, &lsredis_preset_ht);
-  if( err != 0) {
+  pthread_mutex_lock( &mp->presets.mutex);
+  i = lsredis_presets_find( mp, preset_name);
+  if( i >= 0) {
     //
     // Found it.  Things are simple.
     //
-    pl = entry_outp->data;
-    lsredis_setstr( pl->position, "%.3f", dval);
-    pthread_mutex_unlock( &lsredis_preset_list_mutex);
+    lsredis_setstr( mp->presets.slots[i]->position_p, "%.3f", dval);
+    pthread_mutex_unlock( &mp->presets.mutex);
     return;
   }
   //
-  // OK, our preset was not found, add it
+  // OK, our preset was not found, add it.  The table picks up the new
+  // entry from the changes to presets.length and friends.
   //
-  presets_length_p = lsredis_get_obj(  "%s.presets.length", motor_name);
-  plength = lsredis_get_or_set_l( presets_length_p, 0);
+  plength = lsredis_get_or_set_l( mp->presets_length, 0);
   plength += 1;
 
-  snprintf( s, sizeof( s)-1, "%s.%s.presets.%d.name", lsredis_head, motor_name, plength-1);
-  s[sizeof(s)-1] = 0;
-
-  p1 = lsredis_get_obj( "%s.presets.%d.name", motor_name, plength-1);
+  p1 = lsredis_family_get( &mp->preset_names, plength-1);
   pthread_mutex_lock( &p1->mutex);
   err = 0;
   while( err == 0 && p1->valid == 0)
@@ -1080,73 +2403,68 @@ void lsredis_set_preset( char *motor_name, char *preset_name, double dval) {
   pthread_mutex_unlock( &p1->mutex);
   lsredis_setstr( p1, "%s", preset_name);
   
-  p2 = lsredis_get_obj( "%s.presets.%d.position", motor_name, plength-1);
+  p2 = lsredis_family_get( &mp->preset_positions, plength-1);
   lsredis_setstr( p2, "%.3f", dval);
   
-  lsredis_setstr( presets_length_p, "%ld", plength);
+  lsredis_setstr( mp->presets_length, "%ld", plength);
 
-  pthread_mutex_unlock( &lsredis_preset_list_mutex);
-  lsredis_load_presets( motor_name);
+  pthread_mutex_unlock( &mp->presets.mutex);
 }
 
 /** For the given motor object return the index of the current preset or -1 if we are not at a preset position
+ *  When more than one preset is close enough the lowest index wins.
  */
 int lsredis_find_preset_index_by_position( lspmac_motor_t *mp) {
-  lsredis_obj_t *p;
-  int plength;
-  int i;
+  lsredis_presets_t *t;
   double ur, pos;
+  int lo, hi, mid;
+  int rtn;
 
-  p = lsredis_get_obj( "%s.presets.length", mp->name);
-  plength = lsredis_get_or_set_l( p, 0);
-  
-  if( plength <= 0) {
-    return -1;
-  }
-
-  ur = lsredis_getd( mp->update_resolution);
+  ur  = lsredis_getd( mp->update_resolution);
   pos = lspmac_getPosition( mp);
 
-  for( i=0; i<plength; i++) {
-    p = lsredis_get_obj( "%s.presets.%d.position", mp->name, i);
-    if( fabs( pos - lsredis_getd( p)) <= ur) {
-      return i;
-    }
+  t = &mp->presets;
+  pthread_mutex_lock( &t->mutex);
+  lsredis_presets_refresh( mp);
+
+  //
+  // First preset at or above pos - ur
+  //
+  lo = 0;
+  hi = t->n;
+  while( lo < hi) {
+    mid = (lo + hi) / 2;
+    if( t->slots[t->by_position[mid]]->position < pos - ur)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  rtn = -1;
+  for( ; lo < t->n && t->slots[t->by_position[lo]]->position <= pos + ur; lo++) {
+    if( rtn == -1 || t->by_position[lo] < rtn)
+      rtn = t->by_position[lo];
   }
-  return -1;
+  pthread_mutex_unlock( &t->mutex);
+
+  return rtn;
 }
 
-/** For the given motor object return the index of the named prefix or
- ** -1 if the preset is not found
+/** For the given motor object return one more than the index of the
+ ** named preset or -1 if the preset is not found
+ **
+ ** The extra one is what the old linear search returned and
+ ** lspmac_scint_maybe_return_sample_cb depends on it; leave it alone
+ ** until that caller is fixed too.
  */
 int lsredis_find_preset_index_by_name( lspmac_motor_t *mp, char *searchPresetName) {
-  lsredis_obj_t *p;
-  char *tmp;
-  int plength;
-  int i;
-  int found;
-
-  p = lsredis_get_obj( "%s.presets.length", mp->name);
-  plength = lsredis_get_or_set_l( p, 0);
-  if( plength <= 0) {
-    return -1;
-  }
+  int rtn;
 
-  found = 0;
-  for( i=0; i<plength && !found; i++) {
-    p = lsredis_get_obj( "%s.presets.%d.name", mp->name, i);
-    tmp = lsredis_getstr( p);
-    if( tmp) {
-      if( strcmp( tmp, searchPresetName) == 0) {
-	found = 1;
-      }
-      free( tmp);
-    }
-  }
+  pthread_mutex_lock( &mp->presets.mutex);
+  rtn = lsredis_presets_find( mp, searchPresetName);
+  pthread_mutex_unlock( &mp->presets.mutex);
 
-  if( !found)
-    return -1;
-  return i;
+  return rtn < 0 ? -1 : rtn + 1;
 }
 
 /** send log message to our redis log key
@@ -1309,7 +2627,10 @@ void lsredis_sendStatusReport( int severity, char *fmt, ...) {
     emsg[j+1] = 0;
   }
 
-  lsredis_setstr( messp, "{\"severity\": %d, \"msg\": \"%s\"}", severity, emsg);
+  //
+  // The same message twice in a row is still news
+  //
+  lsredis_setstr_force( messp, "{\"severity\": %d, \"msg\": \"%s\"}", severity, emsg);
 }
 
 
@@ -1352,6 +2673,13 @@ void lsredis_configCB( redisAsyncContext *ac, void *reply, void *privdata) {
       lsredis_publisher = strdup( r3->str);
     }
 
+    //
+    // Send values along with our publications
+    //
+    if( strcmp( r2->str, "PUSH")==0) {
+      lsredis_push_values = r3->str[0] == '1' ? 1 : 0;
+    }
+
     if( strcmp( r2->str, "PG")==0) {
       pgpmac_use_pg = r3->str[0] == '0' ? 0 : 1;
     }
@@ -1376,6 +2704,8 @@ void lsredis_configCB( redisAsyncContext *ac, void *reply, void *privdata) {
       if (lsredis_key_select_regex.re_nsub > 0) {
 	regfree(&lsredis_key_select_regex); // cleanup old compiled regex
       }
+      free( lsredis_key_select);
+      lsredis_key_select = strdup( r3->str);
       err = regcomp(&lsredis_key_select_regex, r3->str, REG_EXTENDED);
       if (err != 0) {
 	nerrmsg = regerror(err, &lsredis_key_select_regex, NULL, 0);
@@ -1402,92 +2732,361 @@ void lsredis_configCB( redisAsyncContext *ac, void *reply, void *privdata) {
   */
 
 
-  if( redisAsyncCommand( subac, lsredis_subCB, NULL, "PSUBSCRIBE REDIS_PV_CONNECTOR REDIS_PG_CONNECTOR REDIS_NODE_CONNECTOR mk_pgpmac_redis UI* MD2-* DETECTOR-21-ID-*") == REDIS_ERR) {
+  if( subac == NULL || redisAsyncCommand( subac, lsredis_subCB, NULL, LSREDIS_PSUBSCRIBE) == REDIS_ERR) {
     lslogging_log_message( "Error sending PSUBSCRIBE command");
   }
-  redisAsyncCommand( roac, lsredis_keysCB, NULL, "KEYS *");
+  //
+  // Load everything under our head, a batch at a time
+  //
+  clock_gettime( CLOCK_MONOTONIC, &lsredis_load_start);
+  lsredis_scan_start();
 
   pthread_cond_signal( &lsredis_config_cond);
   pthread_mutex_unlock( &lsredis_config_mutex);
 }
 
 
-/** Initialize this module, that is, set up the connections
- *  \param pub  Publish under this (unique) name
- *  \param re   Regular expression to select keys we want to mirror
- *  \param head Prepend this (+ a dot) to the beginning of requested objects
+/** Find the connection a hiredis context belongs to
  */
-void lsredis_init() {
-  static const char *id = "lsredis_init";
-  int err;
+static lsredis_conn_t *lsredis_find_conn( const redisAsyncContext *ac) {
+  int i;
+
+  for( i=0; i<LSREDIS_NCONNS; i++) {
+    if( *lsredis_conns[i].acp == ac)
+      return &lsredis_conns[i];
+  }
+  return NULL;
+}
+
+/** Try this connection again after its backoff period and lengthen the period for next time
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_schedule_reconnect( lsredis_conn_t *cp) {
+  lsredis_resync_needed = 1;
+
+  lstimer_set_timer_cb( cp->name, 1, cp->backoff_ms / 1000, (cp->backoff_ms % 1000) * 1000000, lsredis_reconnect_cb);
+
+  cp->backoff_ms *= 2;
+  if( cp->backoff_ms > LSREDIS_BACKOFF_MAX_MS)
+    cp->backoff_ms = LSREDIS_BACKOFF_MAX_MS;
+}
+
+/** Refetch an object as part of a resync
+ *  Called for each object by lsredis_map_foreach with lsredis_mutex locked
+ */
+static void lsredis_resync_obj( char *key, void *data, void *arg) {
+  static const char *id = "lsredis_resync_obj";
+  lsredis_batch_t **bp;
+  lsredis_obj_t *p;
+  int ours;
 
+  bp = arg;
+  p  = data;
 
   //
-  // set up hash map to store redis objects
+  // Publications we were waiting for may have been lost with the
+  // connection.  Only count the writes still to come: queued, held
+  // in a batch, or counted by a writer that is waiting for
+  // lsredis_mutex (which we hold) to send them.  Values we are about
+  // to write are newer than what redis has so don't refetch those.
   //
-  err = hcreate_r( 8192, &lsredis_htab);
-  if( err == 0) {
-    lslogging_log_message( "%s: Cannot create hash table.  Really bad things are going to happen.  hcreate_r returned %d", id, err);
+  pthread_mutex_lock( &p->mutex);
+  ours = p->unsent + p->batched + p->sending;
+  p->wait_for_me = ours;
+  lsredis_clear_pushed( p);
+  pthread_mutex_unlock( &p->mutex);
+
+  if( ours)
+    return;
+
+  if( *bp == NULL) {
+    *bp = calloc( 1, sizeof( lsredis_batch_t) + LSREDIS_SCAN_COUNT * sizeof( lsredis_obj_t *));
+    if( *bp == NULL) {
+      lslogging_log_message( "%s: out of memory", id);
+      exit( -1);
+    }
+    (*bp)->resync = 1;
   }
 
-  pthread_cond_init( &lsredis_cond, NULL);
+  (*bp)->p[(*bp)->n++] = p;
+  lsredis_resync_objs++;
+
+  if( (*bp)->n == LSREDIS_SCAN_COUNT) {
+    lsredis_batch_get( *bp);
+    *bp = NULL;
+  }
+}
+
+/** All the values asked for by a resync are back
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_resync_done() {
+  static const char *id = "lsredis_resync_done";
+  struct timespec now;
+  double secs;
+
+  if( lsredis_resync_needed) {
+    //
+    // Lost a connection again before we finished.  The next resync
+    // will have to do.
+    //
+    lslogging_log_message( "%s: resync interrupted", id);
+    return;
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - lsredis_resync_start.tv_sec) + (now.tv_nsec - lsredis_resync_start.tv_nsec)/1.e9;
+
+  lsredis_n_resyncs++;
+  lsredis_resync_last_secs = secs;
+  if( secs > lsredis_resync_max_secs)
+    lsredis_resync_max_secs = secs;
+
+  lslogging_log_message( "%s: refetched %d objects and replayed %d writes in %.3f seconds", id, lsredis_resync_objs, lsredis_resync_writes, secs);
+}
+
+/** Bring everything up to date once all our connections are back
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_resync() {
+  static const char *id = "lsredis_resync";
+  lsredis_batch_t *b;
+  int i;
+
+  for( i=0; i<LSREDIS_NCONNS; i++) {
+    if( *lsredis_conns[i].acp == NULL)
+      return;
+  }
+  lsredis_resync_needed = 0;
+
+  if( lsredis_head == NULL) {
+    //
+    // Never got our configuration.  lsredis_configCB does the rest.
+    //
+    if( lsredis_config_host != NULL)
+      redisAsyncCommand( roac, lsredis_configCB, NULL, "hgetall config.%s", lsredis_config_host);
+    return;
+  }
+
+  lslogging_log_message( "%s: resynchronizing with redis", id);
+  clock_gettime( CLOCK_MONOTONIC, &lsredis_resync_start);
+  lsredis_resync_objs    = 0;
+  lsredis_resync_writes  = 0;
+  lsredis_resync_pending = 0;
+
+  if( redisAsyncCommand( subac, lsredis_subCB, NULL, LSREDIS_PSUBSCRIBE) == REDIS_ERR) {
+    lslogging_log_message( "%s: Error sending PSUBSCRIBE command", id);
+  }
+
+  if( lsredis_load_lost) {
+    lsredis_load_lost = 0;
+    lsredis_scan_start();
+  }
+
+  b = NULL;
+  lsredis_map_foreach( &lsredis_objs, lsredis_resync_obj, &b);
+  if( b != NULL)
+    lsredis_batch_get( b);
+
+  lsredis_resync_writes = lsredis_replay_unsent();
+
+  if( lsredis_resync_pending == 0)
+    lsredis_resync_done();
+}
+
+/** A connection attempt has finished, one way or the other
+ */
+void lsredis_connectCB( const redisAsyncContext *ac, int status) {
+  static const char *id = "lsredis_connectCB";
+  lsredis_conn_t *cp;
+
+  pthread_mutex_lock( &lsredis_mutex);
+  cp = lsredis_find_conn( ac);
+  if( cp == NULL) {
+    pthread_mutex_unlock( &lsredis_mutex);
+    return;
+  }
+
+  if( status != REDIS_OK) {
+    //
+    // hiredis frees the context when we return
+    //
+    lslogging_log_message( "%s: %s could not connect to %s:%d: %s", id, cp->name, lsredis_host, lsredis_port, ac->errstr);
+    *cp->acp = NULL;
+    lsredis_schedule_reconnect( cp);
+    pthread_mutex_unlock( &lsredis_mutex);
+    return;
+  }
+
+  cp->backoff_ms = LSREDIS_BACKOFF_MIN_MS;
+  if( cp->lost) {
+    cp->lost = 0;
+    lsredis_n_reconnects++;
+    lslogging_log_message( "%s: %s reconnected to %s:%d", id, cp->name, lsredis_host, lsredis_port);
+  }
+
+  if( lsredis_resync_needed)
+    lsredis_resync();
+  pthread_mutex_unlock( &lsredis_mutex);
+}
+
+/** call back in case a redis server becomes disconnected
+ *  Replies still outstanding have already been handed to their
+ *  callbacks as NULL.  hiredis frees the context when we return.
+ */
+void lsredis_disconnectCB( const redisAsyncContext *ac, int status) {
+  static const char *id = "lsredis_disconnectCB";
+  lsredis_conn_t *cp;
+
+  pthread_mutex_lock( &lsredis_mutex);
+  cp = lsredis_find_conn( ac);
+  if( cp != NULL) {
+    lslogging_log_message( "%s: %s disconnected with status %d: %s", id, cp->name, status, ac->errstr == NULL ? "" : ac->errstr);
+    *cp->acp = NULL;
+    cp->lost = 1;
+    lsredis_schedule_reconnect( cp);
+  }
+  pthread_mutex_unlock( &lsredis_mutex);
+}
 
-  subac = redisAsyncConnect("127.0.0.1", 6379);
-  if( subac->err) {
-    lslogging_log_message( "Error: %s", subac->errstr);
+/** Start connecting to the redis server
+ *  The connection completes (or fails) in lsredis_connectCB.
+ *  Must be called with lsredis_mutex locked
+ */
+static void lsredis_connect( lsredis_conn_t *cp) {
+  static const char *id = "lsredis_connect";
+  redisAsyncContext *ac;
+
+  ac = redisAsyncConnect( lsredis_host, lsredis_port);
+  if( ac == NULL) {
+    lslogging_log_message( "%s: out of memory", id);
+    exit( -1);
+  }
+
+  if( ac->err) {
+    lslogging_log_message( "%s: %s Error: %s", id, cp->name, ac->errstr);
+    redisAsyncFree( ac);
+    cp->lost = 1;
+    lsredis_schedule_reconnect( cp);
+    return;
   }
 
-  subfd.fd           = subac->c.fd;
-  subfd.events       = 0;
-  subac->ev.data     = &subfd;
-  subac->ev.addRead  = lsredis_addRead;
-  subac->ev.delRead  = lsredis_delRead;
-  subac->ev.addWrite = lsredis_addWrite;
-  subac->ev.delWrite = lsredis_delWrite;
-  subac->ev.cleanup  = lsredis_cleanup;
+  cp->pfd->fd     = ac->c.fd;
+  cp->pfd->events = 0;
+  ac->ev.data     = cp->pfd;
+  ac->ev.addRead  = lsredis_addRead;
+  ac->ev.delRead  = lsredis_delRead;
+  ac->ev.addWrite = lsredis_addWrite;
+  ac->ev.delWrite = lsredis_delWrite;
+  ac->ev.cleanup  = lsredis_cleanup;
+
+  redisAsyncSetConnectCallback( ac, lsredis_connectCB);
+  redisAsyncSetDisconnectCallback( ac, lsredis_disconnectCB);
+
+  *cp->acp = ac;
 
-  roac = redisAsyncConnect("127.0.0.1", 6379);
-  if( roac->err) {
-    lslogging_log_message( "%s: Error: %s", id, roac->errstr);
+  //
+  // hiredis finishes connecting when the socket is first writable.
+  // At startup our first command takes care of that (and our thread is not running yet).
+  //
+  if( lsredis_running)
+    lsredis_addWrite( cp->pfd);
+}
+
+/** Time to try a dropped connection again
+ *  Called from the timer thread.
+ */
+void lsredis_reconnect_cb( char *event, struct timespec *due, unsigned long int overruns) {
+  int i;
+
+  pthread_mutex_lock( &lsredis_mutex);
+  for( i=0; i<LSREDIS_NCONNS; i++) {
+    if( strcmp( event, lsredis_conns[i].name) == 0 && *lsredis_conns[i].acp == NULL) {
+      lsredis_connect( &lsredis_conns[i]);
+    }
   }
+  pthread_mutex_unlock( &lsredis_mutex);
+}
+
+/** How long does it take for other people's changes to show up here?
+ *  pushed counts values that came with their publication (and said when they
+ *  were written), timed from the write.  fetched counts values we had to ask
+ *  for, timed from the publication.  Means and maxima are in seconds.
+ */
+void lsredis_sync_stats( unsigned long int *pushed, double *push_mean_secs, double *push_max_secs,
+			 unsigned long int *fetched, double *fetch_mean_secs, double *fetch_max_secs) {
+  pthread_mutex_lock( &lsredis_mutex);
+  *pushed          = lsredis_n_pushed;
+  *push_mean_secs  = lsredis_n_pushed  == 0 ? 0.0 : lsredis_push_sum_secs  / lsredis_n_pushed;
+  *push_max_secs   = lsredis_push_max_secs;
+  *fetched         = lsredis_n_fetched;
+  *fetch_mean_secs = lsredis_n_fetched == 0 ? 0.0 : lsredis_fetch_sum_secs / lsredis_n_fetched;
+  *fetch_max_secs  = lsredis_fetch_max_secs;
+  pthread_mutex_unlock( &lsredis_mutex);
+}
 
-  rofd.fd           = roac->c.fd;
-  rofd.events       = 0;
-  roac->ev.data     = &rofd;
-  roac->ev.addRead  = lsredis_addRead;
-  roac->ev.delRead  = lsredis_delRead;
-  roac->ev.addWrite = lsredis_addWrite;
-  roac->ev.delWrite = lsredis_delWrite;
-  roac->ev.cleanup  = lsredis_cleanup;
+/** How often have we lost redis and how long did it take to catch up?
+ */
+void lsredis_connection_stats( int *reconnects, int *resyncs, double *last_resync_secs, double *max_resync_secs) {
+  pthread_mutex_lock( &lsredis_mutex);
+  *reconnects       = lsredis_n_reconnects;
+  *resyncs          = lsredis_n_resyncs;
+  *last_resync_secs = lsredis_resync_last_secs;
+  *max_resync_secs  = lsredis_resync_max_secs;
+  pthread_mutex_unlock( &lsredis_mutex);
+}
 
-  wrac = redisAsyncConnect("127.0.0.1", 6379);
-  if( wrac->err) {
-    lslogging_log_message( "Error: %s", wrac->errstr);
+/** Drop all our connections as though the server had gone away.
+ *  They come back after the usual backoff and we resync.  For testing.
+ */
+void lsredis_drop_connections() {
+  int i;
+
+  pthread_mutex_lock( &lsredis_mutex);
+  for( i=0; i<LSREDIS_NCONNS; i++) {
+    if( *lsredis_conns[i].acp != NULL)
+      shutdown( (*lsredis_conns[i].acp)->c.fd, SHUT_RDWR);
   }
+  pthread_mutex_unlock( &lsredis_mutex);
+}
 
-  wrfd.fd           = wrac->c.fd;
-  wrfd.events       = 0;
-  wrac->ev.data     = &wrfd;
-  wrac->ev.addRead  = lsredis_addRead;
-  wrac->ev.delRead  = lsredis_delRead;
-  wrac->ev.addWrite = lsredis_addWrite;
-  wrac->ev.delWrite = lsredis_delWrite;
-  wrac->ev.cleanup  = lsredis_cleanup;
+/** Initialize this module, that is, set up the connections
+ *  \param pub  Publish under this (unique) name
+ *  \param re   Regular expression to select keys we want to mirror
+ *  \param head Prepend this (+ a dot) to the beginning of requested objects
+ */
+void lsredis_init() {
+  static const char *id = "lsredis_init";
+  int i;
 
 
-  // separate hash table for the presets
   //
-  memset(&lsredis_preset_ht, 0, sizeof(lsredis_preset_ht));
-  hcreate_r(lsredis_preset_max_n * 2, &lsredis_preset_ht);
+  // set up hash map to store redis objects
+  //
+  lsredis_map_init( &lsredis_objs, 8192);
+
+  pthread_cond_init( &lsredis_cond, NULL);
+
+  const char* redis_host = getenv("LS_REDIS_HOSTNAME");
+  if (redis_host != NULL) {
+    lsredis_host = strdup(redis_host);
+  }
+  const char* redis_port = getenv("LS_REDIS_PORT");
+  if (redis_port != NULL && atoi(redis_port) > 0) {
+    lsredis_port = atoi(redis_port);
+  }
+  lslogging_log_message( "%s: using redis server %s:%d", id, lsredis_host, lsredis_port);
 
   pthread_mutexattr_init( &mutex_initializer);
   pthread_mutexattr_settype( &mutex_initializer, PTHREAD_MUTEX_RECURSIVE);
 
   pthread_mutex_init( &lsredis_mutex, &mutex_initializer);
-  pthread_mutex_init( &lsredis_preset_list_mutex, &mutex_initializer);
   pthread_mutex_init( &lsredis_config_mutex, &mutex_initializer);
   pthread_cond_init(  &lsredis_config_cond,  NULL);
 
+  for( i=0; i<LSREDIS_NCONNS; i++) {
+    lsredis_connect( &lsredis_conns[i]);
+  }
 }
 
 void lsredis_config() {
@@ -1504,7 +3103,15 @@ void lsredis_config() {
     lhostname[i] = 0;
 
     lslogging_log_message( "%s: our host name is '%s'", id, lhostname);
-    redisAsyncCommand( roac, lsredis_configCB, NULL, "hgetall config.%s", lhostname);
+
+    //
+    // If we are not connected yet the request goes out with the resync
+    //
+    pthread_mutex_lock( &lsredis_mutex);
+    lsredis_config_host = strdup( lhostname);
+    if( roac != NULL)
+      redisAsyncCommand( roac, lsredis_configCB, NULL, "hgetall config.%s", lhostname);
+    pthread_mutex_unlock( &lsredis_mutex);
   }
   
   pthread_mutex_lock( &lsredis_config_mutex);
@@ -1537,24 +3144,20 @@ const char *lsredis_get_head() {
 /** service the socket requests
  */
 void lsredis_fd_service( struct pollfd *evt) {
+  lsredis_conn_t *cp;
+  int i;
+
   pthread_mutex_lock( &lsredis_mutex);
-  if( evt->fd == subac->c.fd) {
-    if( evt->revents & POLLIN)
-      redisAsyncHandleRead( subac);
-    if( evt->revents & POLLOUT)
-      redisAsyncHandleWrite( subac);
-  }
-  if( evt->fd == roac->c.fd) {
-    if( evt->revents & POLLIN)
-      redisAsyncHandleRead( roac);
-    if( evt->revents & POLLOUT)
-      redisAsyncHandleWrite( roac);
-  }
-  if( evt->fd == wrac->c.fd) {
-    if( evt->revents & POLLIN)
-      redisAsyncHandleRead( wrac);
-    if( evt->revents & POLLOUT)
-      redisAsyncHandleWrite( wrac);
+  for( i=0; i<LSREDIS_NCONNS; i++) {
+    cp = &lsredis_conns[i];
+    //
+    // Check the context each time: handling a read or a write can
+    // lose the connection and free the context.
+    //
+    if( *cp->acp != NULL && evt->fd == (*cp->acp)->c.fd && (evt->revents & POLLIN))
+      redisAsyncHandleRead( *cp->acp);
+    if( *cp->acp != NULL && evt->fd == (*cp->acp)->c.fd && (evt->revents & POLLOUT))
+      redisAsyncHandleWrite( *cp->acp);
   }
   pthread_mutex_unlock( &lsredis_mutex);
 }
@@ -1577,8 +3180,20 @@ void lsredis_sig_service(
 
 }
 
-void lsredis_heartbeat_cb( char *event) {
+/** Publish the time once a second
+ *  Called directly from the timer thread.
+ */
+void lsredis_heartbeat_cb( char *event, struct timespec *due, unsigned long int overruns) {
   static lsredis_obj_t *hb_time = NULL;
+  static unsigned long int hb_count = 0;
+  static unsigned long int last_writes = 0, last_commands = 0, last_suppressed = 0;
+  static unsigned long int last_pushed = 0, last_fetched = 0;
+  static int last_reconnects = 0, last_resyncs = 0;
+  unsigned long int writes, commands, suppressed;
+  unsigned long int pushed, fetched;
+  double push_mean, push_max, fetch_mean, fetch_max;
+  int reconnects, resyncs;
+  double resync_last, resync_max;
   struct timespec now;
   struct tm lnow;
   char snow[64];
@@ -1598,6 +3213,35 @@ void lsredis_heartbeat_cb( char *event) {
   msecs = now.tv_nsec / 1000;
   strftime( snow, sizeof(snow)-1, "%Y-%m-%d %H:%M:%S", &lnow);
   lsredis_setstr( hb_time, "%s.%.06u", snow, msecs);
+
+  //
+  // Once a minute report what batching and dropping unchanged values has saved us
+  //
+  if( ++hb_count % 60 == 0) {
+    lsredis_write_stats( &writes, &commands, &suppressed);
+    if( commands - last_commands < 4 * (writes - last_writes) || suppressed != last_suppressed)
+      lslogging_log_message( "lsredis_heartbeat_cb: %lu writes in %lu commands over the last minute, %.1f commands/s saved, %lu unchanged writes dropped",
+			     writes - last_writes, commands - last_commands,
+			     (4.0 * (writes - last_writes) - (commands - last_commands)) / 60.0,
+			     suppressed - last_suppressed);
+    last_writes     = writes;
+    last_commands   = commands;
+    last_suppressed = suppressed;
+
+    lsredis_sync_stats( &pushed, &push_mean, &push_max, &fetched, &fetch_mean, &fetch_max);
+    if( pushed != last_pushed || fetched != last_fetched)
+      lslogging_log_message( "lsredis_heartbeat_cb: %lu values came with their publication (write to here mean %.3f ms, max %.3f ms), %lu were fetched (publication to here mean %.3f ms, max %.3f ms)",
+			     pushed, push_mean * 1000., push_max * 1000., fetched, fetch_mean * 1000., fetch_max * 1000.);
+    last_pushed  = pushed;
+    last_fetched = fetched;
+
+    lsredis_connection_stats( &reconnects, &resyncs, &resync_last, &resync_max);
+    if( reconnects != last_reconnects || resyncs != last_resyncs)
+      lslogging_log_message( "lsredis_heartbeat_cb: %d reconnects (%d new), %d resyncs (%d new), last resync took %.3f s, longest %.3f s",
+			     reconnects, reconnects - last_reconnects, resyncs, resyncs - last_resyncs, resync_last, resync_max);
+    last_reconnects = reconnects;
+    last_resyncs    = resyncs;
+  }
 }
 
 
@@ -1637,8 +3281,7 @@ void *lsredis_worker(  void *dummy) {
   pthread_cond_signal( &lsredis_cond);
   pthread_mutex_unlock( &lsredis_mutex);
 
-  lsevents_add_listener( "^Heartbeat$", lsredis_heartbeat_cb);
-  lstimer_set_timer( "Heartbeat", -1, 1, 0);
+  lstimer_set_timer_cb( "Heartbeat", -1, 1, 0, lsredis_heartbeat_cb);
 
   while(1) {
     nfda = 1;
@@ -89,6 +89,721 @@ void lstest_lspmac_est_move_time() {
 
 
 
-void lstest_main() {
+/** Seconds between two times
+ */
+static double lstest_elapsed( struct timespec *t1, struct timespec *t2) {
+  return (t2->tv_sec - t1->tv_sec) + (t2->tv_nsec - t1->tv_nsec)/1.e9;
+}
+
+#define LSTEST_BI_FRAMES 1000000	//!< status frames to run through each binary input scan
+
+/** Compare the old per input binary input scan with the grouped xor
+ *  scan now used by lspmac_get_status_cb.  Only the change detection
+ *  is timed (with the input mutex taken as the status callback does);
+ *  no events are sent.  The inputs are pointed at a scratch copy of
+ *  the status words which has a random bit flipped every 64 frames or so.
+ */
+void lstest_lspmac_bi_scan() {
+  struct timespec t1, t2;
+  lspmac_bi_t *bp;
+  lspmac_bi_group_t *gp;
+  int *base, *top;
+  int *words;
+  int nwords;
+  int prev_bi[32];
+  int prev_grp[32];
+  int changes_bi, changes_grp;
+  unsigned int seed, r;
+  unsigned int changed, seen;
+  lspmac_bi_link_t *lp;
+  int current, b;
+  int frame, i;
+  double bi_secs, grp_secs;
+
+  if( lspmac_nbis == 0)
+    return;
+
+  base = top = lspmac_bis[0].ptr;
+  for( i=1; i<lspmac_nbis; i++) {
+    if( lspmac_bis[i].ptr < base)
+      base = lspmac_bis[i].ptr;
+    if( lspmac_bis[i].ptr > top)
+      top = lspmac_bis[i].ptr;
+  }
+  nwords = top - base + 1;
+  words  = calloc( nwords, sizeof( int));
+  if( words == NULL) {
+    lslogging_log_message( "lstest_lspmac_bi_scan: out of memory");
+    return;
+  }
+
+  //
+  // Old way: every input, every frame
+  //
+  memset( prev_bi, 0, sizeof( prev_bi));
+  changes_bi = 0;
+  seed = 1;
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( frame=0; frame<LSTEST_BI_FRAMES; frame++) {
+    seed = seed * 1103515245 + 12345;
+    r = seed >> 16;
+    if( (r & 0x3f) == 0)
+      words[(r >> 6) % nwords] ^= 1 << ((r >> 12) & 0x0f);
+
+    for( i=0; i<lspmac_nbis; i++) {
+      bp = &(lspmac_bis[i]);
+      pthread_mutex_lock( &(bp->mutex));
+      current = (words[bp->ptr - base] & bp->mask) == 0 ? 0 : 1;
+      if( current != prev_bi[i]) {
+	changes_bi++;
+	prev_bi[i] = current;
+      }
+      pthread_mutex_unlock( &(bp->mutex));
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  bi_secs = lstest_elapsed( &t1, &t2);
+
+  //
+  // New way: one xor per status word, visit only changed bits
+  //
+  memset( words, 0, nwords * sizeof( int));
+  memset( prev_grp, 0, sizeof( prev_grp));
+  changes_grp = 0;
+  seed = 1;
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( frame=0; frame<LSTEST_BI_FRAMES; frame++) {
+    seed = seed * 1103515245 + 12345;
+    r = seed >> 16;
+    if( (r & 0x3f) == 0)
+      words[(r >> 6) % nwords] ^= 1 << ((r >> 12) & 0x0f);
+
+    for( i=0; i<lspmac_nbi_groups; i++) {
+      gp = &(lspmac_bi_groups[i]);
+      current = words[gp->ptr - base] & gp->mask;
+      changed = current ^ prev_grp[i];
+      prev_grp[i] = current;
+      seen = 0;
+      while( changed) {
+	b = __builtin_ctz( changed);
+	for( lp = gp->bits[b]; lp != NULL; lp = lp->next) {
+	  bp = lp->bp;
+	  if( bp->mask & seen)
+	    continue;
+	  pthread_mutex_lock( &(bp->mutex));
+	  changes_grp++;
+	  pthread_mutex_unlock( &(bp->mutex));
+	}
+	seen    |= 1u << b;
+	changed &= changed - 1;
+      }
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  grp_secs = lstest_elapsed( &t1, &t2);
+
+  free( words);
+
+  lslogging_log_message( "lstest_lspmac_bi_scan: %d inputs in %d words, %d frames", lspmac_nbis, lspmac_nbi_groups, LSTEST_BI_FRAMES);
+  lslogging_log_message( "lstest_lspmac_bi_scan: per input  %.1f ns/frame  %d changes", bi_secs  * 1.e9 / LSTEST_BI_FRAMES, changes_bi);
+  lslogging_log_message( "lstest_lspmac_bi_scan: grouped    %.1f ns/frame  %d changes", grp_secs * 1.e9 / LSTEST_BI_FRAMES, changes_grp);
+}
+
+#define LSTEST_MOTOR_FRAMES 1000	//!< status frames to run the motor read routines over
+
+/** Time the motor read routines the status callback runs every frame.
+ *  The status buffer is held still while we run so every pass after
+ *  the first finds nothing new to report, as on a quiet frame.  The
+ *  reads take each motor's mutex as the status thread does; the status
+ *  thread just waits for its next frame until we are done.
+ */
+void lstest_lspmac_status_frame() {
+  struct timespec t1, t2;
+  int frame;
+  double secs;
+
+  if( lspmac_nmotors == 0)
+    return;
+
+  pthread_mutex_lock( &md2_status_mutex);
+
+  lspmac_read_motors();
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( frame=0; frame<LSTEST_MOTOR_FRAMES; frame++)
+    lspmac_read_motors();
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  secs = lstest_elapsed( &t1, &t2);
+
+  pthread_mutex_unlock( &md2_status_mutex);
+
+  lslogging_log_message( "lstest_lspmac_status_frame: %d motors, %d frames, %.1f ns/frame", lspmac_nmotors, LSTEST_MOTOR_FRAMES, secs * 1.e9 / LSTEST_MOTOR_FRAMES);
+}
+
+#define LSTEST_EVENT_SENDS 100000
+
+/** Time sending coalescable events faster than anyone can listen to them.
+ *  Nothing should block; the excess shows up as dropped events.  Those
+ *  are real events too (timer ticks, for one) so this only runs when
+ *  asked for with "test disruptive".
+ */
+void lstest_lsevents_send() {
+  struct timespec t1, t2;
+  unsigned long dropped1, overflows1, dropped2, overflows2;
+  double secs;
+  int ev;
+  int i;
+
+  ev = lsevents_intern( "lstest flood");
+  lsevents_set_policy( ev, LSEVENTS_COALESCE);
+
+  lsevents_queue_stats( &dropped1, &overflows1);
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_EVENT_SENDS; i++) {
+    lsevents_send_event_id( ev);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  lsevents_queue_stats( &dropped2, &overflows2);
+  secs = lstest_elapsed( &t1, &t2);
+
+  lslogging_log_message( "lstest_lsevents_send: %d sends  %.1f ns/send  %lu dropped  %lu overflows",
+			 LSTEST_EVENT_SENDS, secs * 1.e9 / LSTEST_EVENT_SENDS, dropped2 - dropped1, overflows2 - overflows1);
+}
+
+#define LSTEST_COALESCE_EVENTS 100
+static int lstest_coalesce_calls;	//!< calls to lstest_coalesce_cb
+static int lstest_coalesce_suppressed;	//!< what lstest_coalesce_cb was last told
+static int lstest_coalesce_done;	//!< lstest_coalesce_done_cb has run
+
+static void lstest_coalesce_cb( char *event, int suppressed) {
+  __atomic_store_n( &lstest_coalesce_suppressed, suppressed, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch( &lstest_coalesce_calls, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Send our burst from the dispatch thread so none of it can be
+ *  delivered before all of it has been sent
+ */
+static void lstest_coalesce_send_cb( char *event) {
+  int ev;
+  int i;
+
+  ev = lsevents_intern( "lstest coalesce");
+  for( i=0; i<LSTEST_COALESCE_EVENTS; i++)
+    lsevents_send_event_id( ev);
+  lsevents_send_event( "lstest coalesce done");
+}
+
+static void lstest_coalesce_done_cb( char *event) {
+  __atomic_store_n( &lstest_coalesce_done, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Send a burst of events to a coalescing listener.  It should be
+ *  called once and told about all but one of them.
+ */
+void lstest_lsevents_coalesce() {
+  int ev;
+  int i;
+
+  ev = lsevents_intern( "lstest coalesce");
+  lsevents_add_coalescing_listener( "^lstest coalesce$",      lstest_coalesce_cb);
+  lsevents_add_listener(            "^lstest coalesce send$", lstest_coalesce_send_cb);
+  lsevents_add_listener(            "^lstest coalesce done$", lstest_coalesce_done_cb);
+
+  //
+  // Get the first instance, which builds the callback list, out of the way
+  //
+  lstest_coalesce_calls = 0;
+  lsevents_send_event_id( ev);
+  for( i=0; i<1000 && __atomic_load_n( &lstest_coalesce_calls, __ATOMIC_SEQ_CST) == 0; i++)
+    usleep( 1000);
+
+  lstest_coalesce_calls      = 0;
+  lstest_coalesce_suppressed = -1;
+  lstest_coalesce_done       = 0;
+  lsevents_send_event( "lstest coalesce send");
+  for( i=0; i<1000 && (!__atomic_load_n( &lstest_coalesce_done, __ATOMIC_SEQ_CST) || __atomic_load_n( &lstest_coalesce_calls, __ATOMIC_SEQ_CST) == 0); i++)
+    usleep( 1000);
+
+  //
+  // Give any extra calls time to show up
+  //
+  usleep( 100000);
+
+  lsevents_remove_coalescing_listener( "^lstest coalesce$",      lstest_coalesce_cb);
+  lsevents_remove_listener(            "^lstest coalesce send$", lstest_coalesce_send_cb);
+  lsevents_remove_listener(            "^lstest coalesce done$", lstest_coalesce_done_cb);
+
+  if( lstest_coalesce_calls != 1 || lstest_coalesce_suppressed != LSTEST_COALESCE_EVENTS - 1)
+    lslogging_log_message( "lstest_lsevents_coalesce: FAILED sent %d  calls %d  suppressed %d (expected 1 call with %d suppressed)",
+			   LSTEST_COALESCE_EVENTS, lstest_coalesce_calls, lstest_coalesce_suppressed, LSTEST_COALESCE_EVENTS - 1);
+  else
+    lslogging_log_message( "lstest_lsevents_coalesce: sent %d  calls %d  suppressed %d",
+			   LSTEST_COALESCE_EVENTS, lstest_coalesce_calls, lstest_coalesce_suppressed);
+}
+
+/** Compare the listener matcher with running every listener's regexec
+ *  over all the event names we know about.  The counts had better agree.
+ */
+void lstest_lsevents_match() {
+  struct timespec t1, t2;
+  double re_secs, trie_secs;
+  char *name;
+  int i, nnames, n_re, n_trie, mismatches;
+
+  mismatches = 0;
+  for( nnames=0; lsevents_id_name( nnames) != NULL; nnames++) {
+    name = lsevents_id_name( nnames);
+    if( lsevents_match_count( name, 1) != lsevents_match_count( name, 0)) {
+      lslogging_log_message( "lstest_lsevents_match: mismatch for '%s'", name);
+      mismatches++;
+    }
+  }
+
+  n_re = 0;
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<nnames; i++)
+    n_re += lsevents_match_count( lsevents_id_name( i), 1);
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  re_secs = lstest_elapsed( &t1, &t2);
+
+  n_trie = 0;
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<nnames; i++)
+    n_trie += lsevents_match_count( lsevents_id_name( i), 0);
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  trie_secs = lstest_elapsed( &t1, &t2);
+
+  lslogging_log_message( "lstest_lsevents_match: %d names  %d mismatches", nnames, mismatches);
+  lslogging_log_message( "lstest_lsevents_match: regexec all  %.2f us/name  %d matches", re_secs   * 1.e6 / (nnames ? nnames : 1), n_re);
+  lslogging_log_message( "lstest_lsevents_match: matcher      %.2f us/name  %d matches", trie_secs * 1.e6 / (nnames ? nnames : 1), n_trie);
+}
+
+#define LSTEST_TRACE_EVENTS 1000
+static int lstest_trace_n;		//!< events received by lstest_trace_cb
+static int lstest_trace_out_of_order;	//!< events received with the wrong ival[0]
+
+static void lstest_trace_cb( char *event, lsevents_payload_t *pl) {
+  if( pl->ival[0] != lstest_trace_n % LSTEST_TRACE_EVENTS)
+    lstest_trace_out_of_order++;
+  lstest_trace_n++;
+}
+
+/** Record some events, replay them, and see that they come back the
+ *  same and in the same order.
+ */
+void lstest_lsevents_trace() {
+  static char *path = "/tmp/lstest_events.trace";
+  lsevents_payload_t pl;
+  long n;
+  int ev;
+  int i;
+
+  ev = lsevents_intern( "lstest trace");
+  lsevents_add_payload_listener( "^lstest trace$", lstest_trace_cb);
+
+  lstest_trace_n            = 0;
+  lstest_trace_out_of_order = 0;
+
+  if( lsevents_trace_start( path)) {
+    lsevents_remove_payload_listener( "^lstest trace$", lstest_trace_cb);
+    lslogging_log_message( "lstest_lsevents_trace: FAILED could not start a trace in %s", path);
+    return;
+  }
+  memset( &pl, 0, sizeof( pl));
+  for( i=0; i<LSTEST_TRACE_EVENTS; i++) {
+    pl.ival[0] = i;
+    lsevents_send_event_id_payload( ev, &pl);
+  }
+  for( i=0; i<5000 && __atomic_load_n( &lstest_trace_n, __ATOMIC_SEQ_CST) < LSTEST_TRACE_EVENTS; i++)
+    usleep( 1000);
+  lsevents_trace_stop();
+
+  n = lsevents_trace_replay( path, 0.0, "^lstest trace$");
+  for( i=0; i<5000 && __atomic_load_n( &lstest_trace_n, __ATOMIC_SEQ_CST) < LSTEST_TRACE_EVENTS + n; i++)
+    usleep( 1000);
+
+  lsevents_remove_payload_listener( "^lstest trace$", lstest_trace_cb);
+
+  lslogging_log_message( "lstest_lsevents_trace: %ssent %d  replayed %ld  received %d  out of order %d",
+			 lstest_trace_n == LSTEST_TRACE_EVENTS + n ? "" : "FAILED ",
+			 LSTEST_TRACE_EVENTS, n, lstest_trace_n, lstest_trace_out_of_order);
+}
+
+#define LSTEST_TIMERS 10000
+
+static void lstest_lstimer_cb( char *event, struct timespec *due, unsigned long int overruns) {
+}
+
+/** Time setting and unsetting a lot of timers.  They are all set far
+ *  enough in the future that none of them should go off.  They are
+ *  callback timers so we don't leave 10k event names behind, and all
+ *  of them, along with a one shot timer that does go off, had better
+ *  be gone when we're done.
+ */
+void lstest_lstimer_10k() {
+  struct timespec t1, t2;
+  double set_secs, reset_secs, unset_secs;
+  char event[64];
+  int active0, active, active2;
+  int i;
+
+  active0 = lstimer_active_count();
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_TIMERS; i++) {
+    snprintf( event, sizeof( event), "lstest timer %d", i);
+    lstimer_set_timer_cb( event, 1, 3600 + i, 0, lstest_lstimer_cb);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  set_secs = lstest_elapsed( &t1, &t2);
+  active = lstimer_active_count();
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_TIMERS; i++) {
+    snprintf( event, sizeof( event), "lstest timer %d", (i * 7919) % LSTEST_TIMERS);
+    lstimer_set_timer_cb( event, 1, 7200 - i, 0, lstest_lstimer_cb);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  reset_secs = lstest_elapsed( &t1, &t2);
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_TIMERS; i++) {
+    snprintf( event, sizeof( event), "lstest timer %d", i);
+    lstimer_unset_timer( event);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  unset_secs = lstest_elapsed( &t1, &t2);
+  active2 = lstimer_active_count();
+
+  lstimer_set_timer_cb( "lstest one shot", 1, 0, 1000000, lstest_lstimer_cb);
+  usleep( 100000);
+
+  lslogging_log_message( "lstest_lstimer_10k: %d timers  %d active after set  %d active after unset",
+			 LSTEST_TIMERS, active - active0, active2 - active0);
+  if( active - active0 != LSTEST_TIMERS || active2 != active0)
+    lslogging_log_message( "lstest_lstimer_10k: FAILED expected %d active after set and 0 after unset", LSTEST_TIMERS);
+  if( lstimer_get_stats( "lstest one shot", NULL, NULL, NULL) == 0)
+    lslogging_log_message( "lstest_lstimer_10k: FAILED one shot timer still known after it went off");
+  lslogging_log_message( "lstest_lstimer_10k: set %.2f us  reset %.2f us  unset %.2f us per timer",
+			 set_secs * 1.e6 / LSTEST_TIMERS, reset_secs * 1.e6 / LSTEST_TIMERS, unset_secs * 1.e6 / LSTEST_TIMERS);
+}
+
+/** Run a fast periodic timer for a second and report how late it
+ *  fired.  The deadline is absolute so the first shot is on a round
+ *  millisecond.
+ */
+void lstest_lstimer_jitter() {
+  struct timespec deadline;
+
+  clock_gettime( CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec  += 1;
+  deadline.tv_nsec  = 0;
+  lstimer_set_timer_abs( "lstest jitter", -1, &deadline, 0, 2000000);
+  sleep( 2);
+  lstimer_report();
+  lstimer_unset_timer( "lstest jitter");
+}
+
+static unsigned long int lstest_rate_calls;	//!< calls to lstest_rate_cb
+
+static void lstest_rate_cb( char *event, struct timespec *due, unsigned long int overruns) {
+  lstest_rate_calls++;
+}
+
+/** Run a 500 us callback timer for a second and see how close we
+ *  get to 2000 calls per second.
+ */
+void lstest_lstimer_rate() {
+  unsigned long int fired, overruns;
+  double rate;
+
+  lstest_rate_calls = 0;
+  lstimer_set_timer_cb( "lstest rate", -1, 0, 500000, lstest_rate_cb);
+  sleep( 1);
+  lstimer_get_stats( "lstest rate", &fired, &overruns, &rate);
+  lstimer_unset_timer( "lstest rate");
+
+  lslogging_log_message( "lstest_lstimer_rate: %lu calls  %lu fired  %lu overruns  %.1f/s (asked for 2000/s)",
+			 lstest_rate_calls, fired, overruns, rate);
+}
+
+#define LSTEST_REDIS_SETS 100000
+/** Time a burst of value changes arriving for an object nobody reads
+ *  and count how many of them we actually parse.
+ */
+void lstest_lsredis_set_burst() {
+  struct timespec t1, t2;
+  unsigned long int sets1, parses1, aparses1, sets2, parses2, aparses2;
+  lsredis_obj_t *p;
+  double secs;
+  int i;
+
+  p = lsredis_get_obj( "lstest.scratch");
+  if( p == NULL)
+    return;
+
+  lsredis_parse_stats( &sets1, &parses1, &aparses1);
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    lsredis_set_value( p, "{%d,%d.5,\"x y\"}", i, i);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  secs = lstest_elapsed( &t1, &t2);
+  lsredis_getd( p);
+  lsredis_parse_stats( &sets2, &parses2, &aparses2);
+
+  lslogging_log_message( "lstest_lsredis_set_burst: %lu sets  %.2f us/set  %lu parses  %lu array parses",
+			 sets2 - sets1, secs * 1.e6 / LSTEST_REDIS_SETS, parses2 - parses1, aparses2 - aparses1);
+}
+
+/** Drop our redis connections, write while they are down, and see
+ *  that they all come back, that the write is replayed, and that our
+ *  value survives the resync.  Everyone else using redis in this
+ *  process sees the connections go too, and lstest.reconnect is left
+ *  behind in redis, so this only runs with "test disruptive".
+ */
+void lstest_lsredis_reconnect() {
+  int reconnects1, resyncs1, reconnects2, resyncs2;
+  unsigned long int writes1, writes2, dummy;
+  double last_secs, max_secs;
+  lsredis_obj_t *p;
+  char v[64], *got;
+  int i, ok;
+
+  p = lsredis_get_obj( "lstest.reconnect");
+  if( p == NULL)
+    return;
+
+  lsredis_connection_stats( &reconnects1, &resyncs1, &last_secs, &max_secs);
+  lsredis_write_stats( &writes1, &dummy, &dummy);
+
+  lsredis_drop_connections();
+
+  //
+  // The first reconnect waits a good deal longer than this
+  //
+  usleep( 20000);
+  snprintf( v, sizeof( v), "%ld", (long)time( NULL));
+  lsredis_setstr( p, "%s", v);
+
+  for( i=0; i<100; i++) {
+    usleep( 100000);
+    lsredis_connection_stats( &reconnects2, &resyncs2, &last_secs, &max_secs);
+    if( resyncs2 > resyncs1)
+      break;
+  }
+  lsredis_write_stats( &writes2, &dummy, &dummy);
+
+  got = lsredis_getstr( p);
+  ok  = resyncs2 > resyncs1 && reconnects2 - reconnects1 >= 3 && writes2 > writes1 && strcmp( got, v) == 0;
+
+  lslogging_log_message( "lstest_lsredis_reconnect: %s%d reconnects  %d resyncs  last resync %.3f s  value '%s' (wrote '%s')",
+			 ok ? "" : "FAILED ", reconnects2 - reconnects1, resyncs2 - resyncs1, last_secs, got, v);
+  free( got);
+}
+
+/** Compare copying a value with borrowing it
+ */
+void lstest_lsredis_borrow() {
+  struct timespec t1, t2;
+  double copy_secs, borrow_secs;
+  lsredis_obj_t *p;
+  char *v;
+  int i;
+
+  p = lsredis_get_obj( "lstest.scratch");
+  if( p == NULL)
+    return;
+  lsredis_set_value( p, "%%10.3f");
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    v = lsredis_getstr( p);
+    free( v);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  copy_secs = lstest_elapsed( &t1, &t2);
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    v = lsredis_borrow( p);
+    lsredis_release( v);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  borrow_secs = lstest_elapsed( &t1, &t2);
+
+  lslogging_log_message( "lstest_lsredis_borrow: getstr/free %.1f ns  borrow/release %.1f ns",
+			 copy_secs * 1.e9 / LSTEST_REDIS_SETS, borrow_secs * 1.e9 / LSTEST_REDIS_SETS);
+}
+
+/** Time preset lookups by name and by position and check that they agree
+ */
+void lstest_lsredis_presets() {
+  struct timespec t1, t2;
+  double name_secs, pos_secs;
+  double cover;
+  int i, by_name, by_pos;
+
+  if( !lsredis_find_preset( aperz->name, "Cover", &cover)) {
+    lslogging_log_message( "lstest_lsredis_presets: aperz has no Cover preset, skipping");
+    return;
+  }
+  if( lsredis_find_preset_index_by_name( aperz, "Cover") < 0) {
+    lslogging_log_message( "lstest_lsredis_presets: FAILED found Cover by value but not by index");
+    return;
+  }
+  if( lsredis_find_preset_index_by_name( aperz, "lstest no such preset") != -1) {
+    lslogging_log_message( "lstest_lsredis_presets: FAILED found a preset that does not exist");
+    return;
+  }
+
+  by_name = 0;
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    by_name += lsredis_find_preset_index_by_name( aperz, "Cover");
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  name_secs = lstest_elapsed( &t1, &t2);
+
+  by_pos = 0;
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    by_pos += lsredis_find_preset_index_by_position( aperz);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  pos_secs = lstest_elapsed( &t1, &t2);
+
+  lslogging_log_message( "lstest_lsredis_presets: by name %.1f ns  by position %.1f ns (%d %d)",
+			 name_secs * 1.e9 / LSTEST_REDIS_SETS, pos_secs * 1.e9 / LSTEST_REDIS_SETS,
+			 by_name / LSTEST_REDIS_SETS, by_pos / LSTEST_REDIS_SETS);
+}
+
+/** Compare lsredis_get_obj against cached handles for an indexed key
+ */
+void lstest_lsredis_handles() {
+  static lsredis_family_t fam = LSREDIS_FAMILY_INITIALIZER( "lstest.scratch.%d");
+  struct timespec t1, t2;
+  double get_secs, family_secs;
+  lsredis_obj_t *p;
+  int i;
+
+  for( i=0; i<8; i++) {
+    if( lsredis_family_get( &fam, i) != lsredis_get_obj( "lstest.scratch.%d", i)) {
+      lslogging_log_message( "lstest_lsredis_handles: FAILED handle %d does not match lsredis_get_obj", i);
+      return;
+    }
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    p = lsredis_get_obj( "lstest.scratch.%d", i & 7);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  get_secs = lstest_elapsed( &t1, &t2);
+
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  for( i=0; i<LSTEST_REDIS_SETS; i++) {
+    p = lsredis_family_get( &fam, i & 7);
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t2);
+  family_secs = lstest_elapsed( &t1, &t2);
+
+  lslogging_log_message( "lstest_lsredis_handles: lsredis_get_obj %.1f ns  lsredis_family_get %.1f ns (%s)",
+			 get_secs * 1.e9 / LSTEST_REDIS_SETS, family_secs * 1.e9 / LSTEST_REDIS_SETS, p == NULL ? "null" : p->key);
+}
+
+/** Time lookups in the redis object map at 10k, 100k, and 1M keys
+ */
+void lstest_lsredis_map() {
+  static int sizes[] = { 10000, 100000, 1000000};
+  struct timespec t1, t2;
+  double insert_secs, find_secs, miss_secs;
+  lsredis_map_t m;
+  char **keys;
+  char miss[64];
+  int i, j, n, found, bad;
+
+  for( j=0; j<sizeof( sizes)/sizeof( sizes[0]); j++) {
+    n = sizes[j];
+    keys = calloc( n, sizeof( char *));
+    if( keys == NULL)
+      return;
+    for( i=0; i<n; i++) {
+      keys[i] = calloc( 48, sizeof( char));
+      snprintf( keys[i], 48, "stns.2.lstest.key.%d.VALUE", i);
+    }
+
+    lsredis_map_init( &m, 16);
+    clock_gettime( CLOCK_MONOTONIC, &t1);
+    for( i=0; i<n; i++)
+      lsredis_map_insert( &m, keys[i], keys[i]);
+    clock_gettime( CLOCK_MONOTONIC, &t2);
+    insert_secs = lstest_elapsed( &t1, &t2);
+
+    found = 0;
+    clock_gettime( CLOCK_MONOTONIC, &t1);
+    for( i=0; i<n; i++)
+      found += lsredis_map_find( &m, keys[(i * 7919L) % n]) != NULL;
+    clock_gettime( CLOCK_MONOTONIC, &t2);
+    find_secs = lstest_elapsed( &t1, &t2);
+
+    clock_gettime( CLOCK_MONOTONIC, &t1);
+    for( i=0; i<n; i++) {
+      snprintf( miss, sizeof( miss), "stns.2.lstest.nokey.%d", i);
+      found += lsredis_map_find( &m, miss) != NULL;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t2);
+    miss_secs = lstest_elapsed( &t1, &t2);
+
+    if( found != n)
+      lslogging_log_message( "lstest_lsredis_map: FAILED found %d of %d keys (counting misses)", found, n);
+
+    for( i=0; i<n; i+=2)
+      lsredis_map_remove( &m, keys[i]);
+
+    //
+    // Shifting entries back as the even keys go must not lose any of
+    // the odd ones
+    //
+    bad = 0;
+    for( i=0; i<n; i++) {
+      if( (lsredis_map_find( &m, keys[i]) != keys[i]) != (i % 2 == 0))
+	bad++;
+    }
+    if( bad != 0 || m.n != n/2)
+      lslogging_log_message( "lstest_lsredis_map: FAILED %d keys wrong after removing the even ones, %d left (expected %d)", bad, m.n, n/2);
+
+    lslogging_log_message( "lstest_lsredis_map: %7d keys  insert %.1f ns  hit %.1f ns  miss (with snprintf) %.1f ns  found %d  left %d",
+			   n, insert_secs * 1.e9 / n, find_secs * 1.e9 / n, miss_secs * 1.e9 / n, found, m.n);
+
+    lsredis_map_free( &m);
+    for( i=0; i<n; i++)
+      free( keys[i]);
+    free( keys);
+  }
+}
+
+/** Run the tests
+ *  \param disruptive 1 to also run the tests that get in the way of a running system
+ */
+void lstest_main( int disruptive) {
+  lstest_lsredis_presets();
+  lstest_lsredis_handles();
+  lstest_lsredis_map();
+  lstest_lsredis_borrow();
+  lstest_lsredis_set_burst();
+  if( disruptive)
+    lstest_lsredis_reconnect();
+  lstest_lstimer_rate();
+  lstest_lstimer_jitter();
+  lstest_lstimer_10k();
+  lstest_lsevents_trace();
+  lstest_lsevents_match();
+  if( disruptive)
+    lstest_lsevents_send();
+  lstest_lsevents_coalesce();
+  lstest_lspmac_bi_scan();
+  lstest_lspmac_status_frame();
   lstest_lspmac_est_move_time();
+  lsevents_callback_report();
 }
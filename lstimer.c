@@ -7,368 +7,722 @@
  */
 
 
-//! We'll allow this many timers. This should be way more than enough.
-#define LSTIMER_LIST_LENGTH 1024
-
 /** times within this amount in the future are considered "now"
  * and the events should be called
  */
-#define LSTIMER_RESOLUTION_NSECS 100000
+#define LSTIMER_RESOLUTION_NSECS 10000
 
-static int lstimer_active_timers = 0;	//!< count of the number timers we are tracking
+#define LSTIMER_HEAP_INIT   64		//!< initial size of the timer heap (it grows as needed)
+#define LSTIMER_HASH_INIT   64		//!< initial number of hash buckets (doubles when the table gets full)
 
 /** Everything we need to know about a timer.
+ *  Times are nanoseconds on CLOCK_MONOTONIC.
+ *
+ *  A timer that is set again before it runs out of shots keeps its
+ *  jitter statistics.  One that runs out of shots is freed after its
+ *  last shot, as is one that is unset, so a stream of uniquely named
+ *  one shot timers costs nothing once they have gone off.
  */
 typedef struct lstimer_list_struct {
-  int shots;				//!< run this many times: -1 means reload forever, 0 means we are done with this timer and it may be reused
+  struct lstimer_list_struct *hnext;	//!< next timer in our hash bucket
+  int heap_index;			//!< where we are in lstimer_heap, -1 when not armed
+  int shots;				//!< run this many times: -1 means reload forever
   unsigned long int ncalls;		//!< track how many times we triggered a callback (like an unsigned long int is really needed)
-  char event[LSEVENTS_EVENT_LENGTH];	//!< the event to send
-  long int next_secs;		//!< epoch (seconds) of next alarm
-  long int next_nsecs;		//!< nano seconds of next alarm
-  long int delay_secs;		//!< number of seconds for a periodic delay
-  long int delay_nsecs;	//!< nano seconds of delay
-  long int last_secs;		//!< the last time this timer was triggered
-  long int last_nsecs;		//!< the last time this timer was triggered
-  long int init_secs;		//!< our initialization time
-  long int init_nsecs;		//!< our initialization time
+  char *event;				//!< the event to send
+  int event_id;				//!< the event to send, interned
+  int64_t next_ns;			//!< next alarm
+  int64_t delay_ns;			//!< periodic delay
+  int64_t last_ns;			//!< the last time this timer was triggered
+  int64_t init_ns;			//!< our initialization time
+  unsigned long int nfired;		//!< times fired since the timer was created
+  int64_t late_sum_ns;			//!< sum of (fire time - due time) for jitter statistics
+  int64_t late_min_ns;			//!< earliest we have fired relative to the due time
+  int64_t late_max_ns;			//!< latest we have fired relative to the due time
+  int64_t reported_late_ns;		//!< late_max_ns when lstimer_report_late last mentioned us
+  void (*cb)( char *, struct timespec *, unsigned long int);	//!< call this instead of sending an event
+  int running;				//!< cb is being called right now (without lstimer_mutex)
+  int dead;				//!< out of shots or unset while cb was running: free it when cb returns
+  int policy;				//!< LSTIMER_CATCHUP or LSTIMER_SKIP: what to do about missed periods
+  int policy_set;			//!< policy was set by lstimer_set_timer_policy rather than defaulted
+  unsigned long int overruns;		//!< periods missed (skipped or delivered more than a period late) since the timer was created
+  unsigned long int ndelivered;		//!< shots delivered since the timer was last set, for the achieved rate
+  unsigned long int reported_overruns;	//!< overruns when lstimer_report_slow last looked at us
+  int reported_slow;			//!< lstimer_report_slow last found us below the rate
 } lstimer_list_t;
 
-static lstimer_list_t lstimer_list[LSTIMER_LIST_LENGTH];	//!< Our timer list
+static lstimer_list_t **lstimer_heap = NULL;	//!< armed timers: a binary min heap on next_ns
+static int lstimer_active_timers     = 0;	//!< count of the number timers waiting to go off
+static int lstimer_heap_size         = 0;	//!< allocated size of lstimer_heap
+
+static lstimer_list_t **lstimer_hash = NULL;	//!< all our timers by event name
+static int lstimer_hash_size         = 0;	//!< number of buckets in lstimer_hash (a power of 2)
+static int lstimer_hash_count        = 0;	//!< number of timers in lstimer_hash
 
 static pthread_t lstimer_thread;		//!< the timer thread
 static pthread_mutex_t lstimer_mutex;		//!< protect the timer list
-static pthread_cond_t  lstimer_cond;		//!< allows us to be idle when there is nothing to do
-static timer_t lstimer_timerid;			//!< our real time timer
-static int new_timer    = 0;			//!< indicate that a new timer exists and a call to service_timers is required
-static int check_timers = 0;			//!< set by timer interupt
-static int got_signal   = 0;
+static int lstimer_tfd = -1;			//!< our timerfd, armed for the earliest timer
+static int lstimer_efd = -1;			//!< eventfd used to wake the worker when the timer list changes
 
-/** Unsets all timers for the given event
+/** Now in nanoseconds on the monotonic clock
  */
-void lstimer_unset_timer( char *event) {
-  int i;
+static int64_t lstimer_now_ns() {
+  struct timespec now;
 
-  pthread_mutex_lock( &lstimer_mutex);
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-  for( i=0; i<LSTIMER_LIST_LENGTH; i++) {
-    if( strcmp( event, lstimer_list[i].event) == 0 && lstimer_list[i].shots != 0) {
-      lstimer_list[i].shots = 0;
-      if (lstimer_active_timers > 0) {
-	lstimer_active_timers--;
-      }
-      if (lstimer_active_timers == 0) {
-	break;
+/** Let the worker know the timer list has changed
+ */
+static void lstimer_wake() {
+  uint64_t one;
+
+  one = 1;
+  if( write( lstimer_efd, &one, sizeof( one)) != sizeof( one) && errno != EAGAIN) {
+    lslogging_log_message( "lstimer_wake: write failed: %s", strerror( errno));
+  }
+}
+
+/** Hash of an event name (FNV-1a)
+ */
+static unsigned int lstimer_hash_name( char *event) {
+  unsigned int h;
+
+  for( h = 2166136261U; *event; event++) {
+    h ^= (unsigned char)*event;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+/** Find the active timer for an event
+ *  Call with lstimer_mutex locked.
+ */
+static lstimer_list_t *lstimer_find( char *event) {
+  lstimer_list_t *p;
+
+  if( lstimer_hash_size == 0)
+    return NULL;
+
+  for( p = lstimer_hash[lstimer_hash_name( event) & (lstimer_hash_size - 1)]; p != NULL; p = p->hnext) {
+    if( strcmp( p->event, event) == 0)
+      return p;
+  }
+  return NULL;
+}
+
+/** Add a timer to the name index
+ *  Call with lstimer_mutex locked.
+ */
+static void lstimer_hash_add( lstimer_list_t *p) {
+  static const char *id = FILEID "lstimer_hash_add";
+  lstimer_list_t **newhash, *q, *next;
+  unsigned int b;
+  int i, newsize;
+
+  if( lstimer_hash_count >= lstimer_hash_size) {
+    newsize = lstimer_hash_size == 0 ? LSTIMER_HASH_INIT : 2 * lstimer_hash_size;
+    newhash = calloc( newsize, sizeof( lstimer_list_t *));
+    if( newhash == NULL) {
+      lslogging_log_message( "%s: out of memory", id);
+      exit( -1);
+    }
+    for( i=0; i<lstimer_hash_size; i++) {
+      for( q = lstimer_hash[i]; q != NULL; q = next) {
+	next = q->hnext;
+	b = lstimer_hash_name( q->event) & (newsize - 1);
+	q->hnext = newhash[b];
+	newhash[b] = q;
       }
     }
+    free( lstimer_hash);
+    lstimer_hash      = newhash;
+    lstimer_hash_size = newsize;
   }
 
-  // Set this flag and trigger the signal in case a timer interupt
-  // came in while we were futzing around.
-  //
-  check_timers = 1;
-  pthread_cond_signal( &lstimer_cond);
+  b = lstimer_hash_name( p->event) & (lstimer_hash_size - 1);
+  p->hnext = lstimer_hash[b];
+  lstimer_hash[b] = p;
+  lstimer_hash_count++;
+}
 
-  pthread_mutex_unlock( &lstimer_mutex);
+/** Take a timer out of the name index
+ *  Call with lstimer_mutex locked.
+ */
+static void lstimer_hash_remove( lstimer_list_t *p) {
+  lstimer_list_t **pp;
+
+  for( pp = &lstimer_hash[lstimer_hash_name( p->event) & (lstimer_hash_size - 1)]; *pp != NULL; pp = &(*pp)->hnext) {
+    if( *pp == p) {
+      *pp = p->hnext;
+      lstimer_hash_count--;
+      return;
+    }
+  }
 }
 
+/** Put the heap entry at i in its place
+ *  Call with lstimer_mutex locked.
+ */
+static void lstimer_heap_fix( int i) {
+  lstimer_list_t *p;
+  int child;
 
-/** Create a timer
- * \param event  Name of the event to send when the timer goes off
- * \param shots  Number of times to run.  0 means never, -1 means forever
- * \param secs   Number of seconds to wait
- * \param nsecs  Number of nano-seconds to run in addition to secs
+  p = lstimer_heap[i];
+
+  // up
+  while( i > 0 && lstimer_heap[(i-1)/2]->next_ns > p->next_ns) {
+    lstimer_heap[i] = lstimer_heap[(i-1)/2];
+    lstimer_heap[i]->heap_index = i;
+    i = (i-1)/2;
+  }
+
+  // down
+  while( (child = 2*i + 1) < lstimer_active_timers) {
+    if( child+1 < lstimer_active_timers && lstimer_heap[child+1]->next_ns < lstimer_heap[child]->next_ns)
+      child++;
+    if( lstimer_heap[child]->next_ns >= p->next_ns)
+      break;
+    lstimer_heap[i] = lstimer_heap[child];
+    lstimer_heap[i]->heap_index = i;
+    i = child;
+  }
+
+  lstimer_heap[i] = p;
+  p->heap_index   = i;
+}
+
+/** Arm a timer: add it to the heap
+ *  Call with lstimer_mutex locked.
  */
-void lstimer_set_timer( char *event, int shots, unsigned long int secs, unsigned long int nsecs) {
-  static const char *id = FILEID "lstimer_set_timer";
+static void lstimer_heap_insert( lstimer_list_t *p) {
+  static const char *id = FILEID "lstimer_heap_insert";
+
+  if( lstimer_active_timers == lstimer_heap_size) {
+    lstimer_heap_size = lstimer_heap_size == 0 ? LSTIMER_HEAP_INIT : 2 * lstimer_heap_size;
+    lstimer_heap = realloc( lstimer_heap, lstimer_heap_size * sizeof( lstimer_list_t *));
+    if( lstimer_heap == NULL) {
+      lslogging_log_message( "%s: out of memory", id);
+      exit( -1);
+    }
+  }
+  lstimer_heap[lstimer_active_timers++] = p;
+  lstimer_heap_fix( lstimer_active_timers - 1);
+}
+
+/** Disarm a timer: take it out of the heap
+ *  Call with lstimer_mutex locked.
+ */
+static void lstimer_heap_remove( lstimer_list_t *p) {
   int i;
-  struct timespec now;
 
-  // shots == 0 is a no-op
-  //
-  if (shots == 0) {
-    lslogging_log_message("%s: tried to set a timer with 0 shots for event %s", id, event);
+  i = p->heap_index;
+  if( i < 0)
     return;
+
+  lstimer_active_timers--;
+  if( i != lstimer_active_timers) {
+    lstimer_heap[i] = lstimer_heap[lstimer_active_timers];
+    lstimer_heap_fix( i);
   }
+  p->heap_index = -1;
+}
 
+/** Remove a timer from the heap and name index and free it
+ *  Call with lstimer_mutex locked.
+ */
+static void lstimer_remove( lstimer_list_t *p) {
+  lstimer_heap_remove( p);
+  lstimer_hash_remove( p);
+
+  if( p->running) {
+    p->dead = 1;
+    return;
+  }
+
+  free( p->event);
+  free( p);
+}
+
+/** Point the timerfd at the earliest timer, or disarm it if there are none.
+ *  Call with lstimer_mutex locked.
+ */
+static void lstimer_arm() {
+  static const char *id = FILEID "lstimer_arm";
+  struct itimerspec its;
+
+  memset( &its, 0, sizeof( its));
+  if( lstimer_active_timers > 0) {
+    its.it_value.tv_sec  = lstimer_heap[0]->next_ns / 1000000000LL;
+    its.it_value.tv_nsec = lstimer_heap[0]->next_ns % 1000000000LL;
+  }
+  if( timerfd_settime( lstimer_tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    lslogging_log_message( "%s: timerfd_settime failed: %s", id, strerror( errno));
+  }
+}
+
+/** Unsets all timers for the given event
+ */
+void lstimer_unset_timer( char *event) {
+  lstimer_list_t *p;
+
+  pthread_mutex_lock( &lstimer_mutex);
+
+  p = lstimer_find( event);
+  if( p != NULL) {
+    lstimer_remove( p);
+    lstimer_wake();
+  }
+
+  pthread_mutex_unlock( &lstimer_mutex);
+}
+
+
+/** Set up a timer whose first expiration is at first_ns
+ * \param event    Name of the event to send when the timer goes off
+ * \param shots    Number of times to run.  -1 means forever
+ * \param first_ns First expiration (CLOCK_MONOTONIC nanoseconds)
+ * \param delay_ns Period for subsequent expirations
+ * \param cb       Routine to call, NULL to send event instead
+ */
+static void lstimer_set( char *event, int shots, int64_t first_ns, int64_t delay_ns, void (*cb)( char *, struct timespec *, unsigned long int)) {
+  static const char *id = FILEID "lstimer_set";
+  int event_id;
+  lstimer_list_t *p;
 
-  // Time we were called.  Delay is based on call time, not queued time
-  //
-  clock_gettime( CLOCK_REALTIME, &now);
-  
   pthread_mutex_lock( &lstimer_mutex);
 
   do {
-    // Make sure our event is registered (saves a tiny bit of time later)
-    //
-    // Return value is the current list of callbacks trigger by our
-    // event, Possibly NULL.
-    //
-    lsevents_preregister_event( event);
-    
-    //
-    // See if we already have an active timer for this event.
-    //
-    for (i=0; i<LSTIMER_LIST_LENGTH; i++) {
-      if (strcmp(lstimer_list[i].event, event) == 0) {
-	if (lstimer_list[i].shots != 0) {
-	  // We'll increment this further down so if we don't do this
-	  // now we'll be incorrectly be adding one later.
-	  lstimer_active_timers--;
-	  new_timer--;
-	}
+    event_id = -1;
+    if( cb == NULL) {
+      // Intern our event so that service_timers need not format or
+      // look up the name each time the timer goes off
+      //
+      event_id = lsevents_intern( "%s", event);
+      if( event_id < 0) {
+	lslogging_log_message( "%s: could not register event %s", id, event);
 	break;
       }
+
+      //
+      // A late tick of a periodic timer makes up for a lost one
+      //
+      lsevents_set_policy( event_id, shots == -1 ? LSEVENTS_COALESCE : LSEVENTS_CRITICAL);
     }
-    
+
     //
-    // No existing timer for this event exists.  Take over the first
-    // inactive time we can find.
+    // Reuse an existing timer for this event, else make a new one.
     //
-    if (i == LSTIMER_LIST_LENGTH) {
-      for( i=0; i<LSTIMER_LIST_LENGTH; i++) {
-	if( lstimer_list[i].shots == 0)
-	  break;
+    p = lstimer_find( event);
+    if( p == NULL) {
+      p = calloc( 1, sizeof( lstimer_list_t));
+      if( p == NULL) {
+	lslogging_log_message( "%s: out of memory", id);
+	exit( -1);
       }
-    }
-    
-    //
-    // Well, this is awkward.  There are no more timer slots available.
-    // Probably there is a big bad bug somewhere.
-    //
-    if( i == LSTIMER_LIST_LENGTH) {
-      lslogging_log_message("%s: out of timers for event: %s, shots: %d,  secs: %u, nsecs: %u",
-			     id, event, shots, secs, nsecs);
-      break;
+      p->event      = strdup( event);
+      p->heap_index = -1;
+      lstimer_hash_add( p);
     }
 
     //
-    // Set up our new timer
+    // Set up our new timer.  Expiration n (counting from 0) is at
+    // init_ns + (n+1) * delay_ns.
     //
-    strncpy( lstimer_list[i].event, event, LSEVENTS_EVENT_LENGTH - 1);
-    lstimer_list[i].event[LSEVENTS_EVENT_LENGTH - 1] = 0;
-    lstimer_list[i].shots        = shots;
-    lstimer_list[i].delay_secs   = secs;
-    lstimer_list[i].delay_nsecs  = nsecs;
-    
-    lstimer_list[i].next_secs    = secs + now.tv_sec + (now.tv_nsec + nsecs) / 1000000000;
-    lstimer_list[i].next_nsecs   = (now.tv_nsec + nsecs) % 1000000000;
-    lstimer_list[i].last_secs    = 0;
-    lstimer_list[i].last_nsecs   = 0;
-    
-    lstimer_list[i].ncalls       = 0;
-    lstimer_list[i].init_secs    = now.tv_sec;
-    lstimer_list[i].init_nsecs   = now.tv_nsec;
-    
-    lstimer_active_timers++;
-    new_timer++;
+    p->event_id     = event_id;
+    p->cb           = cb;
+    p->shots        = shots;
+    p->delay_ns     = delay_ns;
+    p->next_ns      = first_ns;
+    p->init_ns      = first_ns - delay_ns;
+    p->last_ns      = 0;
+    p->ncalls       = 0;
+    p->ndelivered   = 0;
+    if( !p->policy_set)
+      p->policy     = cb == NULL ? LSTIMER_CATCHUP : LSTIMER_SKIP;
+    if( p->heap_index < 0)
+      lstimer_heap_insert( p);
+    else
+      lstimer_heap_fix( p->heap_index);
+
+    lstimer_wake();
   } while (0);
 
-  pthread_cond_signal(  &lstimer_cond);
   pthread_mutex_unlock( &lstimer_mutex);
 }
 
-
-/** Send events that are past due, due, or just about to be due.
+/** Create a timer
+ * \param event  Name of the event to send when the timer goes off
+ * \param shots  Number of times to run.  0 means never, -1 means forever
+ * \param secs   Number of seconds to wait
+ * \param nsecs  Number of nano-seconds to run in addition to secs
  */
-static void service_timers() {
-  int
-    i,
-    found_active;
-
-  lstimer_list_t *p;
-  struct timespec now, then, soonest;
-  struct itimerspec its;
+void lstimer_set_timer( char *event, int shots, unsigned long int secs, unsigned long int nsecs) {
+  static const char *id = FILEID "lstimer_set_timer";
+  int64_t delay_ns;
 
+  // shots == 0 is a no-op
   //
-  // Did I remind you not to let this thread own the lstimer mutex outside of this
-  // service routine when SIGRTMIN is active?
-  //
-
-  // Call with lstimer_mutex locked
+  if (shots == 0) {
+    lslogging_log_message("%s: tried to set a timer with 0 shots for event %s", id, event);
+    return;
+  }
 
-  clock_gettime( CLOCK_REALTIME, &now);
+  // Delay is based on call time, not queued time
   //
-  // Project a tad into the future
-  then.tv_sec  = now.tv_sec + (now.tv_nsec + LSTIMER_RESOLUTION_NSECS) / 1000000000;
-  then.tv_nsec = (now.tv_nsec + LSTIMER_RESOLUTION_NSECS) % 1000000000;
-
-  found_active = 0;
-  for( i=0; (found_active < lstimer_active_timers) && (i<LSTIMER_LIST_LENGTH); i++) {
-    p = &(lstimer_list[i]);
-    if( p->shots != 0) {
-      found_active++;
-      if(  p->next_secs < then.tv_sec || (p->next_secs == then.tv_sec && p->next_nsecs <= then.tv_nsec)) {
-	lsevents_send_event( p->event);
-	//
-	// After sending the event, compute the next time we need to do this
-	//
-	p->last_secs  = now.tv_sec;
-	p->last_nsecs = now.tv_nsec;
-	p->ncalls++;
-	//
-	// Decrement non-infinite loops
-	if( p->shots != -1)
-	  p->shots--;
-	if( p->shots == 0) {
-	  //
-	  // Take this timer out of the mix
-	  lstimer_active_timers--;
-	  //
-	  // And rejigger found_active so we do not stop looking for active timers too soon
-	  //
-	  found_active--;
-	} else {
-	  p->next_secs  = p->init_secs + (p->ncalls+1) * p->delay_secs + (p->init_nsecs + (p->ncalls+1)*p->delay_nsecs)/1000000000;
-	  p->next_nsecs = (p->init_nsecs + (p->ncalls+1)*p->delay_nsecs) % 1000000000;
-	}
-      }
+  delay_ns = (int64_t)secs * 1000000000LL + nsecs;
+  lstimer_set( event, shots, lstimer_now_ns() + delay_ns, delay_ns, NULL);
+}
 
-      //
-      // See when we need to come back here again next
-      //
-      if( found_active == 1) {
-	soonest.tv_sec  = p->next_secs;
-	soonest.tv_nsec = p->next_nsecs;
-      } else {
-	if( soonest.tv_sec > p->next_secs || (soonest.tv_sec == p->next_secs && soonest.tv_nsec > p->next_nsecs)) {
-	  soonest.tv_sec  = p->next_secs;
-	  soonest.tv_nsec = p->next_nsecs;
-	}
-      }
-    }
+/** Create a timer that calls a routine directly from the timer thread
+ *  rather than sending an event.  The routine is called without any
+ *  lstimer locks held so it may set or unset timers, but it should
+ *  be quick: other timers wait for it.
+ *
+ *  The routine gets the timer name, the time (CLOCK_MONOTONIC) the
+ *  timer was due, and the number of periods that went by without a
+ *  call because we were late.  Missed periods are skipped, not made up.
+ *
+ * \param event  Name of the timer
+ * \param shots  Number of times to run.  0 means never, -1 means forever
+ * \param secs   Number of seconds to wait
+ * \param nsecs  Number of nano-seconds to run in addition to secs
+ * \param cb     The routine to call
+ */
+void lstimer_set_timer_cb( char *event, int shots, unsigned long int secs, unsigned long int nsecs, void (*cb)( char *, struct timespec *, unsigned long int)) {
+  static const char *id = FILEID "lstimer_set_timer_cb";
+  int64_t delay_ns;
+
+  if (shots == 0) {
+    lslogging_log_message("%s: tried to set a timer with 0 shots for event %s", id, event);
+    return;
   }
 
-  //
-  // set up the next interupt
-  //
-  if( soonest.tv_sec != 0) {
-    its.it_value.tv_sec     = soonest.tv_sec;
-    its.it_value.tv_nsec    = soonest.tv_nsec;
-    its.it_interval.tv_sec  = 0;
-    its.it_interval.tv_nsec = 0;
-    timer_settime( lstimer_timerid, TIMER_ABSTIME, &its, NULL);
+  delay_ns = (int64_t)secs * 1000000000LL + nsecs;
+  lstimer_set( event, shots, lstimer_now_ns() + delay_ns, delay_ns, cb);
+}
+
+/** Create a timer that first goes off at an absolute time
+ * \param event     Name of the event to send when the timer goes off
+ * \param shots     Number of times to run.  0 means never, -1 means forever
+ * \param deadline  When to first go off, on CLOCK_MONOTONIC
+ * \param secs      Seconds between subsequent shots
+ * \param nsecs     Nano-seconds between subsequent shots in addition to secs
+ */
+void lstimer_set_timer_abs( char *event, int shots, struct timespec *deadline, unsigned long int secs, unsigned long int nsecs) {
+  static const char *id = FILEID "lstimer_set_timer_abs";
+
+  if (shots == 0) {
+    lslogging_log_message("%s: tried to set a timer with 0 shots for event %s", id, event);
+    return;
   }
+
+  lstimer_set( event, shots, (int64_t)deadline->tv_sec * 1000000000LL + deadline->tv_nsec, (int64_t)secs * 1000000000LL + nsecs, NULL);
 }
 
-/** Service the signal
+/** Number of timers waiting to go off
  */
-static void handler( int sig, siginfo_t *si, void *dummy) {
-  got_signal = 1;
+int lstimer_active_count() {
+  int rtn;
+
+  pthread_mutex_lock( &lstimer_mutex);
+  rtn = lstimer_active_timers;
+  pthread_mutex_unlock( &lstimer_mutex);
+  return rtn;
 }
 
-/** Our worker.
- *  The main loop runs when a new timer is added.
- *  The service routine deals with maintenance.
+/** Decide what a periodic timer does when it falls more than a
+ *  period behind.  LSTIMER_CATCHUP delivers every missed period as fast
+ *  as it can; LSTIMER_SKIP delivers once and moves on to the next
+ *  period in the future.  By default event timers catch up and
+ *  callback timers skip.
+ * \param event  Name of an existing timer
+ * \param policy LSTIMER_CATCHUP or LSTIMER_SKIP
+ * \returns 0 on success, -1 if there is no such timer
  */
-static void *lstimer_worker(
-		     void *dummy		//!< [in] required by protocol
-		     ) {
-  static const char *id = FILEID "lstimer_worker";
-  struct sigevent  sev;
-  struct sigaction sa;
-  sigset_t mask;
-  struct timespec timeout, now;
-  int err;
+int lstimer_set_timer_policy( char *event, int policy) {
+  lstimer_list_t *p;
 
-  // See example at http://www.kernel.org/doc/man-pages/online/pages/man2/timer_create.2.html
-  //
+  pthread_mutex_lock( &lstimer_mutex);
+  p = lstimer_find( event);
+  if( p != NULL) {
+    p->policy     = policy;
+    p->policy_set = 1;
+  }
+  pthread_mutex_unlock( &lstimer_mutex);
 
-  // Set up hander
-  //
-  sa.sa_flags = SA_SIGINFO;
-  sa.sa_sigaction = handler;
-  sigemptyset(&sa.sa_mask);
-  if (sigaction(SIGRTMIN, &sa, NULL) == -1) {
-    lslogging_log_message("%s: sigaction failed", id);
-    exit( -1);
+  return p == NULL ? -1 : 0;
+}
+
+/** How is a timer keeping up?
+ * \param event    Name of the timer
+ * \param fired    Returns the number of shots delivered since the timer was created
+ * \param overruns Returns the number of periods missed since the timer was created
+ * \param rate     Returns the shots per second delivered since the timer was last set
+ * \returns 0 on success, -1 if there is no such timer
+ */
+int lstimer_get_stats( char *event, unsigned long int *fired, unsigned long int *overruns, double *rate) {
+  lstimer_list_t *p;
+
+  pthread_mutex_lock( &lstimer_mutex);
+  p = lstimer_find( event);
+  if( p != NULL) {
+    if( fired != NULL)
+      *fired = p->nfired;
+    if( overruns != NULL)
+      *overruns = p->overruns;
+    if( rate != NULL)
+      *rate = p->ndelivered == 0 || p->last_ns <= p->init_ns ? 0.0 : p->ndelivered * 1.e9 / (p->last_ns - p->init_ns);
   }
+  pthread_mutex_unlock( &lstimer_mutex);
 
-  // Create the timer
-  //
-  sev.sigev_notify = SIGEV_SIGNAL;
-  sev.sigev_signo  = SIGRTMIN;
-  sev.sigev_value.sival_ptr = &lstimer_timerid;
-  timer_create( CLOCK_REALTIME, &sev, &lstimer_timerid);
+  return p == NULL ? -1 : 0;
+}
 
+/** Log how late (or early) each of our timers has been firing
+ */
+void lstimer_report() {
+  lstimer_list_t *p;
+  int i;
 
-  //
-  // Prepare to block the timer signal while in the service routine
-  //
-  sigemptyset( &mask);
-  sigaddset( &mask, SIGRTMIN);
-  
-  while( 1) {
-    pthread_mutex_lock( &lstimer_mutex);
+  pthread_mutex_lock( &lstimer_mutex);
+  for( i=0; i<lstimer_hash_size; i++) {
+    for( p = lstimer_hash[i]; p != NULL; p = p->hnext) {
+      if( p->nfired == 0)
+	continue;
+      lslogging_log_message( "lstimer_report: '%s' fired %lu  overruns %lu  late mean %.1f us  min %.1f us  max %.1f us  rate %.2f/s of %.2f/s  %s",
+			     p->event, p->nfired, p->overruns, p->late_sum_ns / 1000.0 / p->nfired,
+			     p->late_min_ns / 1000.0, p->late_max_ns / 1000.0,
+			     p->ndelivered == 0 || p->last_ns <= p->init_ns ? 0.0 : p->ndelivered * 1.e9 / (p->last_ns - p->init_ns),
+			     p->delay_ns > 0 ? 1.e9 / p->delay_ns : 0.0,
+			     p->heap_index < 0 ? "idle" : "armed");
+    }
+  }
+  pthread_mutex_unlock( &lstimer_mutex);
+}
 
-    clock_gettime( CLOCK_REALTIME, &now);
-    timeout.tv_sec  = now.tv_sec + 1;
-    timeout.tv_nsec = now.tv_nsec;
+/** Log the timers that have fired later than usecs, and later than
+ *  ever before, since the last time we were called.  Quiet enough to
+ *  call every minute.
+ */
+void lstimer_report_late(
+			 unsigned long int usecs	/**< [in] only mention timers at least this late */
+			 ) {
+  lstimer_list_t *p;
+  int i;
 
-    err = 0;
-    while( new_timer == 0 && check_timers == 0 && err == 0) {
-      err = pthread_cond_timedwait( &lstimer_cond, &lstimer_mutex, &timeout);
+  pthread_mutex_lock( &lstimer_mutex);
+  for( i=0; i<lstimer_hash_size; i++) {
+    for( p = lstimer_hash[i]; p != NULL; p = p->hnext) {
+      if( p->nfired == 0 || p->late_max_ns < (int64_t)usecs * 1000 || p->late_max_ns <= p->reported_late_ns)
+	continue;
+      lslogging_log_message( "lstimer_report_late: '%s' fired %.1f us late  (mean %.1f us over %lu)",
+			     p->event, p->late_max_ns / 1000.0, p->late_sum_ns / 1000.0 / p->nfired, p->nfired);
+      p->reported_late_ns = p->late_max_ns;
     }
+  }
+  pthread_mutex_unlock( &lstimer_mutex);
+}
 
-    //
-    // Should probably only go on timeout if got_signal is non zero
-    // but there should be no harm done if it's zero as long as the
-    // timeout interval is not too short
-    //
-    if (err == ETIMEDOUT) {
-      got_signal = 0;
-    } else {
-      if (err != 0) {
+#define LSTIMER_RATE_MIN_SHOTS 10	//!< shots needed before we believe a timer's achieved rate
+
+/** Log the periodic timers that have overrun since the last time we
+ *  were called or whose achieved rate has fallen below fraction of
+ *  the rate they were set to.  Quiet enough to call every minute.
+ */
+void lstimer_report_slow(
+			 double fraction		/**< [in] mention timers running slower than this part of their rate (ie, 0.9) */
+			 ) {
+  lstimer_list_t *p;
+  double rate, nominal;
+  int i, slow;
+
+  pthread_mutex_lock( &lstimer_mutex);
+  for( i=0; i<lstimer_hash_size; i++) {
+    for( p = lstimer_hash[i]; p != NULL; p = p->hnext) {
+      if( p->delay_ns <= 0 || p->shots == 1 || p->ndelivered < LSTIMER_RATE_MIN_SHOTS || p->last_ns <= p->init_ns)
 	continue;
+
+      rate    = p->ndelivered * 1.e9 / (p->last_ns - p->init_ns);
+      nominal = 1.e9 / p->delay_ns;
+      slow    = rate < fraction * nominal;
+      if( p->overruns != p->reported_overruns || (slow && !p->reported_slow)) {
+	lslogging_log_message( "lstimer_report_slow: '%s' rate %.2f/s of %.2f/s  overruns %lu (%lu new)",
+			       p->event, rate, nominal, p->overruns, p->overruns - p->reported_overruns);
+	p->reported_overruns = p->overruns;
       }
+      p->reported_slow = slow;
     }
+  }
+  pthread_mutex_unlock( &lstimer_mutex);
+}
+
+/** Send events (or call routines) that are past due, due, or just about to be due.
+ *  Call with lstimer_mutex locked
+ */
+static void service_timers() {
+  lstimer_list_t *p;
+  int64_t now, then, late, due;
+  unsigned long int overruns;
+  struct timespec due_ts;
+
+  now = lstimer_now_ns();
+  //
+  // Project a tad into the future
+  then = now + LSTIMER_RESOLUTION_NSECS;
+
+  while( lstimer_active_timers > 0 && lstimer_heap[0]->next_ns <= then) {
+    p   = lstimer_heap[0];
+    due = p->next_ns;
 
-    // ignore signals so we don't service the signal while we are already in the
-    // service routine
     //
-    pthread_sigmask( SIG_SETMASK, &mask, NULL);
+    // Jitter statistics
+    //
+    late = now - due;
+    if( p->nfired == 0 || late < p->late_min_ns)
+      p->late_min_ns = late;
+    if( p->nfired == 0 || late > p->late_max_ns)
+      p->late_max_ns = late;
+    p->late_sum_ns += late;
+    p->nfired++;
+    p->ndelivered++;
 
     //
-    // Setting up the timer interval is in the handler
-    // so just call it
+    // Periods that have gone by entirely while we weren't looking.
+    // With LSTIMER_CATCHUP they are delivered one at a time on the
+    // following passes, each counting as an overrun since it is a
+    // period late.  With LSTIMER_SKIP they are dropped and callbacks
+    // are told how many.
     //
-    service_timers();
+    overruns = 0;
+    if( p->delay_ns > 0 && late >= p->delay_ns) {
+      if( p->policy == LSTIMER_CATCHUP) {
+	p->overruns++;
+      } else if( p->shots != 1) {
+	overruns = late / p->delay_ns;
+	if( p->shots != -1 && overruns > p->shots - 1)
+	  overruns = p->shots - 1;
+	p->overruns += overruns;
+      }
+    }
 
+    if( p->cb == NULL)
+      lsevents_send_event_id( p->event_id);
+
+    //
+    // Compute the next time we need to do this
     //
-    // Reset our flags
+    p->last_ns = now;
+    p->ncalls += 1 + overruns;
     //
-    new_timer = 0;
-    check_timers = 0;
+    // Decrement non-infinite loops
+    if( p->shots != -1)
+      p->shots -= 1 + overruns;
+    if( p->shots == 0) {
+      //
+      // Take this timer out of the mix.  A callback still needs it;
+      // it is freed below.
+      lstimer_heap_remove( p);
+      lstimer_hash_remove( p);
+      p->dead = 1;
+    } else {
+      p->next_ns = p->init_ns + (p->ncalls+1) * p->delay_ns;
+      lstimer_heap_fix( 0);
+    }
 
-    pthread_mutex_unlock( &lstimer_mutex);
+    if( p->cb != NULL) {
+      due_ts.tv_sec  = due / 1000000000LL;
+      due_ts.tv_nsec = due % 1000000000LL;
+
+      p->running = 1;
+      pthread_mutex_unlock( &lstimer_mutex);
+      p->cb( p->event, &due_ts, overruns);
+      pthread_mutex_lock( &lstimer_mutex);
+      p->running = 0;
+
+      now  = lstimer_now_ns();
+      then = now + LSTIMER_RESOLUTION_NSECS;
+    }
+
+    if( p->dead) {
+      free( p->event);
+      free( p);
+    }
+  }
 
+  //
+  // set up the next interupt
+  //
+  lstimer_arm();
+}
 
-    // Let the signals rain down
+/** Our worker.
+ *  Wait for either the timerfd to go off or for someone to change
+ *  the timer list, then send whatever events are due and rearm.
+ */
+static void *lstimer_worker(
+		     void *dummy		//!< [in] required by protocol
+		     ) {
+  static const char *id = FILEID "lstimer_worker";
+  struct pollfd fda[2];
+  uint64_t count;
+  int err;
+
+  fda[0].fd     = lstimer_tfd;
+  fda[0].events = POLLIN;
+  fda[1].fd     = lstimer_efd;
+  fda[1].events = POLLIN;
+
+  while( 1) {
+    err = poll( fda, 2, -1);
+    if( err == -1) {
+      if( errno != EINTR)
+	lslogging_log_message( "%s: poll failed: %s", id, strerror( errno));
+      continue;
+    }
+
+    //
+    // Drain the descriptors.  We don't care how many times they went
+    // off, only that they did.
     //
-    pthread_sigmask( SIG_UNBLOCK, &mask, NULL);
+    if( fda[0].revents & POLLIN)
+      err = read( lstimer_tfd, &count, sizeof( count));
+    if( fda[1].revents & POLLIN)
+      err = read( lstimer_efd, &count, sizeof( count));
+
+    pthread_mutex_lock( &lstimer_mutex);
+    service_timers();
+    pthread_mutex_unlock( &lstimer_mutex);
   }
+  return NULL;
 }
 
 
 /** Initialize the timer list and pthread stuff.
  */
 void lstimer_init() {
-  int i;
+  static const char *id = FILEID "lstimer_init";
   pthread_mutexattr_t mutex_initializer;
 
   pthread_mutexattr_init( &mutex_initializer);
   pthread_mutexattr_settype( &mutex_initializer, PTHREAD_MUTEX_RECURSIVE);
-
-  for( i=0; i<LSTIMER_LIST_LENGTH; i++) {
-    lstimer_list[i].shots = 0;
-  }
+  pthread_mutex_init( &lstimer_mutex, &mutex_initializer);
 
   //
-  // recursive is needed to handle a race condition where the interupt
-  // triggers when we have the mutex but before we can turn off the
-  // signal.
+  // Timers are on the monotonic clock so that stepping the wall
+  // clock does not move them.
   //
-  pthread_mutex_init( &lstimer_mutex, &mutex_initializer);
-  pthread_cond_init(  &lstimer_cond, NULL);
+  lstimer_tfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if( lstimer_tfd == -1) {
+    lslogging_log_message( "%s: timerfd_create failed: %s", id, strerror( errno));
+    exit( -1);
+  }
+
+  lstimer_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if( lstimer_efd == -1) {
+    lslogging_log_message( "%s: eventfd failed: %s", id, strerror( errno));
+    exit( -1);
+  }
 }
 
 /** Start up our thread.
@@ -30,6 +30,8 @@ All positions are in millimeters or degrees.
 
  collect                                     Start collecting data
 
+ eventTrace start <file> | stop | replay <file> [<speed> [<regex>]]   Record dispatched events to <file>, stop recording, or send the events in <file> (those matching <regex>) again at <speed> times the original rate (0 for as fast as possible).  Do not replay on a working beamline
+
  homestages				     Home centering stages and alignment stages
 
  moveAbs  <motor1> <position_or_presetName 1>...<motorN> <position or presetName N> [<optional preset>]   Move the given motors to the said positions.  If given, the new positions will be as "optional Preset".
@@ -46,6 +48,8 @@ All positions are in millimeters or degrees.
 
  shutterless                                 Like collect but only used for line segment mode with the Eiger
 
+ shutterTiming [<passes>]                    Measure the fast shutter opening and closing delays (default 20 passes).  Collections use the results
+
  set <motor1> [<motor2>...<motorN>] <preset> Set all named motors current position as <preset>.  <preset> will be created if it does not currently exist.
 
  setbackvector                               Set the current alignment stage position as the Back preset and the difference between Back and Beam as Back_Vector
@@ -140,6 +144,24 @@ static regex_t md2cmds_cmd_regex;
 
 static regex_t md2cmds_cmd_set_regex;
 
+//
+// Cached redis handles for keys we look up over and over
+//
+static lsredis_obj_t *md2cmds_centers_length_p = NULL;			//!< centers.length
+static lsredis_family_t md2cmds_centers_cx = LSREDIS_FAMILY_INITIALIZER( "centers.%d.cx");	//!< centers.%d.cx
+static lsredis_family_t md2cmds_centers_cy = LSREDIS_FAMILY_INITIALIZER( "centers.%d.cy");	//!< centers.%d.cy
+static lsredis_family_t md2cmds_centers_ax = LSREDIS_FAMILY_INITIALIZER( "centers.%d.ax");	//!< centers.%d.ax
+static lsredis_family_t md2cmds_centers_ay = LSREDIS_FAMILY_INITIALIZER( "centers.%d.ay");	//!< centers.%d.ay
+static lsredis_family_t md2cmds_centers_az = LSREDIS_FAMILY_INITIALIZER( "centers.%d.az");	//!< centers.%d.az
+static lsredis_obj_t *md2cmds_cam_xscale_p  = NULL;			//!< cam.xScale
+static lsredis_obj_t *md2cmds_cam_yscale_p  = NULL;			//!< cam.yScale
+static lsredis_obj_t *md2cmds_cam_centerx_p = NULL;			//!< cam.CenterX
+static lsredis_obj_t *md2cmds_cam_centery_p = NULL;			//!< cam.CenterY
+static lsredis_family_t md2cmds_zoom_scalex  = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.ScaleX");	//!< cam.zoom.%d.ScaleX
+static lsredis_family_t md2cmds_zoom_scaley  = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.ScaleY");	//!< cam.zoom.%d.ScaleY
+static lsredis_family_t md2cmds_zoom_centerx = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.CenterX");	//!< cam.zoom.%d.CenterX
+static lsredis_family_t md2cmds_zoom_centery = LSREDIS_FAMILY_INITIALIZER( "cam.zoom.%d.CenterY");	//!< cam.zoom.%d.CenterY
+
 typedef struct md2cmds_cmd_kv_struct {
   char *k;
   int (*v)( const char *);
@@ -150,6 +172,7 @@ void md2cmds_mvcenter_move(double, double, double, double, double);
 
 int md2cmds_abort(            const char *);
 int md2cmds_collect(          const char *);
+int md2cmds_event_trace(      const char *);
 int md2cmds_goto_point(       const char *);
 int md2cmds_homestages(       const char *);
 int md2cmds_moveAbs(          const char *);
@@ -161,6 +184,7 @@ int md2cmds_run_cmd(          const char *);
 int md2cmds_rotate(           const char *);
 int md2cmds_nonrotate(        const char *);
 int md2cmds_shutterless(      const char *);
+int md2cmds_shutter_timing(   const char *);
 int md2cmds_set(              const char *);
 int md2cmds_setbeamstoplimits(const char *);
 int md2cmds_settransferpoint( const char *);
@@ -175,6 +199,7 @@ int md2cmds_transfer(         const char *);
 static md2cmds_cmd_kv_t md2cmds_cmd_kvs[] = {
   { "abort",            md2cmds_abort},
   { "changeMode",       md2cmds_phase_change},
+  { "eventTrace",       md2cmds_event_trace},
   { "gotoPoint",        md2cmds_goto_point},
   { "homestages",       md2cmds_homestages},
   { "moveAbs",          md2cmds_moveAbs},
@@ -186,7 +211,8 @@ static md2cmds_cmd_kv_t md2cmds_cmd_kvs[] = {
   { "set",              md2cmds_set},
   { "setbackvector",    md2cmds_setbackvector},
   { "setbeamstoplimits",md2cmds_setbeamstoplimits},
-  { "setsamplebeam",    md2cmds_setsamplebeam}
+  { "setsamplebeam",    md2cmds_setsamplebeam},
+  { "shutterTiming",    md2cmds_shutter_timing}
 };
 
 //
@@ -355,8 +381,8 @@ double md2cmds_prep_axis( lspmac_motor_t *mp, double pos) {
   u2c         = lsredis_getd( mp->u2c);
   neutral_pos = lsredis_getd( mp->neutral_pos);
 
-  mp->motion_seen = 0;
-  mp->not_done    = 1;
+  mp->hot->motion_seen = 0;
+  mp->hot->not_done    = 1;
 
   rtn = u2c   * (pos + neutral_pos);
 
@@ -1665,7 +1691,7 @@ int md2cmds_goto_point( const char *ccmd) {
     return 1;
   }
 
-  clength = lsredis_getl( lsredis_get_obj( "centers.length"));
+  clength = lsredis_getl( lsredis_handle( &md2cmds_centers_length_p, "centers.length"));
   if( pt < 0 || pt >= clength) {
     lslogging_log_message( "md2cmds_goto_point: invalid point number.  Found %d but centers.length is %d", pt, clength);
     lsredis_sendStatusReport( 1, "gotoPoint: invalid point number.  Found %d but centers.length is %d", pt, clength);
@@ -1674,11 +1700,11 @@ int md2cmds_goto_point( const char *ccmd) {
   }
   free( cmd);
 
-  cx = lsredis_getd( lsredis_get_obj( "centers.%d.cx", pt));
-  cy = lsredis_getd( lsredis_get_obj( "centers.%d.cy", pt));
-  ax = lsredis_getd( lsredis_get_obj( "centers.%d.ax", pt));
-  ay = lsredis_getd( lsredis_get_obj( "centers.%d.ay", pt));
-  az = lsredis_getd( lsredis_get_obj( "centers.%d.az", pt));
+  cx = lsredis_getd( lsredis_family_get( &md2cmds_centers_cx, pt));
+  cy = lsredis_getd( lsredis_family_get( &md2cmds_centers_cy, pt));
+  ax = lsredis_getd( lsredis_family_get( &md2cmds_centers_ax, pt));
+  ay = lsredis_getd( lsredis_family_get( &md2cmds_centers_ay, pt));
+  az = lsredis_getd( lsredis_family_get( &md2cmds_centers_az, pt));
 
 
   err = lspmac_est_move_time( &move_time, &mmask,
@@ -1948,6 +1974,23 @@ int md2cmds_raster( const char *cmd) {
   return 0;
 }
 
+#define MD2CMDS_SHUTTER_MAX_LATENCY 20.0	//!< longest believable shutter opening or closing delay (msec)
+
+/** A measured shutter delay (see shutterTiming) that is safe to give the pmac
+ *  \param key fastShutter.openLatency or fastShutter.closeLatency
+ *  \returns the delay in msec clamped to [0, MD2CMDS_SHUTTER_MAX_LATENCY], 0 when we have none
+ */
+double md2cmds_shutter_latency( char *key) {
+  double rtn;
+
+  rtn = lsredis_getd( lsredis_get_obj( "%s", key));
+  if( isnan( rtn) || rtn < 0.0)
+    rtn = 0.0;
+  if( rtn > MD2CMDS_SHUTTER_MAX_LATENCY)
+    rtn = MD2CMDS_SHUTTER_MAX_LATENCY;
+  return rtn;
+}
+
 /** Shutterless data collection
  ** \param dummy Unused
  ** returns non-zero on error
@@ -1956,8 +1999,8 @@ int md2cmds_shutterless( const char *dummy) {
   long long skey;       //!< px.shots key of our exposure
   int sindex;           //!< px.shots sindex of our shot
   double exp_time;      //!< Exposure Time from postgresql in seconds
-  //double p6510;               //!< Shutter opening time in msec
-  double p6511;         //!< Shutter closing time in msec
+  double p6510;         //!< Shutter opening time in msec (0 to leave the pmac value alone)
+  double p6511;         //!< Shutter closing time in msec (reserved: the pmac program ignores it)
   double q1;            //!< Exposure Time in mSec
   double q2;            //!< Acceleration Time in mSecs
   double q3;            //!< Time at constant velocity before triggering detector
@@ -2000,11 +2043,12 @@ int md2cmds_shutterless( const char *dummy) {
   int i;
 
   //
-  // Make a guess at the correct value.  TODO: measure and place in
-  // redis variables.
+  // Use the opening delay measured by shutterTiming when we have
+  // one.  There is no closing compensation in the shutterless program
+  // yet (P6511 is reserved) so that value stays the old guess.
   //
-  //p6510 =  10;        // Imperical value: use scope to measure fast-shutter/shutter-box edges
-  p6511 =   2;
+  p6510 = md2cmds_shutter_latency( "fastShutter.openLatency");
+  p6511 = 2;
 
   lslogging_log_message("shutterless 0");
 
@@ -2073,18 +2117,18 @@ int md2cmds_shutterless( const char *dummy) {
   cy_np       = lsredis_getd( ceny->neutral_pos);
   ay_u2c      = lsredis_getd( aligny->u2c);
   ay_np       = lsredis_getd( aligny->neutral_pos);
-  clength     = lsredis_getl( lsredis_get_obj("centers.length"));
-  cx0         = lsredis_getd( lsredis_get_obj("centers.0.cx"));
-  cy0         = lsredis_getd( lsredis_get_obj("centers.0.cy"));
-  ay0         = lsredis_getd( lsredis_get_obj("centers.0.ay"));
+  clength     = lsredis_getl( lsredis_handle( &md2cmds_centers_length_p, "centers.length"));
+  cx0         = lsredis_getd( lsredis_family_get( &md2cmds_centers_cx, 0));
+  cy0         = lsredis_getd( lsredis_family_get( &md2cmds_centers_cy, 0));
+  ay0         = lsredis_getd( lsredis_family_get( &md2cmds_centers_ay, 0));
   if (clength <= 1) {
     cx1 = cx0;
     cy1 = cy0;
     ay1 = ay0;
   } else {
-    cx1 = lsredis_getd( lsredis_get_obj("centers.1.cx"));
-    cy1 = lsredis_getd( lsredis_get_obj("centers.1.cy"));
-    ay1 = lsredis_getd( lsredis_get_obj("centers.1.ay"));
+    cx1 = lsredis_getd( lsredis_family_get( &md2cmds_centers_cx, 1));
+    cy1 = lsredis_getd( lsredis_family_get( &md2cmds_centers_cy, 1));
+    ay1 = lsredis_getd( lsredis_family_get( &md2cmds_centers_ay, 1));
   }
 
   while(1) {
@@ -2137,11 +2181,11 @@ int md2cmds_shutterless( const char *dummy) {
       lsredis_set_preset( "align.y",     "Beam", lspg_nextshot.ay);
       lsredis_set_preset( "align.z",     "Beam", lspg_nextshot.az);
 
-      lsredis_setstr(lsredis_get_obj("centers.0.cx"), "%0.3f", lspg_nextshot.cx);
-      lsredis_setstr(lsredis_get_obj("centers.0.cy"), "%0.3f", lspg_nextshot.cy);
-      lsredis_setstr(lsredis_get_obj("centers.0.ax"), "%0.3f", lspg_nextshot.ax);
-      lsredis_setstr(lsredis_get_obj("centers.0.ay"), "%0.3f", lspg_nextshot.ay);
-      lsredis_setstr(lsredis_get_obj("centers.0.az"), "%0.3f", lspg_nextshot.az);
+      lsredis_setstr(lsredis_family_get( &md2cmds_centers_cx, 0), "%0.3f", lspg_nextshot.cx);
+      lsredis_setstr(lsredis_family_get( &md2cmds_centers_cy, 0), "%0.3f", lspg_nextshot.cy);
+      lsredis_setstr(lsredis_family_get( &md2cmds_centers_ax, 0), "%0.3f", lspg_nextshot.ax);
+      lsredis_setstr(lsredis_family_get( &md2cmds_centers_ay, 0), "%0.3f", lspg_nextshot.ay);
+      lsredis_setstr(lsredis_family_get( &md2cmds_centers_az, 0), "%0.3f", lspg_nextshot.az);
 
 
       cx0 = lspg_nextshot.cx;
@@ -2163,8 +2207,8 @@ int md2cmds_shutterless( const char *dummy) {
          //
          // Don't move if we are within 0.1 microns of our destination
          //
-         (fabs( lspg_nextshot.ax - alignx->position) > 0.0001) ||
-         (fabs( lspg_nextshot.az - alignz->position) > 0.0001)) {
+         (fabs( lspg_nextshot.ax - alignx->hot->position) > 0.0001) ||
+         (fabs( lspg_nextshot.az - alignz->hot->position) > 0.0001)) {
 
 
         lslogging_log_message( "md2cmds_shutterless: moving center to ax=%f, az=%f", lspg_nextshot.ax, lspg_nextshot.az);
@@ -2295,13 +2339,13 @@ int md2cmds_shutterless( const char *dummy) {
     // was not ready, in the state Init.
     //
     if( lspg_eiger_run_prep_all( skey,
-                                 kappa->position,
-                                 phi->position,
-                                 cenx->position,
-                                 ceny->position,
-                                 alignx->position,
-                                 aligny->position,
-                                 alignz->position
+                                 kappa->hot->position,
+                                 phi->hot->position,
+                                 cenx->hot->position,
+                                 ceny->hot->position,
+                                 alignx->hot->position,
+                                 aligny->hot->position,
+                                 alignz->hot->position
                                  )) {
       lslogging_log_message( "md2cmds_shutterless: eiger run prep query error, aborting");
       lsredis_sendStatusReport( 1, "Preparing MD2 failed");
@@ -2363,6 +2407,9 @@ int md2cmds_shutterless( const char *dummy) {
                            p6511, q1, q2, q3, q10, q12, q15, q17, q20, q22, q25, q27
                            );
 
+    if( p6510 > 0.0)
+      lspmac_SockSendDPline( NULL, "P6510=%.1f", p6510);
+
     lspmac_SockSendDPline(  NULL, "B231R");
 
     lslogging_log_message("shutterless 5");
@@ -2558,7 +2605,11 @@ int md2cmds_collect( const char *dummy) {
   double p173;          //!< omega velocity cnts/msec
 
   double p175;          //!< acceleration time (msec)
+  double p178;          //!< shutter rising distance (cnts)
+  double p179;          //!< shutter falling distance (cnts)
   double p180;          //!< exposure time (msec)
+  double open_latency;  //!< measured shutter opening delay (msec)
+  double close_latency; //!< measured shutter closing delay (msec)
   double u2c;           //!< unit to counts conversion
   double neutral_pos;   //!< nominal zero offset
   double max_accel;     //!< maximum acceleration allowed for omega
@@ -2579,6 +2630,9 @@ int md2cmds_collect( const char *dummy) {
   neutral_pos = lsredis_getd( omega->neutral_pos);
   max_accel   = lsredis_getd( omega->max_accel);
 
+  open_latency  = md2cmds_shutter_latency( "fastShutter.openLatency");
+  close_latency = md2cmds_shutter_latency( "fastShutter.closeLatency");
+
   mmask = 0;
 
 
@@ -2640,11 +2694,11 @@ int md2cmds_collect( const char *dummy) {
          //
          // Don't move if we are within 0.1 microns of our destination
          //
-         (fabs( lspg_nextshot.cx - cenx->position) > 0.0001) ||
-         (fabs( lspg_nextshot.cy - ceny->position) > 0.0001) ||
-         (fabs( lspg_nextshot.ax - alignx->position) > 0.0001) ||
-         (fabs( lspg_nextshot.ay - aligny->position) > 0.0001) ||
-         (fabs( lspg_nextshot.az - alignz->position) > 0.0001)) {
+         (fabs( lspg_nextshot.cx - cenx->hot->position) > 0.0001) ||
+         (fabs( lspg_nextshot.cy - ceny->hot->position) > 0.0001) ||
+         (fabs( lspg_nextshot.ax - alignx->hot->position) > 0.0001) ||
+         (fabs( lspg_nextshot.ay - aligny->hot->position) > 0.0001) ||
+         (fabs( lspg_nextshot.az - alignz->hot->position) > 0.0001)) {
 
 
         lslogging_log_message( "md2cmds_collect: moving center to cx=%f, cy=%f, ax=%f, ay=%f, az=%f",lspg_nextshot.cx, lspg_nextshot.cy, lspg_nextshot.ax, lspg_nextshot.ay, lspg_nextshot.az);
@@ -2723,6 +2777,12 @@ int md2cmds_collect( const char *dummy) {
     p173 = fabs(p180) < 1.e-4 ? 0.0 : u2c * lspg_nextshot.dsowidth / p180;
     p175 = p173/max_accel;
 
+    //
+    // Start opening and closing the shutter early by the measured delays
+    //
+    p178 = p173 * open_latency;
+    p179 = p173 * close_latency;
+
 
     //
     // free up access to nextshot
@@ -2735,13 +2795,13 @@ int md2cmds_collect( const char *dummy) {
     // have checked that all is OK with the detector
     //
     if( lspg_seq_run_prep_all( skey,
-                               kappa->position,
-                               phi->position,
-                               cenx->position,
-                               ceny->position,
-                               alignx->position,
-                               aligny->position,
-                               alignz->position
+                               kappa->hot->position,
+                               phi->hot->position,
+                               cenx->hot->position,
+                               ceny->hot->position,
+                               alignx->hot->position,
+                               aligny->hot->position,
+                               alignz->hot->position
                                )) {
       lslogging_log_message( "md2cmds_collect: seq run prep query error, aborting");
       lsredis_sendStatusReport( 1, "Preparing MD2 failed");
@@ -2792,10 +2852,14 @@ int md2cmds_collect( const char *dummy) {
     // Start the exposure
     //
     lsredis_sendStatusReport( 0, "Exposing %s %d", issnap ? "Snap" : "Frame", sindex);
+    if( close_latency > 0.0) {
+      // Otherwise leave whatever falling distance the pmac already has
+      lspmac_SockSendDPline( NULL, "P179=%.1f", p179);
+    }
     lspmac_set_motion_flags( &mmask, omega, NULL);
     lspmac_SockSendDPline( "Exposure",
-                           "&1 P170=%.1f P171=%.1f P173=%.1f P174=0 P175=%.1f P176=0 P177=1 P178=0 P180=%.1f M431=1 &1B131R",
-                           p170,         p171,     p173,            p175,                          p180);
+                           "&1 P170=%.1f P171=%.1f P173=%.1f P174=0 P175=%.1f P176=0 P177=1 P178=%.1f P180=%.1f M431=1 &1B131R",
+                           p170,         p171,     p173,            p175,                   p178,      p180);
 
     //
     // We could look for the "Exposure command accepted" event at this point.
@@ -2892,11 +2956,11 @@ int md2cmds_collect( const char *dummy) {
 
     if( !lspg_nextshot.active2_isnull && lspg_nextshot.active2) {
       if(
-         (fabs( lspg_nextshot.cx2 - cenx->position) > 0.1) ||
-         (fabs( lspg_nextshot.cy2 - ceny->position) > 0.1) ||
-         (fabs( lspg_nextshot.ax2 - alignx->position) > 0.1) ||
-         (fabs( lspg_nextshot.ay2 - aligny->position) > 0.1) ||
-         (fabs( lspg_nextshot.az2 - alignz->position) > 0.1)) {
+         (fabs( lspg_nextshot.cx2 - cenx->hot->position) > 0.1) ||
+         (fabs( lspg_nextshot.cy2 - ceny->hot->position) > 0.1) ||
+         (fabs( lspg_nextshot.ax2 - alignx->hot->position) > 0.1) ||
+         (fabs( lspg_nextshot.ay2 - aligny->hot->position) > 0.1) ||
+         (fabs( lspg_nextshot.az2 - alignz->hot->position) > 0.1)) {
 
         md2cmds_move_prep();
         md2cmds_mvcenter_move( lspg_nextshot.cx, lspg_nextshot.cy, lspg_nextshot.ax, lspg_nextshot.ay, lspg_nextshot.az);
@@ -3076,15 +3140,17 @@ int md2cmds_rotate( const char *dummy) {
 
 /** Tell the database about the time we went through omega=zero.
  *  This should trigger the video feed server to starting making a movie.
+ *  The crossing time comes with the event so a second crossing can't
+ *  change it under us.
  */
-void md2cmds_rotate_cb( char *event) {
+void md2cmds_rotate_cb( char *event, lsevents_payload_t *pl) {
   static lsredis_obj_t *ozt  = NULL;
   struct tm t;
   int usecs;
 
-  gmtime_r( &(omega_zero_time.tv_sec), &t);
+  gmtime_r( &(pl->ts.tv_sec), &t);
 
-  usecs = omega_zero_time.tv_nsec / 1000;
+  usecs = pl->ts.tv_nsec / 1000;
   lspg_query_push( NULL, NULL, "SELECT px.trigcam('%d-%d-%d %d:%d:%d.%06d', %d, 0.0, 90.0)",
                    t.tm_year+1900, t.tm_mon+1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, usecs,
                    (int)(lspmac_getPosition( zoom)));
@@ -3258,9 +3324,12 @@ int md2cmds_nonrotate( const char *dummy) {
 }
 
 /** Fix up xscale and yscale when zoom changes
- *  xscale and yscale have units of microns per pixel
+ *  xscale and yscale have units of microns per pixel.
+ *  We only look at the latest requested zoom so repeats can be coalesced.
+ *  \param event      Name of the event that called us
+ *  \param suppressed Repeats of the event we were spared
  */
-void md2cmds_set_scale_cb( char *event) {
+void md2cmds_set_scale_cb( char *event, int suppressed) {
   int mag;
   lsredis_obj_t *p1, *p2;
   char *vp;
@@ -3272,33 +3341,33 @@ void md2cmds_set_scale_cb( char *event) {
     return;
   }
 
-  p1  = lsredis_get_obj( "cam.xScale");
-  p2  = lsredis_get_obj( "cam.zoom.%d.ScaleX", mag);
+  p1  = lsredis_handle( &md2cmds_cam_xscale_p, "cam.xScale");
+  p2  = lsredis_family_get( &md2cmds_zoom_scalex, mag);
 
-  vp = lsredis_getstr( p2);
+  vp = lsredis_borrow( p2);
   lsredis_setstr( p1, vp);
-  free( vp);
+  lsredis_release( vp);
 
-  p1  = lsredis_get_obj( "cam.CenterX");
-  p2  = lsredis_get_obj( "cam.zoom.%d.CenterX", mag);
+  p1  = lsredis_handle( &md2cmds_cam_centerx_p, "cam.CenterX");
+  p2  = lsredis_family_get( &md2cmds_zoom_centerx, mag);
 
-  vp = lsredis_getstr( p2);
+  vp = lsredis_borrow( p2);
   lsredis_setstr( p1, vp);
-  free( vp);
+  lsredis_release( vp);
 
-  p1  = lsredis_get_obj( "cam.yScale");
-  p2  = lsredis_get_obj( "cam.zoom.%d.ScaleY", mag);
+  p1  = lsredis_handle( &md2cmds_cam_yscale_p, "cam.yScale");
+  p2  = lsredis_family_get( &md2cmds_zoom_scaley, mag);
 
-  vp = lsredis_getstr( p2);
+  vp = lsredis_borrow( p2);
   lsredis_setstr( p1, vp);
-  free( vp);
+  lsredis_release( vp);
 
-  p1  = lsredis_get_obj( "cam.CenterY");
-  p2  = lsredis_get_obj( "cam.zoom.%d.CenterY", mag);
+  p1  = lsredis_handle( &md2cmds_cam_centery_p, "cam.CenterY");
+  p2  = lsredis_family_get( &md2cmds_zoom_centery, mag);
 
-  vp = lsredis_getstr( p2);
+  vp = lsredis_borrow( p2);
   lsredis_setstr( p1, vp);
-  free( vp);
+  lsredis_release( vp);
 }
 
 /** Time the capillary motion for the transfer routine
@@ -3407,15 +3476,63 @@ void md2cmds_action_wait() {
 }
 
 /** Run the test routine(s)
- *  \param dummy Unused
+ *  \param cmd "test" or "test disruptive" to include the tests that disturb a running system
  */
-int md2cmds_test( const char *dummy) {
-  lstest_main();
+int md2cmds_test( const char *cmd) {
+  char which[16];
+
+  which[0] = 0;
+  if( cmd != NULL)
+    sscanf( cmd, "%*s %15s", which);
+
+  lstest_main( strcmp( which, "disruptive") == 0);
   return 0;
 }
 
 
 
+/** Record or replay events
+ *  \param cmd "eventTrace start <file>", "eventTrace stop", or "eventTrace replay <file> [<speed> [<regex>]]"
+ */
+int md2cmds_event_trace( const char *cmd) {
+  static const char *id = "md2cmds_event_trace";
+  char action[16];
+  char path[256];
+  char only[256];
+  double speed;
+  long n;
+
+  speed = 1.0;
+  path[0] = 0;
+  only[0] = 0;
+  if( cmd == NULL || sscanf( cmd, "%*s %15s %255s %lf %255s", action, path, &speed, only) < 1) {
+    lslogging_log_message( "%s: usage: eventTrace start <file> | stop | replay <file> [<speed> [<regex>]]", id);
+    return 1;
+  }
+
+  if( strcmp( action, "stop") == 0) {
+    lsevents_trace_stop();
+    return 0;
+  }
+
+  if( path[0] == 0) {
+    lslogging_log_message( "%s: no file given in '%s'", id, cmd);
+    return 1;
+  }
+
+  if( strcmp( action, "start") == 0)
+    return lsevents_trace_start( path);
+
+  if( strcmp( action, "replay") == 0) {
+    n = lsevents_trace_replay( path, speed, only[0] == 0 ? NULL : only);
+    lslogging_log_message( "%s: replayed %ld events from %s", id, n, path);
+    return n < 0 ? 1 : 0;
+  }
+
+  lslogging_log_message( "%s: unknown action '%s'", id, action);
+  return 1;
+}
+
 int md2cmds_run_cmd( const char *cmd) {
   int err, i;
   lspmac_motor_t *mp;
@@ -3582,6 +3699,254 @@ int md2cmds_setsamplebeam( const char *cmd) {
   return 0;
 }
 
+#define MD2CMDS_SHUTTER_TIMING_PASSES   20	//!< default number of passes for shutterTiming
+#define MD2CMDS_SHUTTER_TIMING_MIN_GOOD 5	//!< fewest good passes we'll believe
+#define MD2CMDS_SHUTTER_TIMING_WIDTH    5.0	//!< omega width of each pass (degrees)
+#define MD2CMDS_SHUTTER_TIMING_EXPOSURE 500.0	//!< shutter open time of each pass (msec)
+#define MD2CMDS_SHUTTER_HIST_BINS       80	//!< number of bins in the latency histograms
+#define MD2CMDS_SHUTTER_HIST_MIN        -10.0	//!< lower edge of the first histogram bin (msec)
+#define MD2CMDS_SHUTTER_HIST_WIDTH      0.5	//!< histogram bin width (msec)
+
+/** Store a shutter latency histogram in redis as json
+ */
+void md2cmds_shutter_hist_store(
+				char *key,		/**< [in] redis key (without the head)     */
+				int *hist		/**< [in] MD2CMDS_SHUTTER_HIST_BINS counts */
+				) {
+  json_t *j_hist;
+  json_t *j_counts;
+  char *hist_str;
+  int i;
+
+  j_counts = json_array();
+  for( i=0; i<MD2CMDS_SHUTTER_HIST_BINS; i++) {
+    json_array_append_new( j_counts, json_integer( hist[i]));
+  }
+
+  j_hist = json_object();
+  json_object_set_new( j_hist, "min",    json_real( MD2CMDS_SHUTTER_HIST_MIN));
+  json_object_set_new( j_hist, "width",  json_real( MD2CMDS_SHUTTER_HIST_WIDTH));
+  json_object_set_new( j_hist, "counts", j_counts);
+
+  hist_str = json_dumps( j_hist, 0);
+  if( hist_str != NULL) {
+    lsredis_setstr( lsredis_get_obj( "%s", key), "%s", hist_str);
+    free( hist_str);
+  }
+  json_decref( j_hist);
+}
+
+/** Make sure the fast shutter is confirmed closed before we open it again
+ *  \returns 0 when closed, 1 on timeout
+ */
+int md2cmds_shutter_closed_wait() {
+  struct timespec now, timeout;
+  int err;
+
+  clock_gettime( CLOCK_REALTIME, &now);
+  timeout.tv_sec  = now.tv_sec + 10;
+  timeout.tv_nsec = now.tv_nsec;
+
+  err = 0;
+  pthread_mutex_lock( &md2cmds_shutter_mutex);
+  if( md2cmds_shutter_open_flag) {
+    fshut->moveAbs( fshut, 0);
+    while( err == 0 && md2cmds_shutter_open_flag)
+      err = pthread_cond_timedwait( &md2cmds_shutter_cond, &md2cmds_shutter_mutex, &timeout);
+  }
+  pthread_mutex_unlock( &md2cmds_shutter_mutex);
+
+  return err == ETIMEDOUT ? 1 : 0;
+}
+
+/** Run the shutter timing passes and store the results
+ *  P178 and P179 are zeroed here; our caller puts them back.
+ *  \returns non-zero on error
+ */
+int md2cmds_shutter_timing_run( int passes) {
+  static const char *id = "md2cmds_shutter_timing";
+  int good;             //!< number of passes that gave us believable edges
+  int pass;
+  int cycles;
+  int mmask;
+  int bin;
+  double u2c;           //!< omega unit to counts conversion
+  double neutral_pos;   //!< omega neutral position
+  double max_accel;     //!< omega maximum acceleration
+  double start;         //!< omega start position of the current pass (deg)
+  double p170;          //!< start cnts
+  double p171;          //!< delta cnts
+  double p173;          //!< omega velocity cnts/msec
+  double p175;          //!< acceleration time (msec)
+  double open_cnts, close_cnts;
+  double open_ms, close_ms;
+  double open_sum, close_sum;
+  int open_hist[MD2CMDS_SHUTTER_HIST_BINS];
+  int close_hist[MD2CMDS_SHUTTER_HIST_BINS];
+
+  u2c         = lsredis_getd( omega->u2c);
+  neutral_pos = lsredis_getd( omega->neutral_pos);
+  max_accel   = lsredis_getd( omega->max_accel);
+
+  p171 = u2c * MD2CMDS_SHUTTER_TIMING_WIDTH;
+  p173 = p171 / MD2CMDS_SHUTTER_TIMING_EXPOSURE;
+  p175 = p173 / max_accel;
+
+  memset( open_hist,  0, sizeof( open_hist));
+  memset( close_hist, 0, sizeof( close_hist));
+  open_sum  = 0.0;
+  close_sum = 0.0;
+  good      = 0;
+
+  start = lspmac_getPosition( omega);
+
+  for( pass=0; pass<passes; pass++) {
+    lsredis_sendStatusReport( 0, "Shutter timing pass %d of %d", pass+1, passes);
+
+    if( md2cmds_shutter_closed_wait()) {
+      lslogging_log_message( "%s: timed out waiting for the shutter to be confirmed closed", id);
+      lsredis_sendStatusReport( 1, "Shutter timing aborted: shutter did not close");
+      return 1;
+    }
+
+    p170   = u2c * (start + neutral_pos);
+    cycles = lspmac_shutter_cycles_get();
+
+    mmask = 0;
+    lspmac_set_motion_flags( &mmask, omega, NULL);
+    lspmac_SockSendDPline( "Exposure",
+                           "&1 P170=%.1f P171=%.1f P173=%.1f P174=0 P175=%.1f P176=0 P177=1 P178=0 P179=0 P180=%.1f M431=1 &1B131R",
+                           p170,         p171,     p173,            p175,                                    MD2CMDS_SHUTTER_TIMING_EXPOSURE);
+
+    if( lspmac_shutter_cycle_wait( cycles, 10.0 + MD2CMDS_SHUTTER_TIMING_EXPOSURE/1000.0, &open_cnts, &close_cnts)) {
+      lslogging_log_message( "%s: pass %d: timed out waiting for the shutter to open and close", id, pass);
+    } else if( isnan( open_cnts) || isnan( close_cnts)) {
+      lslogging_log_message( "%s: pass %d: the shutter opened and closed between status updates, no timing this pass", id, pass);
+    } else {
+      open_ms  = (open_cnts  - p170) / p173;
+      close_ms = (close_cnts - (p170 + p171)) / p173;
+
+      lslogging_log_message( "%s: pass %d: open %.2f msec  close %.2f msec", id, pass, open_ms, close_ms);
+
+      bin = floor( (open_ms - MD2CMDS_SHUTTER_HIST_MIN) / MD2CMDS_SHUTTER_HIST_WIDTH);
+      if( bin >= 0 && bin < MD2CMDS_SHUTTER_HIST_BINS)
+        open_hist[bin]++;
+
+      bin = floor( (close_ms - MD2CMDS_SHUTTER_HIST_MIN) / MD2CMDS_SHUTTER_HIST_WIDTH);
+      if( bin >= 0 && bin < MD2CMDS_SHUTTER_HIST_BINS)
+        close_hist[bin]++;
+
+      //
+      // Each edge is only known to within a status frame so a
+      // small negative delay is just noise.  Anything outside the
+      // histogram is not.
+      //
+      if( open_ms  < MD2CMDS_SHUTTER_HIST_MIN || open_ms  > MD2CMDS_SHUTTER_MAX_LATENCY ||
+          close_ms < MD2CMDS_SHUTTER_HIST_MIN || close_ms > MD2CMDS_SHUTTER_MAX_LATENCY) {
+        lslogging_log_message( "%s: pass %d: ignoring unbelievable delays", id, pass);
+      } else {
+        open_sum  += open_ms;
+        close_sum += close_ms;
+        good++;
+      }
+    }
+
+    //
+    // The program leaves omega ready for the next pass
+    //
+    if( lspmac_est_move_time_wait( 10.0, mmask, NULL)) {
+      lslogging_log_message( "%s: timed out waiting for omega to stop", id);
+      lsredis_sendStatusReport( 1, "Shutter timing aborted: omega did not stop");
+      return 1;
+    }
+    start += MD2CMDS_SHUTTER_TIMING_WIDTH;
+  }
+
+  md2cmds_shutter_hist_store( "fastShutter.openLatencyHist",  open_hist);
+  md2cmds_shutter_hist_store( "fastShutter.closeLatencyHist", close_hist);
+
+  if( good < MD2CMDS_SHUTTER_TIMING_MIN_GOOD || good < passes/2) {
+    lslogging_log_message( "%s: only %d good passes of %d, keeping the old delays", id, good, passes);
+    lsredis_sendStatusReport( 1, "Shutter timing failed: only %d good passes of %d", good, passes);
+    return 1;
+  }
+
+  //
+  // Clamp the means to what collect will accept anyway
+  //
+  open_ms  = open_sum  / good;
+  close_ms = close_sum / good;
+  open_ms  = open_ms  < 0.0 ? 0.0 : (open_ms  > MD2CMDS_SHUTTER_MAX_LATENCY ? MD2CMDS_SHUTTER_MAX_LATENCY : open_ms);
+  close_ms = close_ms < 0.0 ? 0.0 : (close_ms > MD2CMDS_SHUTTER_MAX_LATENCY ? MD2CMDS_SHUTTER_MAX_LATENCY : close_ms);
+
+  lsredis_setstr( lsredis_get_obj( "fastShutter.openLatency"),  "%.2f", open_ms);
+  lsredis_setstr( lsredis_get_obj( "fastShutter.closeLatency"), "%.2f", close_ms);
+
+  lslogging_log_message( "%s: %d good passes of %d: open %.2f msec  close %.2f msec", id, good, passes, open_ms, close_ms);
+  lsredis_sendStatusReport( 0, "Shutter opens in %.1f msec and closes in %.1f msec", open_ms, close_ms);
+
+  return 0;
+}
+
+/** Measure how long the fast shutter takes to open and close.
+ *
+ *  Runs the same omega scan program used by collect with no shutter
+ *  compensation and notes where omega was when the status shows the
+ *  shutter open and close.  Each edge is only located to within one
+ *  status frame so we take many passes and histogram them.  The mean
+ *  delays are saved as fastShutter.openLatency and
+ *  fastShutter.closeLatency (msec) and are used by collect (P178/P179)
+ *  and shutterless (P6510).  The histograms are saved as json in
+ *  fastShutter.openLatencyHist and fastShutter.closeLatencyHist.
+ *
+ *  Like collect, we refuse to run during a collection, put the MD2 in
+ *  data collection mode and wait for the shutter to be confirmed
+ *  closed before each pass.  The pmac's P178 and P179 are put back
+ *  the way we found them however we leave.
+ *
+ *  \param cmd "shutterTiming [passes]"
+ *  returns non-zero on error
+ */
+int md2cmds_shutter_timing( const char *cmd) {
+  static const char *id = "md2cmds_shutter_timing";
+  int passes;           //!< number of passes requested
+  int err;
+  char *running;        //!< collection.running
+  double p178;          //!< rising distance we found
+  double p179;          //!< falling distance we found
+
+  passes = MD2CMDS_SHUTTER_TIMING_PASSES;
+  if( cmd != NULL && sscanf( cmd, "%*s %d", &passes) == 1 && passes < MD2CMDS_SHUTTER_TIMING_MIN_GOOD) {
+    lslogging_log_message( "%s: need at least %d passes in '%s'", id, MD2CMDS_SHUTTER_TIMING_MIN_GOOD, cmd);
+    return 1;
+  }
+
+  running = lsredis_borrow( lsredis_get_obj( "collection.running"));
+  err     = strcmp( running, "True") == 0;
+  lsredis_release( running);
+  if( err) {
+    lsredis_sendStatusReport( 1, "Shutter timing refused: a collection is running");
+    return 1;
+  }
+
+  lsredis_sendStatusReport( 0, "Putting MD2 in data collection mode");
+  if( md2cmds_phase_change( "changeMode dataCollection")) {
+    lsredis_sendStatusReport( 1, "Shutter timing aborted: could not put the MD2 into data collection mode");
+    return 1;
+  }
+
+  if( lspmac_get_variable( "P178", 5.0, &p178) || lspmac_get_variable( "P179", 5.0, &p179)) {
+    lsredis_sendStatusReport( 1, "Shutter timing aborted: could not read the shutter compensation from the pmac");
+    return 1;
+  }
+
+  err = md2cmds_shutter_timing_run( passes);
+
+  lspmac_SockSendDPline( NULL, "P178=%.1f P179=%.1f", p178, p179);
+
+  return err;
+}
+
 /** Set the beamstop limits that plcc 0 checks for the shutter enable
  *  signal
  */
@@ -3782,7 +4147,7 @@ void md2cmds_ca_last_cb( char *event) {
   if( !ca_last_enabled)
     return;
 
-  phase = lsredis_getstr( lsredis_get_obj( "phase"));
+  phase = lsredis_borrow( lsredis_get_obj( "phase"));
   if( strcmp( phase, "center") == 0 || strcmp( phase, "dataCollection") == 0) {
     motor_name[0] = 0;
     for( i=0; i<sizeof(motor_name)-1; i++) {
@@ -3798,7 +4163,7 @@ void md2cmds_ca_last_cb( char *event) {
       }
     }
   }
-  free( phase);
+  lsredis_release( phase);
 }
 
 
@@ -3978,7 +4343,7 @@ pthread_t *md2cmds_run() {
 
   lsevents_add_listener( "^Reset queued$", md2cmds_motion_reset_cb);
 
-  lsevents_add_listener( "^omega crossed zero$",        md2cmds_rotate_cb);
+  lsevents_add_payload_listener( "^omega crossed zero$", md2cmds_rotate_cb);
   lsevents_add_listener( "^omega In Position$",         md2cmds_maybe_rotate_done_cb);
   lsevents_add_listener( ".+ (Moving|In Position)$",    md2cmds_maybe_done_moving_cb);
   lsevents_add_listener( "(.+) (Homing|Homed)$",        md2cmds_maybe_done_homing_cb);
@@ -3989,7 +4354,7 @@ pthread_t *md2cmds_run() {
   lsevents_add_listener( "^Coordsys 4 Stopped$",        md2cmds_coordsys_4_stopped_cb);
   lsevents_add_listener( "^Coordsys 5 Stopped$",        md2cmds_coordsys_5_stopped_cb);
   lsevents_add_listener( "^Coordsys 7 Stopped$",        md2cmds_coordsys_7_stopped_cb);
-  lsevents_add_listener( "^cam.zoom Moving$",           md2cmds_set_scale_cb);
+  lsevents_add_coalescing_listener( "^cam.zoom Moving$", md2cmds_set_scale_cb);
   lsevents_add_listener( "^LSPMAC Done Initializing$",  md2cmds_lspmac_ready_cb);
   lsevents_add_listener( "^Abort Requested$",           md2cmds_lspmac_abort_cb);
   lsevents_add_listener( "^Quitting Program$",          md2cmds_quitting_cb);
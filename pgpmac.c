@@ -624,6 +624,28 @@ void pgpmac_quit_cb( char *event) {
 }
 
 
+#define PGPMAC_STATS_REPORT_SECS 60		//!< how often we log how our queues and timers are keeping up
+#define PGPMAC_STATS_FULL_REPORTS 60		//!< every this many reports log all the callback statistics
+#define PGPMAC_SLOW_CALLBACK_USECS 10000	//!< mention event callbacks that take longer than this
+#define PGPMAC_LATE_TIMER_USECS    5000		//!< mention timers that fire later than this
+#define PGPMAC_SLOW_TIMER_FRACTION 0.9		//!< mention periodic timers achieving less than this part of their rate
+
+/** Log how our event queue and timers are keeping up.
+ *  Called from the timer thread.
+ */
+void pgpmac_stats_report_cb( char *event, struct timespec *due, unsigned long int overruns) {
+  static int nreports = 0;
+
+  lsevents_queue_report();
+  lsevents_callback_report_slow( PGPMAC_SLOW_CALLBACK_USECS);
+  lstimer_report_late( PGPMAC_LATE_TIMER_USECS);
+  lstimer_report_slow( PGPMAC_SLOW_TIMER_FRACTION);
+
+  if( ++nreports % PGPMAC_STATS_FULL_REPORTS == 0)
+    lsevents_callback_report();
+}
+
+
 /** Our main routine
  */
 int main(
@@ -637,6 +659,7 @@ int main(
   static struct option long_options[] = {
     { "i-vars", 0, NULL, 'i'},
     { "m-vars", 0, NULL, 'm'},
+    { "event-workers", 1, NULL, 'e'},
     { NULL,     0, NULL, 0}
   };
   int c;
@@ -676,7 +699,7 @@ int main(
   // Get options
   //
   while( 1) {
-    c=getopt_long( argc, argv, "im", long_options, NULL);
+    c=getopt_long( argc, argv, "ime:", long_options, NULL);
     if( c == -1)
       break;
 
@@ -688,6 +711,10 @@ int main(
     case 'm':
       mvars=1;		// store m variables in pg
       break;
+
+    case 'e':
+      lsevents_set_workers( atoi( optarg));	// run event callbacks on this many threads
+      break;
     }
   }
 
@@ -742,6 +769,8 @@ int main(
   lstimer_init();
   ourThreads[nOurThreads++] = lstimer_run();
 
+  lstimer_set_timer_cb( "Stats Report", -1, PGPMAC_STATS_REPORT_SECS, 0, pgpmac_stats_report_cb);
+
   //
   // Redis is where we get our configuration
   // as well as one of communicating with the outside world
@@ -8,6 +8,7 @@
 
 #define _GNU_SOURCE
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,8 +25,12 @@
 #include <ncurses.h>
 #include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
@@ -46,7 +51,6 @@
 typedef struct lsredis_obj_struct {
   pthread_mutex_t mutex;				//!< Don't let anyone use an old value
   pthread_cond_t cond;					//!< wait for a valid value
-  struct lsredis_obj_struct *next;			//!< the next in our list (I guess this is going to be a linked list)
   char creating;					//!< 1 if this key does not exist and we haven't set it yet: read will create and set an empty string value, write will create and set the requested value
   char valid;						//!< 1 if we think the value is good, 0 otherwise
   int wait_for_me;					//!< Number of times we need to see our publication before we start accepting new values
@@ -59,10 +63,77 @@ typedef struct lsredis_obj_struct {
   char **avalue;					//!< our value as an array of strings
   int bvalue;						//!< our value as a boolean (1 or 0) -1 means we couldn't figure it out
   char cvalue;						//!< just the first character of our value
+  unsigned char derived;				//!< which of dvalue, lvalue, avalue, bvalue, and cvalue have been computed from value since it last changed
+  char batched;						//!< 1 if a write of this object is waiting for some thread's lsredis_batch_end
+  char unsent;						//!< 1 if a write of this object is waiting for the write connection to come back
+  int sending;						//!< writes counted in wait_for_me that have not yet been sent or queued
+  struct timespec fetch_start;				//!< when a publication sent us to get a new value (tv_sec 0 if it didn't)
+  unsigned int gen;					//!< bumped for each pushed value, local write and fetch: replies to older fetches are dropped
+  char *pushed_by;					//!< publisher of a pushed value whose key only publication hasn't arrived yet, NULL if none
   int hits;						//!< number of times we've searched for this key
   void (*onSet)();					//!< function to call when object is set (used for out of band aborts in md2cmds)
+  void (*onChange)( void *);				//!< like onSet but passed change_arg (used to keep the preset tables current)
+  void *change_arg;					//!< argument for onChange
 } lsredis_obj_t;
 
+/** Slot in an lsredis_map_t
+ */
+typedef struct lsredis_map_entry_struct {
+  uint64_t hash;					//!< hash of key, 0 if the slot is empty
+  char *key;						//!< the key (not copied)
+  void *data;						//!< what we are storing under key
+} lsredis_map_entry_t;
+
+/** Open addressing (linear probing) hash map keyed by string
+ */
+typedef struct lsredis_map_struct {
+  int size;						//!< number of slots (a power of 2)
+  int n;						//!< number of slots in use
+  lsredis_map_entry_t *e;				//!< the slots
+} lsredis_map_t;
+
+/** Family of redis object handles whose keys differ only by an index
+ *  (e.g. centers.%d.cx).  Each handle is resolved the first time it is
+ *  asked for and cached thereafter.
+ */
+typedef struct lsredis_family_struct {
+  pthread_mutex_t mutex;				//!< protect the handle array
+  char *fmt;						//!< key template with a single %d for the index
+  int n;						//!< number of slots allocated in h
+  lsredis_obj_t **h;					//!< the handles, NULL until resolved
+} lsredis_family_t;
+
+//! Static initializer for a family with a constant template
+#define LSREDIS_FAMILY_INITIALIZER( fmt) { PTHREAD_MUTEX_INITIALIZER, fmt, 0, NULL }
+
+struct lsredis_presets_struct;
+
+/** One of a motor's presets as we keep it locally
+ */
+typedef struct lsredis_preset_struct {
+  struct lsredis_presets_struct *table;			//!< the table we belong to
+  int index;						//!< our index in <motor>.presets
+  int dirty;						//!< 1 when redis has changed our name or position since we last looked
+  lsredis_obj_t *name_p;				//!< <motor>.presets.<index>.name
+  lsredis_obj_t *position_p;				//!< <motor>.presets.<index>.position
+  char *name;						//!< our copy of the name, NULL if we don't have one
+  double position;					//!< our copy of the position
+} lsredis_preset_t;
+
+/** A motor's presets, indexed by name and sorted by position
+ */
+typedef struct lsredis_presets_struct {
+  pthread_mutex_t mutex;				//!< protect the table
+  unsigned long int changes;				//!< bumped whenever one of our redis objects changes
+  unsigned long int seen;				//!< changes as of our last refresh
+  int length_dirty;					//!< 1 when <motor>.presets.length has changed since we last looked
+  int n;						//!< number of presets
+  int nslots;						//!< number of presets allocated (never shrinks)
+  lsredis_preset_t **slots;				//!< the presets by index
+  int *by_position;					//!< indices of the first n presets sorted by position
+  lsredis_map_t names;					//!< preset name -> index + 1
+} lsredis_presets_t;
+
 //! Number of status box rows
 #define LS_DISPLAY_WINDOW_HEIGHT 8
 
@@ -76,6 +147,14 @@ typedef struct lsredis_obj_struct {
 //! Fixed length for event names: simplifies string handling
 #define LSEVENTS_EVENT_LENGTH   256
 
+//! Event queue policies (see lsevents_set_policy)
+#define LSEVENTS_CRITICAL 0
+#define LSEVENTS_COALESCE 1
+
+//! Periodic timer policies (see lstimer_set_timer_policy)
+#define LSTIMER_CATCHUP 0
+#define LSTIMER_SKIP    1
+
 /** PMAC ethernet packet definition.
  *
  * Taken directly from the Delta Tau documentation.
@@ -104,6 +183,29 @@ typedef struct lspmac_cmd_queue_struct {
 
 
 #define LSPMAC_MAGIC_NUMBER 0x9700436
+
+/** Per frame motor state.
+ *
+ * Everything the read routines look at or update on every status
+ * frame lives in its own contiguous array (lspmac_motor_hot) so that
+ * the status callback walks a few cache lines per frame instead of
+ * every motor structure.  The rest of the motor, mostly
+ * configuration, stays in lspmac_motor_t.
+ */
+typedef struct lspmac_motor_hot_struct {
+  int *actual_pos_cnts_p;			//!< pointer to the md2_status structure to the actual position
+  int *status1_p;				//!< First 24 bit PMAC motor status word
+  int *status2_p;				//!< Second 24 bit PMAC motor status word
+  int actual_pos_cnts;				//!< local copy of actual counts so only our mutex is needed to read
+  int status1;					//!< local copy of status1
+  int status2;					//!< local copy of status2
+  int not_done;					//!< set to 1 when request is queued, zero after motion has toggled
+  int motion_seen;				//!< set to 1 when motion has been verified to have started
+  double position;				//!< scaled position
+  double reported_position;			//!< previous position reported to redis
+  struct lspmac_motor_struct *mp;		//!< the rest of the motor
+} lspmac_motor_hot_t;
+
 /** Motor information.
  *
  * A catchall for motors and motor like objects.
@@ -113,23 +215,17 @@ typedef struct lspmac_motor_struct {
   int magic;					//!< magic number identifying this as a motor structure
   pthread_mutex_t mutex;			//!< coordinate waiting for motor to be done
   pthread_cond_t cond;				//!< used to signal when a motor is done moving
-  int not_done;					//!< set to 1 when request is queued, zero after motion has toggled
+  lspmac_motor_hot_t *hot;			//!< our per frame state (in lspmac_motor_hot)
   void (*read)( struct lspmac_motor_struct *);	//!< method to read the motor status and position
   int command_sent;				//!< Motion command verified sent to pmac
-  int motion_seen;				//!< set to 1 when motion has been verified to have started
   pmac_cmd_queue_t *pq;				//!< the queue item requesting motion.  Used to check time request was made
   int homing;					//!< Homing routine started
+  int ev_moving;				//!< interned "<name> Moving" event
+  int ev_in_position;				//!< interned "<name> In Position" event
+  int ev_homed;					//!< interned "<name> Homed" event
   int requested_pos_cnts;			//!< requested position
-  int *actual_pos_cnts_p;			//!< pointer to the md2_status structure to the actual position
-  int actual_pos_cnts;				//!< local copy of actual counts so only our mutex is needed to read
-  double position;				//!< scaled position
   double reported_pg_position;			//!< previous position reported to postgresql
-  double reported_position;			//!< previous position reported to redis
   double requested_position;			//!< The position as requested by the user
-  int *status1_p;				//!< First 24 bit PMAC motor status word
-  int status1;					//!< local copy of status1
-  int *status2_p;				//!< Second 24 bit PMAC motor status word
-  int status2;					//!< local copy of status2
   char *dac_mvar;				//!< controlling mvariable as a string
   char *name;					//!< Name of motor as refered by ls database kvs table
   lsredis_obj_t *active;			//!< Use the motor ("true") or not ("false")
@@ -146,6 +242,10 @@ typedef struct lspmac_motor_struct {
   lsredis_obj_t *min_pos;			//!< our minimum position (soft limit)
   lsredis_obj_t *motor_num;			//!< pmac motor number
   lsredis_obj_t *neutral_pos;			//!< zero offset
+  lsredis_obj_t *presets_length;		//!< number of presets we have
+  lsredis_family_t preset_names;		//!< handles for <name>.presets.%d.name
+  lsredis_family_t preset_positions;		//!< handles for <name>.presets.%d.position
+  lsredis_presets_t presets;			//!< our presets, kept current by lsredis
   lsredis_obj_t *pos_limit_hit;			//!< positive limit status
   lsredis_obj_t *neg_limit_hit;			//!< negative limit status
   lsredis_obj_t *precision;			//!< moves of less than this amount may be ignored
@@ -167,6 +267,19 @@ typedef struct lspmac_motor_struct {
   WINDOW *win;					//!< our ncurses window
 } lspmac_motor_t;
 
+/** Small typed payload that may go along with an event (see
+ *  lsevents_send_event_id_payload).  What the fields mean is up to
+ *  the sender and the listeners of the event.
+ */
+typedef struct lsevents_payload_struct {
+  struct timespec ts;		//!< when the thing happened (CLOCK_REALTIME), filled in with the send time if 0
+  lspmac_motor_t *mp;		//!< the motor the event is about, if any
+  double position;		//!< motor position at ts
+  long   ival[2];		//!< integers
+  double dval[2];		//!< doubles
+  int tid;			//!< thread that sent the event (filled in by lsevents)
+} lsevents_payload_t;
+
 
 /** Storage for binary inputs.
  */
@@ -181,11 +294,31 @@ typedef struct lspmac_bi_struct {
   int first_time;		//!< flag indicating we've not read the input even once
   char *changeEventOn;		//!< Event to send when the value changes to 1
   char *changeEventOff;		//!< Event to send when the value changes to 0
+  int changeEventOn_id;		//!< interned changeEventOn or -1 if none
+  int changeEventOff_id;	//!< interned changeEventOff or -1 if none
   char *onStatus;		//!< set status to this when on
   char *offStatus;		//!< set status to this when off
   lsredis_obj_t *status_str;    //!< Our status string
 } lspmac_bi_t;
 
+/** One entry in the list of binary inputs that use a given status bit
+ */
+typedef struct lspmac_bi_link_struct {
+  lspmac_bi_t *bp;				//!< the input
+  struct lspmac_bi_link_struct *next;		//!< the next input using this bit
+} lspmac_bi_link_t;
+
+/** Binary inputs that live in the same status word.  Changes to the
+ *  whole group are found with a single xor against the last frame.
+ */
+typedef struct lspmac_bi_group_struct {
+  int *ptr;			//!< the status word our inputs live in
+  int mask;			//!< union of the masks of our inputs
+  int previous;			//!< (*ptr & mask) from the last status frame
+  int first_time;		//!< flag indicating we've not read the word even once
+  lspmac_bi_link_t *bits[32];	//!< the inputs that use each bit of the word
+} lspmac_bi_group_t;
+
 
 /** Store each query along with it's callback function.
  *  All calls are asynchronous
@@ -463,6 +596,7 @@ extern int pgpmac_monitor_detector_position;
 extern lspg_nextshot_t lspg_nextshot;
 
 extern lspmac_motor_t lspmac_motors[];
+extern lspmac_motor_hot_t lspmac_motor_hot[];
 extern lspmac_motor_t *omega;
 extern lspmac_motor_t *alignx;
 extern lspmac_motor_t *aligny;
@@ -495,6 +629,11 @@ extern lspmac_motor_t *flight_f;
 
 extern int lspmac_nmotors;
 
+extern lspmac_bi_t lspmac_bis[];
+extern int lspmac_nbis;
+extern lspmac_bi_group_t lspmac_bi_groups[];
+extern int lspmac_nbi_groups;
+
 extern lspmac_bi_t    *lp_air;
 extern lspmac_bi_t    *hp_air;
 extern lspmac_bi_t    *cryo_switch;
@@ -560,7 +699,12 @@ char **lsredis_get_string_array( lsredis_obj_t *p);
 void lspmac_SockSendDPline( char *, char *fmt, ...);
 pmac_cmd_queue_t *lspmac_SockSendline(char *, char *, ...);
 lsredis_obj_t *lsredis_get_obj( char *, ...);
+lsredis_obj_t *lsredis_handle( lsredis_obj_t **cache, char *fmt, ...);
+void lsredis_family_init( lsredis_family_t *f, char *fmt, ...);
+lsredis_obj_t *lsredis_family_get( lsredis_family_t *f, int i);
 char *lsredis_getstr( lsredis_obj_t *p);
+char *lsredis_borrow( lsredis_obj_t *p);
+void lsredis_release( char *v);
 void PmacSockSendline( char *s);
 unsigned int lspg_nextsample_all( int *err);
 char lsredis_getc( lsredis_obj_t *p);
@@ -570,6 +714,26 @@ void lsevents_init();
 void lsevents_remove_listener( char *, void (*cb)(char *));
 pthread_t *lsevents_run();
 void lsevents_send_event( char *, ...);
+void lsevents_send_event_id( int id);
+void lsevents_set_policy( int id, int policy);
+void lsevents_queue_stats( unsigned long *dropped, unsigned long *overflows);
+void lsevents_queue_report();
+void lsevents_callback_report_slow( unsigned long usecs);
+void lsevents_never_wait();
+void lsevents_callback_report();
+void lsevents_set_workers( int n);
+void lsevents_add_coalescing_listener( char *raw_regexp, void (*cb)(char *, int));
+void lsevents_remove_coalescing_listener( char *event, void (*cb)(char *, int));
+void lsevents_add_payload_listener( char *raw_regexp, void (*cb)(char *, lsevents_payload_t *));
+void lsevents_remove_payload_listener( char *event, void (*cb)(char *, lsevents_payload_t *));
+void lsevents_send_event_id_payload( int id, lsevents_payload_t *plp);
+void lsevents_send_event_payload( lsevents_payload_t *plp, char *fmt, ...);
+int  lsevents_trace_start( char *path);
+void lsevents_trace_stop();
+long lsevents_trace_replay( char *path, double speed, char *only);
+int  lsevents_match_count( char *event, int use_re);
+int  lsevents_intern( char *fmt, ...);
+char *lsevents_id_name( int id);
 void lsevents_preregister_event( char *fmt, ...);
 void lslogging_init();
 void lslogging_log_message(const char *fmt, ...);
@@ -606,6 +770,10 @@ int lspmac_jogabs_queue( lspmac_motor_t *, double);
 int lspmac_move_or_jog_abs_queue( lspmac_motor_t *mp, double requested_position,int use_jo);
 int lspmac_move_or_jog_preset_queue( lspmac_motor_t *, char *, int);
 void lspmac_move_or_jog_queue( lspmac_motor_t *, double, int);
+void lspmac_read_motors();
+int  lspmac_shutter_cycles_get();
+int  lspmac_shutter_cycle_wait( int cycles, double timeout_secs, double *open_cnts, double *close_cnts);
+int  lspmac_get_variable( char *var, double timeout_secs, double *value);
 int lspmac_move_preset_queue( lspmac_motor_t *mp, char *preset_name);
 int lspmac_moveabs_queue( lspmac_motor_t *, double);
 int lspmac_jogabs_queue( lspmac_motor_t *, double);
@@ -621,11 +789,35 @@ void lsredis_init();
 int  lsredis_regexec( const regex_t *preg, lsredis_obj_t *p, size_t nmatch, regmatch_t *pmatch, int eflags);
 pthread_t *lsredis_run();
 void lsredis_setstr( lsredis_obj_t *p, char *fmt, ...);
+void lsredis_map_init( lsredis_map_t *m, int size);
+void lsredis_map_free( lsredis_map_t *m);
+void *lsredis_map_find( lsredis_map_t *m, const char *key);
+int lsredis_map_insert( lsredis_map_t *m, char *key, void *data);
+void *lsredis_map_remove( lsredis_map_t *m, const char *key);
+void lsredis_map_foreach( lsredis_map_t *m, void (*fn)( char *, void *, void *), void *arg);
+void lsredis_batch_begin();
+void lsredis_batch_end();
+void lsredis_setstr_force( lsredis_obj_t *p, char *fmt, ...);
+void lsredis_write_stats( unsigned long int *writes, unsigned long int *commands, unsigned long int *suppressed);
+void lsredis_connection_stats( int *reconnects, int *resyncs, double *last_resync_secs, double *max_resync_secs);
+void lsredis_drop_connections();
+void lsredis_sync_stats( unsigned long int *pushed, double *push_mean_secs, double *push_max_secs,
+			 unsigned long int *fetched, double *fetch_mean_secs, double *fetch_max_secs);
+void lsredis_set_value( lsredis_obj_t *p, char *fmt, ...);
+void lsredis_parse_stats( unsigned long int *sets, unsigned long int *parses, unsigned long int *array_parses);
 void lsraster_init();
 pthread_t *lsraster_run();
 void lsraster_step(const char *key);
 void lstimer_set_timer( char *, int, unsigned long int, unsigned long int);
+void lstimer_set_timer_cb( char *event, int shots, unsigned long int secs, unsigned long int nsecs, void (*cb)( char *, struct timespec *, unsigned long int));
+void lstimer_set_timer_abs( char *event, int shots, struct timespec *deadline, unsigned long int secs, unsigned long int nsecs);
 void lstimer_unset_timer( char *event);
+int lstimer_set_timer_policy( char *event, int policy);
+int lstimer_get_stats( char *event, unsigned long int *fired, unsigned long int *overruns, double *rate);
+int lstimer_active_count();
+void lstimer_report();
+void lstimer_report_late( unsigned long int usecs);
+void lstimer_report_slow( double fraction);
 void lstimer_init();
 pthread_t *lstimer_run();
 void lsupdate_init();
@@ -633,7 +825,7 @@ pthread_t *lsupdate_run();
 void md2cmds_init();
 pthread_t *md2cmds_run();
 void pgpmac_printf( char *fmt, ...);
-void lstest_main();
+void lstest_main( int disruptive);
 int lspmac_est_move_time( double *est_time, int *mmask, lspmac_motor_t *mp_1, int jog_1, char *preset_1, double end_point_1, ...);
 int lspmac_est_move_time_wait( double move_time, int cmask, lspmac_motor_t *mp_1, ...);
 void lsredis_set_preset( char *base, char *preset_name, double dval);
@@ -648,13 +840,14 @@ int lsredis_find_preset_index_by_position( lspmac_motor_t *mp);
 int lsredis_find_preset_index_by_name( lspmac_motor_t *mp, char *searchPresetName);
 void lspmac_SockSendDPControlChar( char *event, char c);
 int lspmac_set_motion_flags( int *mmaskp, lspmac_motor_t *mp_1, ...);
-void lsredis_load_presets( char *motor_name);
+void lsredis_load_presets( lspmac_motor_t *mp);
 void pgpmac_request_stay_of_execution( int secs);
 void md2cmds_push_queue( char *action);
 pmac_cmd_queue_t *lspmac_SockSendControlCharPrint( char *event, char c);
 void lsredis_config();
 void lsredis_sendStatusReport( int severity, char *fmt, ...);
 void lsredis_set_onSet( lsredis_obj_t *p, void (*cb)());
+void lsredis_set_onChange( lsredis_obj_t *p, void (*cb)( void *), void *arg);
 const char *lsredis_get_head();
 
 #endif // header guard